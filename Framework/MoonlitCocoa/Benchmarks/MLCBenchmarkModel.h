@@ -0,0 +1,22 @@
+//
+//  MLCBenchmarkModel.h
+//  MoonlitCocoa
+//
+//  Created by agent on 17.10.26.
+//  Released into the public domain.
+//
+
+#import <Foundation/Foundation.h>
+#import <MoonlitCocoa/MoonlitCocoa.h>
+
+/**
+ * A model object used to measure the initialization, hashing, and equality of
+ * #MLCModel subclasses.
+ */
+@lua_bridged(MLCBenchmarkModel, MLCModel)
+@property (nonatomic, copy, readonly) NSString *name;
+@property (nonatomic, copy, readonly) NSNumber *quantity;
+@property (nonatomic, copy, readonly) NSString *identifier;
+
+- (id)initWithName:(NSString *)name quantity:(NSNumber *)quantity identifier:(NSString *)identifier;
+@end
@@ -0,0 +1,5 @@
+local M = {
+	keysForValuesAffectingEquality = { "name", "identifier" }
+}
+
+return M
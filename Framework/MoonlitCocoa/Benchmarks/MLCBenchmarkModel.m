@@ -0,0 +1,21 @@
+//
+//  MLCBenchmarkModel.m
+//  MoonlitCocoa
+//
+//  Created by agent on 17.10.26.
+//  Released into the public domain.
+//
+
+#import "MLCBenchmarkModel.h"
+
+@interface MLCBenchmarkModel ()
+@property (nonatomic, copy, readwrite) NSString *name;
+@property (nonatomic, copy, readwrite) NSNumber *quantity;
+@property (nonatomic, copy, readwrite) NSString *identifier;
+@end
+
+@implementation MLCBenchmarkModel
+@synthesize name = m_name;
+@synthesize quantity = m_quantity;
+@synthesize identifier = m_identifier;
+@end
@@ -0,0 +1,43 @@
+//
+//  MLCBenchmarkObject.h
+//  MoonlitCocoa
+//
+//  Created by agent on 17.10.26.
+//  Released into the public domain.
+//
+
+#import <Foundation/Foundation.h>
+#import <MoonlitCocoa/MoonlitCocoa.h>
+
+/**
+ * A bridged object used to measure calls in each direction between
+ * Objective-C and Lua. Methods without an Objective-C implementation are
+ * implemented in MLCBenchmarkObject.lua.
+ */
+@lua_bridged(MLCBenchmarkObject, MLCBridgedObject)
+/**
+ * The number of times that #increment has been invoked.
+ */
+@property (nonatomic, assign) NSUInteger counter;
+
+/**
+ * Increments #counter. This is implemented in Objective-C, and called from Lua
+ * to measure the trampoline.
+ */
+- (void)increment;
+
+/**
+ * Invokes #increment from Lua \a count times, within a single forwarded call.
+ */
+- (void)incrementTimes:(int)count;
+
+/**
+ * Returns the sum of \a a and \a b, as calculated in Lua.
+ */
+- (int)addInteger:(int)a toInteger:(int)b;
+
+/**
+ * Returns \a obj after converting it into Lua and back.
+ */
+- (id)echoObject:(id)obj;
+@end
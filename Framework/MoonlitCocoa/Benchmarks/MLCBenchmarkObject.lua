@@ -0,0 +1,19 @@
+local M = {
+	["incrementTimes:"] = function (self, count)
+		for i = 1, count do
+			self:increment()
+		end
+	end,
+
+	["addInteger:toInteger:"] = function (self, a, b)
+		return a + b
+	end,
+
+	["echoObject:"] = function (self, obj)
+		return obj
+	end,
+
+	constant = 42
+}
+
+return M
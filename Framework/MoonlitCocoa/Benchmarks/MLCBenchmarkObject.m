@@ -0,0 +1,18 @@
+//
+//  MLCBenchmarkObject.m
+//  MoonlitCocoa
+//
+//  Created by agent on 17.10.26.
+//  Released into the public domain.
+//
+
+#import "MLCBenchmarkObject.h"
+
+@implementation MLCBenchmarkObject
+@synthesize counter = m_counter;
+
+- (void)increment; {
+	++m_counter;
+}
+
+@end
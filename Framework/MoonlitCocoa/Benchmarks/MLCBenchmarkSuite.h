@@ -0,0 +1,54 @@
+//
+//  MLCBenchmarkSuite.h
+//  MoonlitCocoa
+//
+//  Created by agent on 17.10.26.
+//  Released into the public domain.
+//
+
+#import <Foundation/Foundation.h>
+
+/**
+ * Runs benchmarks and collects their timings for output as JSON.
+ *
+ * Each benchmark is run once as a warm-up, and then #repetitions more times,
+ * with the time per iteration reported for every repetition along with their
+ * median and minimum.
+ */
+@interface MLCBenchmarkSuite : NSObject
+/**
+ * Initializes a suite which runs each benchmark for roughly \a iterations
+ * iterations, \a repetitions times. Benchmarks are only run if their name
+ * contains \a filter, or if \a filter is \c nil.
+ */
+- (id)initWithIterations:(NSUInteger)iterations repetitions:(NSUInteger)repetitions filter:(NSString *)filter;
+
+/**
+ * The base number of iterations for each benchmark. Expensive benchmarks use
+ * a fraction of this number.
+ */
+@property (nonatomic, readonly) NSUInteger iterations;
+
+/**
+ * The number of times that each benchmark is timed.
+ */
+@property (nonatomic, readonly) NSUInteger repetitions;
+
+/**
+ * Times \a block, which should perform the operation being measured \a count
+ * times, where \a count is \a iterations, or a tenth of that during the
+ * warm-up. \a parameters (which may be \c nil) is included in the results to
+ * distinguish variants of the same benchmark, and must be representable in
+ * JSON.
+ *
+ * Any setup that should not be measured must be done before invoking this
+ * method.
+ */
+- (void)measureBenchmarkWithName:(NSString *)name parameters:(NSDictionary *)parameters iterations:(NSUInteger)iterations usingBlock:(void (^)(NSUInteger count))block;
+
+/**
+ * Returns the results of every benchmark measured so far, in the order they
+ * were run, as dictionaries which can be serialized to JSON.
+ */
+- (NSArray *)results;
+@end
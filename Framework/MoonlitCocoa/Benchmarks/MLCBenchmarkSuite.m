@@ -0,0 +1,89 @@
+//
+//  MLCBenchmarkSuite.m
+//  MoonlitCocoa
+//
+//  Created by agent on 17.10.26.
+//  Released into the public domain.
+//
+
+#import "MLCBenchmarkSuite.h"
+#import <MoonlitCocoa/MoonlitCocoa.h>
+
+@interface MLCBenchmarkSuite ()
+@property (nonatomic, readwrite) NSUInteger iterations;
+@property (nonatomic, readwrite) NSUInteger repetitions;
+@property (nonatomic, copy) NSString *filter;
+@property (nonatomic, strong) NSMutableArray *mutableResults;
+@end
+
+@implementation MLCBenchmarkSuite
+@synthesize iterations = m_iterations;
+@synthesize repetitions = m_repetitions;
+@synthesize filter = m_filter;
+@synthesize mutableResults = m_mutableResults;
+
+- (id)initWithIterations:(NSUInteger)iterations repetitions:(NSUInteger)repetitions filter:(NSString *)filter; {
+	self = [super init];
+	if (!self)
+		return nil;
+
+	self.iterations = MAX(iterations, 1);
+	self.repetitions = MAX(repetitions, 1);
+	self.filter = filter;
+	self.mutableResults = [[NSMutableArray alloc] init];
+	return self;
+}
+
+- (void)measureBenchmarkWithName:(NSString *)name parameters:(NSDictionary *)parameters iterations:(NSUInteger)iterations usingBlock:(void (^)(NSUInteger count))block; {
+	if (self.filter && [name rangeOfString:self.filter].location == NSNotFound)
+		return;
+
+	iterations = MAX(iterations, 1);
+
+	@autoreleasepool {
+		block(MAX(iterations / 10, 1));
+	}
+
+	NSMutableArray *samples = [[NSMutableArray alloc] initWithCapacity:self.repetitions];
+
+	for (NSUInteger i = 0;i < self.repetitions;++i) {
+		@autoreleasepool {
+			uint64_t startTime = MLCProfilerCurrentTime();
+			block(iterations);
+			uint64_t endTime = MLCProfilerCurrentTime();
+
+			double nanoseconds = (double)MLCProfilerNanosecondsFromTime(endTime - startTime) / iterations;
+			[samples addObject:[NSNumber numberWithDouble:nanoseconds]];
+		}
+	}
+
+	NSArray *sortedSamples = [samples sortedArrayUsingSelector:@selector(compare:)];
+	NSNumber *median = [sortedSamples objectAtIndex:[sortedSamples count] / 2];
+	NSNumber *minimum = [sortedSamples objectAtIndex:0];
+
+	NSMutableDictionary *result = [[NSMutableDictionary alloc] init];
+	[result setObject:name forKey:@"name"];
+	[result setObject:[NSNumber numberWithUnsignedInteger:iterations] forKey:@"iterations"];
+	[result setObject:median forKey:@"medianNanosecondsPerIteration"];
+	[result setObject:minimum forKey:@"minimumNanosecondsPerIteration"];
+	[result setObject:samples forKey:@"nanosecondsPerIteration"];
+
+	if (parameters)
+		[result setObject:parameters forKey:@"parameters"];
+
+	[self.mutableResults addObject:result];
+
+	NSMutableString *label = [name mutableCopy];
+	for (NSString *key in [[parameters allKeys] sortedArrayUsingSelector:@selector(compare:)]) {
+		[label appendFormat:@" %@=%@", key, [parameters objectForKey:key]];
+	}
+
+	// progress goes to stderr, so that stdout can be redirected to a file
+	fprintf(stderr, "%-48s %14.1f ns\n", [label UTF8String], [median doubleValue]);
+}
+
+- (NSArray *)results; {
+	return [self.mutableResults copy];
+}
+
+@end
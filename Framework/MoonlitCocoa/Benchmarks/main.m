@@ -0,0 +1,317 @@
+//
+//  main.m
+//  MoonlitCocoa
+//
+//  Created by agent on 17.10.26.
+//  Released into the public domain.
+//
+//  Measures the costs of the bridge between Objective-C and Lua, and writes
+//  the results as JSON, so that they can be compared across versions.
+//
+//  Usage: MLCBenchmark [-iterations N] [-repetitions N] [-filter NAME] [-output PATH]
+//
+
+#import <Foundation/Foundation.h>
+#import <MoonlitCocoa/MoonlitCocoa.h>
+#import "MLCBenchmarkModel.h"
+#import "MLCBenchmarkObject.h"
+#import "MLCBenchmarkSuite.h"
+#import <lua.h>
+
+#if MLC_USE_LUAJIT
+#import <luajit.h>
+#endif
+
+/**
+ * Incremented with the results of measured operations, so that the compiler
+ * cannot discard them.
+ */
+static volatile NSUInteger MLCBenchmarkSink;
+
+/**
+ * The sizes of the strings, arrays, and dictionaries used to measure
+ * marshaling.
+ */
+static const NSUInteger MLCBenchmarkMarshalingSizes[] = { 1, 16, 256, 4096 };
+
+static void benchmarkStartup (MLCBenchmarkSuite *suite) {
+	[suite measureBenchmarkWithName:@"state.startup" parameters:nil iterations:suite.iterations / 1000 usingBlock:^(NSUInteger count){
+		for (NSUInteger i = 0;i < count;++i) {
+			@autoreleasepool {
+				MLCState *state = [[MLCState alloc] init];
+				MLCBenchmarkSink += (NSUInteger)(__bridge void *)state;
+			}
+		}
+	}];
+}
+
+static void benchmarkScriptLoading (MLCBenchmarkSuite *suite) {
+	NSURL *scriptURL = [[NSBundle mainBundle] URLForResource:@"MLCBenchmarkObject" withExtension:@"lua"];
+	NSString *source = [NSString stringWithContentsOfURL:scriptURL usedEncoding:NULL error:NULL];
+	if (!source) {
+		NSLog(@"Could not find MLCBenchmarkObject.lua, skipping script benchmarks");
+		return;
+	}
+
+	NSURL *originalCacheURL = [MLCState bytecodeCacheURL];
+	MLCState *state = [[MLCState alloc] init];
+
+	void (^loadScript)(NSUInteger) = ^(NSUInteger count){
+		for (NSUInteger i = 0;i < count;++i) {
+			@autoreleasepool {
+				if ([state loadScript:source error:NULL])
+					lua_pop(state.state, 1);
+			}
+		}
+	};
+
+	// without a cache, every load runs the Metalua compiler
+	[MLCState setBytecodeCacheURL:nil];
+	[suite measureBenchmarkWithName:@"script.compile" parameters:nil iterations:suite.iterations / 1000 usingBlock:loadScript];
+
+	NSString *cachePath = [NSTemporaryDirectory() stringByAppendingPathComponent:[[NSProcessInfo processInfo] globallyUniqueString]];
+	NSURL *cacheURL = [NSURL fileURLWithPath:cachePath isDirectory:YES];
+
+	// the warm-up run populates the cache
+	[MLCState setBytecodeCacheURL:cacheURL];
+	[suite measureBenchmarkWithName:@"script.cachedLoad" parameters:nil iterations:suite.iterations / 100 usingBlock:loadScript];
+
+	[MLCState setBytecodeCacheURL:originalCacheURL];
+	[[NSFileManager defaultManager] removeItemAtURL:cacheURL error:NULL];
+
+	// plain Lua files skip the Metalua compiler entirely
+	[suite measureBenchmarkWithName:@"script.loadPlain" parameters:nil iterations:suite.iterations / 100 usingBlock:^(NSUInteger count){
+		for (NSUInteger i = 0;i < count;++i) {
+			@autoreleasepool {
+				if ([state loadScriptAtURL:scriptURL error:NULL])
+					lua_pop(state.state, 1);
+			}
+		}
+	}];
+}
+
+static void benchmarkForwarding (MLCBenchmarkSuite *suite) {
+	MLCBenchmarkObject *obj = [[MLCBenchmarkObject alloc] init];
+
+	[suite measureBenchmarkWithName:@"forwarding.scalar" parameters:nil iterations:suite.iterations usingBlock:^(NSUInteger count){
+		for (NSUInteger i = 0;i < count;++i) {
+			MLCBenchmarkSink += (NSUInteger)[obj addInteger:(int)i toInteger:1];
+		}
+	}];
+
+	NSString *string = @"MoonlitCocoa";
+	[suite measureBenchmarkWithName:@"forwarding.object" parameters:nil iterations:suite.iterations usingBlock:^(NSUInteger count){
+		for (NSUInteger i = 0;i < count;++i) {
+			@autoreleasepool {
+				MLCBenchmarkSink += [[obj echoObject:string] length];
+			}
+		}
+	}];
+
+	[suite measureBenchmarkWithName:@"forwarding.key" parameters:nil iterations:suite.iterations usingBlock:^(NSUInteger count){
+		for (NSUInteger i = 0;i < count;++i) {
+			@autoreleasepool {
+				MLCBenchmarkSink += [[obj valueForKey:@"constant"] unsignedIntegerValue];
+			}
+		}
+	}];
+}
+
+static void benchmarkTrampoline (MLCBenchmarkSuite *suite) {
+	MLCBenchmarkObject *obj = [[MLCBenchmarkObject alloc] init];
+
+	// a single forwarded call loops in Lua, so its cost is amortized across
+	// every iteration
+	[suite measureBenchmarkWithName:@"trampoline.call" parameters:nil iterations:suite.iterations usingBlock:^(NSUInteger count){
+		[obj incrementTimes:(int)count];
+	}];
+
+	MLCBenchmarkSink += obj.counter;
+}
+
+/**
+ * Measures pushing \a value onto \a state, and converting it back into
+ * Objective-C, including reading every element of a collection.
+ */
+static void benchmarkMarshalingOfValue (MLCBenchmarkSuite *suite, MLCState *state, NSString *kind, id value, NSUInteger size) {
+	NSDictionary *parameters = [NSDictionary dictionaryWithObject:[NSNumber numberWithUnsignedInteger:size] forKey:@"size"];
+	NSUInteger iterations = MAX(suite.iterations / size, 100);
+
+	NSString *pushName = [NSString stringWithFormat:@"marshal.%@.push", kind];
+	[suite measureBenchmarkWithName:pushName parameters:parameters iterations:iterations usingBlock:^(NSUInteger count){
+		[state lock];
+
+		lua_State *L = state.state;
+		int top = lua_gettop(L);
+
+		for (NSUInteger i = 0;i < count;++i) {
+			[state pushObject:value];
+			lua_settop(L, top);
+		}
+
+		[state unlock];
+	}];
+
+	NSString *roundTripName = [NSString stringWithFormat:@"marshal.%@.roundTrip", kind];
+	[suite measureBenchmarkWithName:roundTripName parameters:parameters iterations:iterations usingBlock:^(NSUInteger count){
+		[state lock];
+
+		for (NSUInteger i = 0;i < count;++i) {
+			@autoreleasepool {
+				[state pushObject:value];
+				id result = [state popValueOnStack];
+
+				if ([result isKindOfClass:[NSString class]]) {
+					MLCBenchmarkSink += [result length];
+				} else {
+					for (id element in result) {
+						MLCBenchmarkSink += (NSUInteger)(__bridge void *)element;
+					}
+				}
+			}
+		}
+
+		[state unlock];
+	}];
+}
+
+static void benchmarkMarshaling (MLCBenchmarkSuite *suite) {
+	MLCState *state = [[MLCState alloc] init];
+
+	size_t sizeCount = sizeof(MLCBenchmarkMarshalingSizes) / sizeof(*MLCBenchmarkMarshalingSizes);
+	for (size_t i = 0;i < sizeCount;++i) {
+		NSUInteger size = MLCBenchmarkMarshalingSizes[i];
+
+		NSString *string = [@"" stringByPaddingToLength:size withString:@"MoonlitCocoa" startingAtIndex:0];
+		benchmarkMarshalingOfValue(suite, state, @"string", string, size);
+
+		NSMutableArray *array = [[NSMutableArray alloc] initWithCapacity:size];
+		NSMutableDictionary *dictionary = [[NSMutableDictionary alloc] initWithCapacity:size];
+
+		for (NSUInteger j = 0;j < size;++j) {
+			NSNumber *number = [NSNumber numberWithUnsignedInteger:j];
+
+			[array addObject:number];
+			[dictionary setObject:number forKey:[NSString stringWithFormat:@"key%lu", (unsigned long)j]];
+		}
+
+		benchmarkMarshalingOfValue(suite, state, @"array", array, size);
+		benchmarkMarshalingOfValue(suite, state, @"dictionary", dictionary, size);
+	}
+}
+
+static void benchmarkModel (MLCBenchmarkSuite *suite) {
+	NSNumber *quantity = [NSNumber numberWithInt:5];
+
+	[suite measureBenchmarkWithName:@"model.init" parameters:nil iterations:suite.iterations usingBlock:^(NSUInteger count){
+		for (NSUInteger i = 0;i < count;++i) {
+			@autoreleasepool {
+				MLCBenchmarkModel *model = [[MLCBenchmarkModel alloc] initWithName:@"Widget" quantity:quantity identifier:@"A-1"];
+				MLCBenchmarkSink += (NSUInteger)(__bridge void *)model;
+			}
+		}
+	}];
+
+	NSDictionary *dictionary = [NSDictionary dictionaryWithObjectsAndKeys:
+		@"Widget", @"name",
+		quantity, @"quantity",
+		@"A-1", @"identifier",
+		nil
+	];
+
+	[suite measureBenchmarkWithName:@"model.initWithDictionary" parameters:nil iterations:suite.iterations usingBlock:^(NSUInteger count){
+		for (NSUInteger i = 0;i < count;++i) {
+			@autoreleasepool {
+				MLCBenchmarkModel *model = [[MLCBenchmarkModel alloc] initWithDictionary:dictionary];
+				MLCBenchmarkSink += (NSUInteger)(__bridge void *)model;
+			}
+		}
+	}];
+
+	MLCBenchmarkModel *model = [[MLCBenchmarkModel alloc] initWithDictionary:dictionary];
+	MLCBenchmarkModel *equalModel = [[MLCBenchmarkModel alloc] initWithDictionary:dictionary];
+
+	[suite measureBenchmarkWithName:@"model.hash" parameters:nil iterations:suite.iterations usingBlock:^(NSUInteger count){
+		for (NSUInteger i = 0;i < count;++i) {
+			@autoreleasepool {
+				MLCBenchmarkSink += [model hash];
+			}
+		}
+	}];
+
+	[suite measureBenchmarkWithName:@"model.isEqual" parameters:nil iterations:suite.iterations usingBlock:^(NSUInteger count){
+		for (NSUInteger i = 0;i < count;++i) {
+			@autoreleasepool {
+				MLCBenchmarkSink += (NSUInteger)[model isEqual:equalModel];
+			}
+		}
+	}];
+}
+
+/**
+ * Describes the build and machine that the benchmarks ran with.
+ */
+static NSDictionary *environmentDictionary (void) {
+	NSProcessInfo *processInfo = [NSProcessInfo processInfo];
+	NSString *frameworkVersion = [[[NSBundle bundleForClass:[MLCState class]] infoDictionary] objectForKey:@"CFBundleVersion"];
+
+	#if MLC_USE_LUAJIT
+	NSString *luaVersion = [NSString stringWithUTF8String:LUAJIT_VERSION];
+	#else
+	NSString *luaVersion = [NSString stringWithUTF8String:LUA_RELEASE];
+	#endif
+
+	return [NSDictionary dictionaryWithObjectsAndKeys:
+		frameworkVersion ?: @"unknown", @"frameworkVersion",
+		luaVersion, @"luaVersion",
+		[processInfo operatingSystemVersionString], @"operatingSystem",
+		[NSNumber numberWithUnsignedInteger:[processInfo activeProcessorCount]], @"processorCount",
+		[[NSDate date] description], @"date",
+		nil
+	];
+}
+
+int main (int argc, const char *argv[]) {
+	@autoreleasepool {
+		NSUserDefaults *defaults = [NSUserDefaults standardUserDefaults];
+
+		NSUInteger iterations = (NSUInteger)[defaults integerForKey:@"iterations"] ?: 100000;
+		NSUInteger repetitions = (NSUInteger)[defaults integerForKey:@"repetitions"] ?: 5;
+		NSString *filter = [defaults stringForKey:@"filter"];
+		NSString *outputPath = [defaults stringForKey:@"output"];
+
+		MLCBenchmarkSuite *suite = [[MLCBenchmarkSuite alloc] initWithIterations:iterations repetitions:repetitions filter:filter];
+
+		benchmarkStartup(suite);
+		benchmarkScriptLoading(suite);
+		benchmarkForwarding(suite);
+		benchmarkTrampoline(suite);
+		benchmarkMarshaling(suite);
+		benchmarkModel(suite);
+
+		NSDictionary *report = [NSDictionary dictionaryWithObjectsAndKeys:
+			environmentDictionary(), @"environment",
+			[NSNumber numberWithUnsignedInteger:suite.repetitions], @"repetitions",
+			[suite results], @"benchmarks",
+			nil
+		];
+
+		NSError *error = nil;
+		NSData *JSON = [NSJSONSerialization dataWithJSONObject:report options:NSJSONWritingPrettyPrinted error:&error];
+		if (!JSON) {
+			NSLog(@"Could not serialize benchmark results: %@", error);
+			return EXIT_FAILURE;
+		}
+
+		if (outputPath) {
+			if (![JSON writeToFile:outputPath options:NSDataWritingAtomic error:&error]) {
+				NSLog(@"Could not write benchmark results to %@: %@", outputPath, error);
+				return EXIT_FAILURE;
+			}
+		} else {
+			[[NSFileHandle fileHandleWithStandardOutput] writeData:JSON];
+		}
+	}
+
+	return EXIT_SUCCESS;
+}
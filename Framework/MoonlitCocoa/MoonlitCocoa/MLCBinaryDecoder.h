@@ -0,0 +1,76 @@
+//
+//  MLCBinaryDecoder.h
+//  MoonlitCocoa
+//
+//  Created by agent on 17.10.26.
+//  Released into the public domain.
+//
+
+#import <Foundation/Foundation.h>
+#import <MoonlitCocoa/MLCBinaryFormat.h>
+
+@class MLCState;
+
+/**
+ * Reads values written by #MLCBinaryEncoder, one at a time.
+ *
+ * Models are recreated using \c -initWithDictionary:, so that any validation
+ * they perform still applies. Arrays and dictionaries are decoded as \c
+ * NSArray and \c NSDictionary, \c nil as \c NSNull, and any string which is
+ * not valid UTF-8 as \c NSData. Dictionaries decoded into Objective-C may only
+ * be keyed by values which can be copied and are not collections; a Lua table
+ * with table keys can only be decoded back into Lua.
+ *
+ * Input is not trusted: values nested more than 512 levels deep are rejected
+ * as malformed, and lengths larger than the rest of the input fail without
+ * allocating memory for them.
+ *
+ * A decoder is not thread-safe.
+ */
+@interface MLCBinaryDecoder : NSObject
+/**
+ * Decodes the first value in \a data, or returns \c nil if an error occurs.
+ */
++ (id)objectWithData:(NSData *)data error:(NSError **)error;
+
+/**
+ * Initializes a decoder which reads from \a data.
+ */
+- (id)initWithData:(NSData *)data;
+
+/**
+ * Initializes a decoder which reads from \a fileDescriptor as values are
+ * decoded. The file descriptor is not closed by the decoder.
+ */
+- (id)initWithFileDescriptor:(int)fileDescriptor;
+
+/**
+ * Initializes a decoder which reads from a memory mapping of the file at \a
+ * URL, which is unmapped when the decoder is deallocated. Returns \c nil if
+ * the file cannot be opened or mapped.
+ */
+- (id)initWithContentsOfMappedFileAtURL:(NSURL *)URL error:(NSError **)error;
+
+/**
+ * Whether every value in the stream has been decoded.
+ */
+@property (nonatomic, readonly, getter = isAtEnd) BOOL atEnd;
+
+/**
+ * Decodes the next value in the stream. Returns \c nil without an error if the
+ * receiver is at the end of the stream, or \c nil with an error if decoding
+ * fails, after which no more values can be decoded.
+ */
+- (id)decodeObjectWithError:(NSError **)error;
+
+/**
+ * Decodes the next value in the stream directly into Lua values, and pushes
+ * it onto the stack of \a state. Arrays and dictionaries become Lua tables,
+ * and models become bridged objects.
+ *
+ * A decoder can only decode values onto one #MLCState. If an error occurs, or
+ * if the receiver is at the end of the stream, \c NO is returned, and nothing
+ * is pushed.
+ */
+- (BOOL)decodeValueOntoState:(MLCState *)state error:(NSError **)error;
+@end
@@ -0,0 +1,1173 @@
+//
+//  MLCBinaryDecoder.m
+//  MoonlitCocoa
+//
+//  Created by agent on 17.10.26.
+//  Released into the public domain.
+//
+
+#import "MLCBinaryDecoder.h"
+#import "MLCMarshaling.h"
+#import "MLCModel.h"
+#import "MLCState.h"
+#import <errno.h>
+#import <fcntl.h>
+#import <lauxlib.h>
+#import <math.h>
+#import <sys/mman.h>
+#import <sys/stat.h>
+#import <unistd.h>
+
+/**
+ * The number of bytes read at a time by a decoder which reads from a file
+ * descriptor.
+ */
+static const size_t MLCBinaryDecoderFileBufferLength = 64 * 1024;
+
+/**
+ * The deepest that values may be nested within arrays, dictionaries, and
+ * models. Anything deeper is rejected as malformed, instead of overflowing the
+ * C stack while recursing.
+ */
+static const NSUInteger MLCBinaryDecoderMaximumDepth = 512;
+
+/**
+ * Returns an error in #MLCBinaryErrorDomain.
+ */
+static NSError *binaryError (MLCBinaryError code, NSString *description) {
+	NSDictionary *userInfo = [NSDictionary dictionaryWithObject:description forKey:NSLocalizedDescriptionKey];
+	return [NSError errorWithDomain:MLCBinaryErrorDomain code:code userInfo:userInfo];
+}
+
+/**
+ * Returns an #MLCBinaryErrorFile error with the given description, wrapping
+ * the current value of \c errno.
+ */
+static NSError *fileError (NSString *description) {
+	NSError *underlyingError = [NSError errorWithDomain:NSPOSIXErrorDomain code:errno userInfo:nil];
+	NSDictionary *userInfo = [NSDictionary dictionaryWithObjectsAndKeys:
+		description, NSLocalizedDescriptionKey,
+		underlyingError, NSUnderlyingErrorKey,
+		nil
+	];
+
+	return [NSError errorWithDomain:MLCBinaryErrorDomain code:MLCBinaryErrorFile userInfo:userInfo];
+}
+
+/**
+ * Describes an #MLCModel subclass as it was written into a stream.
+ */
+@interface MLCBinaryDecoderLayout : NSObject
+/**
+ * The class to instantiate.
+ */
+@property (nonatomic, unsafe_unretained) Class modelClass;
+
+/**
+ * The names of the properties which follow each model, in order.
+ */
+@property (nonatomic, copy) NSArray *propertyNames;
+
+/**
+ * The type encoding character of each property in #propertyNames.
+ */
+@property (nonatomic, copy) NSData *propertyTypes;
+@end
+
+@implementation MLCBinaryDecoderLayout
+@synthesize modelClass = m_modelClass;
+@synthesize propertyNames = m_propertyNames;
+@synthesize propertyTypes = m_propertyTypes;
+@end
+
+@interface MLCBinaryDecoder () {
+	/**
+	 * The bytes available to be decoded, and the position of the next byte to
+	 * decode.
+	 */
+	const unsigned char *m_bytes;
+	size_t m_length;
+	size_t m_position;
+
+	/**
+	 * The data being read from, if the receiver was initialized with data.
+	 */
+	NSData *m_data;
+
+	/**
+	 * The memory mapping being read from, if any.
+	 */
+	void *m_mappedBytes;
+	size_t m_mappedLength;
+
+	/**
+	 * The file descriptor being read from, or -1. When reading from a file
+	 * descriptor, #m_bytes points into #m_buffer.
+	 */
+	int m_fileDescriptor;
+	unsigned char *m_buffer;
+	size_t m_capacity;
+
+	/**
+	 * The number of values currently being decoded, each nested within the
+	 * last. This only needs to be balanced while decoding succeeds, since
+	 * nothing more is decoded after an error.
+	 */
+	NSUInteger m_depth;
+
+	/**
+	 * Whether the magic number and version have been read.
+	 */
+	BOOL m_readHeader;
+
+	/**
+	 * The first error which occurred, after which nothing more is decoded.
+	 */
+	NSError *m_error;
+
+	/**
+	 * Every string decoded so far, in order of their numbers. Strings which
+	 * are not valid UTF-8 are kept as \c NSData.
+	 */
+	NSMutableArray *m_strings;
+
+	/**
+	 * Every #MLCBinaryDecoderLayout decoded so far, in order of their numbers.
+	 */
+	NSMutableArray *m_layouts;
+
+	/**
+	 * Every container decoded so far, in order of their numbers. Containers
+	 * which were decoded as Lua tables are represented by \c NSNull.
+	 */
+	NSMutableArray *m_objects;
+
+	/**
+	 * The state that Lua values are decoded onto, and a reference to a table
+	 * in its registry. The table holds a table mapping string numbers to Lua
+	 * strings at index 1, and a table mapping object numbers to Lua tables at
+	 * index 2. Both are indexed by number plus one.
+	 */
+	MLCState *m_state;
+	int m_luaReference;
+}
+
+/**
+ * Initializes the receiver to read from \a bytes, or from \a fileDescriptor if
+ * \a bytes is \c NULL.
+ */
+- (id)initWithBytes:(const void *)bytes length:(size_t)length fileDescriptor:(int)fileDescriptor;
+
+/**
+ * Reads the magic number and version if they haven't been read yet. Returns
+ * \c NO and sets #m_error if they are invalid.
+ */
+- (BOOL)readHeader;
+
+/**
+ * Reads a value, returning \c nil and setting #m_error if it cannot be
+ * decoded.
+ */
+- (id)readObject;
+- (id)readObjectWithTag:(unsigned char)tag;
+- (id)readStringDefinition;
+- (id)readStringReference;
+- (MLCBinaryDecoderLayout *)readLayout;
+- (id)readModelWithLayout:(MLCBinaryDecoderLayout *)layout;
+
+/**
+ * Sets #m_error to an error with the given code and description, unless an
+ * error has already occurred.
+ */
+- (void)failWithCode:(MLCBinaryError)code description:(NSString *)description;
+
+/**
+ * Sets #m_error to an #MLCBinaryErrorMalformed error.
+ */
+- (void)failAsMalformed;
+
+/**
+ * Returns whether the receiver has not failed, copying #m_error into \a error
+ * otherwise.
+ */
+- (BOOL)succeededWithError:(NSError **)error;
+@end
+
+@implementation MLCBinaryDecoder
+
+#pragma mark Reading
+
+/**
+ * Returns whether the file being read could still contain \a length more bytes.
+ * Only regular files have a known size, so anything else is assumed to.
+ */
+static BOOL fileMayContainBytes (__unsafe_unretained MLCBinaryDecoder *decoder, size_t length) {
+	struct stat info;
+	if (fstat(decoder->m_fileDescriptor, &info) != 0 || !S_ISREG(info.st_mode))
+		return YES;
+
+	off_t offset = lseek(decoder->m_fileDescriptor, 0, SEEK_CUR);
+	if (offset < 0 || offset > info.st_size)
+		return YES;
+
+	return (unsigned long long)length <= (unsigned long long)(info.st_size - offset);
+}
+
+/**
+ * Reads more of the file into the buffer, until at least \a length bytes are
+ * available. Returns \c NO if the file ends first.
+ *
+ * Lengths come from the file itself, so the buffer only grows as data actually
+ * arrives, and lengths that cannot fit in the rest of a regular file are
+ * rejected without allocating anything.
+ */
+static BOOL refillBuffer (__unsafe_unretained MLCBinaryDecoder *decoder, size_t length) {
+	size_t remaining = decoder->m_length - decoder->m_position;
+	memmove(decoder->m_buffer, decoder->m_buffer + decoder->m_position, remaining);
+
+	decoder->m_length = remaining;
+	decoder->m_position = 0;
+	decoder->m_bytes = decoder->m_buffer;
+
+	if (length > remaining && !fileMayContainBytes(decoder, length - remaining))
+		return NO;
+
+	while (decoder->m_length < length) {
+		if (decoder->m_length == decoder->m_capacity) {
+			size_t capacity = MIN(MAX(decoder->m_capacity * 2, MLCBinaryDecoderFileBufferLength), length);
+
+			unsigned char *buffer = realloc(decoder->m_buffer, capacity);
+			if (!buffer)
+				return NO;
+
+			decoder->m_buffer = buffer;
+			decoder->m_bytes = buffer;
+			decoder->m_capacity = capacity;
+		}
+
+		ssize_t bytesRead = read(decoder->m_fileDescriptor, decoder->m_buffer + decoder->m_length, decoder->m_capacity - decoder->m_length);
+		if (bytesRead < 0) {
+			if (errno == EINTR)
+				continue;
+
+			if (!decoder->m_error)
+				decoder->m_error = fileError(NSLocalizedString(@"Could not read encoded values from the file.", @""));
+
+			return NO;
+		}
+
+		if (bytesRead == 0)
+			return NO;
+
+		decoder->m_length += (size_t)bytesRead;
+	}
+
+	return YES;
+}
+
+/**
+ * Returns whether \a length bytes are available at the current position,
+ * reading more from the file if necessary. Sets #m_error if not.
+ */
+static BOOL ensureBytes (__unsafe_unretained MLCBinaryDecoder *decoder, size_t length) {
+	if (decoder->m_length - decoder->m_position >= length)
+		return YES;
+
+	if (decoder->m_fileDescriptor >= 0 && refillBuffer(decoder, length))
+		return YES;
+
+	[decoder failWithCode:MLCBinaryErrorTruncated description:NSLocalizedString(@"The encoded data ended unexpectedly.", @"")];
+	return NO;
+}
+
+static BOOL readByte (__unsafe_unretained MLCBinaryDecoder *decoder, unsigned char *byte) {
+	if (!ensureBytes(decoder, 1))
+		return NO;
+
+	*byte = decoder->m_bytes[decoder->m_position++];
+	return YES;
+}
+
+static BOOL readVarint (__unsafe_unretained MLCBinaryDecoder *decoder, unsigned long long *value) {
+	unsigned long long result = 0;
+
+	for (unsigned shift = 0;shift < 64;shift += 7) {
+		unsigned char byte = 0;
+		if (!readByte(decoder, &byte))
+			return NO;
+
+		result |= (unsigned long long)(byte & 0x7F) << shift;
+
+		if (!(byte & 0x80)) {
+			*value = result;
+			return YES;
+		}
+	}
+
+	[decoder failAsMalformed];
+	return NO;
+}
+
+static BOOL readSignedVarint (__unsafe_unretained MLCBinaryDecoder *decoder, long long *value) {
+	unsigned long long encoded = 0;
+	if (!readVarint(decoder, &encoded))
+		return NO;
+
+	*value = (long long)(encoded >> 1) ^ -(long long)(encoded & 1);
+	return YES;
+}
+
+static BOOL readDouble (__unsafe_unretained MLCBinaryDecoder *decoder, double *value) {
+	NSSwappedDouble swapped;
+	if (!ensureBytes(decoder, sizeof(swapped)))
+		return NO;
+
+	memcpy(&swapped, decoder->m_bytes + decoder->m_position, sizeof(swapped));
+	decoder->m_position += sizeof(swapped);
+
+	*value = NSSwapLittleDoubleToHost(swapped);
+	return YES;
+}
+
+/**
+ * Reads a length, and makes sure that many bytes are available.
+ */
+static BOOL readLength (__unsafe_unretained MLCBinaryDecoder *decoder, size_t *length) {
+	unsigned long long value = 0;
+	if (!readVarint(decoder, &value))
+		return NO;
+
+	if (value > SIZE_MAX) {
+		[decoder failAsMalformed];
+		return NO;
+	}
+
+	*length = (size_t)value;
+	return ensureBytes(decoder, *length);
+}
+
+/**
+ * Reads a count of values, and returns a capacity suitable for storing that
+ * many values, which is limited by the number of bytes remaining.
+ */
+static BOOL readCount (__unsafe_unretained MLCBinaryDecoder *decoder, unsigned long long *count, NSUInteger *capacity) {
+	if (!readVarint(decoder, count))
+		return NO;
+
+	*capacity = (NSUInteger)MIN(*count, decoder->m_length - decoder->m_position);
+	return YES;
+}
+
+#pragma mark Lifecycle
+
++ (id)objectWithData:(NSData *)data error:(NSError **)error; {
+	MLCBinaryDecoder *decoder = [[self alloc] initWithData:data];
+	id object = [decoder decodeObjectWithError:error];
+
+	if (!object && error && !*error)
+		*error = binaryError(MLCBinaryErrorTruncated, NSLocalizedString(@"The encoded data contains no values.", @""));
+
+	return object;
+}
+
+- (id)initWithData:(NSData *)data; {
+	NSParameterAssert(data != nil);
+
+	self = [self initWithBytes:[data bytes] length:[data length] fileDescriptor:-1];
+	if (!self)
+		return nil;
+
+	m_data = [data copy];
+	m_bytes = [m_data bytes];
+	return self;
+}
+
+- (id)initWithFileDescriptor:(int)fileDescriptor; {
+	NSParameterAssert(fileDescriptor >= 0);
+	return [self initWithBytes:NULL length:0 fileDescriptor:fileDescriptor];
+}
+
+- (id)initWithContentsOfMappedFileAtURL:(NSURL *)URL error:(NSError **)error; {
+	NSParameterAssert([URL isFileURL]);
+
+	int fd = open([[URL path] fileSystemRepresentation], O_RDONLY);
+	if (fd < 0) {
+		if (error)
+			*error = fileError(NSLocalizedString(@"Could not open the file.", @""));
+
+		return nil;
+	}
+
+	struct stat info;
+	if (fstat(fd, &info) != 0) {
+		if (error)
+			*error = fileError(NSLocalizedString(@"Could not open the file.", @""));
+
+		close(fd);
+		return nil;
+	}
+
+	size_t length = (size_t)info.st_size;
+	void *bytes = NULL;
+
+	if (length) {
+		bytes = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (bytes == MAP_FAILED) {
+			if (error)
+				*error = fileError(NSLocalizedString(@"Could not map the file into memory.", @""));
+
+			close(fd);
+			return nil;
+		}
+
+		// values are decoded front to back
+		posix_madvise(bytes, length, POSIX_MADV_SEQUENTIAL);
+	}
+
+	// the mapping remains valid after the file is closed
+	close(fd);
+
+	self = [self initWithBytes:bytes length:length fileDescriptor:-1];
+	if (!self) {
+		if (bytes)
+			munmap(bytes, length);
+
+		return nil;
+	}
+
+	m_mappedBytes = bytes;
+	m_mappedLength = length;
+	return self;
+}
+
+- (id)initWithBytes:(const void *)bytes length:(size_t)length fileDescriptor:(int)fileDescriptor; {
+	self = [super init];
+	if (!self)
+		return nil;
+
+	m_fileDescriptor = fileDescriptor;
+	m_luaReference = LUA_NOREF;
+
+	if (fileDescriptor >= 0) {
+		m_capacity = MLCBinaryDecoderFileBufferLength;
+		m_buffer = malloc(m_capacity);
+		m_bytes = m_buffer;
+	} else {
+		m_bytes = bytes;
+		m_length = length;
+	}
+
+	m_strings = [[NSMutableArray alloc] init];
+	m_layouts = [[NSMutableArray alloc] init];
+	m_objects = [[NSMutableArray alloc] init];
+	return self;
+}
+
+- (void)dealloc {
+	free(m_buffer);
+	m_buffer = NULL;
+
+	if (m_mappedBytes) {
+		munmap(m_mappedBytes, m_mappedLength);
+		m_mappedBytes = NULL;
+	}
+
+	// this may be deallocated on a different thread than the one using the
+	// state, so the reference must be released without waiting for it
+	if (m_state)
+		MLCStateReleaseReference(m_state, m_luaReference);
+}
+
+#pragma mark Errors
+
+- (void)failWithCode:(MLCBinaryError)code description:(NSString *)description; {
+	if (!m_error)
+		m_error = binaryError(code, description);
+}
+
+- (void)failAsMalformed; {
+	[self failWithCode:MLCBinaryErrorMalformed description:NSLocalizedString(@"The encoded data is corrupt.", @"")];
+}
+
+- (BOOL)succeededWithError:(NSError **)error; {
+	if (!m_error)
+		return YES;
+
+	if (error)
+		*error = m_error;
+
+	return NO;
+}
+
+#pragma mark Stream
+
+- (BOOL)readHeader; {
+	if (m_readHeader)
+		return YES;
+
+	size_t length = sizeof(MLCBinaryFormatMagic) + 1;
+	if (!ensureBytes(self, length))
+		return NO;
+
+	const unsigned char *header = m_bytes + m_position;
+	if (memcmp(header, MLCBinaryFormatMagic, sizeof(MLCBinaryFormatMagic)) != 0 || header[sizeof(MLCBinaryFormatMagic)] != MLCBinaryFormatVersion) {
+		[self failWithCode:MLCBinaryErrorMalformed description:NSLocalizedString(@"The data is not in a supported encoding.", @"")];
+		return NO;
+	}
+
+	m_position += length;
+	m_readHeader = YES;
+	return YES;
+}
+
+- (BOOL)isAtEnd {
+	if (m_error || ![self readHeader])
+		return YES;
+
+	if (m_position < m_length)
+		return NO;
+
+	if (m_fileDescriptor >= 0)
+		return !refillBuffer(self, 1);
+
+	return YES;
+}
+
+#pragma mark Objective-C values
+
+- (id)decodeObjectWithError:(NSError **)error; {
+	if (self.atEnd) {
+		[self succeededWithError:error];
+		return nil;
+	}
+
+	id object = [self readObject];
+	if (![self succeededWithError:error])
+		return nil;
+
+	return object;
+}
+
+- (id)readObject; {
+	unsigned char tag = 0;
+	if (!readByte(self, &tag))
+		return nil;
+
+	if (m_depth >= MLCBinaryDecoderMaximumDepth) {
+		[self failAsMalformed];
+		return nil;
+	}
+
+	++m_depth;
+	id object = [self readObjectWithTag:tag];
+	--m_depth;
+
+	return object;
+}
+
+- (id)readObjectWithTag:(unsigned char)tag; {
+	switch (tag) {
+	case MLCBinaryTagNil:
+		return [NSNull null];
+
+	case MLCBinaryTagFalse:
+		return [NSNumber numberWithBool:NO];
+
+	case MLCBinaryTagTrue:
+		return [NSNumber numberWithBool:YES];
+
+	case MLCBinaryTagInteger:
+		{
+			long long value = 0;
+			if (!readSignedVarint(self, &value))
+				return nil;
+
+			return [NSNumber numberWithLongLong:value];
+		}
+
+	case MLCBinaryTagUnsignedInteger:
+		{
+			unsigned long long value = 0;
+			if (!readVarint(self, &value))
+				return nil;
+
+			return [NSNumber numberWithUnsignedLongLong:value];
+		}
+
+	case MLCBinaryTagDouble:
+		{
+			double value = 0;
+			if (!readDouble(self, &value))
+				return nil;
+
+			return [NSNumber numberWithDouble:value];
+		}
+
+	case MLCBinaryTagString:
+		return [self readStringDefinition];
+
+	case MLCBinaryTagStringReference:
+		return [self readStringReference];
+
+	case MLCBinaryTagData:
+		{
+			size_t length = 0;
+			if (!readLength(self, &length))
+				return nil;
+
+			NSData *data = [NSData dataWithBytes:m_bytes + m_position length:length];
+			m_position += length;
+			return data;
+		}
+
+	case MLCBinaryTagDecimalNumber:
+		{
+			id string = [self readObject];
+			if (![string isKindOfClass:[NSString class]]) {
+				[self failAsMalformed];
+				return nil;
+			}
+
+			return [NSDecimalNumber decimalNumberWithString:string];
+		}
+
+	case MLCBinaryTagArray:
+		{
+			unsigned long long count = 0;
+			NSUInteger capacity = 0;
+			if (!readCount(self, &count, &capacity))
+				return nil;
+
+			NSMutableArray *array = [[NSMutableArray alloc] initWithCapacity:capacity];
+			for (unsigned long long i = 0;i < count;++i) {
+				id value = [self readObject];
+				if (!value)
+					return nil;
+
+				[array addObject:value];
+			}
+
+			[m_objects addObject:array];
+			return array;
+		}
+
+	case MLCBinaryTagDictionary:
+		{
+			unsigned long long count = 0;
+			NSUInteger capacity = 0;
+			if (!readCount(self, &count, &capacity))
+				return nil;
+
+			NSMutableDictionary *dictionary = [[NSMutableDictionary alloc] initWithCapacity:capacity];
+			for (unsigned long long i = 0;i < count;++i) {
+				id key = [self readObject];
+				if (!key)
+					return nil;
+
+				// Lua tables may be keyed by tables, but Foundation collections
+				// would be mutable keys, and anything else must be copyable
+				if (![key conformsToProtocol:@protocol(NSCopying)] || [key isKindOfClass:[NSArray class]] || [key isKindOfClass:[NSDictionary class]]) {
+					[self failWithCode:MLCBinaryErrorUnsupportedValue description:NSLocalizedString(@"A dictionary key decoded into Objective-C must be a string, number, data, or model.", @"")];
+					return nil;
+				}
+
+				id value = [self readObject];
+				if (!value)
+					return nil;
+
+				[dictionary setObject:value forKey:key];
+			}
+
+			[m_objects addObject:dictionary];
+			return dictionary;
+		}
+
+	case MLCBinaryTagLayout:
+		{
+			MLCBinaryDecoderLayout *layout = [self readLayout];
+			if (!layout)
+				return nil;
+
+			return [self readModelWithLayout:layout];
+		}
+
+	case MLCBinaryTagModel:
+		{
+			unsigned long long number = 0;
+			if (!readVarint(self, &number))
+				return nil;
+
+			if (number >= [m_layouts count]) {
+				[self failAsMalformed];
+				return nil;
+			}
+
+			return [self readModelWithLayout:[m_layouts objectAtIndex:(NSUInteger)number]];
+		}
+
+	case MLCBinaryTagReference:
+		{
+			unsigned long long number = 0;
+			if (!readVarint(self, &number))
+				return nil;
+
+			if (number >= [m_objects count]) {
+				[self failAsMalformed];
+				return nil;
+			}
+
+			id object = [m_objects objectAtIndex:(NSUInteger)number];
+			if (object == [NSNull null]) {
+				[self failWithCode:MLCBinaryErrorUnsupportedValue description:NSLocalizedString(@"A value decoded into Lua cannot be referred to from Objective-C.", @"")];
+				return nil;
+			}
+
+			return object;
+		}
+
+	default:
+		[self failAsMalformed];
+		return nil;
+	}
+}
+
+- (id)readStringDefinition; {
+	size_t length = 0;
+	if (!readLength(self, &length))
+		return nil;
+
+	const void *bytes = m_bytes + m_position;
+	m_position += length;
+
+	id string = [[NSString alloc] initWithBytes:bytes length:length encoding:NSUTF8StringEncoding];
+	if (!string)
+		string = [NSData dataWithBytes:bytes length:length];
+
+	[m_strings addObject:string];
+	return string;
+}
+
+- (id)readStringReference; {
+	unsigned long long number = 0;
+	if (!readVarint(self, &number))
+		return nil;
+
+	if (number >= [m_strings count]) {
+		[self failAsMalformed];
+		return nil;
+	}
+
+	return [m_strings objectAtIndex:(NSUInteger)number];
+}
+
+- (MLCBinaryDecoderLayout *)readLayout; {
+	id className = [self readObject];
+	if (![className isKindOfClass:[NSString class]]) {
+		[self failAsMalformed];
+		return nil;
+	}
+
+	unsigned long long count = 0;
+	NSUInteger capacity = 0;
+	if (!readCount(self, &count, &capacity))
+		return nil;
+
+	NSMutableArray *names = [[NSMutableArray alloc] initWithCapacity:capacity];
+	NSMutableData *types = [[NSMutableData alloc] initWithCapacity:capacity];
+
+	for (unsigned long long i = 0;i < count;++i) {
+		id name = [self readObject];
+		if (![name isKindOfClass:[NSString class]]) {
+			[self failAsMalformed];
+			return nil;
+		}
+
+		unsigned char type = 0;
+		if (!readByte(self, &type))
+			return nil;
+
+		if (!type || !strchr("@csilqCSILQBfd", type)) {
+			[self failAsMalformed];
+			return nil;
+		}
+
+		[names addObject:name];
+		[types appendBytes:&type length:1];
+	}
+
+	Class cls = NSClassFromString(className);
+	if (![cls isSubclassOfClass:[MLCModel class]]) {
+		[self failWithCode:MLCBinaryErrorModelRejected description:[NSString stringWithFormat:NSLocalizedString(@"%@ is not a model class.", @""), className]];
+		return nil;
+	}
+
+	MLCBinaryDecoderLayout *layout = [[MLCBinaryDecoderLayout alloc] init];
+	layout.modelClass = cls;
+	layout.propertyNames = names;
+	layout.propertyTypes = types;
+
+	[m_layouts addObject:layout];
+	return layout;
+}
+
+- (id)readModelWithLayout:(MLCBinaryDecoderLayout *)layout; {
+	NSArray *names = layout.propertyNames;
+	const char *types = [layout.propertyTypes bytes];
+	NSUInteger count = [names count];
+
+	NSMutableDictionary *dictionary = [[NSMutableDictionary alloc] initWithCapacity:count];
+	NSNull *null = [NSNull null];
+
+	for (NSUInteger i = 0;i < count;++i) {
+		id value = nil;
+
+		switch (types[i]) {
+		case '@':
+			value = [self readObject];
+			if (!value)
+				return nil;
+
+			// unset properties are left at their defaults
+			if (value == null)
+				continue;
+
+			break;
+
+		case 'c':
+		case 's':
+		case 'i':
+		case 'l':
+		case 'q':
+			{
+				long long scalar = 0;
+				if (!readSignedVarint(self, &scalar))
+					return nil;
+
+				value = [NSNumber numberWithLongLong:scalar];
+			}
+
+			break;
+
+		case 'C':
+		case 'S':
+		case 'I':
+		case 'L':
+		case 'Q':
+			{
+				unsigned long long scalar = 0;
+				if (!readVarint(self, &scalar))
+					return nil;
+
+				value = [NSNumber numberWithUnsignedLongLong:scalar];
+			}
+
+			break;
+
+		case 'B':
+			{
+				unsigned char scalar = 0;
+				if (!readByte(self, &scalar))
+					return nil;
+
+				value = [NSNumber numberWithBool:scalar != 0];
+			}
+
+			break;
+
+		case 'f':
+		case 'd':
+			{
+				double scalar = 0;
+				if (!readDouble(self, &scalar))
+					return nil;
+
+				value = [NSNumber numberWithDouble:scalar];
+			}
+
+			break;
+		}
+
+		[dictionary setObject:value forKey:[names objectAtIndex:i]];
+	}
+
+	// going through -initWithDictionary: runs any validation, as well as any
+	// overrides in subclasses
+	MLCModel *model = [[layout.modelClass alloc] initWithDictionary:dictionary];
+	if (!model) {
+		[self failWithCode:MLCBinaryErrorModelRejected description:[NSString stringWithFormat:NSLocalizedString(@"An instance of %@ could not be initialized with the decoded values.", @""), layout.modelClass]];
+		return nil;
+	}
+
+	[m_objects addObject:model];
+	return model;
+}
+
+#pragma mark Lua values
+
+/**
+ * Decodes the next value and pushes it onto the stack of \a state. \a strings
+ * and \a tables are the stack indices of the tables described by
+ * #m_luaReference.
+ */
+static BOOL readLuaValue (__unsafe_unretained MLCBinaryDecoder *decoder, MLCState *state, int strings, int tables) {
+	lua_State *L = state.state;
+
+	unsigned char tag = 0;
+	if (!readByte(decoder, &tag))
+		return NO;
+
+	// value + key + copy of the value
+	[state growStackBySize:3];
+
+	switch (tag) {
+	case MLCBinaryTagNil:
+		lua_pushnil(L);
+		return YES;
+
+	case MLCBinaryTagFalse:
+	case MLCBinaryTagTrue:
+		lua_pushboolean(L, tag == MLCBinaryTagTrue);
+		return YES;
+
+	case MLCBinaryTagInteger:
+		{
+			long long value = 0;
+			if (!readSignedVarint(decoder, &value))
+				return NO;
+
+			lua_pushnumber(L, (lua_Number)value);
+		}
+
+		return YES;
+
+	case MLCBinaryTagUnsignedInteger:
+		{
+			unsigned long long value = 0;
+			if (!readVarint(decoder, &value))
+				return NO;
+
+			lua_pushnumber(L, (lua_Number)value);
+		}
+
+		return YES;
+
+	case MLCBinaryTagDouble:
+		{
+			double value = 0;
+			if (!readDouble(decoder, &value))
+				return NO;
+
+			lua_pushnumber(L, value);
+		}
+
+		return YES;
+
+	case MLCBinaryTagString:
+		{
+			size_t length = 0;
+			if (!readLength(decoder, &length))
+				return NO;
+
+			lua_pushlstring(L, (const char *)decoder->m_bytes + decoder->m_position, length);
+
+			// keep the string for both Lua and Objective-C references
+			id string = [[NSString alloc] initWithBytes:decoder->m_bytes + decoder->m_position length:length encoding:NSUTF8StringEncoding];
+			if (!string)
+				string = [NSData dataWithBytes:decoder->m_bytes + decoder->m_position length:length];
+
+			decoder->m_position += length;
+			[decoder->m_strings addObject:string];
+
+			lua_pushvalue(L, -1);
+			lua_rawseti(L, strings, (int)[decoder->m_strings count]);
+		}
+
+		return YES;
+
+	case MLCBinaryTagStringReference:
+		{
+			unsigned long long number = 0;
+			if (!readVarint(decoder, &number))
+				return NO;
+
+			if (number >= [decoder->m_strings count]) {
+				[decoder failAsMalformed];
+				return NO;
+			}
+
+			lua_rawgeti(L, strings, (int)number + 1);
+			if (!lua_isnil(L, -1))
+				return YES;
+
+			lua_pop(L, 1);
+
+			// the string was decoded into Objective-C, so convert it once
+			id string = [decoder->m_strings objectAtIndex:(NSUInteger)number];
+			if ([string isKindOfClass:[NSString class]])
+				lua_pushlstring(L, [string UTF8String], [string lengthOfBytesUsingEncoding:NSUTF8StringEncoding]);
+			else
+				lua_pushlstring(L, [string bytes], [string length]);
+
+			lua_pushvalue(L, -1);
+			lua_rawseti(L, strings, (int)number + 1);
+		}
+
+		return YES;
+
+	case MLCBinaryTagData:
+		{
+			size_t length = 0;
+			if (!readLength(decoder, &length))
+				return NO;
+
+			lua_pushlstring(L, (const char *)decoder->m_bytes + decoder->m_position, length);
+			decoder->m_position += length;
+		}
+
+		return YES;
+
+	case MLCBinaryTagArray:
+	case MLCBinaryTagDictionary:
+		{
+			unsigned long long count = 0;
+			NSUInteger capacity = 0;
+			if (!readCount(decoder, &count, &capacity))
+				return NO;
+
+			if (decoder->m_depth >= MLCBinaryDecoderMaximumDepth) {
+				[decoder failAsMalformed];
+				return NO;
+			}
+
+			int preallocated = (int)MIN(capacity, (NSUInteger)INT_MAX);
+			++decoder->m_depth;
+
+			if (tag == MLCBinaryTagArray) {
+				lua_createtable(L, preallocated, 0);
+
+				for (unsigned long long i = 0;i < count;++i) {
+					if (!readLuaValue(decoder, state, strings, tables))
+						return NO;
+
+					lua_rawseti(L, -2, (int)i + 1);
+				}
+			} else {
+				lua_createtable(L, 0, preallocated);
+
+				for (unsigned long long i = 0;i < count;++i) {
+					if (!readLuaValue(decoder, state, strings, tables))
+						return NO;
+
+					if (lua_isnil(L, -1) || (lua_type(L, -1) == LUA_TNUMBER && isnan(lua_tonumber(L, -1)))) {
+						// not a valid table key
+						lua_pop(L, 1);
+						[decoder failAsMalformed];
+						return NO;
+					}
+
+					if (!readLuaValue(decoder, state, strings, tables)) {
+						lua_pop(L, 1);
+						return NO;
+					}
+
+					lua_rawset(L, -3);
+				}
+			}
+
+			--decoder->m_depth;
+			[decoder->m_objects addObject:[NSNull null]];
+
+			lua_pushvalue(L, -1);
+			lua_rawseti(L, tables, (int)[decoder->m_objects count]);
+		}
+
+		return YES;
+
+	case MLCBinaryTagReference:
+		{
+			unsigned long long number = 0;
+			if (!readVarint(decoder, &number))
+				return NO;
+
+			if (number >= [decoder->m_objects count]) {
+				[decoder failAsMalformed];
+				return NO;
+			}
+
+			id object = [decoder->m_objects objectAtIndex:(NSUInteger)number];
+			if (object == [NSNull null])
+				lua_rawgeti(L, tables, (int)number + 1);
+			else
+				[state pushObject:object];
+		}
+
+		return YES;
+
+	default:
+		{
+			if (decoder->m_depth >= MLCBinaryDecoderMaximumDepth) {
+				[decoder failAsMalformed];
+				return NO;
+			}
+
+			// models and decimal numbers are created in Objective-C, and then
+			// bridged
+			++decoder->m_depth;
+			id object = [decoder readObjectWithTag:tag];
+			--decoder->m_depth;
+
+			if (!object)
+				return NO;
+
+			[state pushObject:object];
+		}
+
+		return YES;
+	}
+}
+
+- (BOOL)decodeValueOntoState:(MLCState *)state error:(NSError **)error; {
+	NSParameterAssert(state != nil);
+	NSAssert(!m_state || m_state == state, @"%@ can only decode values onto one state", self);
+
+	if (self.atEnd) {
+		if (!m_error)
+			[self failWithCode:MLCBinaryErrorTruncated description:NSLocalizedString(@"There are no more values to decode.", @"")];
+
+		return [self succeededWithError:error];
+	}
+
+	lua_State *L = state.state;
+	int top = lua_gettop(L);
+
+	// bookkeeping table + strings + tables
+	[state growStackBySize:3];
+
+	if (!m_state) {
+		m_state = state;
+
+		lua_createtable(L, 2, 0);
+		lua_newtable(L);
+		lua_rawseti(L, -2, 1);
+		lua_newtable(L);
+		lua_rawseti(L, -2, 2);
+
+		m_luaReference = luaL_ref(L, LUA_REGISTRYINDEX);
+	}
+
+	lua_rawgeti(L, LUA_REGISTRYINDEX, m_luaReference);
+	lua_rawgeti(L, -1, 1);
+	lua_rawgeti(L, -2, 2);
+
+	if (!readLuaValue(self, state, top + 2, top + 3)) {
+		lua_settop(L, top);
+		return [self succeededWithError:error];
+	}
+
+	// move the value to where the bookkeeping table was
+	lua_replace(L, top + 1);
+	lua_settop(L, top + 1);
+	return YES;
+}
+
+@end
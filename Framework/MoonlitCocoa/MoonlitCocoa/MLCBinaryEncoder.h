@@ -0,0 +1,84 @@
+//
+//  MLCBinaryEncoder.h
+//  MoonlitCocoa
+//
+//  Created by agent on 17.10.26.
+//  Released into the public domain.
+//
+
+#import <Foundation/Foundation.h>
+#import <MoonlitCocoa/MLCBinaryFormat.h>
+
+@class MLCState;
+
+/**
+ * Writes object graphs and Lua values in a compact binary format, which can be
+ * read back with #MLCBinaryDecoder.
+ *
+ * #MLCModel instances are written using a layout derived from their declared
+ * properties, so property names and class names are only written once per
+ * stream, and scalar properties are written without going through \c NSNumber.
+ * Strings are interned, and any array, dictionary, or model which appears more
+ * than once in a stream is written once and then referred to.
+ *
+ * Besides models, the supported objects are \c NSNull, \c NSNumber, \c
+ * NSDecimalNumber, \c NSString, \c NSData, \c NSArray, and \c NSDictionary. An
+ * object graph which contains itself cannot be encoded.
+ *
+ * An encoder is not thread-safe.
+ */
+@interface MLCBinaryEncoder : NSObject
+/**
+ * Encodes \a object into a new stream, and returns the encoded data, or \c nil
+ * if an error occurs.
+ */
++ (NSData *)dataWithObject:(id)object error:(NSError **)error;
+
+/**
+ * Initializes an encoder which writes to memory. The encoded bytes are
+ * available from #encodedData.
+ */
+- (id)init;
+
+/**
+ * Initializes an encoder which writes to \a fileDescriptor as values are
+ * encoded. The file descriptor is not closed by the encoder.
+ */
+- (id)initWithFileDescriptor:(int)fileDescriptor;
+
+/**
+ * The bytes encoded so far, if the receiver writes to memory, or \c nil if
+ * it writes to a file descriptor.
+ */
+@property (nonatomic, copy, readonly) NSData *encodedData;
+
+/**
+ * Appends \a object, and every object it contains, to the stream. \a object
+ * may be \c nil.
+ *
+ * If an error occurs, \c NO is returned, and the stream should be discarded.
+ */
+- (BOOL)encodeObject:(id)object error:(NSError **)error;
+
+/**
+ * Appends the Lua value at \a index of \a state to the stream, without
+ * converting it to Objective-C first. Tables which are sequences are written
+ * as arrays, and any other tables as dictionaries. Bridged objects are written
+ * as if by #encodeObject:error:. Functions, coroutines, and light userdata are
+ * not supported.
+ *
+ * An encoder can only encode values from one #MLCState. The stack of \a state
+ * is left unchanged.
+ *
+ * If an error occurs, \c NO is returned, and the stream should be discarded.
+ */
+- (BOOL)encodeValueAtStackIndex:(int)index ofState:(MLCState *)state error:(NSError **)error;
+
+/**
+ * Writes any buffered bytes to the file descriptor of the receiver, if it has
+ * one. Further values can be appended afterward.
+ *
+ * Returns \c NO if writing fails, or if an earlier encode failed.
+ */
+- (BOOL)finishEncodingWithError:(NSError **)error;
+@end
@@ -0,0 +1,805 @@
+//
+//  MLCBinaryEncoder.m
+//  MoonlitCocoa
+//
+//  Created by agent on 17.10.26.
+//  Released into the public domain.
+//
+
+#import "MLCBinaryEncoder.h"
+#import "MLCBridgedObject.h"
+#import "MLCMarshaling.h"
+#import "MLCModel.h"
+#import "MLCModelProperty.h"
+#import "MLCState.h"
+#import <dispatch/dispatch.h>
+#import <errno.h>
+#import <lauxlib.h>
+#import <math.h>
+#import <objc/runtime.h>
+#import <unistd.h>
+
+static char * const MLCBinaryEncoderAssociatedLayoutKey = "AssociatedBinaryLayout";
+
+/**
+ * The number of bytes buffered by an encoder before writing to its file
+ * descriptor.
+ */
+static const size_t MLCBinaryEncoderFileBufferLength = 64 * 1024;
+
+/**
+ * The initial capacity of the buffer of an encoder which writes to memory.
+ */
+static const size_t MLCBinaryEncoderMemoryBufferLength = 1024;
+
+/**
+ * The largest magnitude of a Lua number which is written as an integer. Every
+ * integer up to this magnitude can be represented exactly by a double.
+ */
+static const lua_Number MLCBinaryEncoderMaximumExactInteger = 9007199254740992.0;
+
+/**
+ * Returns an error in #MLCBinaryErrorDomain.
+ */
+static NSError *binaryError (MLCBinaryError code, NSString *description) {
+	NSDictionary *userInfo = [NSDictionary dictionaryWithObject:description forKey:NSLocalizedDescriptionKey];
+	return [NSError errorWithDomain:MLCBinaryErrorDomain code:code userInfo:userInfo];
+}
+
+@interface MLCModel (BinaryEncoderPrivate)
++ (NSDictionary *)modelPropertiesByName;
+@end
+
+/**
+ * Describes the properties of an #MLCModel subclass which are written by an
+ * encoder. Layouts are created once per class, and then reused for every
+ * instance.
+ */
+@interface MLCBinaryLayout : NSObject
+/**
+ * Returns the layout for \a cls, creating it if necessary.
+ */
++ (MLCBinaryLayout *)layoutForModelClass:(Class)cls;
+
+/**
+ * Initializes a layout with the properties of \a cls that can be written and
+ * then set again when decoding. These are the properties backed by an instance
+ * variable, with a getter implemented in Objective-C, and of an object or
+ * scalar type.
+ */
+- (id)initWithModelClass:(Class)cls;
+
+/**
+ * The name of the class described by the receiver.
+ */
+@property (nonatomic, copy, readonly) NSString *className;
+
+/**
+ * The #MLCModelProperty objects of the layout, sorted by name.
+ */
+@property (nonatomic, copy, readonly) NSArray *properties;
+@end
+
+@interface MLCBinaryLayout ()
+@property (nonatomic, copy, readwrite) NSString *className;
+@property (nonatomic, copy, readwrite) NSArray *properties;
+@end
+
+@implementation MLCBinaryLayout
+@synthesize className = m_className;
+@synthesize properties = m_properties;
+
++ (MLCBinaryLayout *)layoutForModelClass:(Class)cls; {
+	MLCBinaryLayout *layout = objc_getAssociatedObject(cls, MLCBinaryEncoderAssociatedLayoutKey);
+	if (layout)
+		return layout;
+
+	layout = [[self alloc] initWithModelClass:cls];
+
+	@synchronized (cls) {
+		MLCBinaryLayout *existingLayout = objc_getAssociatedObject(cls, MLCBinaryEncoderAssociatedLayoutKey);
+		if (existingLayout)
+			return existingLayout;
+
+		objc_setAssociatedObject(cls, MLCBinaryEncoderAssociatedLayoutKey, layout, OBJC_ASSOCIATION_RETAIN);
+	}
+
+	return layout;
+}
+
+- (id)initWithModelClass:(Class)cls; {
+	self = [super init];
+	if (!self)
+		return nil;
+
+	NSMutableArray *properties = [[NSMutableArray alloc] init];
+
+	for (MLCModelProperty *property in [[cls modelPropertiesByName] objectEnumerator]) {
+		if (!property.ivar || !property.getterImplementation)
+			continue;
+
+		if (!property.type || !strchr("@csilqCSILQBfd", property.type))
+			continue;
+
+		[properties addObject:property];
+	}
+
+	[properties sortUsingComparator:^(MLCModelProperty *a, MLCModelProperty *b){
+		return [a.name compare:b.name];
+	}];
+
+	self.className = NSStringFromClass(cls);
+	self.properties = properties;
+	return self;
+}
+
+@end
+
+@interface MLCBinaryEncoder () {
+	/**
+	 * Bytes which have been encoded, but not yet written to #m_fileDescriptor.
+	 * If the receiver writes to memory, this holds the whole stream.
+	 */
+	unsigned char *m_bytes;
+	size_t m_length;
+	size_t m_capacity;
+
+	/**
+	 * The file descriptor being written to, or -1 if the receiver writes to
+	 * memory.
+	 */
+	int m_fileDescriptor;
+
+	/**
+	 * The first error which occurred, after which nothing more is written.
+	 */
+	NSError *m_error;
+
+	/**
+	 * Maps every string written so far to its number.
+	 */
+	NSMutableDictionary *m_stringNumbers;
+	NSUInteger m_stringCount;
+
+	/**
+	 * Maps every container written so far to its number plus one. The
+	 * containers themselves are retained by #m_objects, so that their
+	 * addresses cannot be reused.
+	 */
+	NSMapTable *m_objectNumbers;
+	NSMutableArray *m_objects;
+	NSUInteger m_objectCount;
+
+	/**
+	 * The containers currently being written, used to detect cycles.
+	 */
+	NSHashTable *m_objectsInProgress;
+
+	/**
+	 * Maps every #MLCBinaryLayout written so far to its number plus one.
+	 */
+	NSMapTable *m_layoutNumbers;
+	NSUInteger m_layoutCount;
+
+	/**
+	 * The state that Lua values are encoded from, and a reference to a table
+	 * in its registry. The table holds a table mapping strings to their
+	 * numbers at index 1, and a table mapping tables to their numbers (or to
+	 * \c false while they are being written) at index 2.
+	 */
+	MLCState *m_state;
+	int m_luaReference;
+}
+
+/**
+ * Initializes the receiver to buffer up to \a capacity bytes at a time.
+ */
+- (id)initWithFileDescriptor:(int)fileDescriptor bufferCapacity:(size_t)capacity;
+
+/**
+ * Writes \a object, returning \c NO and setting #m_error if it cannot be
+ * encoded.
+ */
+- (BOOL)writeObject:(id)object;
+- (BOOL)writeNumber:(NSNumber *)number;
+- (void)writeString:(NSString *)string;
+- (BOOL)writeArray:(NSArray *)array;
+- (BOOL)writeDictionary:(NSDictionary *)dictionary;
+- (BOOL)writeModel:(MLCModel *)model;
+
+/**
+ * Sets #m_error to an error with the given code and description, unless an
+ * error has already occurred.
+ */
+- (void)failWithCode:(MLCBinaryError)code description:(NSString *)description;
+
+/**
+ * Returns whether the receiver has not failed, copying #m_error into \a error
+ * otherwise.
+ */
+- (BOOL)succeededWithError:(NSError **)error;
+@end
+
+@implementation MLCBinaryEncoder
+
+#pragma mark Writing
+
+static void flushBuffer (__unsafe_unretained MLCBinaryEncoder *encoder) {
+	size_t offset = 0;
+
+	while (offset < encoder->m_length && !encoder->m_error) {
+		ssize_t written = write(encoder->m_fileDescriptor, encoder->m_bytes + offset, encoder->m_length - offset);
+		if (written < 0) {
+			if (errno == EINTR)
+				continue;
+
+			NSError *underlyingError = [NSError errorWithDomain:NSPOSIXErrorDomain code:errno userInfo:nil];
+			NSDictionary *userInfo = [NSDictionary dictionaryWithObjectsAndKeys:
+				NSLocalizedString(@"Could not write encoded values to the file.", @""), NSLocalizedDescriptionKey,
+				underlyingError, NSUnderlyingErrorKey,
+				nil
+			];
+
+			encoder->m_error = [NSError errorWithDomain:MLCBinaryErrorDomain code:MLCBinaryErrorFile userInfo:userInfo];
+			break;
+		}
+
+		offset += (size_t)written;
+	}
+
+	encoder->m_length = 0;
+}
+
+static void writeBytes (__unsafe_unretained MLCBinaryEncoder *encoder, const void *bytes, size_t length) {
+	if (encoder->m_length + length > encoder->m_capacity) {
+		if (encoder->m_fileDescriptor >= 0)
+			flushBuffer(encoder);
+
+		if (encoder->m_length + length > encoder->m_capacity) {
+			size_t capacity = MAX(encoder->m_capacity * 2, encoder->m_length + length);
+			encoder->m_bytes = realloc(encoder->m_bytes, capacity);
+			encoder->m_capacity = capacity;
+		}
+	}
+
+	memcpy(encoder->m_bytes + encoder->m_length, bytes, length);
+	encoder->m_length += length;
+}
+
+static void writeByte (__unsafe_unretained MLCBinaryEncoder *encoder, unsigned char byte) {
+	writeBytes(encoder, &byte, 1);
+}
+
+static void writeVarint (__unsafe_unretained MLCBinaryEncoder *encoder, unsigned long long value) {
+	unsigned char bytes[10];
+	size_t length = 0;
+
+	while (value >= 0x80) {
+		bytes[length++] = (unsigned char)(value | 0x80);
+		value >>= 7;
+	}
+
+	bytes[length++] = (unsigned char)value;
+	writeBytes(encoder, bytes, length);
+}
+
+static void writeSignedVarint (__unsafe_unretained MLCBinaryEncoder *encoder, long long value) {
+	// zigzag encoding keeps small negative numbers short
+	writeVarint(encoder, ((unsigned long long)value << 1) ^ (unsigned long long)(value >> 63));
+}
+
+static void writeDouble (__unsafe_unretained MLCBinaryEncoder *encoder, double value) {
+	NSSwappedDouble swapped = NSSwapHostDoubleToLittle(value);
+	writeBytes(encoder, &swapped, sizeof(swapped));
+}
+
+static void writeStringDefinition (__unsafe_unretained MLCBinaryEncoder *encoder, const char *bytes, size_t length) {
+	writeByte(encoder, MLCBinaryTagString);
+	writeVarint(encoder, length);
+	writeBytes(encoder, bytes, length);
+
+	++encoder->m_stringCount;
+}
+
+#pragma mark Lifecycle
+
++ (NSData *)dataWithObject:(id)object error:(NSError **)error; {
+	MLCBinaryEncoder *encoder = [[self alloc] init];
+	if (![encoder encodeObject:object error:error])
+		return nil;
+
+	return encoder.encodedData;
+}
+
+- (id)init; {
+	return [self initWithFileDescriptor:-1 bufferCapacity:MLCBinaryEncoderMemoryBufferLength];
+}
+
+- (id)initWithFileDescriptor:(int)fileDescriptor; {
+	NSParameterAssert(fileDescriptor >= 0);
+	return [self initWithFileDescriptor:fileDescriptor bufferCapacity:MLCBinaryEncoderFileBufferLength];
+}
+
+- (id)initWithFileDescriptor:(int)fileDescriptor bufferCapacity:(size_t)capacity; {
+	self = [super init];
+	if (!self)
+		return nil;
+
+	m_fileDescriptor = fileDescriptor;
+	m_capacity = capacity;
+	m_bytes = malloc(capacity);
+	m_luaReference = LUA_NOREF;
+
+	m_stringNumbers = [[NSMutableDictionary alloc] init];
+	m_objectNumbers = NSCreateMapTable(NSNonOwnedPointerMapKeyCallBacks, NSIntegerMapValueCallBacks, 0);
+	m_objects = [[NSMutableArray alloc] init];
+	m_objectsInProgress = NSCreateHashTable(NSNonOwnedPointerHashCallBacks, 0);
+	m_layoutNumbers = NSCreateMapTable(NSNonOwnedPointerMapKeyCallBacks, NSIntegerMapValueCallBacks, 0);
+
+	writeBytes(self, MLCBinaryFormatMagic, sizeof(MLCBinaryFormatMagic));
+	writeByte(self, MLCBinaryFormatVersion);
+
+	return self;
+}
+
+- (void)dealloc {
+	free(m_bytes);
+	m_bytes = NULL;
+
+	// this may be deallocated on a different thread than the one using the
+	// state, so the reference must be released without waiting for it
+	if (m_state)
+		MLCStateReleaseReference(m_state, m_luaReference);
+}
+
+- (NSData *)encodedData {
+	if (m_fileDescriptor >= 0)
+		return nil;
+
+	return [NSData dataWithBytes:m_bytes length:m_length];
+}
+
+#pragma mark Errors
+
+- (void)failWithCode:(MLCBinaryError)code description:(NSString *)description; {
+	if (!m_error)
+		m_error = binaryError(code, description);
+}
+
+- (BOOL)succeededWithError:(NSError **)error; {
+	if (!m_error)
+		return YES;
+
+	if (error)
+		*error = m_error;
+
+	return NO;
+}
+
+#pragma mark Objective-C values
+
+- (BOOL)encodeObject:(id)object error:(NSError **)error; {
+	if (!m_error)
+		[self writeObject:object];
+
+	return [self succeededWithError:error];
+}
+
+- (BOOL)writeObject:(id)object; {
+	if (!object || object == [NSNull null]) {
+		writeByte(self, MLCBinaryTagNil);
+		return YES;
+	}
+
+	if ([object isKindOfClass:[NSString class]]) {
+		[self writeString:object];
+		return YES;
+	}
+
+	if ([object isKindOfClass:[NSNumber class]])
+		return [self writeNumber:object];
+
+	if ([object isKindOfClass:[NSData class]]) {
+		NSUInteger length = [object length];
+
+		writeByte(self, MLCBinaryTagData);
+		writeVarint(self, length);
+		writeBytes(self, [object bytes], length);
+		return YES;
+	}
+
+	// anything else is a container, which is only written once
+	uintptr_t existingNumber = (uintptr_t)NSMapGet(m_objectNumbers, (__bridge void *)object);
+	if (existingNumber) {
+		writeByte(self, MLCBinaryTagReference);
+		writeVarint(self, existingNumber - 1);
+		return YES;
+	}
+
+	if (NSHashGet(m_objectsInProgress, (__bridge void *)object)) {
+		[self failWithCode:MLCBinaryErrorUnsupportedValue description:[NSString stringWithFormat:NSLocalizedString(@"%@ cannot be encoded, because it contains itself.", @""), [object class]]];
+		return NO;
+	}
+
+	NSHashInsert(m_objectsInProgress, (__bridge void *)object);
+
+	BOOL success = NO;
+	if ([object isKindOfClass:[MLCModel class]]) {
+		success = [self writeModel:object];
+	} else if ([object isKindOfClass:[NSArray class]]) {
+		success = [self writeArray:object];
+	} else if ([object isKindOfClass:[NSDictionary class]]) {
+		success = [self writeDictionary:object];
+	} else {
+		[self failWithCode:MLCBinaryErrorUnsupportedValue description:[NSString stringWithFormat:NSLocalizedString(@"Objects of class %@ cannot be encoded.", @""), [object class]]];
+	}
+
+	NSHashRemove(m_objectsInProgress, (__bridge void *)object);
+
+	if (!success)
+		return NO;
+
+	[m_objects addObject:object];
+	NSMapInsert(m_objectNumbers, (__bridge void *)object, (void *)(uintptr_t)(++m_objectCount));
+	return YES;
+}
+
+- (BOOL)writeNumber:(NSNumber *)number; {
+	if ([number isKindOfClass:[NSDecimalNumber class]]) {
+		writeByte(self, MLCBinaryTagDecimalNumber);
+		[self writeString:[number stringValue]];
+		return YES;
+	}
+
+	if (MLCNumberIsBoolean(number)) {
+		writeByte(self, [number boolValue] ? MLCBinaryTagTrue : MLCBinaryTagFalse);
+		return YES;
+	}
+
+	switch (*[number objCType]) {
+	case 'c':
+	case 's':
+	case 'i':
+	case 'l':
+	case 'q':
+		writeByte(self, MLCBinaryTagInteger);
+		writeSignedVarint(self, [number longLongValue]);
+		break;
+
+	case 'C':
+	case 'S':
+	case 'I':
+	case 'L':
+	case 'Q':
+		{
+			unsigned long long value = [number unsignedLongLongValue];
+			if (value <= LLONG_MAX) {
+				writeByte(self, MLCBinaryTagInteger);
+				writeSignedVarint(self, (long long)value);
+			} else {
+				writeByte(self, MLCBinaryTagUnsignedInteger);
+				writeVarint(self, value);
+			}
+		}
+
+		break;
+
+	default:
+		writeByte(self, MLCBinaryTagDouble);
+		writeDouble(self, [number doubleValue]);
+	}
+
+	return YES;
+}
+
+- (void)writeString:(NSString *)string; {
+	NSNumber *existingNumber = [m_stringNumbers objectForKey:string];
+	if (existingNumber) {
+		writeByte(self, MLCBinaryTagStringReference);
+		writeVarint(self, [existingNumber unsignedIntegerValue]);
+		return;
+	}
+
+	[m_stringNumbers setObject:[NSNumber numberWithUnsignedInteger:m_stringCount] forKey:string];
+	writeStringDefinition(self, [string UTF8String], [string lengthOfBytesUsingEncoding:NSUTF8StringEncoding]);
+}
+
+- (BOOL)writeArray:(NSArray *)array; {
+	writeByte(self, MLCBinaryTagArray);
+	writeVarint(self, [array count]);
+
+	for (id value in array) {
+		if (![self writeObject:value])
+			return NO;
+	}
+
+	return YES;
+}
+
+- (BOOL)writeDictionary:(NSDictionary *)dictionary; {
+	writeByte(self, MLCBinaryTagDictionary);
+	writeVarint(self, [dictionary count]);
+
+	for (id key in dictionary) {
+		if (![self writeObject:key])
+			return NO;
+
+		if (![self writeObject:[dictionary objectForKey:key]])
+			return NO;
+	}
+
+	return YES;
+}
+
+- (BOOL)writeModel:(MLCModel *)model; {
+	MLCBinaryLayout *layout = [MLCBinaryLayout layoutForModelClass:[model class]];
+	NSArray *properties = layout.properties;
+
+	uintptr_t existingNumber = (uintptr_t)NSMapGet(m_layoutNumbers, (__bridge void *)layout);
+	if (existingNumber) {
+		writeByte(self, MLCBinaryTagModel);
+		writeVarint(self, existingNumber - 1);
+	} else {
+		// layouts are retained by their class, so they don't need to be
+		// retained here
+		NSMapInsert(m_layoutNumbers, (__bridge void *)layout, (void *)(uintptr_t)(++m_layoutCount));
+
+		writeByte(self, MLCBinaryTagLayout);
+		[self writeString:layout.className];
+		writeVarint(self, [properties count]);
+
+		for (MLCModelProperty *property in properties) {
+			[self writeString:property.name];
+			writeByte(self, (unsigned char)property.type);
+		}
+	}
+
+	for (MLCModelProperty *property in properties) {
+		IMP getterImplementation = property.getterImplementation;
+		SEL getter = property.getter;
+
+		#define readProperty(TYPE) \
+			((TYPE (*)(id, SEL))getterImplementation)(model, getter)
+
+		switch (property.type) {
+		case '@':
+			if (![self writeObject:readProperty(id)])
+				return NO;
+
+			break;
+
+		case 'c': writeSignedVarint(self, readProperty(signed char)); break;
+		case 's': writeSignedVarint(self, readProperty(short)); break;
+		case 'i': writeSignedVarint(self, readProperty(int)); break;
+		case 'l': writeSignedVarint(self, readProperty(long)); break;
+		case 'q': writeSignedVarint(self, readProperty(long long)); break;
+		case 'C': writeVarint(self, readProperty(unsigned char)); break;
+		case 'S': writeVarint(self, readProperty(unsigned short)); break;
+		case 'I': writeVarint(self, readProperty(unsigned int)); break;
+		case 'L': writeVarint(self, readProperty(unsigned long)); break;
+		case 'Q': writeVarint(self, readProperty(unsigned long long)); break;
+		case 'B': writeByte(self, readProperty(_Bool) ? 1 : 0); break;
+		case 'f': writeDouble(self, readProperty(float)); break;
+		case 'd': writeDouble(self, readProperty(double)); break;
+		}
+
+		#undef readProperty
+	}
+
+	return YES;
+}
+
+#pragma mark Lua values
+
+static BOOL writeLuaValue (__unsafe_unretained MLCBinaryEncoder *encoder, MLCState *state, int index, int strings, int tables);
+
+static BOOL writeLuaTable (__unsafe_unretained MLCBinaryEncoder *encoder, MLCState *state, int index, int strings, int tables) {
+	lua_State *L = state.state;
+
+	lua_pushvalue(L, index);
+	lua_rawget(L, tables);
+
+	if (lua_isnumber(L, -1)) {
+		writeByte(encoder, MLCBinaryTagReference);
+		writeVarint(encoder, (unsigned long long)lua_tonumber(L, -1));
+		lua_pop(L, 1);
+		return YES;
+	}
+
+	if (lua_isboolean(L, -1)) {
+		lua_pop(L, 1);
+		[encoder failWithCode:MLCBinaryErrorUnsupportedValue description:NSLocalizedString(@"A Lua table cannot be encoded, because it contains itself.", @"")];
+		return NO;
+	}
+
+	lua_pop(L, 1);
+
+	// mark the table as being written
+	lua_pushvalue(L, index);
+	lua_pushboolean(L, 0);
+	lua_rawset(L, tables);
+
+	// the table is a sequence if its only keys are 1 through its length
+	size_t length = lua_objlen(L, index);
+	size_t count = 0;
+	BOOL isSequence = YES;
+
+	lua_pushnil(L);
+	while (lua_next(L, index)) {
+		++count;
+
+		if (isSequence) {
+			if (lua_type(L, -2) != LUA_TNUMBER) {
+				isSequence = NO;
+			} else {
+				lua_Number key = lua_tonumber(L, -2);
+				if (key != floor(key) || key < 1 || key > length)
+					isSequence = NO;
+			}
+		}
+
+		lua_pop(L, 1);
+	}
+
+	BOOL success = YES;
+
+	if (isSequence && count == length) {
+		writeByte(encoder, MLCBinaryTagArray);
+		writeVarint(encoder, length);
+
+		for (size_t i = 1;i <= length && success;++i) {
+			lua_rawgeti(L, index, (int)i);
+			success = writeLuaValue(encoder, state, lua_gettop(L), strings, tables);
+			lua_pop(L, 1);
+		}
+	} else {
+		writeByte(encoder, MLCBinaryTagDictionary);
+		writeVarint(encoder, count);
+
+		lua_pushnil(L);
+		while (lua_next(L, index)) {
+			int top = lua_gettop(L);
+			success = writeLuaValue(encoder, state, top - 1, strings, tables) && writeLuaValue(encoder, state, top, strings, tables);
+
+			if (!success) {
+				lua_pop(L, 2);
+				break;
+			}
+
+			lua_pop(L, 1);
+		}
+	}
+
+	if (!success)
+		return NO;
+
+	lua_pushvalue(L, index);
+	lua_pushnumber(L, encoder->m_objectCount++);
+	lua_rawset(L, tables);
+	return YES;
+}
+
+static BOOL writeLuaValue (__unsafe_unretained MLCBinaryEncoder *encoder, MLCState *state, int index, int strings, int tables) {
+	lua_State *L = state.state;
+
+	// key + value + copy of the value
+	[state growStackBySize:3];
+
+	switch (lua_type(L, index)) {
+	case LUA_TNIL:
+		writeByte(encoder, MLCBinaryTagNil);
+		return YES;
+
+	case LUA_TBOOLEAN:
+		writeByte(encoder, lua_toboolean(L, index) ? MLCBinaryTagTrue : MLCBinaryTagFalse);
+		return YES;
+
+	case LUA_TNUMBER:
+		{
+			lua_Number number = lua_tonumber(L, index);
+
+			if (number == floor(number) && fabs(number) <= MLCBinaryEncoderMaximumExactInteger && !(number == 0 && signbit(number))) {
+				writeByte(encoder, MLCBinaryTagInteger);
+				writeSignedVarint(encoder, (long long)number);
+			} else {
+				writeByte(encoder, MLCBinaryTagDouble);
+				writeDouble(encoder, number);
+			}
+		}
+
+		return YES;
+
+	case LUA_TSTRING:
+		{
+			lua_pushvalue(L, index);
+			lua_rawget(L, strings);
+
+			if (lua_isnumber(L, -1)) {
+				writeByte(encoder, MLCBinaryTagStringReference);
+				writeVarint(encoder, (unsigned long long)lua_tonumber(L, -1));
+				lua_pop(L, 1);
+				return YES;
+			}
+
+			lua_pop(L, 1);
+
+			lua_pushvalue(L, index);
+			lua_pushnumber(L, encoder->m_stringCount);
+			lua_rawset(L, strings);
+
+			size_t length = 0;
+			const char *bytes = lua_tolstring(L, index, &length);
+			writeStringDefinition(encoder, bytes, length);
+		}
+
+		return YES;
+
+	case LUA_TTABLE:
+		return writeLuaTable(encoder, state, index, strings, tables);
+
+	case LUA_TUSERDATA:
+		lua_pushvalue(L, index);
+
+		if ([MLCBridgedObject isOnStack:state]) {
+			id object = [MLCBridgedObject popFromStack:state];
+			return [encoder writeObject:object];
+		}
+
+		lua_pop(L, 1);
+
+		// fall through
+
+	default:
+		[encoder failWithCode:MLCBinaryErrorUnsupportedValue description:[NSString stringWithFormat:NSLocalizedString(@"Lua values of type %s cannot be encoded.", @""), luaL_typename(L, index)]];
+		return NO;
+	}
+}
+
+- (BOOL)encodeValueAtStackIndex:(int)index ofState:(MLCState *)state error:(NSError **)error; {
+	NSParameterAssert(state != nil);
+	NSAssert(!m_state || m_state == state, @"%@ can only encode values from one state", self);
+
+	if (m_error)
+		return [self succeededWithError:error];
+
+	lua_State *L = state.state;
+	int top = lua_gettop(L);
+
+	if (index < 0)
+		index = top + index + 1;
+
+	// bookkeeping table + strings + tables
+	[state growStackBySize:3];
+
+	if (!m_state) {
+		m_state = state;
+
+		lua_createtable(L, 2, 0);
+		lua_newtable(L);
+		lua_rawseti(L, -2, 1);
+		lua_newtable(L);
+		lua_rawseti(L, -2, 2);
+
+		m_luaReference = luaL_ref(L, LUA_REGISTRYINDEX);
+	}
+
+	lua_rawgeti(L, LUA_REGISTRYINDEX, m_luaReference);
+	lua_rawgeti(L, -1, 1);
+	lua_rawgeti(L, -2, 2);
+
+	writeLuaValue(self, state, index, top + 2, top + 3);
+
+	lua_settop(L, top);
+	return [self succeededWithError:error];
+}
+
+#pragma mark Finishing
+
+- (BOOL)finishEncodingWithError:(NSError **)error; {
+	if (m_fileDescriptor >= 0)
+		flushBuffer(self);
+
+	return [self succeededWithError:error];
+}
+
+@end
@@ -0,0 +1,152 @@
+//
+//  MLCBinaryFormat.h
+//  MoonlitCocoa
+//
+//  Created by agent on 17.10.26.
+//  Released into the public domain.
+//
+
+#import <Foundation/Foundation.h>
+
+/**
+ * The error domain for errors returned by #MLCBinaryEncoder and
+ * #MLCBinaryDecoder.
+ */
+extern NSString * const MLCBinaryErrorDomain;
+
+/**
+ * Error codes in #MLCBinaryErrorDomain.
+ */
+typedef enum {
+	/**
+	 * A value could not be encoded, because it is not of a supported type, or
+	 * because it contains itself.
+	 */
+	MLCBinaryErrorUnsupportedValue = 1,
+
+	/**
+	 * The input ended in the middle of a value.
+	 */
+	MLCBinaryErrorTruncated,
+
+	/**
+	 * The input is not in the binary format, or is corrupt.
+	 */
+	MLCBinaryErrorMalformed,
+
+	/**
+	 * A model could not be decoded, because its class does not exist, or
+	 * because it rejected the decoded values.
+	 */
+	MLCBinaryErrorModelRejected,
+
+	/**
+	 * Reading from or writing to a file failed. The underlying \c
+	 * NSPOSIXErrorDomain error is available under \c NSUnderlyingErrorKey.
+	 */
+	MLCBinaryErrorFile
+} MLCBinaryError;
+
+/**
+ * The bytes that begin every stream in the binary format, followed by a
+ * single byte for #MLCBinaryFormatVersion.
+ */
+extern const char MLCBinaryFormatMagic[4];
+
+/**
+ * The version of the binary format written by #MLCBinaryEncoder.
+ */
+#define MLCBinaryFormatVersion 1
+
+/**
+ * Identifies the kind of each value in the binary format.
+ *
+ * A stream consists of #MLCBinaryFormatMagic, the version, and then any number
+ * of values. Integers are written as unsigned LEB128 varints, and signed
+ * integers are zigzag-encoded first. Doubles are written as eight
+ * little-endian bytes.
+ *
+ * Strings, model layouts, and objects are each numbered in the order that they
+ * are first written, so that they are only written out once per stream.
+ */
+typedef enum {
+	MLCBinaryTagNil = 0x00,
+	MLCBinaryTagFalse = 0x01,
+	MLCBinaryTagTrue = 0x02,
+
+	/**
+	 * Followed by a zigzag-encoded varint.
+	 */
+	MLCBinaryTagInteger = 0x03,
+
+	/**
+	 * Followed by a varint, for values which do not fit in a signed 64-bit
+	 * integer.
+	 */
+	MLCBinaryTagUnsignedInteger = 0x04,
+
+	/**
+	 * Followed by a double.
+	 */
+	MLCBinaryTagDouble = 0x05,
+
+	/**
+	 * Followed by a varint length, and that many bytes of UTF-8. The string is
+	 * given the next string number.
+	 */
+	MLCBinaryTagString = 0x06,
+
+	/**
+	 * Followed by the varint number of a string written earlier.
+	 */
+	MLCBinaryTagStringReference = 0x07,
+
+	/**
+	 * Followed by a varint length, and that many bytes.
+	 */
+	MLCBinaryTagData = 0x08,
+
+	/**
+	 * Followed by the string representation of an \c NSDecimalNumber, as a
+	 * string value.
+	 */
+	MLCBinaryTagDecimalNumber = 0x09,
+
+	/**
+	 * Followed by a varint count, and that many values. The array is given the
+	 * next object number once all of its values have been written.
+	 */
+	MLCBinaryTagArray = 0x0A,
+
+	/**
+	 * Followed by a varint count, and that many keys and values, alternating.
+	 * The dictionary is given the next object number once all of its values
+	 * have been written.
+	 */
+	MLCBinaryTagDictionary = 0x0B,
+
+	/**
+	 * Followed by the name of an #MLCModel subclass as a string value, a
+	 * varint count of properties, and the name (as a string value) and type
+	 * encoding character of each property. The layout is given the next layout
+	 * number, and a model using it follows, as if for #MLCBinaryTagModel
+	 * without the layout number.
+	 */
+	MLCBinaryTagLayout = 0x0C,
+
+	/**
+	 * Followed by the varint number of a layout written earlier, and the value
+	 * of each property in that layout. Object properties are written as
+	 * values. Scalar properties are written without a tag, as a varint, a
+	 * zigzag-encoded varint, a double, or (for \c _Bool) a single byte, as
+	 * determined by their type encoding. The model is given the next object
+	 * number once all of its properties have been written.
+	 */
+	MLCBinaryTagModel = 0x0D,
+
+	/**
+	 * Followed by the varint number of an array, dictionary, or model written
+	 * earlier.
+	 */
+	MLCBinaryTagReference = 0x0E
+} MLCBinaryTag;
@@ -0,0 +1,13 @@
+//
+//  MLCBinaryFormat.m
+//  MoonlitCocoa
+//
+//  Created by agent on 17.10.26.
+//  Released into the public domain.
+//
+
+#import "MLCBinaryFormat.h"
+
+NSString * const MLCBinaryErrorDomain = @"MLCBinaryErrorDomain";
+
+const char MLCBinaryFormatMagic[4] = { 'M', 'L', 'C', 'B' };
@@ -7,10 +7,39 @@
 //
 
 #import <Foundation/Foundation.h>
+#import <MoonlitCocoa/MLCTask.h>
 #import <MoonlitCocoa/MLCValue.h>
 #import <lua.h>
 
 @class MLCState;
+@class MLCStatePool;
+
+/**
+ * Describes the kind of value associated with a key in the Lua metatable of
+ * a bridged class.
+ */
+typedef enum {
+	/**
+	 * The key is not present (i.e., its value is \c nil).
+	 */
+	MLCLuaValueKindNil,
+
+	/**
+	 * The key is associated with a function.
+	 */
+	MLCLuaValueKindFunction,
+
+	/**
+	 * The key is associated with a table.
+	 */
+	MLCLuaValueKindTable,
+
+	/**
+	 * The key is associated with any other kind of value (such as a string or
+	 * number).
+	 */
+	MLCLuaValueKindScalar
+} MLCLuaValueKind;
 
 /**
  * Declares the interface for a class bridged into Lua, inheriting from the
@@ -27,15 +56,107 @@
  * full userdata into Lua. Any messages sent to an instance of this class that
  * it does not understand will be automatically forwarded to its Lua
  * implementation.
+ *
+ * The first time a function in the Lua implementation is used as a method, a
+ * real method calling it is added to the class (see #resolveInstanceMethod:),
+ * so that later messages skip forwarding entirely.
+ *
+ * Each instance is represented by at most one userdata in any given Lua state,
+ * no matter how many times it is pushed, so instances can be compared for
+ * identity in Lua using \c rawequal.
+ *
+ * Messages may be forwarded from any thread. Each Lua state is locked while
+ * a message is being run in it, so a class whose Lua methods must run
+ * concurrently should return \c YES from #usesStatePool.
  */
 @interface MLCBridgedObject : NSObject <MLCValue>
 /**
  * Returns the #MLCState object for this class. If no Lua state has yet been set
  * up, this will create one and attempt to load a Lua script with the name of
- * the current class and a .mlua or .lua extension.
+ * the current class and a .luac, .mlua, or .lua extension (in that order of
+ * preference).
+ *
+ * @note A .lua script is plain Lua, and no longer has \c metalua.runtime
+ * loaded for it. See MLCState#loadScriptAtURL:error:.
  */
 + (MLCState *)state;
 
+/**
+ * Returns whether the receiver should be set up in the #sharedState, instead of
+ * in a Lua state of its own.
+ *
+ * Classes in the shared state share one copy of the Lua standard libraries and
+ * the Metalua compiler, so each one only costs about as much memory as its
+ * metatable. Because a shared state is also shared by the Lua scripts of every
+ * such class, scripts should avoid defining globals.
+ *
+ * The default implementation returns \c NO. Subclasses may override this
+ * method to return \c YES.
+ */
++ (BOOL)usesSharedState;
+
+/**
+ * Returns the #MLCState shared by all classes which return \c YES from
+ * #usesSharedState.
+ */
++ (MLCState *)sharedState;
+
+/**
+ * Returns whether messages forwarded to Lua from instances of the receiver
+ * should be run in a state checked out of the #statePool, instead of in the
+ * primary #state. This allows Lua methods to run on many threads at once.
+ *
+ * Each pooled state loads its own copy of the receiver's script, so any
+ * module-level variables are not shared between them. Keys whose Lua
+ * implementation depends on such variables should be returned from
+ * #keysRequiringPrimaryState.
+ *
+ * The default implementation returns \c NO, in which case every message is
+ * serialized through the lock of the primary #state. Subclasses may override
+ * this method to return \c YES. This applies to MLCModel subclasses as well,
+ * even though models are immutable, since their scripts may still keep
+ * module-level state.
+ */
++ (BOOL)usesStatePool;
+
+/**
+ * Returns the pool of states used by the receiver when #usesStatePool returns
+ * \c YES. Classes which #usesSharedState all use the same pool.
+ */
++ (MLCStatePool *)statePool;
+
+/**
+ * Returns a set of keys (as strings) which must always be looked up and invoked
+ * in the primary #state, even if the receiver #usesStatePool. This should
+ * include any method which reads or modifies module-level variables in the
+ * receiver's script, so that there is only ever a single instance of them.
+ *
+ * The default implementation returns an empty set.
+ */
++ (NSSet *)keysRequiringPrimaryState;
+
+/**
+ * Returns the MLCState#memoryLimit applied to the primary #state and every
+ * state in the #statePool of the receiver, or zero for no limit. This is not
+ * applied to the #sharedState.
+ *
+ * The default implementation returns zero. Subclasses may override this method
+ * to keep a runaway script from exhausting the memory of the process.
+ */
++ (size_t)memoryLimit;
+
+/**
+ * Loads the receiver's Lua script into \a state, and sets up the metatable used
+ * for instances of the receiver. Returns \c NO if the script could not be
+ * loaded. If the receiver has no script, instances can still be passed into \a
+ * state, but they will have no Lua implementation.
+ *
+ * This is invoked automatically when an instance of the receiver is pushed
+ * onto a state which the receiver has not been set up in yet, so instances of
+ * any bridged class can be passed to the Lua implementation of any other.
+ */
++ (BOOL)registerWithState:(MLCState *)state;
+
 /**
  * The \c __gc metamethod for instances of the receiver.
  *
@@ -49,7 +170,12 @@
  * The \c __index metamethod for instances of the receiver.
  *
  * The default implementation of this function returns a trampoline to invoke
- * a method by the specified name on the specific instance of the receiver.
+ * a method by the specified name. The trampoline must be called with an
+ * instance of the receiver as its first argument, which is most easily done
+ * using Lua's method call syntax (e.g., \c obj:method()).
+ *
+ * Trampolines are cached per class and selector, so repeatedly looking up the
+ * same method does not allocate any memory.
  */
 + (lua_CFunction)indexMetamethod;
 
@@ -71,6 +197,18 @@
  */
 + (BOOL)instancesRespondToSelector:(SEL)aSelector;
 
+/**
+ * If \a aSelector names a function in the metatable of the receiver, and is
+ * declared in a protocol adopted by the receiver (such as the one declared by
+ * #lua_bridged), adds a method to the receiver which calls that function
+ * directly, and returns \c YES.
+ *
+ * Only methods with at most four object arguments, and which do not return an
+ * owning reference, are added. Messages with any other signature are handled
+ * by #forwardInvocation:.
+ */
++ (BOOL)resolveInstanceMethod:(SEL)aSelector;
+
 /**
  * Uses the selector of \a invocation as a key into the Lua table backing the
  * receiver, invoking the function associated with that key using the arguments
@@ -81,12 +219,88 @@
  */
 - (void)forwardInvocation:(NSInvocation *)invocation;
 
+/**
+ * Starts the function associated with \a key in the Lua table backing the
+ * receiver as an #MLCTask in the primary #state, passing \c self followed by
+ * \a arguments. Unlike a forwarded message, the function may suspend itself
+ * with \c await while it waits on asynchronous work, without blocking the
+ * calling thread.
+ *
+ * Returns the task, which has already run until it first suspended or
+ * finished, or \c nil if the receiver has no Lua implementation.
+ */
+- (MLCTask *)startTaskForKey:(NSString *)key withArguments:(NSArray *)arguments completionHandler:(MLCTaskCompletionHandler)handler;
+
+/**
+ * Calls the function associated with \a key in the metatable of the receiver
+ * once for each object in \a objects (which should be instances of the
+ * receiver), passing the object as its only argument, and returns the first
+ * result of each call, with \c nil represented by \c NSNull. This is
+ * equivalent to sending a message to each object, but crosses into Lua only
+ * once, and looks up the function only once.
+ *
+ * If \a options includes \c NSEnumerationConcurrent, the receiver
+ * #usesStatePool, and \a key is not in #keysRequiringPrimaryState, large
+ * arrays are split into batches which run concurrently in states checked out
+ * of the #statePool. Results are always returned in the order of \a objects.
+ * Any other options are ignored.
+ *
+ * Returns \c nil if the receiver has no Lua implementation, or if any call
+ * raises an error (which is logged).
+ *
+ * @warning Lua code running in the #statePool should not use \c
+ * NSEnumerationConcurrent, since it may then wait on a state that is already
+ * checked out by the thread waiting on it.
+ */
++ (NSArray *)mapObjects:(NSArray *)objects usingKey:(NSString *)key options:(NSEnumerationOptions)options;
+
+/**
+ * Calls the function associated with \a key once for each object in \a
+ * objects, as described in #mapObjects:usingKey:options:, and returns the
+ * objects for which the function returned a true value (in the Lua sense), in
+ * order.
+ */
++ (NSArray *)filterObjects:(NSArray *)objects usingKey:(NSString *)key options:(NSEnumerationOptions)options;
+
+/**
+ * Calls the function associated with \a key once for each object in \a
+ * objects, in one batch, passing the result of the previous call (or \a
+ * initialValue, for the first call) followed by the object. Returns the result
+ * of the last call, or \c nil if the receiver has no Lua implementation or any
+ * call raises an error (which is logged).
+ *
+ * The intermediate results are never converted into Objective-C objects.
+ */
++ (id)reduceObjects:(NSArray *)objects usingKey:(NSString *)key initialValue:(id)initialValue;
+
 /**
  * Returns \c YES if the metatable of the receiver has a value associated with
  * \a key.
+ *
+ * @note The result of every lookup into the metatable is cached by the
+ * receiver until its script is loaded again with #registerWithState:.
  */
 + (BOOL)metatableHasValueForKey:(NSString *)key;
 
+/**
+ * Returns the kind of value associated with \a key in the metatable of the
+ * receiver, without converting the value into an Objective-C object.
+ *
+ * @note The result of every lookup into the metatable is cached by the
+ * receiver until its script is loaded again with #registerWithState:.
+ */
++ (MLCLuaValueKind)metatableValueKindForKey:(NSString *)key;
+
+/**
+ * Discards any information cached about the contents of the receiver's
+ * metatable. This is invoked automatically by #registerWithState:, and
+ * whenever Lua code assigns to the metatable.
+ *
+ * Subclasses which cache information derived from the metatable may override
+ * this method to discard it, but must call the superclass implementation.
+ */
++ (void)invalidateMetatableCaches;
+
 /**
  * Uses \a key into the Lua table backing the receiver. If \a key is associated
  * with a non-nil value compatible with Objective-C, that value is returned. If
@@ -96,6 +310,20 @@
  */
 - (id)valueForUndefinedKey:(NSString *)key;
 
+/**
+ * Returns an estimate of the number of bytes that the receiver keeps alive
+ * while it is referenced from Lua. This is reported to the garbage collector
+ * of each state that the receiver is pushed onto, so that the collector runs
+ * often enough to release large objects promptly, instead of only counting
+ * the few bytes of their userdata.
+ *
+ * The default implementation returns zero, so that pushing an object costs
+ * nothing extra unless it asks to be accounted for. Subclasses which own large
+ * buffers or object graphs should override this method to report them. The
+ * value is only read when the receiver is first pushed onto a state.
+ */
+- (size_t)externalMemorySize;
+
 /**
  * Returns the instance of the receiver corresponding to \a userdata, or \c nil
  * if \a userdata is invalid or does not contain an instance of the receiver.
@@ -114,6 +342,12 @@
  * userdata.
  */
 + (void)pushUserdataMetatable;
+
+/**
+ * Pushes onto \a state the metatable object meant for the receiver's userdata,
+ * invoking #registerWithState: first if necessary.
+ */
++ (void)pushUserdataMetatableOntoState:(MLCState *)state;
 @end
 
 // pay no attention to the man behind the curtain
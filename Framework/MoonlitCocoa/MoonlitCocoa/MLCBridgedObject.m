@@ -7,11 +7,237 @@
 //
 
 #import "MLCBridgedObject.h"
+#import "MLCMarshaling.h"
+#import "MLCMarshalingPlan.h"
+#import "MLCProfiler.h"
 #import "MLCState.h"
+#import "MLCStatePool.h"
+#import <dispatch/dispatch.h>
 #import <lauxlib.h>
 #import <objc/runtime.h>
+#import <pthread.h>
 
 static char * const MLCBridgedClassAssociatedStateKey = "AssociatedMLCState";
+static char * const MLCBridgedClassAssociatedMetatableCacheKey = "AssociatedMetatableCache";
+static char * const MLCBridgedClassAssociatedStatePoolKey = "AssociatedMLCStatePool";
+
+/**
+ * The minimum number of objects in each batch when a batch operation is split
+ * across the state pool, so that small arrays aren't split at all.
+ */
+static const NSUInteger MLCBridgedObjectMinimumConcurrentBatchCount = 64;
+
+/**
+ * The maximum number of string keys remembered by each MLCMetatableCache.
+ */
+static const NSUInteger MLCMetatableCacheKeyLimit = 256;
+
+/**
+ * Remembers the kind of value associated with each key in the metatable of
+ * a bridged class, so that repeated queries (e.g., from \c -respondsToSelector:)
+ * do not need to look into Lua. Keys are mostly selectors, so that each can be
+ * compared by pointer, but keys which arrive as strings are kept separately,
+ * rather than being registered as selectors. This class is thread-safe.
+ */
+@interface MLCMetatableCache : NSObject
+/**
+ * If a kind of value has been cached for \a selector, sets \a kind to it and
+ * returns \c YES. Otherwise, returns \c NO.
+ */
+- (BOOL)getKind:(MLCLuaValueKind *)kind forSelector:(SEL)selector;
+
+/**
+ * Caches \a kind as the kind of value associated with \a selector.
+ */
+- (void)setKind:(MLCLuaValueKind)kind forSelector:(SEL)selector;
+
+/**
+ * Like #getKind:forSelector:, but for a key given as a string, which is not
+ * registered as a selector.
+ */
+- (BOOL)getKind:(MLCLuaValueKind *)kind forKey:(NSString *)key;
+
+/**
+ * Caches \a kind as the kind of value associated with \a key. Only a limited
+ * number of keys are cached, since they may come from arbitrary strings.
+ */
+- (void)setKind:(MLCLuaValueKind)kind forKey:(NSString *)key;
+
+/**
+ * Removes everything from the cache, and increments #generation.
+ */
+- (void)removeAllKinds;
+
+/**
+ * Incremented by every #removeAllKinds, so that other caches of values from
+ * the metatable can tell when they have gone stale.
+ */
+@property (readonly) int32_t generation;
+@end
+
+@implementation MLCMetatableCache {
+	pthread_mutex_t m_mutex;
+	NSMapTable *m_kinds;
+	NSMutableDictionary *m_kindsByKey;
+	volatile int32_t m_generation;
+}
+
+@synthesize generation = m_generation;
+
+- (id)init {
+	self = [super init];
+	if (!self)
+		return nil;
+
+	pthread_mutex_init(&m_mutex, NULL);
+
+	m_kinds = [[NSMapTable alloc]
+		initWithKeyOptions:NSPointerFunctionsOpaqueMemory | NSPointerFunctionsOpaquePersonality
+		valueOptions:NSPointerFunctionsOpaqueMemory | NSPointerFunctionsIntegerPersonality
+		capacity:0
+	];
+
+	m_kindsByKey = [[NSMutableDictionary alloc] init];
+
+	return self;
+}
+
+- (void)dealloc {
+	pthread_mutex_destroy(&m_mutex);
+}
+
+- (BOOL)getKind:(MLCLuaValueKind *)kind forSelector:(SEL)selector; {
+	pthread_mutex_lock(&m_mutex);
+
+	// kinds are stored offset by one, since zero indicates a missing entry
+	uintptr_t value = (uintptr_t)NSMapGet(m_kinds, selector);
+
+	pthread_mutex_unlock(&m_mutex);
+
+	if (!value)
+		return NO;
+
+	*kind = (MLCLuaValueKind)(value - 1);
+	return YES;
+}
+
+- (void)setKind:(MLCLuaValueKind)kind forSelector:(SEL)selector; {
+	pthread_mutex_lock(&m_mutex);
+	NSMapInsert(m_kinds, selector, (void *)(uintptr_t)(kind + 1));
+	pthread_mutex_unlock(&m_mutex);
+}
+
+- (BOOL)getKind:(MLCLuaValueKind *)kind forKey:(NSString *)key; {
+	pthread_mutex_lock(&m_mutex);
+	NSNumber *value = [m_kindsByKey objectForKey:key];
+	pthread_mutex_unlock(&m_mutex);
+
+	if (!value)
+		return NO;
+
+	*kind = (MLCLuaValueKind)[value intValue];
+	return YES;
+}
+
+- (void)setKind:(MLCLuaValueKind)kind forKey:(NSString *)key; {
+	pthread_mutex_lock(&m_mutex);
+
+	if ([m_kindsByKey count] < MLCMetatableCacheKeyLimit)
+		[m_kindsByKey setObject:[NSNumber numberWithInt:(int)kind] forKey:[key copy]];
+
+	pthread_mutex_unlock(&m_mutex);
+}
+
+- (void)removeAllKinds; {
+	pthread_mutex_lock(&m_mutex);
+	NSResetMapTable(m_kinds);
+	[m_kindsByKey removeAllObjects];
+	++m_generation;
+	pthread_mutex_unlock(&m_mutex);
+}
+
+@end
+
+/**
+ * The contents of a full userdata created for an #MLCBridgedObject.
+ */
+typedef struct {
+	/**
+	 * A retained pointer to the object. This must be the first member, so
+	 * that the userdata can also be treated as a pointer to the object.
+	 */
+	void *object;
+
+	/**
+	 * The MLCBridgedObject#externalMemorySize added to the state when the
+	 * userdata was created, which is removed again when it is collected.
+	 */
+	size_t externalMemorySize;
+} MLCBridgedUserdata;
+
+/**
+ * The address of this variable is used as the registry key for the table
+ * mapping each bridged object (as a light userdata) to its full userdata.
+ */
+static char MLCUserdataIdentityMapKey;
+
+/**
+ * The address of this variable is used as a key in each userdata metatable,
+ * for a light userdata identifying the bridged class that the metatable
+ * belongs to.
+ */
+static char MLCBridgedClassKey;
+
+/**
+ * If the value at \a index in the stack of \a state is a full userdata created
+ * for an #MLCBridgedObject, returns the class whose metatable it uses.
+ * Otherwise, returns \c Nil.
+ */
+static Class bridgedClassOfUserdata (lua_State *state, int index) {
+	if (lua_type(state, index) != LUA_TUSERDATA)
+		return Nil;
+
+	if (!lua_getmetatable(state, index))
+		return Nil;
+
+	lua_pushlightuserdata(state, &MLCBridgedClassKey);
+	lua_rawget(state, -2);
+
+	Class cls = (__bridge Class)lua_touserdata(state, -1);
+	lua_pop(state, 2);
+
+	return cls;
+}
+
+/**
+ * Pushes onto the stack of \a state the weak-valued table which maps object
+ * pointers to the userdata created for them, creating the table if necessary.
+ *
+ * Lua removes a userdata from the table before running its \c __gc
+ * metamethod, so an object pushed while its previous userdata is awaiting
+ * finalization simply gets a new userdata (and a new retain).
+ */
+static void pushUserdataIdentityMap (lua_State *state) {
+	lua_pushlightuserdata(state, &MLCUserdataIdentityMapKey);
+	lua_rawget(state, LUA_REGISTRYINDEX);
+
+	if (lua_istable(state, -1))
+		return;
+
+	lua_pop(state, 1);
+	lua_newtable(state);
+
+	// setmetatable(identityMap, { __mode = "v" })
+	lua_createtable(state, 0, 1);
+	lua_pushliteral(state, "v");
+	lua_setfield(state, -2, "__mode");
+	lua_setmetatable(state, -2);
+
+	// registry[MLCUserdataIdentityMapKey] = identityMap
+	lua_pushlightuserdata(state, &MLCUserdataIdentityMapKey);
+	lua_pushvalue(state, -2);
+	lua_rawset(state, LUA_REGISTRYINDEX);
+}
 
 /**
  * Invoked as the __gc metamethod on a userdata object. We take this opportunity
@@ -24,12 +250,16 @@ static int userdataGC (lua_State *state) {
 		lua_error(state);
 	}
 
-	void *userdata = lua_touserdata(state, 1);
+	MLCBridgedUserdata *userdata = lua_touserdata(state, 1);
 	if (!userdata) {
 		lua_pushliteral(state, "No userdata object for argument 1");
 		lua_error(state);
 	}
 
+	// the state is nil while it is being closed by -[MLCState dealloc], in
+	// which case there is nothing left to account for
+	[[MLCState stateForLuaState:state] removeExternalMemoryOfSize:userdata->externalMemorySize];
+
 	// transfer ownership to ARC and discard
 	[MLCBridgedObject objectFromUserdata:userdata transferringOwnership:YES];
 
@@ -40,139 +270,880 @@ static int userdataGC (lua_State *state) {
 }
 
 /**
- * A closure which takes two upvalues (\c self and \c _cmd), passing them and
- * all of its arguments to the MLCState#trampolineFunction. The #MLCState object
- * for the \c self upvalue is passed as the only upvalue to the trampoline
- * function.
+ * The address of this variable is used as the key, in each userdata metatable,
+ * for the table of cached method closures.
  */
-static int trampolineTrampoline (lua_State *state) {
+static char MLCMethodClosureCacheKey;
+
+/**
+ * Invoked as the __index metamethod on a userdata object. Returns a closure
+ * invoking a method by the name of the key, which must then be called with the
+ * bridged userdata object as its first argument.
+ *
+ * Closures are cached in the metatable of the userdata, so each one is only
+ * created once per class and selector.
+ */
+static int userdataIndex (lua_State *state) {
 	int args = lua_gettop(state);
+	if (args < 2) {
+		lua_pushliteral(state, "Not enough arguments to __index metamethod");
+		lua_error(state);
+	}
 
-	int selfIndex = lua_upvalueindex(1);
-	int cmdIndex = lua_upvalueindex(2);
+	// pop all arguments not 'self' or the key
+	lua_settop(state, 2);
 
-	void *userdata = lua_touserdata(state, selfIndex);
-	if (!userdata) {
-		lua_pushliteral(state, "No 'self' object captured in closure");
+	if (!lua_isstring(state, 2)) {
+		lua_pushnil(state);
+		return 1;
+	}
+
+	if (!lua_getmetatable(state, 1)) {
+		lua_pushliteral(state, "No metatable found for userdata in __index metamethod");
 		lua_error(state);
 	}
 
-	const char *selectorName = lua_tostring(state, cmdIndex);
-	if (!selectorName) {
-		lua_pushliteral(state, "No '_cmd' value captured in closure");
+	// metatable is now at index 3
+	lua_pushlightuserdata(state, &MLCMethodClosureCacheKey);
+	lua_rawget(state, 3);
+
+	if (!lua_istable(state, -1)) {
+		lua_pop(state, 1);
+		lua_newtable(state);
+
+		// metatable[MLCMethodClosureCacheKey] = {}
+		lua_pushlightuserdata(state, &MLCMethodClosureCacheKey);
+		lua_pushvalue(state, -2);
+		lua_rawset(state, 3);
+	}
+
+	// closure cache is now at index 4
+	lua_pushvalue(state, 2);
+	lua_rawget(state, 4);
+
+	if (!lua_isnil(state, -1))
+		return 1;
+
+	lua_pop(state, 1);
+
+	MLCState *stateObj = [MLCState stateForLuaState:state];
+	Class cls = bridgedClassOfUserdata(state, 1);
+	const char *selectorName = lua_tostring(state, 2);
+
+	MLCLuaExecutionContext context = MLCEnterObjectiveC(stateObj, state);
+
+	@try {
+		[stateObj pushMethodFunctionForClass:cls selectorName:selectorName];
+	} @finally {
+		MLCLeaveObjectiveC(stateObj, context);
+	}
+
+	// cache[key] = closure
+	lua_pushvalue(state, 2);
+	lua_pushvalue(state, -2);
+	lua_rawset(state, 4);
+
+	return 1;
+}
+
+/**
+ * Invoked as the __newindex metamethod on the userdata metatable of a bridged
+ * class, when Lua assigns to the class table (e.g., through \c
+ * getmetatable(obj).name = value). Metamethods are stored in the metatable
+ * itself, and anything else in the table of methods which is the first
+ * upvalue, so that every assignment of a method goes through this function.
+ *
+ * The caches of the class are invalidated after every assignment, since they
+ * may refer to a function that has just been replaced.
+ */
+static int classTableNewIndex (lua_State *state) {
+	if (lua_gettop(state) < 3) {
+		lua_pushliteral(state, "Not enough arguments to __newindex metamethod");
 		lua_error(state);
 	}
 
-	MLCBridgedObject *obj = [MLCBridgedObject objectFromUserdata:userdata transferringOwnership:NO];
+	lua_settop(state, 3);
+
+	BOOL isMetamethod = (lua_type(state, 2) == LUA_TSTRING && strncmp(lua_tostring(state, 2), "__", 2) == 0);
+	lua_rawset(state, (isMetamethod ? 1 : lua_upvalueindex(1)));
+
+	lua_pushlightuserdata(state, &MLCBridgedClassKey);
+	lua_rawget(state, 1);
+
+	Class cls = (__bridge Class)lua_touserdata(state, -1);
+	lua_pop(state, 2);
+
+	MLCState *stateObj = [MLCState stateForLuaState:state];
+	MLCLuaExecutionContext context = MLCEnterObjectiveC(stateObj, state);
+
+	@try {
+		[cls invalidateMetatableCaches];
+	} @finally {
+		MLCLeaveObjectiveC(stateObj, context);
+	}
+
+	return 0;
+}
+
+/**
+ * Used to compare two userdata objects. This implementation compares the
+ * objects for equality using -isEqual:.
+ */
+static int userdataEquals (lua_State *state) {
+	int args = lua_gettop(state);
+	if (args < 2) {
+		lua_pushliteral(state, "Not enough arguments to __eq metamethod");
+		lua_error(state);
+	}
+
+	void *userdataA = lua_touserdata(state, 1);
+	if (!userdataA) {
+		lua_pushliteral(state, "No userdata object for argument 1");
+		lua_error(state);
+	}
+
+	void *userdataB = lua_touserdata(state, 2);
+	if (!userdataB) {
+		lua_pushliteral(state, "No userdata object for argument 2");
+		lua_error(state);
+	}
+
+	// pop all arguments
+	lua_pop(state, args);
+
+	MLCState *stateObj = [MLCState stateForLuaState:state];
+	MLCLuaExecutionContext context = MLCEnterObjectiveC(stateObj, state);
+	BOOL equal = NO;
+
+	@try {
+		id objA = [MLCBridgedObject objectFromUserdata:userdataA transferringOwnership:NO];
+		id objB = [MLCBridgedObject objectFromUserdata:userdataB transferringOwnership:NO];
+
+		equal = [objA isEqual:objB];
+	} @finally {
+		MLCLeaveObjectiveC(stateObj, context);
+	}
+
+	lua_pushboolean(state, equal);
+	return 1;
+}
+
+@interface MLCBridgedObject ()
+/**
+ * Returns the URL of the Lua script implementing the receiver, or \c nil if no
+ * script could be found.
+ */
++ (NSURL *)scriptURL;
+
+/**
+ * Returns whether the receiver's metatable has been set up in \a state.
+ */
++ (BOOL)isRegisteredWithState:(MLCState *)state;
+
+/**
+ * Returns the cache of metatable lookups for the receiver, creating it if
+ * necessary.
+ */
++ (MLCMetatableCache *)metatableCache;
+
+/**
+ * Returns the kind of value associated with the name of \a selector in the
+ * receiver's metatable, using the #metatableCache whenever possible.
+ */
++ (MLCLuaValueKind)metatableValueKindForSelector:(SEL)selector;
+
+/**
+ * Looks up the kind of value associated with \a name in the receiver's
+ * metatable, without consulting the #metatableCache.
+ */
++ (MLCLuaValueKind)lookUpMetatableValueKindForName:(const char *)name;
+
+/**
+ * Invokes \a block with a locked Lua state in which the receiver has been
+ * registered. If the receiver #usesStatePool and \a key is not in
+ * #keysRequiringPrimaryState, the state is checked out of the #statePool.
+ * Otherwise, the primary #state is used.
+ *
+ * \a block is not invoked if the receiver has no Lua script.
+ */
++ (void)performWithStateForKey:(NSString *)key block:(void (^)(MLCState *state))block;
+
+/**
+ * Invokes \a block for one or more batches of \a objects, with a locked state
+ * and the function associated with \a key at the top of its stack. \a block
+ * should pop the function, and return the results for its batch, or \c nil if
+ * an error occurred.
+ *
+ * If \a options includes \c NSEnumerationConcurrent, and the receiver
+ * #usesStatePool for \a key, batches are run concurrently. Returns the results
+ * of every batch, concatenated in order, or \c nil if any batch failed.
+ */
++ (NSArray *)performBatchesOfObjects:(NSArray *)objects forKey:(NSString *)key options:(NSEnumerationOptions)options usingBlock:(NSArray *(^)(MLCState *state, NSArray *batch))block;
+@end
+
+/**
+ * The maximum number of arguments (excluding \c self and \c _cmd) that a
+ * method added by MLCBridgedObject#resolveInstanceMethod: may have.
+ */
+#define MLCLuaMethodMaximumArguments 4
+
+/**
+ * Returns the type encoding of the instance method \a selector in \a protocol
+ * or any protocol that it incorporates, or \c NULL if none declares it.
+ */
+static const char *typeEncodingInProtocol (Protocol *protocol, SEL selector) {
+	struct objc_method_description description = protocol_getMethodDescription(protocol, selector, NO, YES);
+	if (!description.types)
+		description = protocol_getMethodDescription(protocol, selector, YES, YES);
+
+	if (description.types)
+		return description.types;
+
+	unsigned count = 0;
+	Protocol * __unsafe_unretained *protocols = protocol_copyProtocolList(protocol, &count);
+
+	const char *types = NULL;
+	for (unsigned i = 0;i < count && !types;++i) {
+		types = typeEncodingInProtocol(protocols[i], selector);
+	}
+
+	free(protocols);
+	return types;
+}
+
+/**
+ * Returns the type encoding of the instance method \a selector, as declared
+ * in the protocols of \a cls or its superclasses (such as the protocol
+ * declared by #lua_bridged), or \c NULL if none declares it.
+ */
+static const char *typeEncodingOfBridgedMethod (Class cls, SEL selector) {
+	for (;cls;cls = class_getSuperclass(cls)) {
+		unsigned count = 0;
+		Protocol * __unsafe_unretained *protocols = class_copyProtocolList(cls, &count);
+
+		const char *types = NULL;
+		for (unsigned i = 0;i < count && !types;++i) {
+			types = typeEncodingInProtocol(protocols[i], selector);
+		}
+
+		free(protocols);
+
+		if (types)
+			return types;
+	}
+
+	return NULL;
+}
+
+/**
+ * A method added to a bridged class by MLCBridgedObject#resolveInstanceMethod:,
+ * which calls the Lua function of the same name with the receiver and its
+ * arguments.
+ *
+ * Unlike a forwarded message, calling one of these methods does not involve an
+ * \c NSInvocation, and the function in the primary state of the class is kept
+ * in the registry instead of being looked up by name each time.
+ */
+@interface MLCLuaMethod : NSObject
+/**
+ * Initializes a method calling the Lua implementation of \a selector for
+ * instances of \a cls, with the type encoding \a types. Returns \c nil if
+ * the method cannot be implemented this way, in which case it should be left
+ * to \c -forwardInvocation:.
+ *
+ * Only methods with up to #MLCLuaMethodMaximumArguments arguments that are
+ * passed like integers (objects, classes, selectors, pointers, \c BOOL, and
+ * integers no larger than a pointer), and a return type that can be returned
+ * directly (excluding owning references), are supported. Methods taking
+ * floating-point numbers or structures are always forwarded.
+ */
+- (id)initWithClass:(Class)cls selector:(SEL)selector typeEncoding:(const char *)types;
+
+/**
+ * The class for which the method was created.
+ */
+@property (nonatomic, unsafe_unretained, readonly) Class bridgedClass;
+
+/**
+ * The selector of the method.
+ */
+@property (nonatomic, readonly) SEL selector;
+
+/**
+ * The name of #selector, which is the key of the Lua function in the
+ * metatable.
+ */
+@property (nonatomic, copy, readonly) NSString *name;
+
+/**
+ * The signature of the method.
+ */
+@property (nonatomic, strong, readonly) NSMethodSignature *signature;
+
+/**
+ * Returns a new block, suitable for \c imp_implementationWithBlock(), which
+ * invokes the receiver.
+ */
+- (id)implementationBlock;
+
+/**
+ * Calls the Lua function with \a receiver followed by each argument in \a
+ * arguments, which holds the arguments as they were received by the
+ * #implementationBlock, and stores the return value into \a returnValue.
+ *
+ * If the function raises an error, \a returnValue is set to zero, and an
+ * #MLCLuaErrorException is thrown.
+ */
+- (void)invokeWithReceiver:(id)receiver arguments:(const intptr_t *)arguments returnValue:(void *)returnValue;
+@end
+
+@interface MLCLuaMethod () {
+	/**
+	 * A reference to the Lua function in the registry of #primaryState, or \c
+	 * LUA_NOREF if it has not been looked up yet. This must only be accessed
+	 * while #primaryState is locked.
+	 */
+	int m_functionReference;
+
+	/**
+	 * The metatable cache of #bridgedClass, which is invalidated whenever
+	 * the functions in its metatable may have been replaced.
+	 */
+	MLCMetatableCache *m_metatableCache;
+
+	/**
+	 * The MLCMetatableCache#generation of #m_metatableCache when
+	 * #m_functionReference was created.
+	 */
+	int32_t m_functionGeneration;
+
+	NSUInteger m_argumentCount;
+	const MLCTypeConverter *m_argumentConverters[MLCLuaMethodMaximumArguments];
+	const MLCTypeConverter *m_returnConverter;
+
+	/**
+	 * Whether the method is always called in the #primaryState, as opposed to
+	 * a state checked out of the pool of #bridgedClass.
+	 */
+	BOOL m_usesPrimaryState;
+}
+
+@property (nonatomic, unsafe_unretained, readwrite) Class bridgedClass;
+@property (nonatomic, readwrite) SEL selector;
+@property (nonatomic, copy, readwrite) NSString *name;
+@property (nonatomic, strong, readwrite) NSMethodSignature *signature;
+
+/**
+ * The primary state of #bridgedClass.
+ */
+@property (nonatomic, strong) MLCState *primaryState;
+
+/**
+ * Pushes the Lua function onto the #primaryState, which must be locked, using
+ * the reference in the registry if it is still valid.
+ */
+- (void)pushCachedFunction;
+
+/**
+ * Calls the Lua function in \a state, which must be locked, as described in
+ * #invokeWithReceiver:arguments:returnValue:. If \a useCache is \c NO, the
+ * function is looked up by name in the metatable of the class of \a receiver.
+ */
+- (void)callInState:(MLCState *)state withReceiver:(id)receiver arguments:(const intptr_t *)arguments returnValue:(void *)returnValue usingCachedFunction:(BOOL)useCache;
+@end
+
+/**
+ * Returns whether an argument of the type described by \a converter is passed
+ * in the same way as an \c intptr_t, so that a block declaring it as one
+ * receives its value.
+ */
+static BOOL isArgumentPassedAsWord (const MLCTypeConverter *converter) {
+	if (converter->size > sizeof(intptr_t))
+		return NO;
+
+	switch (*converter->type) {
+	case 'c': case 'C':
+	case 's': case 'S':
+	case 'i': case 'I':
+	case 'l': case 'L':
+	case 'q': case 'Q':
+	case 'B':
+	case '@': case '#':
+	case ':': case '*': case '^':
+		return YES;
+
+	default:
+		return NO;
+	}
+}
+
+/**
+ * Stores \a word, an argument received as an \c intptr_t by a block from
+ * #implementationBlockForLuaMethod, into \a buffer as the type described by
+ * \a converter. Bits beyond the size of the type are not guaranteed to be set
+ * by the caller, so they are discarded by converting to the type.
+ */
+static void storeArgumentWord (const MLCTypeConverter *converter, intptr_t word, void *buffer) {
+	switch (*converter->type) {
+	case 'c': *(signed char *)buffer = (signed char)word; break;
+	case 'C': *(unsigned char *)buffer = (unsigned char)word; break;
+	case 's': *(short *)buffer = (short)word; break;
+	case 'S': *(unsigned short *)buffer = (unsigned short)word; break;
+	case 'i': *(int *)buffer = (int)word; break;
+	case 'I': *(unsigned int *)buffer = (unsigned int)word; break;
+	case 'l': *(long *)buffer = (long)word; break;
+	case 'L': *(unsigned long *)buffer = (unsigned long)word; break;
+	case 'q': *(long long *)buffer = (long long)word; break;
+	case 'Q': *(unsigned long long *)buffer = (unsigned long long)(uintptr_t)word; break;
+	case 'B': *(_Bool *)buffer = (_Bool)(unsigned char)word; break;
+
+	default:
+		// objects, classes, selectors, and pointers
+		*(void **)buffer = (void *)word;
+	}
+}
+
+/**
+ * Returns a block for \a method which takes \a argumentCount arguments that
+ * are each passed like an \c intptr_t (see #isArgumentPassedAsWord), and
+ * returns a value of type \a returnType, or \c nil if that combination is not
+ * supported.
+ */
+static id implementationBlockForLuaMethod (MLCLuaMethod *method, NSUInteger argumentCount, char returnType) {
+	// UGH! one block for every number of arguments, for every return type
+	#define implementationBlocks(RTYPE, ...) \
+		do { \
+			switch (argumentCount) { \
+			case 0: \
+				return [^ RTYPE (id self){ \
+					const intptr_t *arguments = NULL; \
+					__VA_ARGS__ \
+				} copy]; \
+			\
+			case 1: \
+				return [^ RTYPE (id self, intptr_t arg1){ \
+					const intptr_t arguments[] = { arg1 }; \
+					__VA_ARGS__ \
+				} copy]; \
+			\
+			case 2: \
+				return [^ RTYPE (id self, intptr_t arg1, intptr_t arg2){ \
+					const intptr_t arguments[] = { arg1, arg2 }; \
+					__VA_ARGS__ \
+				} copy]; \
+			\
+			case 3: \
+				return [^ RTYPE (id self, intptr_t arg1, intptr_t arg2, intptr_t arg3){ \
+					const intptr_t arguments[] = { arg1, arg2, arg3 }; \
+					__VA_ARGS__ \
+				} copy]; \
+			\
+			case 4: \
+				return [^ RTYPE (id self, intptr_t arg1, intptr_t arg2, intptr_t arg3, intptr_t arg4){ \
+					const intptr_t arguments[] = { arg1, arg2, arg3, arg4 }; \
+					__VA_ARGS__ \
+				} copy]; \
+			\
+			default: \
+				return nil; \
+			} \
+		} while (0)
+
+	#define scalarImplementationBlocks(RTYPE) \
+		implementationBlocks(RTYPE, \
+			RTYPE result = 0; \
+			[method invokeWithReceiver:self arguments:arguments returnValue:&result]; \
+			return result; \
+		)
+
+	switch (returnType) {
+	case 'v':
+		implementationBlocks(void,
+			[method invokeWithReceiver:self arguments:arguments returnValue:NULL];
+		);
+
+	case '@':
+	case '#':
+		implementationBlocks(id,
+			__unsafe_unretained id result = nil;
+			[method invokeWithReceiver:self arguments:arguments returnValue:&result];
+			return result;
+		);
+
+	case 'c':
+		scalarImplementationBlocks(signed char);
+
+	case 'C':
+		scalarImplementationBlocks(unsigned char);
+
+	case 'i':
+		scalarImplementationBlocks(int);
+
+	case 'I':
+		scalarImplementationBlocks(unsigned int);
+
+	case 's':
+		scalarImplementationBlocks(short);
+
+	case 'S':
+		scalarImplementationBlocks(unsigned short);
+
+	case 'l':
+		scalarImplementationBlocks(long);
+
+	case 'L':
+		scalarImplementationBlocks(unsigned long);
+
+	case 'q':
+		scalarImplementationBlocks(long long);
+
+	case 'Q':
+		scalarImplementationBlocks(unsigned long long);
+
+	case 'f':
+		scalarImplementationBlocks(float);
+
+	case 'd':
+		scalarImplementationBlocks(double);
+
+	case 'B':
+		scalarImplementationBlocks(_Bool);
+
+	default:
+		return nil;
+	}
+
+	#undef scalarImplementationBlocks
+	#undef implementationBlocks
+}
+
+@implementation MLCLuaMethod
+@synthesize bridgedClass = m_bridgedClass;
+@synthesize selector = m_selector;
+@synthesize name = m_name;
+@synthesize signature = m_signature;
+@synthesize primaryState = m_primaryState;
+
+- (id)initWithClass:(Class)cls selector:(SEL)selector typeEncoding:(const char *)types; {
+	self = [super init];
+	if (!self)
+		return nil;
+
+	NSMethodSignature *signature = [NSMethodSignature signatureWithObjCTypes:types];
+	MLCMarshalingPlan *marshalingPlan = [MLCMarshalingPlan planForSignature:signature];
+
+	m_argumentCount = marshalingPlan.argumentCount;
+	if (m_argumentCount > MLCLuaMethodMaximumArguments)
+		return nil;
+
+	for (NSUInteger i = 0;i < m_argumentCount;++i) {
+		const MLCTypeConverter *converter = [marshalingPlan converterForArgumentAtIndex:i];
+		if (!isArgumentPassedAsWord(converter))
+			return nil;
+
+		m_argumentConverters[i] = converter;
+	}
+
+	m_returnConverter = marshalingPlan.returnConverter;
+
+	char returnType = *m_returnConverter->type;
+	if ((returnType == '@' || returnType == '#') && MLCSelectorReturnsRetainedObject(selector))
+		return nil;
+
+	self.primaryState = [cls state];
+	if (!self.primaryState)
+		return nil;
+
+	self.bridgedClass = cls;
+	self.selector = selector;
+	self.name = NSStringFromSelector(selector);
+	self.signature = signature;
+
+	m_functionReference = LUA_NOREF;
+	m_metatableCache = [cls metatableCache];
+	m_usesPrimaryState = ![cls usesStatePool] || [[cls keysRequiringPrimaryState] containsObject:self.name];
+
+	return self;
+}
+
+- (id)implementationBlock; {
+	return implementationBlockForLuaMethod(self, m_argumentCount, *m_returnConverter->type);
+}
+
+- (void)invokeWithReceiver:(id)receiver arguments:(const intptr_t *)arguments returnValue:(void *)returnValue; {
+	if (returnValue)
+		memset(returnValue, 0, m_returnConverter->size);
+
+	Class cls = [receiver class];
+
+	if (cls != self.bridgedClass || !m_usesPrimaryState) {
+		// a subclass may have a different function in its own metatable, and
+		// each pooled state has its own copy of the function, so look it up
+		// by name
+		[cls performWithStateForKey:self.name block:^(MLCState *state){
+			[self callInState:state withReceiver:receiver arguments:arguments returnValue:returnValue usingCachedFunction:NO];
+		}];
+
+		return;
+	}
+
+	MLCState *state = self.primaryState;
+	[state lock];
 
-	// push the MLCState for the bridged object
-	MLCState *stateObj = [[obj class] state];
-	lua_pushlightuserdata(state, (__bridge void *)stateObj);
+	@try {
+		[self callInState:state withReceiver:receiver arguments:arguments returnValue:returnValue usingCachedFunction:YES];
+	} @finally {
+		[state unlock];
+	}
+}
+
+- (void)pushCachedFunction; {
+	MLCState *state = self.primaryState;
+	lua_State *L = state.state;
+
+	int32_t generation = m_metatableCache.generation;
+	if (m_functionReference != LUA_NOREF && m_functionGeneration == generation) {
+		lua_rawgeti(L, LUA_REGISTRYINDEX, m_functionReference);
+		return;
+	}
+
+	luaL_unref(L, LUA_REGISTRYINDEX, m_functionReference);
+
+	[self.bridgedClass pushUserdataMetatableOntoState:state];
+	[state popTableAndPushField:self.name];
+
+	// keep a reference to the function, leaving it on the stack
+	lua_pushvalue(L, -1);
+	m_functionReference = luaL_ref(L, LUA_REGISTRYINDEX);
+	m_functionGeneration = generation;
+}
+
+- (void)callInState:(MLCState *)state withReceiver:(id)receiver arguments:(const intptr_t *)arguments returnValue:(void *)returnValue usingCachedFunction:(BOOL)useCache; {
+	MLCProfiler *profiler = state.profiler;
+	uint64_t startTime = (profiler ? MLCProfilerCurrentTime() : 0);
+
+	const MLCTypeConverter *returnConverter = m_returnConverter;
+	int argumentCount = (int)m_argumentCount;
+	int resultCount = (returnConverter->size ? 1 : 0);
+
+	// function + self + arguments
+	[state growStackBySize:argumentCount + 2];
+
+	__block NSError *error = nil;
+
+	[state enforceStackDelta:0 forBlock:^{
+		if (useCache) {
+			[self pushCachedFunction];
+		} else {
+			[[receiver class] pushUserdataMetatableOntoState:state];
+			[state popTableAndPushField:self.name];
+		}
+
+		// push self as first argument
+		[receiver pushOntoStack:state];
+
+		for (int i = 0;i < argumentCount;++i) {
+			const MLCTypeConverter *converter = m_argumentConverters[i];
+
+			// large enough for any type passed as a word
+			uint64_t buffer = 0;
+			storeArgumentWord(converter, arguments[i], &buffer);
+			converter->push(converter, state, &buffer);
+		}
 
-	// push MLCState's trampoline function, capturing the MLCState as an upvalue
-	lua_pushcclosure(state, [[stateObj class] trampolineFunction], 1);
+		NSError *callError = nil;
+		if (![state callFunctionWithArgumentCount:argumentCount + 1 resultCount:resultCount error:&callError]) {
+			error = callError;
+			return NO;
+		}
+
+		if (resultCount)
+			returnConverter->pop(returnConverter, state, returnValue);
+
+		return YES;
+	}];
+
+	[profiler recordCrossing:MLCProfilerCrossingLuaMethod selector:self.selector signature:self.signature startTime:startTime];
+
+	if (error)
+		MLCRaiseLuaError(self.name, error);
+}
+
+@end
+
+@implementation MLCBridgedObject
++ (BOOL)accessInstanceVariablesDirectly {
+	return NO;
+}
+
++ (BOOL)usesSharedState; {
+	return NO;
+}
+
++ (BOOL)usesStatePool; {
+	return NO;
+}
+
++ (NSSet *)keysRequiringPrimaryState; {
+	return [NSSet set];
+}
+
++ (size_t)memoryLimit; {
+	return 0;
+}
+
++ (MLCState *)sharedState; {
+	static MLCState *sharedState = nil;
+	static dispatch_once_t pred;
+
+	dispatch_once(&pred, ^{
+		sharedState = [[MLCState alloc] init];
+	});
+
+	return sharedState;
+}
+
++ (MLCStatePool *)sharedStatePool; {
+	static MLCStatePool *sharedStatePool = nil;
+	static dispatch_once_t pred;
+
+	dispatch_once(&pred, ^{
+		// classes are registered into each state as their instances are
+		// pushed, just like in the shared state
+		sharedStatePool = [[MLCStatePool alloc] initWithSetupBlock:nil];
+	});
+
+	return sharedStatePool;
+}
+
++ (MLCState *)state; {
+	MLCState *state = objc_getAssociatedObject(self, MLCBridgedClassAssociatedStateKey);
+	if (state)
+		return state;
+
+	if (![self scriptURL]) {
+		// could not find a script for this class
+		return nil;
+	}
+
+	// Lua code running in the shared state may call this method while holding
+	// its lock, so the lock must always be acquired first to avoid deadlocking
+	MLCState *sharedState = nil;
+	if ([self usesSharedState])
+		sharedState = [MLCBridgedObject sharedState];
+
+	[sharedState lock];
+
+	@try {
+		@synchronized (self) {
+			state = objc_getAssociatedObject(self, MLCBridgedClassAssociatedStateKey);
+			if (state)
+				return state;
+
+			if (sharedState) {
+				state = sharedState;
+
+				// the class may already have been registered, if one of its
+				// instances was passed to another class in the shared state
+				if (![self isRegisteredWithState:state] && ![self registerWithState:state])
+					return nil;
+			} else {
+				state = [[MLCState alloc] init];
+				state.memoryLimit = [self memoryLimit];
+
+				if (![self registerWithState:state])
+					return nil;
+			}
 
-	// move the trampoline below all of the arguments to this function, per
-	// function calling conventions
-	lua_insert(state, 1);
+			objc_setAssociatedObject(self, MLCBridgedClassAssociatedStateKey, state, OBJC_ASSOCIATION_RETAIN);
+		}
+	} @finally {
+		[sharedState unlock];
+	}
 
-	// copy the userdata argument to the top of the stack, then move it down to
-	// the first argument position
-	lua_pushvalue(state, selfIndex);
-	lua_insert(state, 2);
+	return state;
+}
 
-	// same with _cmd, for the second argument
-	lua_pushvalue(state, cmdIndex);
-	lua_insert(state, 3);
++ (MLCStatePool *)statePool; {
+	if ([self usesSharedState])
+		return [MLCBridgedObject sharedStatePool];
 
-	lua_call(state, args + 2, LUA_MULTRET);
+	MLCStatePool *pool = objc_getAssociatedObject(self, MLCBridgedClassAssociatedStatePoolKey);
+	if (pool)
+		return pool;
 
-	// at this point, the stack should contain only return values (now that
-	// the function and all arguments have been popped), so the number of
-	// results is the size of the stack
-	return lua_gettop(state);
-}
+	@synchronized (self) {
+		pool = objc_getAssociatedObject(self, MLCBridgedClassAssociatedStatePoolKey);
+		if (!pool) {
+			pool = [[MLCStatePool alloc] initWithSetupBlock:^(MLCState *state){
+				state.memoryLimit = [self memoryLimit];
+				return [self registerWithState:state];
+			}];
 
-/**
- * Invoked as the __index metamethod on a userdata object. Returns a trampoline
- * invoking a method named after the key on the bridged userdata object.
- */
-static int userdataIndex (lua_State *state) {
-	int args = lua_gettop(state);
-	if (args < 2) {
-		lua_pushliteral(state, "Not enough arguments to __index metamethod");
-		lua_error(state);
+			objc_setAssociatedObject(self, MLCBridgedClassAssociatedStatePoolKey, pool, OBJC_ASSOCIATION_RETAIN);
+		}
 	}
 
-	// pop all arguments not 'self' or '_cmd'
-	lua_pop(state, args - 2);
+	return pool;
+}
 
-	// push the closure onto the stack, using the existing arguments as upvalues
-	lua_pushcclosure(state, &trampolineTrampoline, 2);
++ (void)performWithStateForKey:(NSString *)key block:(void (^)(MLCState *state))block; {
+	// make sure that the script can be loaded before creating any other states
+	MLCState *primaryState = [self state];
+	if (!primaryState)
+		return;
 
-	return 1;
-}
+	if ([self usesStatePool] && ![[self keysRequiringPrimaryState] containsObject:key]) {
+		if ([[self statePool] performWithState:block])
+			return;
 
-/**
- * Used to compare two userdata objects. This implementation compares the
- * objects for equality using -isEqual:.
- */
-static int userdataEquals (lua_State *state) {
-	int args = lua_gettop(state);
-	if (args < 2) {
-		lua_pushliteral(state, "Not enough arguments to __eq metamethod");
-		lua_error(state);
+		// fall back to the primary state if a pooled state could not be set up
 	}
 
-	void *userdataA = lua_touserdata(state, 1);
-	if (!userdataA) {
-		lua_pushliteral(state, "No userdata object for argument 1");
-		lua_error(state);
-	}
+	[primaryState lock];
 
-	void *userdataB = lua_touserdata(state, 2);
-	if (!userdataB) {
-		lua_pushliteral(state, "No userdata object for argument 2");
-		lua_error(state);
+	@try {
+		block(primaryState);
+	} @finally {
+		[primaryState unlock];
 	}
+}
 
-	id objA = [MLCBridgedObject objectFromUserdata:userdataA transferringOwnership:NO];
-	id objB = [MLCBridgedObject objectFromUserdata:userdataB transferringOwnership:NO];
++ (NSURL *)scriptURL; {
+	NSBundle *bundle = [NSBundle bundleForClass:self];
+	NSString *name = NSStringFromClass(self);
 
-	// pop all arguments
-	lua_pop(state, args);
+	// prefer a script precompiled at build time, if there is one
+	NSURL *scriptURL = [bundle URLForResource:name withExtension:@"luac"];
+	if (!scriptURL) {
+		scriptURL = [bundle URLForResource:name withExtension:@"mlua"];
 
-	lua_pushboolean(state, [objA isEqual:objB]);
-	return 1;
-}
+		if (!scriptURL) {
+			scriptURL = [bundle URLForResource:name withExtension:@"lua"];
+		}
+	}
 
-@implementation MLCBridgedObject
-+ (BOOL)accessInstanceVariablesDirectly {
-	return NO;
+	return scriptURL;
 }
 
-+ (MLCState *)state; {
-	MLCState *state = objc_getAssociatedObject(self, MLCBridgedClassAssociatedStateKey);
-	if (!state) {
-		NSBundle *bundle = [NSBundle bundleForClass:self];
-		NSString *name = NSStringFromClass([self class]);
++ (BOOL)isRegisteredWithState:(MLCState *)state; {
+	[state growStackBySize:1];
 
-		NSURL *scriptURL = [bundle URLForResource:name withExtension:@"mlua"];
-		if (!scriptURL) {
-			scriptURL = [bundle URLForResource:name withExtension:@"lua"];
+	luaL_getmetatable(state.state, class_getName(self));
+	BOOL registered = !lua_isnil(state.state, -1);
+	lua_pop(state.state, 1);
 
-			if (!scriptURL) {
-				// could not find a script for this class
-				return nil;
-			}
-		}
+	return registered;
+}
 
-		state = [[MLCState alloc] init];
-		const char *cName = [name UTF8String];
++ (BOOL)registerWithState:(MLCState *)state; {
+	NSURL *scriptURL = [self scriptURL];
+	const char *cName = class_getName(self);
 
-		BOOL success = [state enforceStackDelta:0 forBlock:^{
-			NSError *error = nil;
+	return [state enforceStackDelta:0 forBlock:^{
+		NSError *error = nil;
 
+		if (scriptURL) {
 			if (![state loadScriptAtURL:scriptURL error:&error]) {
 				NSLog(@"Could not initialize Lua state for %@: %@", self, error);
 				return NO;
@@ -183,91 +1154,144 @@ static int userdataEquals (lua_State *state) {
 				NSLog(@"Could not initialize Lua state for %@: %@", self, error);
 				return NO;
 			}
+		} else {
+			[state growStackBySize:1];
+			lua_pushnil(state.state);
+		}
 
-			[state growStackBySize:2];
+		if (!lua_istable(state.state, -1)) {
+			// the script didn't return anything we can use, so treat it as if
+			// it had returned an empty table
+			lua_pop(state.state, 1);
+			lua_newtable(state.state);
+		}
 
-			// stack[LUA_REGISTRYINDEX]["CLASSNAME"] = {}
-			if (luaL_newmetatable(state.state, cName)) {
-				// __gc
-				lua_pushcfunction(state.state, [self gcMetamethod]);
-				lua_setfield(state.state, -2, "__gc");
+		[state growStackBySize:2];
 
-				// __index
-				lua_pushcfunction(state.state, [self indexMetamethod]);
-				lua_setfield(state.state, -2, "__index");
+		// stack[LUA_REGISTRYINDEX]["CLASSNAME"] = {}
+		if (luaL_newmetatable(state.state, cName)) {
+			// __gc
+			lua_pushcfunction(state.state, [self gcMetamethod]);
+			lua_setfield(state.state, -2, "__gc");
 
-				// __eq
-				lua_pushcfunction(state.state, [self eqMetamethod]);
-				lua_setfield(state.state, -2, "__eq");
-			}
+			// __index
+			lua_pushcfunction(state.state, [self indexMetamethod]);
+			lua_setfield(state.state, -2, "__index");
 
-			// space for two key/value pairs
+			// __eq
+			lua_pushcfunction(state.state, [self eqMetamethod]);
+			lua_setfield(state.state, -2, "__eq");
+
+			// metatable[MLCBridgedClassKey] = self
+			lua_pushlightuserdata(state.state, &MLCBridgedClassKey);
+			lua_pushlightuserdata(state.state, (__bridge void *)self);
+			lua_rawset(state.state, -3);
+
+			// methods + its metatable + two copies of methods
 			[state growStackBySize:4];
 
-			// first key for next()
-			lua_pushnil(state.state);
+			// setmetatable(metatable, { __index = methods, __newindex = classTableNewIndex })
+			lua_newtable(state.state);
+			lua_createtable(state.state, 0, 2);
 
-			// script table is now at index -3
-			// empty metatable is now at index -2
-			// key is at index -1
+			lua_pushvalue(state.state, -2);
+			lua_setfield(state.state, -2, "__index");
 
-			// we want to copy all the keys and values from the table at -3 to -2
-			while (lua_next(state.state, -3) != 0) {
-				// script table is now at index -4
-				// empty metatable is now at index -3
-				// key is at index -2
-				// value is at index -1
+			lua_pushvalue(state.state, -2);
+			lua_pushcclosure(state.state, &classTableNewIndex, 1);
+			lua_setfield(state.state, -2, "__newindex");
 
-				[state enforceStackDelta:0 forBlock:^{
-					// duplicate key to the top of the stack (because we can't pop
-					// the one lua_next is using)
-					lua_pushvalue(state.state, -2);
+			lua_setmetatable(state.state, -3);
 
-					// duplicate value to the top of the stack (because it has to
-					// follow the key)
-					lua_pushvalue(state.state, -2);
+			// pop the methods table
+			lua_pop(state.state, 1);
+		}
 
-					// script table is now at index -6
-					// empty metatable is now at index -5
-					// key is at index -2
-					// value is at index -1
+		// space for two key/value pairs
+		[state growStackBySize:4];
 
-					// copy the key and value into our metatable
-					lua_settable(state.state, -5);
+		// first key for next()
+		lua_pushnil(state.state);
 
-					return YES;
-				}];
+		// script table is now at index -3
+		// empty metatable is now at index -2
+		// key is at index -1
 
-				// script table is now at index -4
-				// empty metatable is now at index -3
-				// original key is at index -2
-				// original value is at index -1
+		// we want to copy all the keys and values from the table at -3 to -2
+		while (lua_next(state.state, -3) != 0) {
+			// script table is now at index -4
+			// empty metatable is now at index -3
+			// key is at index -2
+			// value is at index -1
 
-				// pop original value in the stack
-				lua_pop(state.state, 1);
-			}
+			[state enforceStackDelta:0 forBlock:^{
+				// duplicate key to the top of the stack (because we can't pop
+				// the one lua_next is using)
+				lua_pushvalue(state.state, -2);
 
-			// pop the script table and the metatable
-			lua_pop(state.state, 2);
+				// duplicate value to the top of the stack (because it has to
+				// follow the key)
+				lua_pushvalue(state.state, -2);
 
-			return YES;
-		}];
+				// script table is now at index -6
+				// empty metatable is now at index -5
+				// key is at index -2
+				// value is at index -1
 
-		if (!success)
-			return nil;
+				// copy the key and value into our metatable (or, through
+				// __newindex, the methods table behind it)
+				lua_settable(state.state, -5);
 
-		objc_setAssociatedObject(self, MLCBridgedClassAssociatedStateKey, state, OBJC_ASSOCIATION_RETAIN_NONATOMIC);
-	}
+				return YES;
+			}];
 
-	return state;
+			// script table is now at index -4
+			// empty metatable is now at index -3
+			// original key is at index -2
+			// original value is at index -1
+
+			// pop original value in the stack
+			lua_pop(state.state, 1);
+		}
+
+		// pop the script table and the metatable
+		lua_pop(state.state, 2);
+
+		// anything we knew about the metatable (including the functions
+		// referenced by any MLCLuaMethod) may have changed
+		[self invalidateMetatableCaches];
+
+		// and classes loaded since the last registration may have changed how
+		// objects are pushed
+		MLCInvalidateObjectKindCache();
+
+		return YES;
+	}];
 }
 
 + (void)pushUserdataMetatable; {
-	MLCState *state = [self state];
+	[self pushUserdataMetatableOntoState:[self state]];
+}
 
-	NSString *name = NSStringFromClass(self);
-	const char *cName = [name UTF8String];
-	luaL_getmetatable(state.state, cName);
++ (void)pushUserdataMetatableOntoState:(MLCState *)state; {
+	[state growStackBySize:1];
+	luaL_getmetatable(state.state, class_getName(self));
+
+	if (!lua_isnil(state.state, -1))
+		return;
+
+	lua_pop(state.state, 1);
+
+	// this class hasn't been used with the given state yet, so set it up now
+	//
+	// the primary state is checked without creating it, since this may be
+	// invoked while another thread is creating it
+	MLCState *primaryState = objc_getAssociatedObject(self, MLCBridgedClassAssociatedStateKey);
+	if (state == primaryState || [self registerWithState:state]) {
+		luaL_getmetatable(state.state, class_getName(self));
+	} else {
+		lua_pushnil(state.state);
+	}
 }
 
 + (lua_CFunction)gcMetamethod; {
@@ -282,6 +1306,10 @@ static int userdataEquals (lua_State *state) {
 	return &userdataEquals;
 }
 
+- (size_t)externalMemorySize; {
+	return 0;
+}
+
 + (id)objectFromUserdata:(void *)userdata transferringOwnership:(BOOL)transfer; {
 	void **userdataContainingPtr = userdata;
 
@@ -301,27 +1329,135 @@ static int userdataEquals (lua_State *state) {
 
 #pragma mark Forwarding
 
-+ (BOOL)metatableHasValueForKey:(NSString *)key; {
++ (MLCMetatableCache *)metatableCache; {
+	MLCMetatableCache *cache = objc_getAssociatedObject(self, MLCBridgedClassAssociatedMetatableCacheKey);
+	if (cache)
+		return cache;
+
+	@synchronized (self) {
+		cache = objc_getAssociatedObject(self, MLCBridgedClassAssociatedMetatableCacheKey);
+		if (!cache) {
+			cache = [[MLCMetatableCache alloc] init];
+			objc_setAssociatedObject(self, MLCBridgedClassAssociatedMetatableCacheKey, cache, OBJC_ASSOCIATION_RETAIN);
+		}
+	}
+
+	return cache;
+}
+
++ (void)invalidateMetatableCaches; {
+	[[self metatableCache] removeAllKinds];
+}
+
++ (MLCLuaValueKind)metatableValueKindForSelector:(SEL)selector; {
+	MLCMetatableCache *cache = [self metatableCache];
+
+	MLCLuaValueKind kind;
+	if ([cache getKind:&kind forSelector:selector])
+		return kind;
+
+	kind = [self lookUpMetatableValueKindForName:sel_getName(selector)];
+
+	[cache setKind:kind forSelector:selector];
+	return kind;
+}
+
++ (MLCLuaValueKind)lookUpMetatableValueKindForName:(const char *)name; {
+	__block MLCLuaValueKind kind;
+
 	MLCState *state = [self state];
+	if (!state) {
+		// no script, so nothing could be in the metatable
+		return MLCLuaValueKindNil;
+	}
 
-	return [state enforceStackDelta:0 forBlock:^ BOOL {
-		[self pushUserdataMetatable];
-		[state popTableAndPushField:key];
+	[state lock];
 
-		id obj = [state popValueOnStack];
+	@try {
+		[state growStackBySize:2];
 
-		// if the value on the stack is 'nil' (and not anything else), we can
-		// assume that this key does not exist
-		return ![obj isEqual:[NSNull null]];
-	}];
+		[state enforceStackDelta:0 forBlock:^{
+			[self pushUserdataMetatable];
+			lua_getfield(state.state, -1, name);
+
+			switch (lua_type(state.state, -1)) {
+			case LUA_TNIL:
+				kind = MLCLuaValueKindNil;
+				break;
+
+			case LUA_TFUNCTION:
+				kind = MLCLuaValueKindFunction;
+				break;
+
+			case LUA_TTABLE:
+				kind = MLCLuaValueKindTable;
+				break;
+
+			default:
+				kind = MLCLuaValueKindScalar;
+			}
+
+			// pop the value and the metatable
+			lua_pop(state.state, 2);
+			return YES;
+		}];
+	} @finally {
+		[state unlock];
+	}
+
+	return kind;
+}
+
++ (MLCLuaValueKind)metatableValueKindForKey:(NSString *)key; {
+	// keys may be arbitrary strings (from key-value coding, for instance),
+	// and converting them into selectors would register each one with the
+	// runtime forever, so they are cached separately
+	MLCMetatableCache *cache = [self metatableCache];
+
+	MLCLuaValueKind kind;
+	if ([cache getKind:&kind forKey:key])
+		return kind;
+
+	kind = [self lookUpMetatableValueKindForName:[key UTF8String]];
+
+	[cache setKind:kind forKey:key];
+	return kind;
+}
+
++ (BOOL)metatableHasValueForKey:(NSString *)key; {
+	return [self metatableValueKindForKey:key] != MLCLuaValueKindNil;
 }
 
 + (BOOL)instancesRespondToSelector:(SEL)aSelector; {
 	if ([super instancesRespondToSelector:aSelector])
 		return YES;
 
-	NSString *selectorName = NSStringFromSelector(aSelector);
-	return [self metatableHasValueForKey:selectorName];
+	return [self metatableValueKindForSelector:aSelector] != MLCLuaValueKindNil;
+}
+
++ (BOOL)resolveInstanceMethod:(SEL)aSelector {
+	if ([self metatableValueKindForSelector:aSelector] != MLCLuaValueKindFunction)
+		return [super resolveInstanceMethod:aSelector];
+
+	const char *types = typeEncodingOfBridgedMethod(self, aSelector);
+	if (!types) {
+		// without a declaration, the method signature can't be known
+		return [super resolveInstanceMethod:aSelector];
+	}
+
+	MLCLuaMethod *method = [[MLCLuaMethod alloc] initWithClass:self selector:aSelector typeEncoding:types];
+	if (!method) {
+		// leave this method to -forwardInvocation:
+		return [super resolveInstanceMethod:aSelector];
+	}
+
+	IMP implementation = imp_implementationWithBlock((__bridge void *)[method implementationBlock]);
+	if (!class_addMethod(self, aSelector, implementation, types)) {
+		// another thread added the method first
+		imp_removeBlock(implementation);
+	}
+
+	return YES;
 }
 
 - (void)forwardInvocation:(NSInvocation *)invocation {
@@ -336,89 +1472,219 @@ static int userdataEquals (lua_State *state) {
 	else
 		resultCount = 0;
 
-	MLCState *state = [[self class] state];
+	[[self class] performWithStateForKey:selectorName block:^(MLCState *state){
+		MLCProfiler *profiler = state.profiler;
+		uint64_t startTime = (profiler ? MLCProfilerCurrentTime() : 0);
 
-	[state enforceStackDelta:0 forBlock:^{
-		[[self class] pushUserdataMetatable];
-		[state popTableAndPushField:selectorName];
+		[state enforceStackDelta:0 forBlock:^{
+			[[self class] pushUserdataMetatableOntoState:state];
+			[state popTableAndPushField:selectorName];
 
-		// push self as first argument
-		[self pushOntoStack:state];
-		[state pushArgumentsOfInvocation:invocation];
+			// push self as first argument
+			[self pushOntoStack:state];
+			[state pushArgumentsOfInvocation:invocation];
 
-		NSError *error = nil;
-		if (![state callFunctionWithArgumentCount:argumentCount - 1 resultCount:resultCount error:&error]) {
-			NSLog(@"Exception occurred when invoking %@ in Lua: %@", selectorName, error);
-			return NO;
-		}
+			NSError *error = nil;
+			if (![state callFunctionWithArgumentCount:argumentCount - 1 resultCount:resultCount error:&error]) {
+				NSLog(@"Exception occurred when invoking %@ in Lua: %@", selectorName, error);
+				return NO;
+			}
 
-		[state popReturnValueForInvocation:invocation];
-		return YES;
-	}];
-}
+			[state popReturnValueForInvocation:invocation];
+			return YES;
+		}];
 
-- (BOOL)respondsToSelector:(SEL)aSelector {
-	return [[self class] instancesRespondToSelector:aSelector];
+		[profiler recordCrossing:MLCProfilerCrossingForwardedInvocation selector:[invocation selector] signature:signature startTime:startTime];
+	}];
 }
 
-- (id)valueForUndefinedKey:(NSString *)key {
-	// try invoking Lua
+- (MLCTask *)startTaskForKey:(NSString *)key withArguments:(NSArray *)arguments completionHandler:(MLCTaskCompletionHandler)handler; {
 	MLCState *state = [[self class] state];
+	if (!state)
+		return nil;
 
-	__block id result = nil;
+	// self + arguments
+	int argumentCount = (int)[arguments count] + 1;
 
-	[state enforceStackDelta:0 forBlock:^{
-		[[self class] pushUserdataMetatable];
-		[state popTableAndPushField:key];
+	__block MLCTask *task = nil;
 
-		result = [state getValueAtStackIndex:-1];
-		if ([result isEqual:[NSNull null]]) {
-			[NSException raise:NSUndefinedKeyException format:@"Key \"%@\" not found on object %@ (in Objective-C or Lua)", key, self];
-		}
+	[state lock];
 
-		if (result) {
-			lua_pop(state.state, 1);
-		} else {
-			// push self as only argument
+	@try {
+		[state growStackBySize:argumentCount + 1];
+
+		[state enforceStackDelta:0 forBlock:^{
+			[[self class] pushUserdataMetatableOntoState:state];
+			[state popTableAndPushField:key];
+
+			// push self as first argument
 			[self pushOntoStack:state];
 
-			NSError *error = nil;
-			if (![state callFunctionWithArgumentCount:1 resultCount:1 error:&error]) {
-				NSLog(@"Exception occurred when getting key %@ from Lua: %@", key, error);
-				return NO;
+			for (id argument in arguments) {
+				[state pushObject:argument];
+			}
+
+			// the task takes the function and arguments off the stack
+			task = [[MLCTask alloc] initWithArgumentCount:argumentCount ofState:state completionHandler:handler];
+			return YES;
+		}];
+	} @finally {
+		[state unlock];
+	}
+
+	// the task locks the state itself, and invokes the completion handler
+	// after unlocking it
+	[task start];
+	return task;
+}
+
+- (BOOL)respondsToSelector:(SEL)aSelector {
+	return [[self class] instancesRespondToSelector:aSelector];
+}
+
+- (id)valueForUndefinedKey:(NSString *)key {
+	__block id result = nil;
+
+	// try invoking Lua
+	[[self class] performWithStateForKey:key block:^(MLCState *state){
+		MLCProfiler *profiler = state.profiler;
+		uint64_t startTime = (profiler ? MLCProfilerCurrentTime() : 0);
+
+		[state enforceStackDelta:0 forBlock:^{
+			[[self class] pushUserdataMetatableOntoState:state];
+			[state popTableAndPushField:key];
+
+			if (lua_isfunction(state.state, -1)) {
+				// push self as only argument
+				[self pushOntoStack:state];
+
+				NSError *error = nil;
+				if (![state callFunctionWithArgumentCount:1 resultCount:1 error:&error]) {
+					NSLog(@"Exception occurred when getting key %@ from Lua: %@", key, error);
+					return NO;
+				}
+
+				result = [state popValueOnStack];
+				return YES;
 			}
 
+			// popping first leaves the state usable if an exception is raised
 			result = [state popValueOnStack];
-		}
+			if (!result || [result isEqual:[NSNull null]]) {
+				[NSException raise:NSUndefinedKeyException format:@"Key \"%@\" not found on object %@ (in Objective-C or Lua)", key, self];
+			}
 
-		return YES;
+			return YES;
+		}];
+
+		if (profiler)
+			[profiler recordCrossing:MLCProfilerCrossingUndefinedKey selector:NSSelectorFromString(key) signature:nil startTime:startTime];
 	}];
 
 	return result;
 }
 
-#pragma mark MLCValue
-
-+ (BOOL)isOnStack:(MLCState *)state; {
-	if (!lua_isuserdata(state.state, -1))
-		return NO;
+#pragma mark Batches
 
-	// compare metatables only for specific subclasses
-	if (self != [MLCBridgedObject class]) {
-		NSAssert1(state == [self state], @"%@ does not support using an MLCState that is not its own", self);
++ (NSArray *)performBatchesOfObjects:(NSArray *)objects forKey:(NSString *)key options:(NSEnumerationOptions)options usingBlock:(NSArray *(^)(MLCState *state, NSArray *batch))block; {
+	NSUInteger count = [objects count];
+	NSUInteger batchCount = 1;
 
-		return [state enforceStackDelta:0 forBlock:^{
-			lua_getmetatable(state.state, -1);
-			[[self class] pushUserdataMetatable];
+	if ((options & NSEnumerationConcurrent) && [self usesStatePool] && ![[self keysRequiringPrimaryState] containsObject:key]) {
+		batchCount = MIN([self statePool].maximumCount, count / MLCBridgedObjectMinimumConcurrentBatchCount);
+		batchCount = MAX(batchCount, 1);
+	}
 
-			BOOL equal = (BOOL)lua_equal(state.state, -2, -1);
-			lua_pop(state.state, 2);
+	void (^runBatch)(NSArray *, __strong NSArray **) = ^(NSArray *batch, __strong NSArray **results){
+		[self performWithStateForKey:key block:^(MLCState *state){
+			[state enforceStackDelta:0 forBlock:^{
+				[self pushUserdataMetatableOntoState:state];
+				[state popTableAndPushField:key];
 
-			return equal;
+				*results = block(state, batch);
+				return YES;
+			}];
 		}];
-	} else {
-		return YES;
+	};
+
+	if (batchCount == 1) {
+		NSArray *results = nil;
+		runBatch(objects, &results);
+		return results;
 	}
+
+	__strong NSArray **batchResults = (__strong NSArray **)calloc(batchCount, sizeof(*batchResults));
+
+	dispatch_apply(batchCount, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^(size_t i){
+		// spread any remainder across the first batches
+		NSUInteger batchSize = count / batchCount;
+		NSUInteger remainder = count % batchCount;
+		NSUInteger location = i * batchSize + MIN(i, remainder);
+		NSUInteger length = batchSize + (i < remainder ? 1 : 0);
+
+		runBatch([objects subarrayWithRange:NSMakeRange(location, length)], batchResults + i);
+	});
+
+	NSMutableArray *results = [[NSMutableArray alloc] initWithCapacity:count];
+
+	for (NSUInteger i = 0;i < batchCount;++i) {
+		if (results && batchResults[i])
+			[results addObjectsFromArray:batchResults[i]];
+		else
+			results = nil;
+
+		batchResults[i] = nil;
+	}
+
+	free(batchResults);
+	return results;
+}
+
++ (NSArray *)mapObjects:(NSArray *)objects usingKey:(NSString *)key options:(NSEnumerationOptions)options; {
+	return [self performBatchesOfObjects:objects forKey:key options:options usingBlock:^(MLCState *state, NSArray *batch){
+		NSError *error = nil;
+		NSArray *results = [state popFunctionAndMapObjects:batch error:&error];
+		if (!results)
+			NSLog(@"Exception occurred when mapping objects with %@ in Lua: %@", key, error);
+
+		return results;
+	}];
+}
+
++ (NSArray *)filterObjects:(NSArray *)objects usingKey:(NSString *)key options:(NSEnumerationOptions)options; {
+	return [self performBatchesOfObjects:objects forKey:key options:options usingBlock:^(MLCState *state, NSArray *batch){
+		NSError *error = nil;
+		NSArray *results = [state popFunctionAndFilterObjects:batch error:&error];
+		if (!results)
+			NSLog(@"Exception occurred when filtering objects with %@ in Lua: %@", key, error);
+
+		return results;
+	}];
+}
+
++ (id)reduceObjects:(NSArray *)objects usingKey:(NSString *)key initialValue:(id)initialValue; {
+	__block id result = nil;
+
+	// every call depends on the one before it, so this can't be split up
+	[self performBatchesOfObjects:objects forKey:key options:0 usingBlock:^(MLCState *state, NSArray *batch){
+		NSError *error = nil;
+		result = [state popFunctionAndReduceObjects:batch initialValue:initialValue error:&error];
+		if (!result && error)
+			NSLog(@"Exception occurred when reducing objects with %@ in Lua: %@", key, error);
+
+		return batch;
+	}];
+
+	return result;
+}
+
+#pragma mark MLCValue
+
++ (BOOL)isOnStack:(MLCState *)state; {
+	[state growStackBySize:2];
+
+	Class cls = bridgedClassOfUserdata(state.state, -1);
+	return [cls isSubclassOfClass:self];
 }
 
 + (id)popFromStack:(MLCState *)state; {
@@ -434,28 +1700,61 @@ static int userdataEquals (lua_State *state) {
 	// to pop until we've created the Cocoa object
 	lua_pop(state.state, 1);
 
-	NSAssert1(state == [[obj class] state], @"%@ does not support using an MLCState that is not its own", obj);
 	return obj;
 }
 
 - (void)pushOntoStack:(MLCState *)state; {
-	NSAssert1(state == [[self class] state], @"%@ does not support using an MLCState that is not its own", self);
+	lua_State *L = MLCStateGetLuaState(state);
 
-	// userdata + metatable
-	[state growStackBySize:2];
+	// identity map + object key + metatable + userdata + metatable copy
+	MLCGrowStack(L, 5);
+	MLCBeginStackCheck(L);
 
-	[state enforceStackDelta:1 forBlock:^{
-		// create a userdata object containing a pointer to 'self'
-		void *ptr = lua_newuserdata(state.state, sizeof(void *));
-		void *selfPtr = (__bridge_retained void *)self;
-		memcpy(ptr, &selfPtr, sizeof(void *));
+	pushUserdataIdentityMap(L);
 
-		// set up a standard metatable on the object
-		[[self class] pushUserdataMetatable];
-		lua_setmetatable(state.state, -2);
+	// reuse the existing userdata for this object, if there is one
+	lua_pushlightuserdata(L, (__bridge void *)self);
+	lua_rawget(L, -2);
 
-		return YES;
-	}];
+	if (lua_isuserdata(L, -1)) {
+		// remove the identity map, leaving the userdata
+		lua_remove(L, -2);
+
+		MLCEndStackCheck(L, 1);
+		return;
+	}
+
+	lua_pop(L, 1);
+
+	// get the metatable first, since this may involve loading our script
+	// into the state
+	[[self class] pushUserdataMetatableOntoState:state];
+
+	// create a userdata object containing a pointer to 'self'
+	MLCBridgedUserdata *userdata = lua_newuserdata(L, sizeof(MLCBridgedUserdata));
+	userdata->object = (__bridge_retained void *)self;
+	userdata->externalMemorySize = [self externalMemorySize];
+
+	// set up a standard metatable on the object
+	lua_pushvalue(L, -2);
+	lua_setmetatable(L, -2);
+
+	// remove the metatable, leaving the userdata
+	lua_remove(L, -2);
+
+	// identityMap[self] = userdata
+	lua_pushlightuserdata(L, (__bridge void *)self);
+	lua_pushvalue(L, -2);
+	lua_rawset(L, -4);
+
+	// remove the identity map, leaving the userdata
+	lua_remove(L, -2);
+
+	// let the garbage collector know how much memory the userdata keeps
+	// alive
+	[state addExternalMemoryOfSize:userdata->externalMemorySize];
+
+	MLCEndStackCheck(L, 1);
 }
 
 @end
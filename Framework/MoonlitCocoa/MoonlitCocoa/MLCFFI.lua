@@ -0,0 +1,111 @@
+-- MLCFFI.lua
+-- MoonlitCocoa
+--
+-- Created by agent on 17.10.26.
+-- Released into the public domain.
+--
+-- Only loaded when MoonlitCocoa is built with MLC_USE_LUAJIT. Generates Lua
+-- functions which send a message directly through objc_msgSend, using the FFI,
+-- so that calls from a hot loop can be compiled by the JIT instead of going
+-- through the C API trampoline.
+--
+-- Stubs are only generated for methods whose arguments and return value are
+-- all simple scalars (see -[MLCState pushMethodFunctionForClass:selectorName:]).
+-- Each stub raises an error unless its first argument is a userdata using the
+-- metatable of the class it was generated for, since anything else cannot be
+-- safely dereferenced as an object.
+
+local ffi = require 'ffi'
+
+ffi.cdef [[
+typedef struct objc_selector *SEL;
+
+SEL sel_registerName (const char *name);
+void objc_msgSend (void);
+void objc_msgSend_fpret (void);
+]]
+
+local C = ffi.C
+
+-- C types for each supported type encoding
+local ctypes = {
+	v = "void",
+	c = "signed char",
+	C = "unsigned char",
+	i = "int",
+	I = "unsigned int",
+	s = "short",
+	S = "unsigned short",
+	f = "float",
+	d = "double",
+	B = "bool"
+}
+
+local M = {}
+
+-- Returns a function which invokes 'selectorName' on its first argument.
+-- 'returnType' is a single type encoding character, and 'argumentTypes' is
+-- a string with one type encoding character per argument. 'metatable' is the
+-- userdata metatable of the class implementing the method.
+function M.stub (selectorName, returnType, argumentTypes, metatable)
+	local params = { "void *", "SEL" }
+	local args = {}
+	local conversions = {}
+
+	for i = 1, #argumentTypes do
+		local t = argumentTypes:sub(i, i)
+		local arg = "a" .. i
+
+		params[#params + 1] = assert(ctypes[t], "unsupported argument type " .. t)
+		args[#args + 1] = arg
+
+		-- match the conversions performed by -[MLCState popValue:objCType:], so
+		-- that missing arguments are zero and BOOL (a signed char) accepts
+		-- booleans
+		if t == "B" then
+			conversions[#conversions + 1] = ("%s = %s ~= nil and %s ~= false and %s ~= 0"):format(arg, arg, arg, arg)
+		elseif t == "c" or t == "C" then
+			conversions[#conversions + 1] = ("if %s == true then %s = 1 else %s = tonumber(%s) or 0 end"):format(arg, arg, arg, arg)
+		else
+			conversions[#conversions + 1] = ("%s = tonumber(%s) or 0"):format(arg, arg)
+		end
+	end
+
+	local ctype = assert(ctypes[returnType], "unsupported return type " .. returnType)
+	local prototype = ctype .. " (*)(" .. table.concat(params, ", ") .. ")"
+
+	-- floating-point values are returned on the x87 stack on i386
+	local msgSend = C.objc_msgSend
+	if ffi.arch == "x86" and (returnType == "f" or returnType == "d") then
+		msgSend = C.objc_msgSend_fpret
+	end
+
+	local fn = ffi.cast(prototype, msgSend)
+	local sel = C.sel_registerName(selectorName)
+
+	local argList = table.concat(args, ", ")
+	local callArgs = (#args > 0) and (", " .. argList) or ""
+	local selfParam = (#args > 0) and ("self, " .. argList) or "self"
+
+	local source = ([[
+		local ffi, fn, sel, metatable, selectorName = ...
+		local cast = ffi.cast
+		local idptr = ffi.typeof("void **")
+		local type, getmetatable, error, tostring = type, getmetatable, error, tostring
+
+		return function (%s)
+			-- matches the error raised by the trampoline for a receiver
+			-- which does not respond to the selector
+			if type(self) ~= "userdata" or getmetatable(self) ~= metatable then
+				error(tostring(self) .. " does not recognize selector " .. selectorName, 2)
+			end
+
+			%s
+			return fn(cast(idptr, self)[0], sel%s)
+		end
+	]]):format(selfParam, table.concat(conversions, "\n"), callArgs)
+
+	return assert(loadstring(source, "=" .. selectorName))(ffi, fn, sel, metatable, selectorName)
+end
+
+return M
@@ -0,0 +1,95 @@
+//
+//  MLCInvocationPlan.h
+//  MoonlitCocoa
+//
+//  Created by agent on 17.10.26.
+//  Released into the public domain.
+//
+
+#import <Foundation/Foundation.h>
+
+@class MLCMarshalingPlan;
+@class MLCState;
+
+/**
+ * The maximum number of arguments (excluding \c self and \c _cmd) that a method
+ * may accept in order to be invoked directly through its \c IMP.
+ */
+#define MLCInvocationPlanMaximumDirectArguments 4
+
+/**
+ * Describes how to invoke a specific method on instances of a specific class
+ * from Lua. Plans are created once per class and selector, and then reused for
+ * every call, so that the method signature, implementation, and the types of
+ * each argument do not need to be looked up again.
+ */
+@interface MLCInvocationPlan : NSObject
+/**
+ * Initializes the receiver with a plan for invoking \a selector on instances of
+ * \a cls. Returns \c nil if instances of \a cls do not provide a method
+ * signature for \a selector.
+ */
+- (id)initWithClass:(Class)cls selector:(SEL)selector;
+
+/**
+ * The class this plan was created for.
+ */
+@property (nonatomic, unsafe_unretained, readonly) Class targetClass;
+
+/**
+ * The selector this plan invokes.
+ */
+@property (nonatomic, readonly) SEL selector;
+
+/**
+ * The method signature of #selector on instances of #targetClass.
+ */
+@property (nonatomic, strong, readonly) NSMethodSignature *signature;
+
+/**
+ * The plan used to convert the arguments and return value of #signature.
+ */
+@property (nonatomic, strong, readonly) MLCMarshalingPlan *marshalingPlan;
+
+/**
+ * The implementation of #selector on #targetClass at the time the plan was
+ * created, or \c NULL if the method is only available through forwarding.
+ */
+@property (nonatomic, readonly) IMP implementation;
+
+/**
+ * The number of arguments accepted by the method, excluding \c self and \c
+ * _cmd.
+ */
+@property (nonatomic, readonly) NSUInteger argumentCount;
+
+/**
+ * The type encoding of the method's return value, with any qualifiers removed.
+ */
+@property (nonatomic, readonly) const char *returnType;
+
+/**
+ * Whether the method can be called through #implementation without
+ * constructing an \c NSInvocation. This is the case if every argument is an
+ * object, there are no more than #MLCInvocationPlanMaximumDirectArguments of
+ * them, and the return type is \c void, an object, or a scalar.
+ */
+@property (nonatomic, readonly, getter = isDirectlyInvokable) BOOL directlyInvokable;
+
+/**
+ * Returns the type encoding of the argument at \a index (where zero is the
+ * first argument after \c _cmd), with any qualifiers removed.
+ */
+- (const char *)typeOfArgumentAtIndex:(NSUInteger)index;
+
+/**
+ * Invokes the planned method on \a target, using the values starting at \a
+ * index in the stack of \a state as arguments. Arguments which were not passed
+ * from Lua are filled in with zero or \c nil, matching Lua semantics. Upon
+ * return, the method's return value (if any) is pushed onto the stack, and the
+ * number of values pushed is returned.
+ *
+ * @note The stack below the return value is not modified.
+ */
+- (int)invokeWithTarget:(id)target state:(MLCState *)state argumentIndex:(int)index;
+@end
@@ -0,0 +1,355 @@
+//
+//  MLCInvocationPlan.m
+//  MoonlitCocoa
+//
+//  Created by agent on 17.10.26.
+//  Released into the public domain.
+//
+
+#import "MLCInvocationPlan.h"
+#import "MLCMarshaling.h"
+#import "MLCMarshalingPlan.h"
+#import "MLCState.h"
+#import <lua.h>
+#import <objc/runtime.h>
+
+/**
+ * Returns \a type with any leading type qualifiers skipped.
+ */
+static const char *skipTypeQualifiers (const char *type) {
+	while (
+		*type == 'r' ||
+		*type == 'n' ||
+		*type == 'N' ||
+		*type == 'o' ||
+		*type == 'O' ||
+		*type == 'R' ||
+		*type == 'V'
+	) {
+		++type;
+	}
+
+	return type;
+}
+
+/**
+ * Returns whether \a type can be returned from a direct call to an \c IMP
+ * without any special handling.
+ */
+static BOOL isDirectReturnType (const char *type) {
+	switch (*type) {
+	case 'v':
+	case '@':
+	case '#':
+	case 'c':
+	case 'C':
+	case 'i':
+	case 'I':
+	case 's':
+	case 'S':
+	case 'l':
+	case 'L':
+	case 'q':
+	case 'Q':
+	case 'f':
+	case 'd':
+	case 'B':
+		return YES;
+
+	default:
+		return NO;
+	}
+}
+
+@interface MLCInvocationPlan () {
+	/**
+	 * The argument converters of #marshalingPlan, cached to avoid a message
+	 * send for each argument of each call.
+	 */
+	const MLCTypeConverter **m_argumentConverters;
+
+	/**
+	 * The return value converter of #marshalingPlan.
+	 */
+	const MLCTypeConverter *m_returnConverter;
+}
+
+@property (nonatomic, unsafe_unretained, readwrite) Class targetClass;
+@property (nonatomic, readwrite) SEL selector;
+@property (nonatomic, strong, readwrite) NSMethodSignature *signature;
+@property (nonatomic, strong, readwrite) MLCMarshalingPlan *marshalingPlan;
+@property (nonatomic, readwrite) IMP implementation;
+@property (nonatomic, readwrite) NSUInteger argumentCount;
+@property (nonatomic, readwrite) const char *returnType;
+@property (nonatomic, readwrite, getter = isDirectlyInvokable) BOOL directlyInvokable;
+
+/**
+ * Invokes the receiver's #implementation directly, without creating an \c
+ * NSInvocation.
+ */
+- (int)invokeDirectlyWithTarget:(id)target state:(MLCState *)state argumentIndex:(int)index;
+
+/**
+ * Invokes the receiver's method using an \c NSInvocation.
+ */
+- (int)invokeIndirectlyWithTarget:(id)target state:(MLCState *)state argumentIndex:(int)index;
+@end
+
+@implementation MLCInvocationPlan
+@synthesize targetClass = m_targetClass;
+@synthesize selector = m_selector;
+@synthesize signature = m_signature;
+@synthesize marshalingPlan = m_marshalingPlan;
+@synthesize implementation = m_implementation;
+@synthesize argumentCount = m_argumentCount;
+@synthesize returnType = m_returnType;
+@synthesize directlyInvokable = m_directlyInvokable;
+
+- (id)initWithClass:(Class)cls selector:(SEL)selector; {
+	self = [super init];
+	if (!self)
+		return nil;
+
+	NSMethodSignature *signature = nil;
+	if (class_isMetaClass(cls)) {
+		// the target is a class object, so look up the class method
+		Class instanceClass = objc_getClass(class_getName(cls));
+		signature = [instanceClass methodSignatureForSelector:selector];
+	} else {
+		signature = [cls instanceMethodSignatureForSelector:selector];
+	}
+
+	if (!signature)
+		return nil;
+
+	self.targetClass = cls;
+	self.selector = selector;
+	self.signature = signature;
+
+	Method method = class_getInstanceMethod(cls, selector);
+	if (method)
+		self.implementation = method_getImplementation(method);
+
+	MLCMarshalingPlan *marshalingPlan = [MLCMarshalingPlan planForSignature:signature];
+	self.marshalingPlan = marshalingPlan;
+
+	self.argumentCount = marshalingPlan.argumentCount;
+	self.returnType = skipTypeQualifiers([signature methodReturnType]);
+
+	m_returnConverter = marshalingPlan.returnConverter;
+
+	BOOL allObjects = YES;
+
+	if (self.argumentCount) {
+		m_argumentConverters = calloc(self.argumentCount, sizeof(*m_argumentConverters));
+
+		for (NSUInteger i = 0;i < self.argumentCount;++i) {
+			const MLCTypeConverter *converter = [marshalingPlan converterForArgumentAtIndex:i];
+			m_argumentConverters[i] = converter;
+
+			if (*converter->type != '@' && *converter->type != '#')
+				allObjects = NO;
+		}
+	}
+
+	// only methods which can be called through a plain C function pointer,
+	// with argument and return types that need no special treatment, can skip
+	// NSInvocation
+	self.directlyInvokable =
+		self.implementation != NULL &&
+		self.implementation != (IMP)_objc_msgForward &&
+		allObjects &&
+		self.argumentCount <= MLCInvocationPlanMaximumDirectArguments &&
+		isDirectReturnType(self.returnType) &&
+		!((*self.returnType == '@' || *self.returnType == '#') && MLCSelectorReturnsRetainedObject(selector));
+
+	return self;
+}
+
+- (void)dealloc {
+	free(m_argumentConverters);
+	m_argumentConverters = NULL;
+}
+
+- (const char *)typeOfArgumentAtIndex:(NSUInteger)index; {
+	NSParameterAssert(index < self.argumentCount);
+	return m_argumentConverters[index]->type;
+}
+
+- (int)invokeWithTarget:(id)target state:(MLCState *)state argumentIndex:(int)index; {
+	if (self.directlyInvokable)
+		return [self invokeDirectlyWithTarget:target state:state argumentIndex:index];
+	else
+		return [self invokeIndirectlyWithTarget:target state:state argumentIndex:index];
+}
+
+- (int)invokeDirectlyWithTarget:(id)target state:(MLCState *)state argumentIndex:(int)index; {
+	int top = lua_gettop(state.state);
+
+	__strong id args[MLCInvocationPlanMaximumDirectArguments] = { nil };
+	for (NSUInteger i = 0;i < self.argumentCount;++i) {
+		// any arguments required by the method but not passed from the Lua
+		// script get filled with nil, matching Lua semantics
+		int argIndex = index + (int)i;
+		if (argIndex <= top)
+			args[i] = MLCGetValue(state, argIndex);
+	}
+
+	IMP imp = self.implementation;
+	SEL sel = self.selector;
+
+	#define callIMP(RTYPE, ...) \
+		do { \
+			switch (self.argumentCount) { \
+			case 0: \
+				__VA_ARGS__ ((RTYPE (*)(id, SEL))imp)(target, sel); \
+				break; \
+			\
+			case 1: \
+				__VA_ARGS__ ((RTYPE (*)(id, SEL, id))imp)(target, sel, args[0]); \
+				break; \
+			\
+			case 2: \
+				__VA_ARGS__ ((RTYPE (*)(id, SEL, id, id))imp)(target, sel, args[0], args[1]); \
+				break; \
+			\
+			case 3: \
+				__VA_ARGS__ ((RTYPE (*)(id, SEL, id, id, id))imp)(target, sel, args[0], args[1], args[2]); \
+				break; \
+			\
+			case 4: \
+				__VA_ARGS__ ((RTYPE (*)(id, SEL, id, id, id, id))imp)(target, sel, args[0], args[1], args[2], args[3]); \
+				break; \
+			} \
+		} while (0)
+
+	#define callAndPushScalar(RTYPE) \
+		do { \
+			RTYPE result = 0; \
+			callIMP(RTYPE, result =); \
+			m_returnConverter->push(m_returnConverter, state, &result); \
+		} while (0)
+
+	switch (*self.returnType) {
+	case 'v':
+		callIMP(void);
+		return 0;
+
+	case '@':
+	case '#':
+		{
+			id result = nil;
+			callIMP(id, result =);
+			MLCPushObject(state, result);
+		}
+
+		return 1;
+
+	case 'c':
+		callAndPushScalar(signed char);
+		break;
+
+	case 'C':
+		callAndPushScalar(unsigned char);
+		break;
+
+	case 'i':
+		callAndPushScalar(int);
+		break;
+
+	case 'I':
+		callAndPushScalar(unsigned int);
+		break;
+
+	case 's':
+		callAndPushScalar(short);
+		break;
+
+	case 'S':
+		callAndPushScalar(unsigned short);
+		break;
+
+	case 'l':
+		callAndPushScalar(long);
+		break;
+
+	case 'L':
+		callAndPushScalar(unsigned long);
+		break;
+
+	case 'q':
+		callAndPushScalar(long long);
+		break;
+
+	case 'Q':
+		callAndPushScalar(unsigned long long);
+		break;
+
+	case 'f':
+		callAndPushScalar(float);
+		break;
+
+	case 'd':
+		callAndPushScalar(double);
+		break;
+
+	case 'B':
+		callAndPushScalar(_Bool);
+		break;
+
+	default:
+		NSAssert1(NO, @"Unexpected return type \"%s\" for a direct invocation", self.returnType);
+		return 0;
+	}
+
+	#undef callAndPushScalar
+	#undef callIMP
+
+	return 1;
+}
+
+- (int)invokeIndirectlyWithTarget:(id)target state:(MLCState *)state argumentIndex:(int)index; {
+	int top = lua_gettop(state.state);
+
+	NSInvocation *invocation = [NSInvocation invocationWithMethodSignature:self.signature];
+	[invocation setTarget:target];
+	[invocation setSelector:self.selector];
+
+	MLCMarshalingPlan *marshalingPlan = self.marshalingPlan;
+	NSUInteger frameLength = marshalingPlan.argumentFrameLength;
+
+	// every argument has its own place in the frame, as laid out by the
+	// marshaling plan
+	unsigned char frame[frameLength ? frameLength : 1];
+
+	for (NSUInteger i = 0;i < self.argumentCount;++i) {
+		const MLCTypeConverter *converter = m_argumentConverters[i];
+		unsigned char *buffer = frame + [marshalingPlan offsetOfArgumentAtIndex:i];
+		int argIndex = index + (int)i;
+
+		if (argIndex <= top) {
+			lua_pushvalue(state.state, argIndex);
+			converter->pop(converter, state, buffer);
+		} else {
+			// any arguments required by the method but not passed from the Lua
+			// script get filled with zero, matching Lua semantics
+			memset(buffer, 0, converter->size);
+		}
+
+		[invocation setArgument:buffer atIndex:(NSInteger)i + 2];
+	}
+
+	[invocation invoke];
+
+	NSUInteger returnLength = [self.signature methodReturnLength];
+	if (!returnLength)
+		return 0;
+
+	unsigned char returnBuffer[MAX(returnLength, m_returnConverter->size)];
+
+	[invocation getReturnValue:returnBuffer];
+	m_returnConverter->push(m_returnConverter, state, returnBuffer);
+	return 1;
+}
+
+@end
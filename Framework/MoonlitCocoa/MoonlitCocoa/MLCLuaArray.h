@@ -0,0 +1,55 @@
+//
+//  MLCLuaArray.h
+//  MoonlitCocoa
+//
+//  Created by agent on 17.10.26.
+//  Released into the public domain.
+//
+
+#import <Foundation/Foundation.h>
+
+@class MLCState;
+
+/**
+ * An immutable array backed directly by the array part of a Lua table. The
+ * table is kept alive in the registry of its state for as long as the receiver
+ * exists, and its values are only converted into Objective-C objects as they
+ * are accessed. Converted values are cached, so each is converted at most
+ * once.
+ *
+ * Instances of this class are returned from \c +[NSArray popFromStack:], and
+ * should not usually need to be created directly.
+ *
+ * @note The count of the receiver is fixed to the length of the table upon
+ * initialization, but the values are read lazily, so changes made to the table
+ * from Lua may or may not be visible through the receiver. Use
+ * #materializedArray to take a snapshot of the table. The receiver locks its
+ * #state while reading from the table, but its own cache is not synchronized,
+ * so an instance of this class must not be used from multiple threads at once.
+ */
+@interface MLCLuaArray : NSArray
+/**
+ * Initializes the receiver with the Lua table at \a index in the stack of \a
+ * state, which is left unmodified. Returns \c nil if the value at \a index is
+ * not a table.
+ */
+- (id)initWithValueAtStackIndex:(int)index ofState:(MLCState *)state;
+
+/**
+ * The state that the backing Lua table belongs to.
+ */
+@property (nonatomic, strong, readonly) MLCState *state;
+
+/**
+ * Converts every value of the backing Lua table, including any nested tables,
+ * and returns the result as a plain array.
+ */
+- (NSArray *)materializedArray;
+
+/**
+ * Pushes the backing Lua table onto the stack of \a state, without converting
+ * it, if \a state is the receiver's #state. Otherwise, the receiver is pushed as
+ * a new table like any other array.
+ */
+- (void)pushOntoStack:(MLCState *)state;
+@end
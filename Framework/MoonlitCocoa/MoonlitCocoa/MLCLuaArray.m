@@ -0,0 +1,158 @@
+//
+//  MLCLuaArray.m
+//  MoonlitCocoa
+//
+//  Created by agent on 17.10.26.
+//  Released into the public domain.
+//
+
+#import "MLCLuaArray.h"
+#import "MLCLuaDictionary.h"
+#import "MLCMarshaling.h"
+#import "MLCState.h"
+#import "NSArray+LuaAdditions.h"
+#import <lauxlib.h>
+
+@interface MLCLuaArray () {
+	/**
+	 * The reference to the Lua table in the registry of #state.
+	 */
+	int m_reference;
+
+	/**
+	 * The number of elements in the receiver.
+	 */
+	NSUInteger m_count;
+
+	/**
+	 * The values which have been converted so far, or \c nil at each index
+	 * which has not been accessed yet.
+	 */
+	__strong id *m_values;
+}
+
+@property (nonatomic, strong, readwrite) MLCState *state;
+@end
+
+@implementation MLCLuaArray
+@synthesize state = m_state;
+
+- (id)initWithValueAtStackIndex:(int)index ofState:(MLCState *)state; {
+	self = [super init];
+	if (!self)
+		return nil;
+
+	if (!lua_istable(state.state, index))
+		return nil;
+
+	m_count = lua_objlen(state.state, index);
+	if (m_count) {
+		m_values = (__strong id *)calloc(m_count, sizeof(*m_values));
+		if (!m_values)
+			return nil;
+	}
+
+	[state growStackBySize:1];
+
+	lua_pushvalue(state.state, index);
+	m_reference = luaL_ref(state.state, LUA_REGISTRYINDEX);
+
+	self.state = state;
+	return self;
+}
+
+- (void)dealloc {
+	if (m_values) {
+		// ARC does not release objects stored in malloc'd memory
+		for (NSUInteger i = 0;i < m_count;++i) {
+			m_values[i] = nil;
+		}
+
+		free(m_values);
+		m_values = NULL;
+	}
+
+	// this may be deallocated on a different thread than the one using the
+	// state, so the reference must be released without waiting for it
+	if (m_state)
+		MLCStateReleaseReference(m_state, m_reference);
+}
+
+- (NSArray *)materializedArray; {
+	NSMutableArray *array = [[NSMutableArray alloc] initWithCapacity:m_count];
+
+	for (NSUInteger i = 0;i < m_count;++i) {
+		id value = [self objectAtIndex:i];
+
+		if ([value isKindOfClass:[MLCLuaDictionary class]])
+			value = [value materializedDictionary];
+		else if ([value isKindOfClass:[MLCLuaArray class]])
+			value = [value materializedArray];
+
+		[array addObject:value];
+	}
+
+	return array;
+}
+
+- (void)pushOntoStack:(MLCState *)state; {
+	if (state != self.state) {
+		[super pushOntoStack:state];
+		return;
+	}
+
+	[state growStackBySize:1];
+	lua_rawgeti(state.state, LUA_REGISTRYINDEX, m_reference);
+}
+
+#pragma mark NSArray
+
+- (NSUInteger)count {
+	return m_count;
+}
+
+- (id)objectAtIndex:(NSUInteger)index {
+	if (index >= m_count)
+		[NSException raise:NSRangeException format:@"Index %lu out of bounds for array of count %lu", (unsigned long)index, (unsigned long)m_count];
+
+	id value = m_values[index];
+	if (value)
+		return value;
+
+	MLCState *state = self.state;
+	[state lock];
+
+	lua_State *L = state.state;
+	int top = lua_gettop(L);
+
+	@try {
+		// space for the table and the value
+		[state growStackBySize:2];
+
+		lua_rawgeti(L, LUA_REGISTRYINDEX, m_reference);
+
+		// Lua indices start at one, so adjust appropriately
+		lua_rawgeti(L, -1, (int)index + 1);
+		value = MLCPopValue(state);
+	} @finally {
+		// pop the table, and anything left by an exception
+		lua_settop(L, top);
+		[state unlock];
+	}
+
+	// any values whose types are not understood (including holes in the
+	// table) are represented with NSNull, matching +[NSArray popFromStack:]
+	if (!value)
+		value = [NSNull null];
+
+	m_values[index] = value;
+	return value;
+}
+
+#pragma mark NSCopying
+
+- (id)copyWithZone:(NSZone *)zone {
+	return self;
+}
+
+@end
@@ -0,0 +1,232 @@
+//
+//  MLCLuaDictionary.m
+//  MoonlitCocoa
+//
+//  Created by agent on 17.10.26.
+//  Released into the public domain.
+//
+
+#import "MLCLuaDictionary.h"
+#import "MLCLuaArray.h"
+#import "MLCMarshaling.h"
+#import "MLCState.h"
+#import "NSDictionary+LuaAdditions.h"
+#import <lauxlib.h>
+
+/**
+ * Returns whether values of the given Lua type are converted by
+ * MLCState#popValueOnStack, and thus appear in a bridged dictionary.
+ */
+static BOOL isBridgedType (int type) {
+	switch (type) {
+	case LUA_TNUMBER:
+	case LUA_TBOOLEAN:
+	case LUA_TSTRING:
+	case LUA_TTABLE:
+	case LUA_TUSERDATA:
+	case LUA_TLIGHTUSERDATA:
+	case LUA_TFUNCTION:
+		return YES;
+
+	default:
+		return NO;
+	}
+}
+
+@interface MLCLuaDictionary () {
+	/**
+	 * The reference to the Lua table in the registry of #state.
+	 */
+	int m_reference;
+}
+
+@property (nonatomic, strong, readwrite) MLCState *state;
+
+/**
+ * The values which have been converted so far, keyed by their converted keys.
+ * Values for boolean keys are not cached.
+ */
+@property (nonatomic, strong) NSMutableDictionary *cachedValues;
+
+/**
+ * Every key of the backing Lua table whose value can be converted, or \c nil if
+ * the keys have not been enumerated yet.
+ */
+@property (nonatomic, copy) NSArray *keys;
+
+/**
+ * Enumerates the backing Lua table, if necessary, and returns #keys.
+ */
+- (NSArray *)allKeysOfTable;
+
+/**
+ * Pushes the backing Lua table onto the stack of #state.
+ */
+- (void)pushTable;
+@end
+
+@implementation MLCLuaDictionary
+@synthesize state = m_state;
+@synthesize cachedValues = m_cachedValues;
+@synthesize keys = m_keys;
+
+- (id)initWithValueAtStackIndex:(int)index ofState:(MLCState *)state; {
+	self = [super init];
+	if (!self)
+		return nil;
+
+	if (!lua_istable(state.state, index))
+		return nil;
+
+	[state growStackBySize:1];
+
+	lua_pushvalue(state.state, index);
+	m_reference = luaL_ref(state.state, LUA_REGISTRYINDEX);
+
+	self.state = state;
+	self.cachedValues = [[NSMutableDictionary alloc] init];
+	return self;
+}
+
+- (void)dealloc {
+	// this may be deallocated on a different thread than the one using the
+	// state, so the reference must be released without waiting for it
+	if (m_state)
+		MLCStateReleaseReference(m_state, m_reference);
+}
+
+- (void)pushTable; {
+	[self.state growStackBySize:1];
+	lua_rawgeti(self.state.state, LUA_REGISTRYINDEX, m_reference);
+}
+
+- (NSArray *)allKeysOfTable; {
+	if (self.keys)
+		return self.keys;
+
+	MLCState *state = self.state;
+	NSMutableArray *keys = [[NSMutableArray alloc] init];
+
+	[state lock];
+
+	lua_State *L = state.state;
+	int top = lua_gettop(L);
+
+	@try {
+		// space for the key and value used during iteration
+		[state growStackBySize:2];
+
+		[self pushTable];
+		lua_pushnil(L);
+
+		while (lua_next(L, -2) != 0) {
+			// key is now at -2
+			// value is now at -1
+			if (isBridgedType(lua_type(L, -2)) && isBridgedType(lua_type(L, -1))) {
+				id key = MLCGetValue(state, -2);
+				if (key)
+					[keys addObject:key];
+			}
+
+			// pop the value, leaving the key for the next iteration
+			lua_pop(L, 1);
+		}
+	} @finally {
+		// pop the table, and anything left by an exception
+		lua_settop(L, top);
+		[state unlock];
+	}
+
+	self.keys = keys;
+	return self.keys;
+}
+
+- (NSDictionary *)materializedDictionary; {
+	NSArray *keys = [self allKeysOfTable];
+	NSMutableDictionary *dict = [[NSMutableDictionary alloc] initWithCapacity:[keys count]];
+
+	for (id key in keys) {
+		id value = [self objectForKey:key];
+
+		if ([value isKindOfClass:[MLCLuaDictionary class]])
+			value = [value materializedDictionary];
+		else if ([value isKindOfClass:[MLCLuaArray class]])
+			value = [value materializedArray];
+
+		if (value)
+			[dict setObject:value forKey:key];
+	}
+
+	return dict;
+}
+
+- (void)pushOntoStack:(MLCState *)state; {
+	if (state != self.state) {
+		[super pushOntoStack:state];
+		return;
+	}
+
+	[self pushTable];
+}
+
+#pragma mark NSDictionary
+
+- (NSUInteger)count {
+	return [[self allKeysOfTable] count];
+}
+
+- (id)objectForKey:(id)key {
+	if (!key)
+		return nil;
+
+	// booleans compare equal to the numbers zero and one in Foundation, but
+	// are distinct keys in Lua, so they can't share the cache with numbers
+	BOOL isCacheable = !([key isKindOfClass:[NSNumber class]] && MLCNumberIsBoolean(key));
+
+	id value = nil;
+	if (isCacheable) {
+		value = [self.cachedValues objectForKey:key];
+		if (value)
+			return value;
+	}
+
+	MLCState *state = self.state;
+
+	[state lock];
+
+	lua_State *L = state.state;
+	int top = lua_gettop(L);
+
+	@try {
+		// space for the table and the key
+		[state growStackBySize:2];
+
+		[self pushTable];
+		MLCPushObject(state, key);
+
+		lua_rawget(L, -2);
+		if (isBridgedType(lua_type(L, -1)))
+			value = MLCPopValue(state);
+	} @finally {
+		// pop the table, and anything left by an exception
+		lua_settop(L, top);
+		[state unlock];
+	}
+
+	if (value && isCacheable)
+		[self.cachedValues setObject:value forKey:key];
+
+	return value;
+}
+
+- (NSEnumerator *)keyEnumerator {
+	return [[self allKeysOfTable] objectEnumerator];
+}
+
+#pragma mark NSCopying
+
+- (id)copyWithZone:(NSZone *)zone {
+	return self;
+}
+
+@end
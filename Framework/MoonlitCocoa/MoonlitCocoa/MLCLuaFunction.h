@@ -0,0 +1,79 @@
+//
+//  MLCLuaFunction.h
+//  MoonlitCocoa
+//
+//  Created by agent on 17.10.26.
+//  Released into the public domain.
+//
+
+#import <Foundation/Foundation.h>
+#import <MoonlitCocoa/MLCValue.h>
+
+@class MLCState;
+
+/**
+ * A reference to a Lua function, which can be called from Objective-C without
+ * looking it up by name. The function is kept alive in the registry of its
+ * state for as long as the receiver exists.
+ *
+ * Each call locks the receiver's #state, pushes the function with \c
+ * lua_rawgeti, and invokes it with \c lua_pcall. Except for
+ * #callWithArguments:error:, errors raised by the function are thrown as an
+ * #MLCLuaErrorException, whose reason includes the Lua error message.
+ *
+ * Instances of this class are returned from MLCState#popValueOnStack for Lua
+ * functions, and should not usually need to be created directly.
+ */
+@interface MLCLuaFunction : NSObject <MLCValue, NSCopying>
+/**
+ * Initializes the receiver with the Lua function at \a index in the stack of \a
+ * state, which is left unmodified. Returns \c nil if the value at \a index is
+ * not a function.
+ */
+- (id)initWithValueAtStackIndex:(int)index ofState:(MLCState *)state;
+
+/**
+ * The state that the function belongs to.
+ */
+@property (nonatomic, strong, readonly) MLCState *state;
+
+/**
+ * Calls the receiver with \a arguments (where \c NSNull represents \c nil), and
+ * returns all of its results, with \c nil values represented by \c NSNull.
+ * Returns \c nil and fills in \a error (if provided) if the function raises an
+ * error.
+ */
+- (NSArray *)callWithArguments:(NSArray *)arguments error:(NSError **)error;
+
+/**
+ * Calls the receiver with \a arguments, and returns its first result, or \c
+ * nil if it returned nothing. If the function raises an error, an
+ * #MLCLuaErrorException is thrown.
+ */
+- (id)callWithArguments:(NSArray *)arguments;
+
+/**
+ * A block which calls the receiver with two objects, and expects it to return
+ * a number which is negative, zero, or positive if the first object is less
+ * than, equal to, or greater than the second (respectively).
+ */
+@property (nonatomic, copy, readonly) NSComparator comparator;
+
+/**
+ * A block which calls the receiver with an object, and returns whether its
+ * first result is true (in the Lua sense).
+ */
+@property (nonatomic, copy, readonly) BOOL (^predicateBlock)(id obj);
+
+/**
+ * A block which calls the receiver with an object, and returns its first
+ * result.
+ */
+@property (nonatomic, copy, readonly) id (^transformBlock)(id obj);
+
+/**
+ * A block which calls the receiver with a number, and returns its first result
+ * as a number.
+ */
+@property (nonatomic, copy, readonly) double (^numericTransformBlock)(double value);
+@end
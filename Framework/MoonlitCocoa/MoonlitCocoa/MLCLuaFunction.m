@@ -0,0 +1,282 @@
+//
+//  MLCLuaFunction.m
+//  MoonlitCocoa
+//
+//  Created by agent on 17.10.26.
+//  Released into the public domain.
+//
+
+#import "MLCLuaFunction.h"
+#import "MLCMarshaling.h"
+#import "MLCState.h"
+#import <lauxlib.h>
+
+@interface MLCLuaFunction () {
+	/**
+	 * A reference to the function in the registry of #state.
+	 */
+	int m_reference;
+}
+
+@property (nonatomic, strong, readwrite) MLCState *state;
+@end
+
+/**
+ * Makes room for the function and \a argCount arguments on the stack of \a L,
+ * and pushes the function referenced by \a function. \a L must belong to the
+ * function's #state, which must be locked.
+ */
+static void pushFunction (__unsafe_unretained MLCLuaFunction *function, lua_State *L, int argCount);
+
+/**
+ * Pops \a argCount arguments and then the function pushed by #pushFunction,
+ * and calls the function, leaving one result on the stack. If the function
+ * raises an error, an #MLCLuaErrorException is thrown.
+ *
+ * \a state must be locked when invoking this function.
+ */
+static void callFunction (__unsafe_unretained MLCLuaFunction *function, __unsafe_unretained MLCState *state, int argCount);
+
+@implementation MLCLuaFunction
+@synthesize state = m_state;
+
+// these are defined within the implementation so that they may read the ivars
+// directly
+static void pushFunction (__unsafe_unretained MLCLuaFunction *function, lua_State *L, int argCount) {
+	MLCGrowStack(L, argCount + 1);
+	lua_rawgeti(L, LUA_REGISTRYINDEX, function->m_reference);
+}
+
+static void callFunction (__unsafe_unretained MLCLuaFunction *function, __unsafe_unretained MLCState *state, int argCount) {
+	NSError *error = nil;
+	if (![state callFunctionWithArgumentCount:argCount resultCount:1 error:&error])
+		MLCRaiseLuaError([function description], error);
+}
+
+- (id)initWithValueAtStackIndex:(int)index ofState:(MLCState *)state; {
+	self = [super init];
+	if (!self)
+		return nil;
+
+	lua_State *L = state.state;
+	if (!lua_isfunction(L, index))
+		return nil;
+
+	[state growStackBySize:1];
+
+	lua_pushvalue(L, index);
+	m_reference = luaL_ref(L, LUA_REGISTRYINDEX);
+
+	self.state = state;
+	return self;
+}
+
+- (void)dealloc {
+	// this may be deallocated on a different thread than the one using the
+	// state, so the reference must be released without waiting for it
+	if (m_state)
+		MLCStateReleaseReference(m_state, m_reference);
+}
+
+- (NSArray *)callWithArguments:(NSArray *)arguments error:(NSError **)error; {
+	MLCState *state = m_state;
+	int argCount = (int)[arguments count];
+
+	[state lock];
+
+	lua_State *L = MLCStateGetLuaState(state);
+	int top = lua_gettop(L);
+
+	NSMutableArray *results = nil;
+
+	@try {
+		pushFunction(self, L, argCount);
+
+		for (id argument in arguments) {
+			MLCPushObject(state, argument);
+		}
+
+		if ([state callFunctionWithArgumentCount:argCount resultCount:LUA_MULTRET error:error]) {
+			int resultCount = lua_gettop(L) - top;
+			results = [[NSMutableArray alloc] initWithCapacity:(NSUInteger)resultCount];
+
+			for (int i = top + 1;i <= top + resultCount;++i) {
+				id value = MLCGetValue(state, i);
+				[results addObject:value ?: [NSNull null]];
+			}
+		}
+	} @finally {
+		lua_settop(L, top);
+		[state unlock];
+	}
+
+	return results;
+}
+
+- (id)callWithArguments:(NSArray *)arguments; {
+	MLCState *state = m_state;
+	int argCount = (int)[arguments count];
+
+	[state lock];
+
+	lua_State *L = MLCStateGetLuaState(state);
+	int top = lua_gettop(L);
+
+	@try {
+		pushFunction(self, L, argCount);
+
+		for (id argument in arguments) {
+			MLCPushObject(state, argument);
+		}
+
+		callFunction(self, state, argCount);
+		return MLCPopValue(state);
+	} @finally {
+		lua_settop(L, top);
+		[state unlock];
+	}
+}
+
+#pragma mark Blocks
+
+- (NSComparator)comparator {
+	return ^(id left, id right){
+		MLCState *state = m_state;
+		NSComparisonResult result = NSOrderedSame;
+
+		[state lock];
+
+		lua_State *L = MLCStateGetLuaState(state);
+		int top = lua_gettop(L);
+
+		@try {
+			pushFunction(self, L, 2);
+			MLCPushObject(state, left);
+			MLCPushObject(state, right);
+			callFunction(self, state, 2);
+
+			lua_Number order = lua_tonumber(L, -1);
+
+			if (order < 0)
+				result = NSOrderedAscending;
+			else if (order > 0)
+				result = NSOrderedDescending;
+		} @finally {
+			lua_settop(L, top);
+			[state unlock];
+		}
+
+		return result;
+	};
+}
+
+- (BOOL (^)(id))predicateBlock {
+	return ^(id obj){
+		MLCState *state = m_state;
+		BOOL result = NO;
+
+		[state lock];
+
+		lua_State *L = MLCStateGetLuaState(state);
+		int top = lua_gettop(L);
+
+		@try {
+			pushFunction(self, L, 1);
+			MLCPushObject(state, obj);
+			callFunction(self, state, 1);
+
+			result = (BOOL)lua_toboolean(L, -1);
+		} @finally {
+			lua_settop(L, top);
+			[state unlock];
+		}
+
+		return result;
+	};
+}
+
+- (id (^)(id))transformBlock {
+	return ^(id obj){
+		MLCState *state = m_state;
+
+		[state lock];
+
+		lua_State *L = MLCStateGetLuaState(state);
+		int top = lua_gettop(L);
+
+		@try {
+			pushFunction(self, L, 1);
+			MLCPushObject(state, obj);
+			callFunction(self, state, 1);
+
+			return MLCPopValue(state);
+		} @finally {
+			lua_settop(L, top);
+			[state unlock];
+		}
+	};
+}
+
+- (double (^)(double))numericTransformBlock {
+	return ^(double value){
+		MLCState *state = m_state;
+		double result = 0;
+
+		[state lock];
+
+		lua_State *L = MLCStateGetLuaState(state);
+		int top = lua_gettop(L);
+
+		@try {
+			pushFunction(self, L, 1);
+			lua_pushnumber(L, value);
+			callFunction(self, state, 1);
+
+			result = lua_tonumber(L, -1);
+		} @finally {
+			lua_settop(L, top);
+			[state unlock];
+		}
+
+		return result;
+	};
+}
+
+#pragma mark NSCopying
+
+- (id)copyWithZone:(NSZone *)zone {
+	return self;
+}
+
+#pragma mark MLCValue
+
++ (BOOL)isOnStack:(MLCState *)state; {
+	return lua_isfunction(state.state, -1);
+}
+
++ (id)popFromStack:(MLCState *)state; {
+	MLCLuaFunction *function = [[self alloc] initWithValueAtStackIndex:-1 ofState:state];
+	lua_pop(state.state, 1);
+	return function;
+}
+
+- (void)pushOntoStack:(MLCState *)state; {
+	// the state may be shared with other threads, and the registry must not
+	// change while the reference is read from it
+	[state lock];
+
+	@try {
+		[state growStackBySize:1];
+
+		if (state == m_state) {
+			lua_rawgeti(state.state, LUA_REGISTRYINDEX, m_reference);
+		} else {
+			// functions cannot be moved between states
+			lua_pushnil(state.state);
+		}
+	} @finally {
+		[state unlock];
+	}
+}
+
+@end
@@ -0,0 +1,62 @@
+//
+//  MLCLuaString.h
+//  MoonlitCocoa
+//
+//  Created by agent on 17.10.26.
+//  Released into the public domain.
+//
+
+#import <Foundation/Foundation.h>
+
+@class MLCState;
+
+/**
+ * The minimum length, in bytes, of a Lua string that will be bridged as an
+ * #MLCLuaString instead of being copied into a new \c NSString.
+ */
+#define MLCLuaStringMinimumLength 256
+
+/**
+ * An immutable string backed directly by a Lua string. The Lua string is kept
+ * alive in the registry of its state for as long as the receiver exists, so
+ * its bytes can be read without ever being copied.
+ *
+ * If the Lua string only contains ASCII characters, the receiver reads its
+ * characters straight out of the Lua string. Otherwise, the bytes are decoded
+ * once, upon initialization, but #UTF8String and pushing the receiver back
+ * onto the stack of its state still do not copy.
+ *
+ * Instances of this class are returned from \c +[NSString popFromStack:] for
+ * long strings, and should not usually need to be created directly.
+ */
+@interface MLCLuaString : NSString
+/**
+ * Initializes the receiver with the Lua string at \a index in the stack of \a
+ * state, which is left unmodified. Returns \c nil if the value at \a index is
+ * not a string or is not valid UTF-8.
+ */
+- (id)initWithValueAtStackIndex:(int)index ofState:(MLCState *)state;
+
+/**
+ * The state that the backing Lua string belongs to.
+ */
+@property (nonatomic, strong, readonly) MLCState *state;
+
+/**
+ * The bytes of the backing Lua string, which are always followed by a NUL
+ * terminator. This pointer remains valid for the lifetime of the receiver.
+ */
+@property (nonatomic, readonly) const char *bytes;
+
+/**
+ * The length of #bytes, not including the NUL terminator.
+ */
+@property (nonatomic, readonly) NSUInteger byteLength;
+
+/**
+ * Pushes the backing Lua string onto the stack of \a state, without copying it,
+ * if \a state is the receiver's #state. Otherwise, the receiver is encoded as
+ * UTF-8 like any other string.
+ */
+- (void)pushOntoStack:(MLCState *)state;
+@end
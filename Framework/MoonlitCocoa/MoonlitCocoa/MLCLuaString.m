@@ -0,0 +1,163 @@
+//
+//  MLCLuaString.m
+//  MoonlitCocoa
+//
+//  Created by agent on 17.10.26.
+//  Released into the public domain.
+//
+
+#import "MLCLuaString.h"
+#import "MLCMarshaling.h"
+#import "MLCState.h"
+#import "NSString+LuaAdditions.h"
+#import <lauxlib.h>
+
+/**
+ * Returns whether the \a length bytes at \a bytes are all ASCII characters.
+ */
+static BOOL isASCII (const char *bytes, size_t length) {
+	for (size_t i = 0;i < length;++i) {
+		if ((unsigned char)bytes[i] & 0x80)
+			return NO;
+	}
+
+	return YES;
+}
+
+@interface MLCLuaString () {
+	/**
+	 * The reference to the Lua string in the registry of #state.
+	 */
+	int m_reference;
+
+	/**
+	 * The decoded contents of the Lua string, or \c nil if it only contains
+	 * ASCII characters.
+	 */
+	NSString *m_decodedString;
+}
+
+@property (nonatomic, strong, readwrite) MLCState *state;
+@property (nonatomic, readwrite) const char *bytes;
+@property (nonatomic, readwrite) NSUInteger byteLength;
+@end
+
+@implementation MLCLuaString
+@synthesize state = m_state;
+@synthesize bytes = m_bytes;
+@synthesize byteLength = m_byteLength;
+
+- (id)initWithValueAtStackIndex:(int)index ofState:(MLCState *)state; {
+	self = [super init];
+	if (!self)
+		return nil;
+
+	lua_State *L = state.state;
+	if (lua_type(L, index) != LUA_TSTRING)
+		return nil;
+
+	size_t length = 0;
+	const char *bytes = lua_tolstring(L, index, &length);
+
+	if (!isASCII(bytes, length)) {
+		m_decodedString = [[NSString alloc] initWithBytes:bytes length:length encoding:NSUTF8StringEncoding];
+		if (!m_decodedString)
+			return nil;
+	}
+
+	[state growStackBySize:1];
+
+	// pin the string, so that its bytes remain valid
+	lua_pushvalue(L, index);
+	m_reference = luaL_ref(L, LUA_REGISTRYINDEX);
+
+	self.state = state;
+	self.bytes = bytes;
+	self.byteLength = length;
+
+	return self;
+}
+
+- (void)dealloc {
+	// this may be deallocated on a different thread than the one using the
+	// state, so the reference must be released without waiting for it
+	if (m_state)
+		MLCStateReleaseReference(m_state, m_reference);
+}
+
+- (void)pushOntoStack:(MLCState *)state; {
+	if (state != self.state) {
+		[super pushOntoStack:state];
+		return;
+	}
+
+	[state growStackBySize:1];
+	lua_rawgeti(state.state, LUA_REGISTRYINDEX, m_reference);
+}
+
+#pragma mark NSString
+
+- (NSUInteger)length {
+	if (m_decodedString)
+		return [m_decodedString length];
+	else
+		return self.byteLength;
+}
+
+- (unichar)characterAtIndex:(NSUInteger)index {
+	if (m_decodedString)
+		return [m_decodedString characterAtIndex:index];
+
+	if (index >= self.byteLength)
+		[NSException raise:NSRangeException format:@"Index %lu out of bounds for string of length %lu", (unsigned long)index, (unsigned long)self.byteLength];
+
+	return (unichar)(unsigned char)self.bytes[index];
+}
+
+- (void)getCharacters:(unichar *)buffer range:(NSRange)range {
+	if (m_decodedString) {
+		[m_decodedString getCharacters:buffer range:range];
+		return;
+	}
+
+	if (NSMaxRange(range) > self.byteLength)
+		[NSException raise:NSRangeException format:@"Range %@ out of bounds for string of length %lu", NSStringFromRange(range), (unsigned long)self.byteLength];
+
+	const char *bytes = self.bytes + range.location;
+	for (NSUInteger i = 0;i < range.length;++i) {
+		buffer[i] = (unichar)(unsigned char)bytes[i];
+	}
+}
+
+- (const char *)UTF8String {
+	return self.bytes;
+}
+
+- (NSUInteger)lengthOfBytesUsingEncoding:(NSStringEncoding)encoding {
+	if (encoding == NSUTF8StringEncoding)
+		return self.byteLength;
+	else
+		return [super lengthOfBytesUsingEncoding:encoding];
+}
+
+- (NSStringEncoding)fastestEncoding {
+	if (m_decodedString)
+		return NSUTF8StringEncoding;
+	else
+		return NSASCIIStringEncoding;
+}
+
+- (NSStringEncoding)smallestEncoding {
+	if (m_decodedString)
+		return [m_decodedString smallestEncoding];
+	else
+		return NSASCIIStringEncoding;
+}
+
+#pragma mark NSCopying
+
+- (id)copyWithZone:(NSZone *)zone {
+	return self;
+}
+
+@end
@@ -0,0 +1,180 @@
+//
+//  MLCMarshaling.h
+//  MoonlitCocoa
+//
+//  Created by agent on 17.10.26.
+//  Released into the public domain.
+//
+
+#import <Foundation/Foundation.h>
+#import "MLCState.h"
+#import <lua.h>
+
+/*
+ * The C core of all conversions between Objective-C objects and Lua values.
+ *
+ * MLCState#pushObject:, MLCState#popValueOnStack, and the MLCValue methods of
+ * the Foundation categories are thin wrappers around these functions. The
+ * functions dispatch on the Lua type or on a cached kind of the object's
+ * class, so converting the contents of a collection involves no blocks and no
+ * message sends beyond those needed to read each element.
+ */
+
+#ifndef NS_BLOCK_ASSERTIONS
+	/**
+	 * Records the top of the stack of \a L, to be checked later by
+	 * #MLCEndStackCheck. Only present when assertions are enabled.
+	 */
+	#define MLCBeginStackCheck(L) \
+		int MLCStackCheckTop = lua_gettop(L)
+
+	/**
+	 * Asserts that the stack of \a L has changed by \a delta slots since
+	 * #MLCBeginStackCheck was used in the same scope.
+	 */
+	#define MLCEndStackCheck(L, delta) \
+		NSCAssert2(lua_gettop(L) == MLCStackCheckTop + (delta), @"Actual stack delta (%i) does not match expected delta (%i)", lua_gettop(L) - MLCStackCheckTop, (delta))
+#else
+	#define MLCBeginStackCheck(L) \
+		do {} while (0)
+
+	#define MLCEndStackCheck(L, delta) \
+		do {} while (0)
+#endif
+
+/**
+ * Returns the \c lua_State of \a state, without a message send.
+ */
+lua_State *MLCStateGetLuaState (__unsafe_unretained MLCState *state);
+
+/**
+ * Releases \a reference from the registry of \a state without waiting for
+ * its lock. If another thread holds the lock, the reference is released when
+ * the state is next unlocked.
+ *
+ * This is intended for \c -dealloc methods, which may run on any thread,
+ * including one that holds a lock which the thread using the state is waiting
+ * for.
+ */
+void MLCStateReleaseReference (__unsafe_unretained MLCState *state, int reference);
+
+/**
+ * The parts of an #MLCState which only apply while Lua code is running.
+ */
+typedef struct {
+	lua_State *stack;
+	unsigned protectedCallDepth;
+	lua_State *runningThread;
+} MLCLuaExecutionContext;
+
+/**
+ * Invoked when Lua calls into Objective-C code through \a state from the
+ * thread \a L, which may be a coroutine of the state. Returns the context to
+ * later pass to #MLCLeaveObjectiveC.
+ *
+ * Until then, the state uses the stack of \a L, so that the arguments can be
+ * read and the results pushed. The memory limit is not enforced while the
+ * Objective-C code runs, since a memory error would otherwise unwind
+ * Objective-C frames without running their cleanup. The state is also not
+ * sampled by its profiler, since it is not running Lua code.
+ *
+ * Every \c lua_CFunction that sends Objective-C messages must do so between
+ * these two calls, and must not raise Lua errors in between.
+ */
+MLCLuaExecutionContext MLCEnterObjectiveC (__unsafe_unretained MLCState *state, lua_State *L);
+
+/**
+ * Restores the context returned by #MLCEnterObjectiveC.
+ */
+void MLCLeaveObjectiveC (__unsafe_unretained MLCState *state, MLCLuaExecutionContext context);
+
+/**
+ * Makes room for \a size more values on the stack of \a L, throwing
+ * #MLCLuaStackOverflowException if the stack cannot grow. This is the C
+ * equivalent of MLCState#growStackBySize:.
+ */
+static inline void MLCGrowStack (lua_State *L, int size) {
+	if (!lua_checkstack(L, size)) {
+		[NSException raise:MLCLuaStackOverflowException format:@"Could not grow Lua stack by %i slots", size];
+	}
+}
+
+/**
+ * Discards the cached kinds of all classes, so that they are looked up again
+ * the next time an instance is pushed. This must be invoked after adding or
+ * replacing \c -pushOntoStack: on a class whose instances may already have
+ * been pushed. It is invoked automatically by MLCBridgedObject when a class is
+ * registered with a state.
+ */
+void MLCInvalidateObjectKindCache (void);
+
+/**
+ * Returns whether \a number was created from a boolean (as MLCPopValue() does
+ * for Lua booleans), on platforms where that can be determined.
+ */
+BOOL MLCNumberIsBoolean (__unsafe_unretained NSNumber *number);
+
+/**
+ * Returns whether \a selector belongs to one of the method families that
+ * return an owning reference, so that the object returned by a method of that
+ * name is already retained for the caller.
+ */
+BOOL MLCSelectorReturnsRetainedObject (SEL selector);
+
+/**
+ * Throws an #MLCLuaErrorException for \a error, which was returned from a call
+ * into Lua made for \a caller (such as the name of a method implemented in
+ * Lua). This is used where the caller has no other way to report the error.
+ */
+void MLCRaiseLuaError (NSString *caller, NSError *error) __attribute__((noreturn));
+
+/**
+ * Pushes \a object onto the stack of \a state, as described by
+ * MLCState#pushObject:.
+ */
+void MLCPushObject (__unsafe_unretained MLCState *state, __unsafe_unretained id object);
+
+/**
+ * Pops the value at the top of the stack of \a state, and returns it converted
+ * into an object, as described by MLCState#popValueOnStack.
+ */
+id MLCPopValue (__unsafe_unretained MLCState *state);
+
+/**
+ * Returns the value at \a index in the stack of \a state converted into an
+ * object, leaving the stack unchanged.
+ */
+id MLCGetValue (__unsafe_unretained MLCState *state, int index);
+
+/**
+ * Pushes \a string onto the stack of \a state as UTF-8. Unpaired surrogates,
+ * which cannot be encoded, are replaced with U+FFFD.
+ */
+void MLCPushString (__unsafe_unretained MLCState *state, __unsafe_unretained NSString *string);
+
+/**
+ * Returns whether the value at \a index in the stack of \a L is the userdata
+ * of an MLCNumericArray, by the identity of its metatable. This needs room for
+ * two more values on the stack.
+ */
+BOOL MLCIsNumericArray (lua_State *L, int index);
+
+/**
+ * Pops the string or number at the top of the stack of \a state, and returns
+ * it as a string. Long strings are bridged without copying. Returns \c nil if
+ * the value is of another type or is not valid UTF-8.
+ */
+NSString *MLCPopString (__unsafe_unretained MLCState *state);
+
+/**
+ * Pushes a new table onto the stack of \a state, containing the elements of \a
+ * array at indices starting from one.
+ */
+void MLCPushArray (__unsafe_unretained MLCState *state, __unsafe_unretained NSArray *array);
+
+/**
+ * Pushes a new table onto the stack of \a state, containing the keys and
+ * values of \a dictionary. Keys that cannot index a Lua table (\c NSNull and
+ * NaN) are skipped.
+ */
+void MLCPushDictionary (__unsafe_unretained MLCState *state, __unsafe_unretained NSDictionary *dictionary);
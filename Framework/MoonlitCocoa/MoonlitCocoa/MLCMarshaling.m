@@ -0,0 +1,441 @@
+//
+//  MLCMarshaling.m
+//  MoonlitCocoa
+//
+//  Created by agent on 17.10.26.
+//  Released into the public domain.
+//
+
+#import "MLCMarshaling.h"
+#import "MLCBridgedObject.h"
+#import "MLCLuaDictionary.h"
+#import "MLCLuaFunction.h"
+#import "MLCLuaString.h"
+#import "MLCNumericArray.h"
+#import "MLCTask.h"
+#import "MLCValue.h"
+#import <dispatch/dispatch.h>
+#import <math.h>
+#import <objc/runtime.h>
+
+/**
+ * The size of the buffer on the C stack used to encode short strings before
+ * pushing them into Lua.
+ */
+#define MLCStringStackBufferSize 256
+
+/**
+ * The number of classes whose #MLCObjectKind is cached. Must be a power of
+ * two.
+ */
+#define MLCObjectKindCacheSize 128
+
+/**
+ * Masks the #MLCObjectKind stored in the low bits of a cache entry, which are
+ * always zero in a class pointer.
+ */
+#define MLCObjectKindMask ((uintptr_t)0x7)
+
+/**
+ * Describes how instances of a class are pushed onto a Lua stack.
+ */
+typedef enum {
+	/**
+	 * The class does not implement \c -pushOntoStack:, so its instances are
+	 * pushed as light userdata, unless they respond to it by forwarding.
+	 */
+	MLCObjectKindOpaque = 0,
+
+	/**
+	 * The class has its own implementation of \c -pushOntoStack:, which must
+	 * be invoked.
+	 */
+	MLCObjectKindCustom,
+
+	/**
+	 * The class uses the \c -pushOntoStack: implementation of one of the
+	 * Foundation categories, which is performed directly.
+	 */
+	MLCObjectKindString,
+	MLCObjectKindNumber,
+	MLCObjectKindNull,
+	MLCObjectKindArray,
+	MLCObjectKindDictionary
+} MLCObjectKind;
+
+/**
+ * Maps class pointers to their #MLCObjectKind, with the kind stored in the
+ * low bits of each entry. Entries are single words, so they can be read and
+ * replaced from any thread without locking.
+ *
+ * Entries are not invalidated when a class gains or replaces \c
+ * -pushOntoStack: at runtime, or when a class is disposed of and its address
+ * reused, except by #MLCInvalidateObjectKindCache.
+ */
+static volatile uintptr_t MLCObjectKindCache[MLCObjectKindCacheSize];
+
+static MLCObjectKind kindOfClass (Class cls) {
+	SEL selector = @selector(pushOntoStack:);
+	if (!class_respondsToSelector(cls, selector))
+		return MLCObjectKindOpaque;
+
+	IMP implementation = class_getMethodImplementation(cls, selector);
+
+	if (implementation == class_getMethodImplementation([NSString class], selector))
+		return MLCObjectKindString;
+	else if (implementation == class_getMethodImplementation([NSNumber class], selector))
+		return MLCObjectKindNumber;
+	else if (implementation == class_getMethodImplementation([NSNull class], selector))
+		return MLCObjectKindNull;
+	else if (implementation == class_getMethodImplementation([NSArray class], selector))
+		return MLCObjectKindArray;
+	else if (implementation == class_getMethodImplementation([NSDictionary class], selector))
+		return MLCObjectKindDictionary;
+	else
+		return MLCObjectKindCustom;
+}
+
+static MLCObjectKind kindOfObject (__unsafe_unretained id object) {
+	uintptr_t key = (uintptr_t)object_getClass(object);
+	NSCAssert((key & MLCObjectKindMask) == 0, @"Class pointer %p is not aligned", (void *)key);
+
+	volatile uintptr_t *entry = &MLCObjectKindCache[(key >> 4) & (MLCObjectKindCacheSize - 1)];
+
+	uintptr_t cached = *entry;
+	if ((cached & ~MLCObjectKindMask) == key)
+		return (MLCObjectKind)(cached & MLCObjectKindMask);
+
+	MLCObjectKind kind = kindOfClass((__bridge Class)(void *)key);
+	*entry = key | (uintptr_t)kind;
+
+	return kind;
+}
+
+void MLCInvalidateObjectKindCache (void) {
+	for (NSUInteger i = 0;i < MLCObjectKindCacheSize;++i) {
+		MLCObjectKindCache[i] = 0;
+	}
+}
+
+BOOL MLCNumberIsBoolean (__unsafe_unretained NSNumber *number) {
+	static Class booleanClass = Nil;
+	static dispatch_once_t pred;
+
+	dispatch_once(&pred, ^{
+		Class cls = object_getClass([NSNumber numberWithBool:YES]);
+
+		// only trust the class if booleans are distinguishable from integers
+		if (cls != object_getClass([NSNumber numberWithInt:1]))
+			booleanClass = cls;
+	});
+
+	if (booleanClass)
+		return object_getClass(number) == booleanClass;
+	else
+		return *[number objCType] == 'B';
+}
+
+BOOL MLCSelectorReturnsRetainedObject (SEL selector) {
+	const char *name = sel_getName(selector);
+	while (*name == '_')
+		++name;
+
+	const char *families[] = { "alloc", "new", "copy", "mutableCopy", "init" };
+	for (size_t i = 0;i < sizeof(families) / sizeof(*families);++i) {
+		size_t length = strlen(families[i]);
+		if (strncmp(name, families[i], length) != 0)
+			continue;
+
+		// the family name must not be followed by a lowercase letter
+		char next = name[length];
+		if (next < 'a' || next > 'z')
+			return YES;
+	}
+
+	return NO;
+}
+
+void MLCRaiseLuaError (NSString *caller, NSError *error) {
+	NSDictionary *userInfo = nil;
+	if (error)
+		userInfo = [NSDictionary dictionaryWithObject:error forKey:NSUnderlyingErrorKey];
+
+	@throw [NSException
+		exceptionWithName:MLCLuaErrorException
+		reason:[NSString stringWithFormat:@"Error calling %@ in Lua: %@", caller, [error localizedDescription]]
+		userInfo:userInfo
+	];
+}
+
+#pragma mark Pushing
+
+void MLCPushObject (__unsafe_unretained MLCState *state, __unsafe_unretained id object) {
+	lua_State *L = MLCStateGetLuaState(state);
+
+	if (!object) {
+		MLCGrowStack(L, 1);
+		lua_pushnil(L);
+		return;
+	}
+
+	switch (kindOfObject(object)) {
+	case MLCObjectKindString:
+		MLCPushString(state, object);
+		break;
+
+	case MLCObjectKindNumber:
+		MLCGrowStack(L, 1);
+
+		// booleans popped from Lua must be pushed back as booleans, or they
+		// would no longer match the same table keys
+		if (MLCNumberIsBoolean(object))
+			lua_pushboolean(L, [object boolValue]);
+		else
+			lua_pushnumber(L, [object doubleValue]);
+
+		break;
+
+	case MLCObjectKindNull:
+		MLCGrowStack(L, 1);
+		lua_pushnil(L);
+		break;
+
+	case MLCObjectKindArray:
+		MLCPushArray(state, object);
+		break;
+
+	case MLCObjectKindDictionary:
+		MLCPushDictionary(state, object);
+		break;
+
+	case MLCObjectKindCustom:
+		[object pushOntoStack:state];
+		break;
+
+	case MLCObjectKindOpaque:
+		// proxies may still respond by forwarding
+		if ([object respondsToSelector:@selector(pushOntoStack:)]) {
+			[object pushOntoStack:state];
+		} else {
+			MLCGrowStack(L, 1);
+			lua_pushlightuserdata(L, (__bridge void *)object);
+		}
+
+		break;
+	}
+}
+
+void MLCPushString (__unsafe_unretained MLCState *state, __unsafe_unretained NSString *string) {
+	lua_State *L = MLCStateGetLuaState(state);
+	MLCGrowStack(L, 1);
+
+	#ifdef __APPLE__
+	// if the string is stored as ASCII internally, its bytes can be passed to
+	// Lua directly, and there is exactly one byte per character (a UTF-8
+	// pointer would not guarantee that)
+	const char *cStr = CFStringGetCStringPtr((__bridge CFStringRef)string, kCFStringEncodingASCII);
+	if (cStr) {
+		lua_pushlstring(L, cStr, [string length]);
+		return;
+	}
+	#endif
+
+	NSUInteger length = [string length];
+	NSUInteger maximumByteLength = [string maximumLengthOfBytesUsingEncoding:NSUTF8StringEncoding];
+
+	char stackBuffer[MLCStringStackBufferSize];
+	char *buffer = stackBuffer;
+
+	if (maximumByteLength > MLCStringStackBufferSize) {
+		buffer = malloc(maximumByteLength);
+		if (!buffer) {
+			[NSException raise:NSMallocException format:@"Could not allocate %lu bytes to push string onto Lua stack", (unsigned long)maximumByteLength];
+		}
+	}
+
+	NSUInteger byteLength = 0;
+	NSRange remainingRange = NSMakeRange(0, length);
+
+	while (remainingRange.length > 0) {
+		NSUInteger usedLength = 0;
+		[string getBytes:buffer + byteLength maxLength:maximumByteLength - byteLength usedLength:&usedLength encoding:NSUTF8StringEncoding options:0 range:remainingRange remainingRange:&remainingRange];
+
+		byteLength += usedLength;
+		if (remainingRange.length == 0)
+			break;
+
+		// conversion stops at an unpaired surrogate, which has no UTF-8
+		// encoding, so substitute U+FFFD REPLACEMENT CHARACTER for it (which
+		// fits, since a single UTF-16 unit is allowed up to three bytes)
+		if (maximumByteLength - byteLength < 3) {
+			if (buffer != stackBuffer)
+				free(buffer);
+
+			[NSException raise:NSCharacterConversionException format:@"Could not convert string to UTF-8 to push onto Lua stack"];
+		}
+
+		memcpy(buffer + byteLength, "\xEF\xBF\xBD", 3);
+		byteLength += 3;
+
+		++remainingRange.location;
+		--remainingRange.length;
+	}
+
+	lua_pushlstring(L, buffer, byteLength);
+
+	if (buffer != stackBuffer)
+		free(buffer);
+}
+
+void MLCPushArray (__unsafe_unretained MLCState *state, __unsafe_unretained NSArray *array) {
+	lua_State *L = MLCStateGetLuaState(state);
+
+	// the table + each value
+	MLCGrowStack(L, 2);
+	MLCBeginStackCheck(L);
+
+	NSUInteger count = [array count];
+	lua_createtable(L, (count <= INT_MAX ? (int)count : 0), 0);
+
+	int index = 1;
+	for (id value in array) {
+		MLCPushObject(state, value);
+
+		// t[index] = value
+		lua_rawseti(L, -2, index++);
+	}
+
+	MLCEndStackCheck(L, 1);
+}
+
+void MLCPushDictionary (__unsafe_unretained MLCState *state, __unsafe_unretained NSDictionary *dictionary) {
+	lua_State *L = MLCStateGetLuaState(state);
+
+	// the table + each key and value
+	MLCGrowStack(L, 3);
+	MLCBeginStackCheck(L);
+
+	NSUInteger count = [dictionary count];
+	lua_createtable(L, 0, (count <= INT_MAX ? (int)count : 0));
+
+	for (id key in dictionary) {
+		MLCPushObject(state, key);
+
+		// NSNull and NaN cannot be keys in Lua (and lua_rawset would raise an
+		// error for NaN)
+		if (lua_isnil(L, -1) || (lua_type(L, -1) == LUA_TNUMBER && isnan(lua_tonumber(L, -1)))) {
+			lua_pop(L, 1);
+			continue;
+		}
+
+		MLCPushObject(state, [dictionary objectForKey:key]);
+
+		// the table is new, so it has no metamethods to respect
+		lua_rawset(L, -3);
+	}
+
+	MLCEndStackCheck(L, 1);
+}
+
+#pragma mark Popping
+
+id MLCPopValue (__unsafe_unretained MLCState *state) {
+	lua_State *L = MLCStateGetLuaState(state);
+	MLCBeginStackCheck(L);
+
+	id result = nil;
+
+	switch (lua_type(L, -1)) {
+	case LUA_TNIL:
+		result = [NSNull null];
+		lua_pop(L, 1);
+		break;
+
+	case LUA_TBOOLEAN:
+		result = [NSNumber numberWithBool:(BOOL)lua_toboolean(L, -1)];
+		lua_pop(L, 1);
+		break;
+
+	case LUA_TNUMBER:
+		result = [NSNumber numberWithDouble:lua_tonumber(L, -1)];
+		lua_pop(L, 1);
+		break;
+
+	case LUA_TSTRING:
+		result = MLCPopString(state);
+		break;
+
+	case LUA_TTABLE:
+		// tables convert their contents lazily
+		result = [[MLCLuaDictionary alloc] initWithValueAtStackIndex:-1 ofState:state];
+		lua_pop(L, 1);
+		break;
+
+	case LUA_TUSERDATA:
+		// this is popped for every element of a converted table, so check
+		// the metatable directly, rather than messaging +isOnStack:
+		MLCGrowStack(L, 2);
+
+		if (MLCIsNumericArray(L, -1))
+			result = [MLCNumericArray popFromStack:state];
+		else
+			result = [MLCBridgedObject popFromStack:state];
+
+		break;
+
+	case LUA_TLIGHTUSERDATA:
+		result = (__bridge id)lua_touserdata(L, -1);
+		lua_pop(L, 1);
+		break;
+
+	case LUA_TTHREAD:
+		result = [MLCTask popFromStack:state];
+		break;
+
+	case LUA_TFUNCTION:
+		result = [MLCLuaFunction popFromStack:state];
+		break;
+
+	default:
+		lua_pop(L, 1);
+	}
+
+	MLCEndStackCheck(L, -1);
+	return result;
+}
+
+id MLCGetValue (__unsafe_unretained MLCState *state, int index) {
+	lua_State *L = MLCStateGetLuaState(state);
+	MLCGrowStack(L, 1);
+
+	// duplicate the value, so that we can pop and then leave the stack in its
+	// previous state
+	lua_pushvalue(L, index);
+	return MLCPopValue(state);
+}
+
+NSString *MLCPopString (__unsafe_unretained MLCState *state) {
+	lua_State *L = MLCStateGetLuaState(state);
+
+	// long strings are bridged without copying
+	if (lua_type(L, -1) == LUA_TSTRING && lua_objlen(L, -1) >= MLCLuaStringMinimumLength) {
+		MLCLuaString *string = [[MLCLuaString alloc] initWithValueAtStackIndex:-1 ofState:state];
+
+		lua_pop(L, 1);
+		return string;
+	}
+
+	size_t length = 0;
+	const char *bytes = lua_tolstring(L, -1, &length);
+	if (!bytes) {
+		lua_pop(L, 1);
+		return nil;
+	}
+
+	NSString *string = [[NSString alloc] initWithBytes:bytes length:length encoding:NSUTF8StringEncoding];
+
+	// Lua can garbage collect a string being popped off the stack, so we wait
+	// to pop until we've created the NSString
+	lua_pop(L, 1);
+	return string;
+}
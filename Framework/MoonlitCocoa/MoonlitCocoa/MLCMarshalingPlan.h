@@ -0,0 +1,157 @@
+//
+//  MLCMarshalingPlan.h
+//  MoonlitCocoa
+//
+//  Created by agent on 17.10.26.
+//  Released into the public domain.
+//
+
+#import <Foundation/Foundation.h>
+
+@class MLCState;
+
+typedef struct MLCTypeConverter MLCTypeConverter;
+
+/**
+ * Pushes the value at \a buffer, of the type described by \a converter, onto
+ * the stack of \a state. Returns \c NO if the type is not supported, in which
+ * case \c nil is pushed instead.
+ */
+typedef BOOL (*MLCTypeConverterPushFunction)(const MLCTypeConverter *converter, __unsafe_unretained MLCState *state, const void *buffer);
+
+/**
+ * Pops the value at the top of the stack of \a state, and stores it into \a
+ * buffer as the type described by \a converter. Returns \c NO if the value
+ * could not be converted, in which case \a buffer is zeroed.
+ */
+typedef BOOL (*MLCTypeConverterPopFunction)(const MLCTypeConverter *converter, __unsafe_unretained MLCState *state, void *buffer);
+
+/**
+ * Converts values of a single Objective-C type to and from Lua.
+ *
+ * Converters are created once for each distinct type encoding, and are never
+ * destroyed, so pointers to them may be kept indefinitely.
+ */
+struct MLCTypeConverter {
+	/**
+	 * The type encoding of the values converted, without any qualifiers.
+	 */
+	const char *type;
+
+	/**
+	 * The size of a value, in bytes.
+	 */
+	NSUInteger size;
+
+	/**
+	 * The alignment of a value, in bytes.
+	 */
+	NSUInteger alignment;
+
+	MLCTypeConverterPushFunction push;
+	MLCTypeConverterPopFunction pop;
+
+	/**
+	 * For a structure, the number of fields that it contains. Otherwise,
+	 * zero.
+	 */
+	NSUInteger fieldCount;
+
+	/**
+	 * For a structure, the converter for each field.
+	 */
+	const MLCTypeConverter **fields;
+
+	/**
+	 * For a structure, the offset of each field from the start of the
+	 * structure.
+	 */
+	NSUInteger *fieldOffsets;
+
+	/**
+	 * For a structure, the key of each field in the Lua table representing it,
+	 * or \c NULL if the fields are stored in the array part of the table.
+	 */
+	const char **fieldNames;
+};
+
+/**
+ * Returns the converter for the first type in \a type, which may begin with
+ * type qualifiers.
+ *
+ * Numbers, \c BOOL, C strings, selectors, pointers, objects, and classes are
+ * supported, as well as structures made up of supported types. Structures are
+ * represented in Lua as tables. The fields of well-known structures (such as
+ * \c NSRange, \c CGPoint, \c CGSize, and \c CGRect) and structures with named
+ * fields are stored by name, and the fields of any other structure are stored
+ * in order in the array part of the table.
+ *
+ * If the type is not supported, the converter pushes \c nil and pops zero.
+ *
+ * This function is thread-safe.
+ */
+const MLCTypeConverter *MLCTypeConverterForType (const char *type);
+
+/**
+ * Describes how to marshal the arguments and return value of one method
+ * signature. Plans are created once per signature, and then reused, so that
+ * the type encodings do not need to be parsed again.
+ */
+@interface MLCMarshalingPlan : NSObject
+/**
+ * Returns a cached plan for \a signature, creating one if necessary. This
+ * method is thread-safe.
+ */
++ (MLCMarshalingPlan *)planForSignature:(NSMethodSignature *)signature;
+
+/**
+ * Initializes the receiver with a plan for \a signature.
+ */
+- (id)initWithSignature:(NSMethodSignature *)signature;
+
+/**
+ * The method signature that this plan was created for.
+ */
+@property (nonatomic, strong, readonly) NSMethodSignature *signature;
+
+/**
+ * The number of arguments in the #signature, excluding \c self and \c _cmd.
+ */
+@property (nonatomic, readonly) NSUInteger argumentCount;
+
+/**
+ * The converter for the return value of the #signature.
+ */
+@property (nonatomic, readonly) const MLCTypeConverter *returnConverter;
+
+/**
+ * The size of a buffer large enough to hold every argument (excluding \c self
+ * and \c _cmd) at the offsets returned by #offsetOfArgumentAtIndex:.
+ */
+@property (nonatomic, readonly) NSUInteger argumentFrameLength;
+
+/**
+ * Returns the converter for the argument at \a index (where zero is the first
+ * argument after \c _cmd).
+ */
+- (const MLCTypeConverter *)converterForArgumentAtIndex:(NSUInteger)index;
+
+/**
+ * Returns the offset of the argument at \a index (where zero is the first
+ * argument after \c _cmd) within a buffer of #argumentFrameLength bytes.
+ */
+- (NSUInteger)offsetOfArgumentAtIndex:(NSUInteger)index;
+
+/**
+ * Pushes every argument of \a invocation after \c _cmd onto the stack of \a
+ * state, in order.
+ */
+- (void)pushArgumentsOfInvocation:(NSInvocation *)invocation ontoState:(MLCState *)state;
+
+/**
+ * Pops a value off the stack of \a state, and sets it as the return value of
+ * \a invocation. Nothing is popped if the #signature has no return value.
+ * Returns \c NO if the value could not be converted.
+ */
+- (BOOL)popReturnValueForInvocation:(NSInvocation *)invocation fromState:(MLCState *)state;
+@end
@@ -0,0 +1,709 @@
+//
+//  MLCMarshalingPlan.m
+//  MoonlitCocoa
+//
+//  Created by agent on 17.10.26.
+//  Released into the public domain.
+//
+
+#import "MLCMarshalingPlan.h"
+#import "MLCMarshaling.h"
+#import "MLCState.h"
+#import <dispatch/dispatch.h>
+#import <lua.h>
+#import <math.h>
+#import <objc/runtime.h>
+#import <pthread.h>
+
+/**
+ * The field names of a structure which is represented in Lua as a table with
+ * named fields, even though its type encoding does not include them.
+ */
+typedef struct {
+	/**
+	 * The name of the structure, without any leading underscores.
+	 */
+	const char *name;
+
+	NSUInteger fieldCount;
+	const char *fieldNames[6];
+} MLCKnownStructure;
+
+static const MLCKnownStructure MLCKnownStructures[] = {
+	{ "NSRange", 2, { "location", "length" } },
+	{ "CGPoint", 2, { "x", "y" } },
+	{ "NSPoint", 2, { "x", "y" } },
+	{ "CGSize", 2, { "width", "height" } },
+	{ "NSSize", 2, { "width", "height" } },
+	{ "CGRect", 2, { "origin", "size" } },
+	{ "NSRect", 2, { "origin", "size" } },
+	{ "CGAffineTransform", 6, { "a", "b", "c", "d", "tx", "ty" } },
+	{ "NSEdgeInsets", 4, { "top", "left", "bottom", "right" } }
+};
+
+/**
+ * Returns \a type with any leading type qualifiers skipped.
+ */
+static const char *skipTypeQualifiers (const char *type) {
+	while (
+		*type == 'r' ||
+		*type == 'n' ||
+		*type == 'N' ||
+		*type == 'o' ||
+		*type == 'O' ||
+		*type == 'R' ||
+		*type == 'V'
+	) {
+		++type;
+	}
+
+	return type;
+}
+
+/**
+ * Returns the end of the first type in \a type, filling in its size and
+ * alignment. Returns \c NULL if the type cannot be parsed.
+ */
+static const char *getSizeAndAlignment (const char *type, NSUInteger *size, NSUInteger *alignment) {
+	@try {
+		return NSGetSizeAndAlignment(type, size, alignment);
+	} @catch (NSException *ex) {
+		return NULL;
+	}
+}
+
+/**
+ * Pops the value at the top of the stack of \a L as a number, treating
+ * booleans as zero or one.
+ */
+static lua_Number popNumber (lua_State *L) {
+	lua_Number num;
+	if (lua_isboolean(L, -1))
+		num = lua_toboolean(L, -1);
+	else
+		num = lua_tonumber(L, -1);
+
+	lua_pop(L, 1);
+	return num;
+}
+
+/**
+ * Converts \a num to a signed integer. Converting a double that is out of
+ * range of the integer type (or NaN) is undefined, so \a num is clamped to the
+ * range of \c int64_t first, and NaN becomes zero. Narrower types then take
+ * the low bits of the result.
+ */
+static int64_t integerFromNumber (lua_Number num) {
+	if (isnan(num))
+		return 0;
+
+	// the limits are powers of two, which are exact as doubles
+	if (num <= (lua_Number)INT64_MIN)
+		return INT64_MIN;
+	else if (num >= -(lua_Number)INT64_MIN)
+		return INT64_MAX;
+
+	return (int64_t)num;
+}
+
+/**
+ * Converts \a num to an unsigned integer, like integerFromNumber(), except
+ * that the full range of \c uint64_t is kept. Negative numbers wrap around,
+ * as they would when converting from a signed integer.
+ */
+static uint64_t unsignedIntegerFromNumber (lua_Number num) {
+	// 2^63, the first number outside the range of int64_t
+	const lua_Number signedLimit = -(lua_Number)INT64_MIN;
+
+	if (num >= signedLimit * 2)
+		return UINT64_MAX;
+	else if (num >= signedLimit)
+		return (uint64_t)num;
+
+	return (uint64_t)integerFromNumber(num);
+}
+
+#pragma mark Scalars
+
+// CONVERT is applied to a popped number before it is cast to TYPE, and is
+// empty for floating-point types
+#define MLCNumericConverterFunctions(NAME, TYPE, CONVERT) \
+	static BOOL push ## NAME (const MLCTypeConverter *converter, __unsafe_unretained MLCState *state, const void *buffer) { \
+		TYPE num; \
+		memcpy(&num, buffer, sizeof(num)); \
+		lua_pushnumber(state.state, (lua_Number)num); \
+		return YES; \
+	} \
+	\
+	static BOOL pop ## NAME (const MLCTypeConverter *converter, __unsafe_unretained MLCState *state, void *buffer) { \
+		TYPE num = (TYPE)CONVERT(popNumber(state.state)); \
+		memcpy(buffer, &num, sizeof(num)); \
+		return YES; \
+	}
+
+// single characters are converted as numbers because BOOL is typedef'd to
+// 'char'
+MLCNumericConverterFunctions(Char, signed char, integerFromNumber)
+MLCNumericConverterFunctions(UnsignedChar, unsigned char, unsignedIntegerFromNumber)
+MLCNumericConverterFunctions(Int, int, integerFromNumber)
+MLCNumericConverterFunctions(UnsignedInt, unsigned int, unsignedIntegerFromNumber)
+MLCNumericConverterFunctions(Short, short, integerFromNumber)
+MLCNumericConverterFunctions(UnsignedShort, unsigned short, unsignedIntegerFromNumber)
+MLCNumericConverterFunctions(Long, long, integerFromNumber)
+MLCNumericConverterFunctions(UnsignedLong, unsigned long, unsignedIntegerFromNumber)
+MLCNumericConverterFunctions(LongLong, long long, integerFromNumber)
+MLCNumericConverterFunctions(UnsignedLongLong, unsigned long long, unsignedIntegerFromNumber)
+MLCNumericConverterFunctions(Float, float, )
+MLCNumericConverterFunctions(Double, double, )
+
+#undef MLCNumericConverterFunctions
+
+static BOOL pushBool (const MLCTypeConverter *converter, __unsafe_unretained MLCState *state, const void *buffer) {
+	_Bool b;
+	memcpy(&b, buffer, sizeof(b));
+	lua_pushboolean(state.state, b);
+	return YES;
+}
+
+static BOOL popBool (const MLCTypeConverter *converter, __unsafe_unretained MLCState *state, void *buffer) {
+	_Bool b = (popNumber(state.state) != 0);
+	memcpy(buffer, &b, sizeof(b));
+	return YES;
+}
+
+static BOOL pushCString (const MLCTypeConverter *converter, __unsafe_unretained MLCState *state, const void *buffer) {
+	const char *str;
+	memcpy(&str, buffer, sizeof(str));
+	lua_pushstring(state.state, str);
+	return YES;
+}
+
+static BOOL popCString (const MLCTypeConverter *converter, __unsafe_unretained MLCState *state, void *buffer) {
+	lua_State *L = state.state;
+
+	size_t length = 0;
+	const char *str = lua_tolstring(L, -1, &length);
+
+	if (str) {
+		// create a junk NSData, added to the autorelease pool, to hold this
+		// string data (including its terminator) and automatically release it
+		__autoreleasing NSData *data = [NSData dataWithBytes:str length:length + 1];
+		str = [data bytes];
+	}
+
+	// pop the string, potentially garbage collecting it
+	lua_pop(L, 1);
+
+	memcpy(buffer, &str, sizeof(str));
+	return YES;
+}
+
+static BOOL pushSelector (const MLCTypeConverter *converter, __unsafe_unretained MLCState *state, const void *buffer) {
+	SEL selector;
+	memcpy(&selector, buffer, sizeof(selector));
+
+	if (selector)
+		lua_pushstring(state.state, sel_getName(selector));
+	else
+		lua_pushnil(state.state);
+
+	return YES;
+}
+
+static BOOL popSelector (const MLCTypeConverter *converter, __unsafe_unretained MLCState *state, void *buffer) {
+	lua_State *L = state.state;
+
+	const char *str = lua_tostring(L, -1);
+	SEL selector = (str ? sel_registerName(str) : NULL);
+
+	// pop the string, potentially garbage collecting it
+	lua_pop(L, 1);
+
+	memcpy(buffer, &selector, sizeof(selector));
+	return YES;
+}
+
+static BOOL pushObject (const MLCTypeConverter *converter, __unsafe_unretained MLCState *state, const void *buffer) {
+	__unsafe_unretained id obj;
+	memcpy(&obj, buffer, sizeof(obj));
+
+	MLCPushObject(state, obj);
+	return YES;
+}
+
+static BOOL popObject (const MLCTypeConverter *converter, __unsafe_unretained MLCState *state, void *buffer) {
+	__autoreleasing id obj = MLCPopValue(state);
+
+	__unsafe_unretained id unsafeObj = obj;
+	memcpy(buffer, &unsafeObj, sizeof(unsafeObj));
+	return YES;
+}
+
+static BOOL pushPointer (const MLCTypeConverter *converter, __unsafe_unretained MLCState *state, const void *buffer) {
+	void *ptr;
+	memcpy(&ptr, buffer, sizeof(ptr));
+	lua_pushlightuserdata(state.state, ptr);
+	return YES;
+}
+
+static BOOL popPointer (const MLCTypeConverter *converter, __unsafe_unretained MLCState *state, void *buffer) {
+	lua_State *L = state.state;
+
+	const void *ptr;
+	if (lua_type(L, -1) == LUA_TUSERDATA) {
+		// the block of a full userdata is only meaningful to the class that
+		// created it (an MLCBridgedUserdata, for instance, just refers to its
+		// object), so pass the object that it represents instead
+		__autoreleasing id obj = MLCPopValue(state);
+		ptr = (__bridge const void *)obj;
+	} else {
+		// anything other than a light userdata (such as a table) has no
+		// pointer that C could use, and becomes NULL
+		ptr = lua_touserdata(L, -1);
+		lua_pop(L, 1);
+	}
+
+	memcpy(buffer, &ptr, sizeof(ptr));
+	return YES;
+}
+
+static BOOL pushVoid (const MLCTypeConverter *converter, __unsafe_unretained MLCState *state, const void *buffer) {
+	// no value, nothing to do
+	return YES;
+}
+
+static BOOL popVoid (const MLCTypeConverter *converter, __unsafe_unretained MLCState *state, void *buffer) {
+	// no value, nothing to do
+	return YES;
+}
+
+static BOOL pushUnsupported (const MLCTypeConverter *converter, __unsafe_unretained MLCState *state, const void *buffer) {
+	NSLog(@"Unsupported argument type \"%s\", pushing nil", converter->type);
+	lua_pushnil(state.state);
+	return NO;
+}
+
+static BOOL popUnsupported (const MLCTypeConverter *converter, __unsafe_unretained MLCState *state, void *buffer) {
+	memset(buffer, 0, converter->size);
+	lua_pop(state.state, 1);
+	return NO;
+}
+
+#define MLCScalarConverter(TYPE_CHAR, TYPE_STRING, TYPE, NAME) \
+	[TYPE_CHAR] = { TYPE_STRING, sizeof(TYPE), __alignof__(TYPE), &push ## NAME, &pop ## NAME, 0, NULL, NULL, NULL }
+
+/**
+ * Converters for every type which is identified by its first character,
+ * indexed by that character. Characters without a converter have a \c NULL
+ * push function.
+ *
+ * The \c void converter pushes and pops nothing.
+ */
+static const MLCTypeConverter MLCScalarConverters[128] = {
+	MLCScalarConverter('c', "c", signed char, Char),
+	MLCScalarConverter('C', "C", unsigned char, UnsignedChar),
+	MLCScalarConverter('i', "i", int, Int),
+	MLCScalarConverter('I', "I", unsigned int, UnsignedInt),
+	MLCScalarConverter('s', "s", short, Short),
+	MLCScalarConverter('S', "S", unsigned short, UnsignedShort),
+	MLCScalarConverter('l', "l", long, Long),
+	MLCScalarConverter('L', "L", unsigned long, UnsignedLong),
+	MLCScalarConverter('q', "q", long long, LongLong),
+	MLCScalarConverter('Q', "Q", unsigned long long, UnsignedLongLong),
+	MLCScalarConverter('f', "f", float, Float),
+	MLCScalarConverter('d', "d", double, Double),
+	MLCScalarConverter('B', "B", _Bool, Bool),
+	MLCScalarConverter('*', "*", char *, CString),
+	MLCScalarConverter(':', ":", SEL, Selector),
+	MLCScalarConverter('@', "@", id, Object),
+	MLCScalarConverter('#', "#", Class, Object),
+	MLCScalarConverter('^', "^", void *, Pointer),
+	['v'] = { "v", 0, 1, &pushVoid, &popVoid, 0, NULL, NULL, NULL }
+};
+
+#undef MLCScalarConverter
+
+#pragma mark Structures
+
+static BOOL pushStruct (const MLCTypeConverter *converter, __unsafe_unretained MLCState *state, const void *buffer) {
+	lua_State *L = state.state;
+
+	// table + field
+	[state growStackBySize:2];
+
+	int namedCount = (converter->fieldNames ? (int)converter->fieldCount : 0);
+	lua_createtable(L, (int)converter->fieldCount - namedCount, namedCount);
+
+	for (NSUInteger i = 0;i < converter->fieldCount;++i) {
+		const MLCTypeConverter *field = converter->fields[i];
+		field->push(field, state, (const unsigned char *)buffer + converter->fieldOffsets[i]);
+
+		if (converter->fieldNames && converter->fieldNames[i])
+			lua_setfield(L, -2, converter->fieldNames[i]);
+		else
+			lua_rawseti(L, -2, (int)i + 1);
+	}
+
+	return YES;
+}
+
+static BOOL popStruct (const MLCTypeConverter *converter, __unsafe_unretained MLCState *state, void *buffer) {
+	lua_State *L = state.state;
+
+	if (!lua_istable(L, -1)) {
+		// a missing structure is zero, matching the treatment of missing
+		// arguments
+		BOOL isNil = lua_isnil(L, -1);
+
+		memset(buffer, 0, converter->size);
+		lua_pop(L, 1);
+		return isNil;
+	}
+
+	[state growStackBySize:1];
+
+	BOOL success = YES;
+	for (NSUInteger i = 0;i < converter->fieldCount;++i) {
+		if (converter->fieldNames && converter->fieldNames[i])
+			lua_getfield(L, -1, converter->fieldNames[i]);
+		else
+			lua_rawgeti(L, -1, (int)i + 1);
+
+		const MLCTypeConverter *field = converter->fields[i];
+		if (!field->pop(field, state, (unsigned char *)buffer + converter->fieldOffsets[i]))
+			success = NO;
+	}
+
+	lua_pop(L, 1);
+	return success;
+}
+
+/**
+ * Returns the field names to use for a structure named \a name (with \a length
+ * characters), with \a count fields, or \c NULL if the structure is not well
+ * known.
+ */
+static const char **knownFieldNames (const char *name, size_t length, NSUInteger count) {
+	while (length && *name == '_') {
+		++name;
+		--length;
+	}
+
+	size_t structureCount = sizeof(MLCKnownStructures) / sizeof(*MLCKnownStructures);
+	for (size_t i = 0;i < structureCount;++i) {
+		const MLCKnownStructure *structure = MLCKnownStructures + i;
+
+		if (structure->fieldCount == count && strlen(structure->name) == length && strncmp(structure->name, name, length) == 0)
+			return (const char **)structure->fieldNames;
+	}
+
+	return NULL;
+}
+
+/**
+ * Fills in the fields of \a converter, whose type is a structure. If any
+ * field is of an unsupported type, \a converter is left unmodified.
+ */
+static void initializeStructConverter (MLCTypeConverter *converter) {
+	const char *name = converter->type + 1;
+	const char *type = name;
+
+	while (*type && *type != '=' && *type != '}')
+		++type;
+
+	// an opaque structure, with no fields that we can see
+	if (*type != '=')
+		return;
+
+	size_t nameLength = (size_t)(type - name);
+	++type;
+
+	NSUInteger count = 0;
+	NSUInteger capacity = 4;
+	NSUInteger offset = 0;
+	BOOL hasNames = NO;
+
+	const MLCTypeConverter **fields = malloc(capacity * sizeof(*fields));
+	NSUInteger *offsets = malloc(capacity * sizeof(*offsets));
+	const char **names = malloc(capacity * sizeof(*names));
+
+	while (*type && *type != '}') {
+		const char *fieldName = NULL;
+
+		if (*type == '"') {
+			const char *start = ++type;
+			while (*type && *type != '"')
+				++type;
+
+			if (!*type)
+				goto unsupported;
+
+			fieldName = strndup(start, (size_t)(type - start));
+			hasNames = YES;
+			++type;
+		}
+
+		const MLCTypeConverter *field = MLCTypeConverterForType(type);
+		const char *next = getSizeAndAlignment(type, NULL, NULL);
+
+		if (!next || field->push == &pushUnsupported || !field->size) {
+			free((void *)fieldName);
+			goto unsupported;
+		}
+
+		if (count == capacity) {
+			capacity *= 2;
+			fields = realloc(fields, capacity * sizeof(*fields));
+			offsets = realloc(offsets, capacity * sizeof(*offsets));
+			names = realloc(names, capacity * sizeof(*names));
+		}
+
+		NSUInteger alignment = MAX(field->alignment, 1);
+		offset = (offset + alignment - 1) / alignment * alignment;
+
+		fields[count] = field;
+		offsets[count] = offset;
+		names[count] = fieldName;
+		++count;
+
+		offset += field->size;
+		type = next;
+	}
+
+	if (!count)
+		goto unsupported;
+
+	converter->fieldCount = count;
+	converter->fields = fields;
+	converter->fieldOffsets = offsets;
+
+	if (hasNames) {
+		converter->fieldNames = names;
+	} else {
+		free(names);
+		converter->fieldNames = knownFieldNames(name, nameLength, count);
+	}
+
+	converter->push = &pushStruct;
+	converter->pop = &popStruct;
+	return;
+
+unsupported:
+	for (NSUInteger i = 0;i < count;++i) {
+		free((void *)names[i]);
+	}
+
+	free(fields);
+	free(offsets);
+	free(names);
+}
+
+#pragma mark Converter cache
+
+/**
+ * Maps type encodings (as C strings) to the converters created for them, for
+ * any type not in #MLCScalarConverters.
+ */
+static NSMapTable *MLCTypeConverterCache = nil;
+
+/**
+ * A recursive mutex protecting #MLCTypeConverterCache. This is held while
+ * creating a converter, which may look up converters for its fields.
+ */
+static pthread_mutex_t MLCTypeConverterCacheMutex;
+
+const MLCTypeConverter *MLCTypeConverterForType (const char *type) {
+	type = skipTypeQualifiers(type);
+
+	unsigned char typeChar = (unsigned char)*type;
+	if (typeChar < 128 && MLCScalarConverters[typeChar].push)
+		return MLCScalarConverters + typeChar;
+
+	static dispatch_once_t pred;
+	dispatch_once(&pred, ^{
+		pthread_mutexattr_t attributes;
+		pthread_mutexattr_init(&attributes);
+		pthread_mutexattr_settype(&attributes, PTHREAD_MUTEX_RECURSIVE);
+		pthread_mutex_init(&MLCTypeConverterCacheMutex, &attributes);
+		pthread_mutexattr_destroy(&attributes);
+
+		MLCTypeConverterCache = [[NSMapTable alloc]
+			initWithKeyOptions:NSPointerFunctionsOpaqueMemory | NSPointerFunctionsCStringPersonality
+			valueOptions:NSPointerFunctionsOpaqueMemory | NSPointerFunctionsOpaquePersonality
+			capacity:0
+		];
+	});
+
+	NSUInteger size = 0;
+	NSUInteger alignment = 0;
+
+	const char *end = getSizeAndAlignment(type, &size, &alignment);
+	if (!end)
+		end = type + strlen(type);
+
+	size_t length = (size_t)(end - type);
+	char key[length + 1];
+
+	memcpy(key, type, length);
+	key[length] = '\0';
+
+	pthread_mutex_lock(&MLCTypeConverterCacheMutex);
+
+	MLCTypeConverter *converter = NSMapGet(MLCTypeConverterCache, key);
+	if (!converter) {
+		converter = calloc(1, sizeof(*converter));
+		converter->type = strdup(key);
+		converter->size = size;
+		converter->alignment = alignment;
+		converter->push = &pushUnsupported;
+		converter->pop = &popUnsupported;
+
+		if (*key == '{' && size)
+			initializeStructConverter(converter);
+
+		NSMapInsert(MLCTypeConverterCache, converter->type, converter);
+	}
+
+	pthread_mutex_unlock(&MLCTypeConverterCacheMutex);
+
+	return converter;
+}
+
+#pragma mark Marshaling plans
+
+@interface MLCMarshalingPlan () {
+	const MLCTypeConverter **m_argumentConverters;
+	NSUInteger *m_argumentOffsets;
+}
+
+@property (nonatomic, strong, readwrite) NSMethodSignature *signature;
+@property (nonatomic, readwrite) NSUInteger argumentCount;
+@property (nonatomic, readwrite) const MLCTypeConverter *returnConverter;
+@property (nonatomic, readwrite) NSUInteger argumentFrameLength;
+@end
+
+@implementation MLCMarshalingPlan
+@synthesize signature = m_signature;
+@synthesize argumentCount = m_argumentCount;
+@synthesize returnConverter = m_returnConverter;
+@synthesize argumentFrameLength = m_argumentFrameLength;
+
++ (MLCMarshalingPlan *)planForSignature:(NSMethodSignature *)signature; {
+	static NSMapTable *plans = nil;
+	static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+	static dispatch_once_t pred;
+
+	dispatch_once(&pred, ^{
+		// signatures are compared by their type encodings, since the same
+		// signature may be represented by many objects
+		plans = [[NSMapTable alloc]
+			initWithKeyOptions:NSPointerFunctionsStrongMemory | NSPointerFunctionsObjectPersonality
+			valueOptions:NSPointerFunctionsStrongMemory | NSPointerFunctionsObjectPersonality
+			capacity:0
+		];
+	});
+
+	pthread_mutex_lock(&mutex);
+	MLCMarshalingPlan *plan = [plans objectForKey:signature];
+	pthread_mutex_unlock(&mutex);
+
+	if (plan)
+		return plan;
+
+	plan = [[self alloc] initWithSignature:signature];
+
+	pthread_mutex_lock(&mutex);
+
+	MLCMarshalingPlan *existingPlan = [plans objectForKey:signature];
+	if (existingPlan)
+		plan = existingPlan;
+	else
+		[plans setObject:plan forKey:signature];
+
+	pthread_mutex_unlock(&mutex);
+
+	return plan;
+}
+
+- (id)initWithSignature:(NSMethodSignature *)signature; {
+	self = [super init];
+	if (!self)
+		return nil;
+
+	self.signature = signature;
+	self.returnConverter = MLCTypeConverterForType([signature methodReturnType]);
+
+	NSUInteger count = [signature numberOfArguments];
+	self.argumentCount = (count > 2 ? count - 2 : 0);
+
+	if (self.argumentCount) {
+		m_argumentConverters = calloc(self.argumentCount, sizeof(*m_argumentConverters));
+		m_argumentOffsets = calloc(self.argumentCount, sizeof(*m_argumentOffsets));
+	}
+
+	NSUInteger frameLength = 0;
+
+	for (NSUInteger i = 0;i < self.argumentCount;++i) {
+		const MLCTypeConverter *converter = MLCTypeConverterForType([signature getArgumentTypeAtIndex:i + 2]);
+
+		NSUInteger alignment = MAX(converter->alignment, 1);
+		frameLength = (frameLength + alignment - 1) / alignment * alignment;
+
+		m_argumentConverters[i] = converter;
+		m_argumentOffsets[i] = frameLength;
+
+		frameLength += converter->size;
+	}
+
+	self.argumentFrameLength = frameLength;
+	return self;
+}
+
+- (void)dealloc {
+	free(m_argumentConverters);
+	free(m_argumentOffsets);
+}
+
+- (const MLCTypeConverter *)converterForArgumentAtIndex:(NSUInteger)index; {
+	NSParameterAssert(index < self.argumentCount);
+	return m_argumentConverters[index];
+}
+
+- (NSUInteger)offsetOfArgumentAtIndex:(NSUInteger)index; {
+	NSParameterAssert(index < self.argumentCount);
+	return m_argumentOffsets[index];
+}
+
+- (void)pushArgumentsOfInvocation:(NSInvocation *)invocation ontoState:(MLCState *)state; {
+	NSUInteger count = self.argumentCount;
+	if (!count)
+		return;
+
+	[state growStackBySize:(int)count];
+
+	unsigned char frame[m_argumentFrameLength ? m_argumentFrameLength : 1];
+
+	for (NSUInteger i = 0;i < count;++i) {
+		const MLCTypeConverter *converter = m_argumentConverters[i];
+		unsigned char *buffer = frame + m_argumentOffsets[i];
+
+		[invocation getArgument:buffer atIndex:(NSInteger)i + 2];
+		converter->push(converter, state, buffer);
+	}
+}
+
+- (BOOL)popReturnValueForInvocation:(NSInvocation *)invocation fromState:(MLCState *)state; {
+	NSUInteger returnLength = [self.signature methodReturnLength];
+	if (!returnLength)
+		return YES;
+
+	const MLCTypeConverter *converter = self.returnConverter;
+	unsigned char buffer[MAX(returnLength, converter->size)];
+
+	BOOL success = converter->pop(converter, state, buffer);
+	[invocation setReturnValue:buffer];
+
+	return success;
+}
+
+@end
@@ -14,6 +14,12 @@
  * An abstract class representing an immutable model object bridged into Lua.
  * This class can be subclassed to get standard model object behaviors and Lua
  * bridging with minimal boilerplate.
+ *
+ * Subclasses may declare initializers of the form \c initWithKey:otherKey:...,
+ * accepting any number of objects, without implementing them. Each argument is
+ * validated and set on the corresponding property, as if it had been passed to
+ * #initWithDictionary:. If a subclass overrides #initWithDictionary:, the
+ * arguments are passed through it.
  */
 @lua_bridged(MLCModel, MLCBridgedObject, NSCoding, NSCopying)
 /**
@@ -33,11 +39,25 @@
  */
 - (NSDictionary *)dictionaryValue;
 
+/**
+ * Whether instances of the receiver should remember their hash after it has
+ * been calculated once. Because model objects are immutable, this is safe for
+ * any subclass whose #keysForValuesAffectingEquality only refer to immutable
+ * values.
+ *
+ * The default implementation returns \c NO. Subclasses may override this
+ * method to return \c YES.
+ */
++ (BOOL)cachesHash;
+
 /**
  * If the Lua metatable for the receiver has a key named \c hash, this method
  * returns that value (or the value returned by that function). Otherwise, this
  * returns a hash calculated from all of the values at
  * #keysForValuesAffectingEquality.
+ *
+ * @note The getters for each key are looked up once per class, and then
+ * invoked directly, without creating any intermediate collections.
  */
 - (NSUInteger)hash;
 
@@ -60,6 +80,11 @@
  * @note Because the implementation of \c -hash depends on the algorithm for
  * determining equality, the object's hash is also determined using the
  * specified key paths.
+ *
+ * @note The getters for the declared properties of the class are looked up
+ * once per class. If a subclass or its Lua implementation overrides this
+ * method, it is consulted for every comparison, and any key paths which are
+ * not declared properties are read using key-value coding.
  */
 - (NSSet *)keysForValuesAffectingEquality;
 @end
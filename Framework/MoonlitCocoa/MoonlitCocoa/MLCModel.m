@@ -7,10 +7,404 @@
 //
 
 #import "MLCModel.h"
+#import "MLCModelProperty.h"
 #import "MLCState.h"
+#import "NSArray+LuaAdditions.h"
 #import <lauxlib.h>
 #import <objc/runtime.h>
 
+static char * const MLCModelAssociatedEqualityPlanKey = "AssociatedEqualityPlan";
+static char * const MLCModelAssociatedPropertiesKey = "AssociatedProperties";
+static char * const MLCModelAssociatedPropertyNamesKey = "AssociatedPropertyNames";
+static char * const MLCModelAssociatedInitializersKey = "AssociatedInitializers";
+static char * const MLCModelAssociatedUndeclaredPropertiesKey = "AssociatedUndeclaredProperties";
+
+/**
+ * The maximum number of undeclared keys whose #MLCModelProperty is cached for
+ * each class. Keys usually come from a fixed schema, but a class initialized
+ * from arbitrary dictionaries shouldn't grow its cache without bound.
+ */
+#define MLCModelUndeclaredPropertyCacheLimit 256
+
+/**
+ * Describes how to read one of the values affecting equality from a model
+ * object.
+ */
+typedef struct {
+	/**
+	 * The getter to invoke directly, or \c NULL if the value must be obtained
+	 * using key-value coding.
+	 */
+	SEL getter;
+
+	/**
+	 * The implementation of #getter in the class for which the plan was
+	 * created. Instances of any other class may override the getter, so this
+	 * is only used for instances of exactly that class.
+	 */
+	IMP implementation;
+
+	/**
+	 * The type encoding of the value, with qualifiers removed. If #getter is \c
+	 * NULL, this is always an object.
+	 */
+	char type;
+
+	/**
+	 * The key path of the value, for use with key-value coding. This string is
+	 * retained by the #MLCModelEqualityPlan.
+	 */
+	__unsafe_unretained NSString *keyPath;
+} MLCEqualityKey;
+
+/**
+ * Holds a scalar value read from a model object.
+ */
+typedef union {
+	long long signedValue;
+	unsigned long long unsignedValue;
+	double floatingValue;
+} MLCEqualityScalar;
+
+/**
+ * Returns the implementation of the getter described by \a key for \a model,
+ * where \a cls is the class that the key was created for.
+ */
+static IMP equalityImplementation (MLCModel *model, const MLCEqualityKey *key, Class cls) {
+	Class modelClass = object_getClass(model);
+	if (modelClass == cls)
+		return key->implementation;
+
+	// a subclass (or an isa-swizzled instance) may override the getter
+	return class_getMethodImplementation(modelClass, key->getter);
+}
+
+/**
+ * Returns the object value described by \a key on \a model, where \a cls is
+ * the class that the key was created for.
+ */
+static id equalityObjectValue (MLCModel *model, const MLCEqualityKey *key, Class cls) {
+	if (key->getter)
+		return ((id (*)(id, SEL))equalityImplementation(model, key, cls))(model, key->getter);
+	else
+		return [model valueForKeyPath:key->keyPath];
+}
+
+/**
+ * Returns the scalar value described by \a key on \a model, where \a cls is
+ * the class that the key was created for. \a key must have a getter with a
+ * scalar return type.
+ */
+static MLCEqualityScalar equalityScalarValue (MLCModel *model, const MLCEqualityKey *key, Class cls) {
+	MLCEqualityScalar value = { 0 };
+	IMP implementation = equalityImplementation(model, key, cls);
+
+	#define readScalar(TYPE, FIELD) \
+		value.FIELD = ((TYPE (*)(id, SEL))implementation)(model, key->getter)
+
+	switch (key->type) {
+	case 'c': readScalar(signed char, signedValue); break;
+	case 's': readScalar(short, signedValue); break;
+	case 'i': readScalar(int, signedValue); break;
+	case 'l': readScalar(long, signedValue); break;
+	case 'q': readScalar(long long, signedValue); break;
+	case 'C': readScalar(unsigned char, unsignedValue); break;
+	case 'S': readScalar(unsigned short, unsignedValue); break;
+	case 'I': readScalar(unsigned int, unsignedValue); break;
+	case 'L': readScalar(unsigned long, unsignedValue); break;
+	case 'Q': readScalar(unsigned long long, unsignedValue); break;
+	case 'B': readScalar(_Bool, unsignedValue); break;
+	case 'f': readScalar(float, floatingValue); break;
+	case 'd': readScalar(double, floatingValue); break;
+	}
+
+	#undef readScalar
+
+	return value;
+}
+
+/**
+ * Returns whether the given type encoding is a scalar type supported by
+ * #equalityScalarValue.
+ */
+static BOOL isEqualityScalarType (char type) {
+	return strchr("csilqCSILQBfd", type) != NULL;
+}
+
+/**
+ * Describes how to compare and hash instances of a specific #MLCModel
+ * subclass. Plans are created once per class, and then reused for every
+ * comparison.
+ */
+@interface MLCModelEqualityPlan : NSObject {
+	MLCEqualityKey *m_keys;
+	NSUInteger m_keyCount;
+
+	/**
+	 * The class whose getter implementations are cached in #m_keys.
+	 */
+	__unsafe_unretained Class m_modelClass;
+}
+
+/**
+ * Initializes the receiver with a plan for comparing instances of \a cls,
+ * with a key for each of its declared properties.
+ */
+- (id)initWithClass:(Class)cls;
+
+/**
+ * Whether the class (or its Lua implementation) overrides
+ * #keysForValuesAffectingEquality, in which case each model is asked for its
+ * key paths, and they are looked up in #keyIndexes. Otherwise, every declared
+ * property is compared.
+ */
+@property (nonatomic, readonly) BOOL usesModelKeyPaths;
+
+/**
+ * Whether the Lua implementation of the class provides \c hash.
+ */
+@property (nonatomic, readonly) BOOL usesLuaHash;
+
+/**
+ * Whether the Lua implementation of the class provides \c isEqual:.
+ */
+@property (nonatomic, readonly) BOOL usesLuaIsEqual;
+
+/**
+ * Combines the hashes of all of the values affecting equality on \a model.
+ */
+- (NSUInteger)hashOfModel:(MLCModel *)model;
+
+/**
+ * Compares all of the values affecting equality on \a model and \a other.
+ */
+- (BOOL)isModel:(MLCModel *)model equalToModel:(MLCModel *)other;
+@end
+
+@interface MLCModelEqualityPlan ()
+@property (nonatomic, readwrite) BOOL usesLuaHash;
+@property (nonatomic, readwrite) BOOL usesLuaIsEqual;
+@property (nonatomic, readwrite) BOOL usesModelKeyPaths;
+
+/**
+ * Retains the key paths referenced by each #MLCEqualityKey.
+ */
+@property (nonatomic, copy) NSArray *keyPaths;
+
+/**
+ * Maps each of #keyPaths to the index of its #MLCEqualityKey, as an \c
+ * NSNumber.
+ */
+@property (nonatomic, copy) NSDictionary *keyIndexes;
+
+/**
+ * Returns the hash of the value described by \a key on \a model.
+ */
+- (NSUInteger)hashOfKey:(const MLCEqualityKey *)key onModel:(MLCModel *)model;
+
+/**
+ * Returns whether the values described by \a key on \a model and \a other are
+ * equal.
+ */
+- (BOOL)isKey:(const MLCEqualityKey *)key onModel:(MLCModel *)model equalToModel:(MLCModel *)other;
+
+/**
+ * Invokes \a block with an #MLCEqualityKey for each key path returned by
+ * #keysForValuesAffectingEquality on \a model. Key paths which are not
+ * declared properties are described by a temporary key, which reads the value
+ * using key-value coding. Returns \c NO if \a block returns \c NO, and stops
+ * enumerating.
+ */
+- (BOOL)enumerateKeysOfModel:(MLCModel *)model usingBlock:(BOOL (^)(const MLCEqualityKey *key))block;
+@end
+
+@implementation MLCModelEqualityPlan
+@synthesize usesLuaHash = m_usesLuaHash;
+@synthesize usesLuaIsEqual = m_usesLuaIsEqual;
+@synthesize usesModelKeyPaths = m_usesModelKeyPaths;
+@synthesize keyPaths = m_keyPaths;
+@synthesize keyIndexes = m_keyIndexes;
+
+- (id)initWithClass:(Class)cls; {
+	self = [super init];
+	if (!self)
+		return nil;
+
+	m_modelClass = cls;
+
+	self.usesLuaHash = [cls metatableHasValueForKey:@"hash"];
+	self.usesLuaIsEqual = [cls metatableHasValueForKey:@"isEqual:"];
+
+	SEL keysSelector = @selector(keysForValuesAffectingEquality);
+	IMP keysImplementation = class_getMethodImplementation(cls, keysSelector);
+
+	self.usesModelKeyPaths = [cls metatableHasValueForKey:NSStringFromSelector(keysSelector)] || keysImplementation != class_getMethodImplementation([MLCModel class], keysSelector);
+
+	// the keys are the same for every instance, so they come from the class,
+	// rather than from whichever instance happens to be compared first
+	self.keyPaths = [[cls modelPropertyNames] allObjects];
+
+	m_keyCount = [self.keyPaths count];
+	m_keys = calloc(m_keyCount ?: 1, sizeof(*m_keys));
+
+	NSMutableDictionary *keyIndexes = [[NSMutableDictionary alloc] initWithCapacity:m_keyCount];
+
+	[self.keyPaths enumerateObjectsUsingBlock:^(NSString *keyPath, NSUInteger index, BOOL *stop){
+		MLCEqualityKey *key = m_keys + index;
+		key->keyPath = keyPath;
+		key->type = '@';
+
+		[keyIndexes setObject:[NSNumber numberWithUnsignedInteger:index] forKey:keyPath];
+
+		SEL getter = NSSelectorFromString(keyPath);
+
+		objc_property_t property = class_getProperty(cls, [keyPath UTF8String]);
+		if (property) {
+			char *customGetter = property_copyAttributeValue(property, "G");
+			if (customGetter) {
+				getter = sel_registerName(customGetter);
+				free(customGetter);
+			}
+		}
+
+		Method method = class_getInstanceMethod(cls, getter);
+		if (!method)
+			return;
+
+		char returnType[16];
+		method_getReturnType(method, returnType, sizeof(returnType));
+
+		// skip any type qualifiers
+		const char *type = returnType + strspn(returnType, "rnNoORV");
+		if (*type != '@' && !isEqualityScalarType(*type))
+			return;
+
+		key->getter = getter;
+		key->implementation = method_getImplementation(method);
+		key->type = *type;
+	}];
+
+	self.keyIndexes = keyIndexes;
+	return self;
+}
+
+- (void)dealloc {
+	free(m_keys);
+	m_keys = NULL;
+}
+
+- (NSUInteger)hashOfKey:(const MLCEqualityKey *)key onModel:(MLCModel *)model; {
+	if (key->type == '@')
+		return [equalityObjectValue(model, key, m_modelClass) hash];
+
+	MLCEqualityScalar value = equalityScalarValue(model, key, m_modelClass);
+
+	if (key->type == 'f' || key->type == 'd') {
+		// zero and negative zero compare equal, so must hash the same
+		if (value.floatingValue == 0)
+			return 0;
+	}
+
+	return (NSUInteger)value.unsignedValue;
+}
+
+- (BOOL)isKey:(const MLCEqualityKey *)key onModel:(MLCModel *)model equalToModel:(MLCModel *)other; {
+	if (key->type == '@') {
+		id value = equalityObjectValue(model, key, m_modelClass);
+		id otherValue = equalityObjectValue(other, key, m_modelClass);
+
+		return value == otherValue || [value isEqual:otherValue];
+	}
+
+	MLCEqualityScalar value = equalityScalarValue(model, key, m_modelClass);
+	MLCEqualityScalar otherValue = equalityScalarValue(other, key, m_modelClass);
+
+	if (key->type == 'f' || key->type == 'd')
+		return value.floatingValue == otherValue.floatingValue;
+	else
+		return value.unsignedValue == otherValue.unsignedValue;
+}
+
+- (BOOL)enumerateKeysOfModel:(MLCModel *)model usingBlock:(BOOL (^)(const MLCEqualityKey *key))block; {
+	NSDictionary *keyIndexes = self.keyIndexes;
+
+	for (NSString *keyPath in [model keysForValuesAffectingEquality]) {
+		NSNumber *index = [keyIndexes objectForKey:keyPath];
+
+		if (index) {
+			if (!block(m_keys + [index unsignedIntegerValue]))
+				return NO;
+		} else {
+			MLCEqualityKey key = { .getter = NULL, .implementation = NULL, .type = '@', .keyPath = keyPath };
+			if (!block(&key))
+				return NO;
+		}
+	}
+
+	return YES;
+}
+
+- (NSUInteger)hashOfModel:(MLCModel *)model; {
+	if (!self.usesModelKeyPaths) {
+		NSUInteger hash = 0;
+
+		for (NSUInteger i = 0;i < m_keyCount;++i) {
+			hash = hash * 31 + [self hashOfKey:m_keys + i onModel:model];
+		}
+
+		return hash;
+	}
+
+	// the key paths come from a set, whose order may differ between equal
+	// models, so their hashes are combined without regard to order
+	__block NSUInteger hash = 0;
+
+	[self enumerateKeysOfModel:model usingBlock:^ BOOL (const MLCEqualityKey *key){
+		NSUInteger valueHash = [self hashOfKey:key onModel:model];
+		hash += valueHash ^ (valueHash >> 16) ^ [key->keyPath hash];
+		return YES;
+	}];
+
+	return hash;
+}
+
+- (BOOL)isModel:(MLCModel *)model equalToModel:(MLCModel *)other; {
+	if (!self.usesModelKeyPaths) {
+		for (NSUInteger i = 0;i < m_keyCount;++i) {
+			if (![self isKey:m_keys + i onModel:model equalToModel:other])
+				return NO;
+		}
+
+		return YES;
+	}
+
+	return [self enumerateKeysOfModel:model usingBlock:^ BOOL (const MLCEqualityKey *key){
+		return [self isKey:key onModel:model equalToModel:other];
+	}];
+}
+
+@end
+
+/**
+ * Returns the type encoding for a generated initializer accepting \a count
+ * objects.
+ */
+static NSString *initializerTypeEncoding (NSUInteger count) {
+	NSMutableString *typeEncoding = [[NSMutableString alloc] init];
+
+	// id impl (id self, SEL _cmd, ...)
+	[typeEncoding appendFormat:@"%s%s%s", @encode(id), @encode(id), @encode(SEL)];
+
+	// add each 'id' argument to the type encoding
+	for (NSUInteger i = 0;i < count;++i) {
+		[typeEncoding appendFormat:@"%s", @encode(id)];
+	}
+
+	return typeEncoding;
+}
+
+@class MLCModelInitializer;
+
 @interface MLCModel ()
 /**
  * Enumerates all the properties of the receiver and any superclasses, up until
@@ -19,19 +413,197 @@
 + (void)enumeratePropertiesUsingBlock:(void (^)(objc_property_t property))block;
 
 /**
- * Returns an array containing the names of all the model properties of the
+ * Returns a dictionary containing an #MLCModelProperty for each of the model
+ * properties of the receiver and any superclasses, up until the MLCModel
+ * class, keyed by property name. The dictionary is created only once per
+ * class.
+ */
++ (NSDictionary *)modelPropertiesByName;
+
+/**
+ * Returns a set containing the names of all the model properties of the
  * receiver and any superclasses, up until the MLCModel class.
  */
 + (NSSet *)modelPropertyNames;
 
 /**
- * Returns a dictionary containing the values on the receiver that are
- * associated with each of the #keysForValuesAffectingEquality.
+ * Returns an #MLCModelProperty for \a key, which is not a declared property of
+ * the receiver, so its value must be set with key-value coding. These are
+ * cached per class, like #modelPropertiesByName.
  */
-- (NSDictionary *)dictionaryWithValuesAffectingEquality;
++ (MLCModelProperty *)modelPropertyForUndeclaredKey:(NSString *)key;
+
+/**
+ * Returns the initializer used to perform \a selector on instances of the
+ * receiver, or \c nil if \a selector does not name an initializer that can be
+ * generated.
+ */
++ (MLCModelInitializer *)initializerForSelector:(SEL)selector;
+
+/**
+ * Returns the plan used to compare and hash instances of the receiver,
+ * creating it if necessary.
+ */
++ (MLCModelEqualityPlan *)equalityPlan;
+@end
+
+/**
+ * Describes how to perform an \c initWith... method generated by #MLCModel on
+ * instances of a specific subclass. Initializers are created once per class
+ * and selector, and then reused for every instance.
+ */
+@interface MLCModelInitializer : NSObject
+/**
+ * Initializes the receiver with a description of \a selector on instances of
+ * \a cls. Returns \c nil if \a selector is not of the form \c
+ * initWithKey:otherKey:...
+ */
+- (id)initWithClass:(Class)cls selector:(SEL)selector;
+
+/**
+ * The #MLCModelProperty set by each argument of the initializer, in order.
+ */
+@property (nonatomic, copy, readonly) NSArray *properties;
+
+/**
+ * Whether the class overrides \c -initWithDictionary:, in which case the
+ * arguments have to be passed through it rather than set directly.
+ */
+@property (nonatomic, readonly) BOOL usesDictionary;
+
+/**
+ * Initializes \a model using \a arguments, which must contain one object for
+ * each of the #properties, and returns the initialized object.
+ */
+- (id)model:(id)model initializedWithArguments:(__unsafe_unretained id *)arguments;
+@end
+
+@interface MLCModelInitializer ()
+@property (nonatomic, copy, readwrite) NSArray *properties;
+@property (nonatomic, readwrite) BOOL usesDictionary;
 @end
 
-@implementation MLCModel
+@implementation MLCModelInitializer
+@synthesize properties = m_properties;
+@synthesize usesDictionary = m_usesDictionary;
+
+- (id)initWithClass:(Class)cls selector:(SEL)selector; {
+	self = [super init];
+	if (!self)
+		return nil;
+
+	NSString *name = NSStringFromSelector(selector);
+	NSRange range = [name rangeOfString:@":" options:NSLiteralSearch];
+
+	// if the name doesn't match a standard init method, or there's no colon
+	// (meaning no argument), or the colon immediately follows "initWith",
+	// we can't build this
+	if (![name hasPrefix:@"initWith"] || range.location == NSNotFound || range.location == 8)
+		return nil;
+
+	NSMutableString *firstPropertyName = [[NSMutableString alloc] init];
+	
+	// grab the letter after 'initWith' and lowercase it
+	[firstPropertyName appendString:[[name substringWithRange:NSMakeRange(8, 1)] lowercaseString]];
+	
+	// append the rest, up to the first colon
+	[firstPropertyName appendString:[name substringWithRange:NSMakeRange(9, range.location - 9)]];
+
+	NSAssert([firstPropertyName length] > 0, @"name of first initializer argument should have a non-zero length");
+	
+	NSMutableArray *initializerPropertyNames = [[NSMutableArray alloc] init];
+	[initializerPropertyNames addObject:firstPropertyName];
+
+	// if the colon wasn't the last character in the initializer name, there
+	// are must be properties named
+	if (range.location < [name length] - 1) {
+		NSArray *otherPropertyNames = [[name substringFromIndex:range.location + 1] componentsSeparatedByString:@":"];
+		NSAssert([otherPropertyNames count] > 0, @"should be at least one other initializer argument if the first colon wasn't the last character in the method name");
+
+		[initializerPropertyNames addObjectsFromArray:otherPropertyNames];
+
+		NSAssert([[initializerPropertyNames lastObject] isEqualToString:@""], @"last colon-separated component of a method name with arguments should be an empty string");
+		[initializerPropertyNames removeLastObject];
+	}
+
+	NSDictionary *declaredProperties = [cls modelPropertiesByName];
+	NSMutableArray *properties = [[NSMutableArray alloc] initWithCapacity:[initializerPropertyNames count]];
+
+	for (NSString *key in initializerPropertyNames) {
+		MLCModelProperty *property = [declaredProperties objectForKey:key];
+		if (!property)
+			property = [cls modelPropertyForUndeclaredKey:key];
+
+		[properties addObject:property];
+	}
+
+	self.properties = properties;
+
+	IMP dictionaryInitializer = class_getMethodImplementation(cls, @selector(initWithDictionary:));
+	self.usesDictionary = (dictionaryInitializer != class_getMethodImplementation([MLCModel class], @selector(initWithDictionary:)));
+
+	return self;
+}
+
+- (id)model:(id)model initializedWithArguments:(__unsafe_unretained id *)arguments; {
+	NSArray *properties = self.properties;
+	NSUInteger count = [properties count];
+
+	if (self.usesDictionary) {
+		// a subclass may perform additional validation in -initWithDictionary:,
+		// so it must see every argument
+		__unsafe_unretained id keys[count];
+		__unsafe_unretained id values[count];
+
+		for (NSUInteger i = 0;i < count;++i) {
+			keys[i] = [[properties objectAtIndex:i] name];
+			values[i] = arguments[i] ?: [NSNull null];
+		}
+
+		NSDictionary *dict = [[NSDictionary alloc] initWithObjects:values forKeys:keys count:count];
+		return [model initWithDictionary:dict];
+	}
+
+	model = [model initWithDictionary:nil];
+	if (!model)
+		return nil;
+
+	for (NSUInteger i = 0;i < count;++i) {
+		MLCModelProperty *property = [properties objectAtIndex:i];
+		if (![property setValue:arguments[i] onModel:model])
+			return nil;
+	}
+
+	return model;
+}
+
+@end
+
+/**
+ * Performs \a initializer, which was created for \a cls and \a selector, on \a
+ * model with the given arguments.
+ */
+static id invokeInitializer (Class cls, MLCModelInitializer *initializer, SEL selector, id model, __unsafe_unretained id *arguments) {
+	// a subclass may declare its own properties and setters, so it needs its
+	// own initializer
+	Class modelClass = object_getClass(model);
+	if (modelClass != cls)
+		initializer = [modelClass initializerForSelector:selector];
+
+	return [initializer model:model initializedWithArguments:arguments];
+}
+
+@implementation MLCModel {
+	/**
+	 * The hash of the receiver, or zero if it has not been calculated and
+	 * cached yet.
+	 */
+	NSUInteger m_cachedHash;
+}
+
++ (BOOL)cachesHash; {
+	return NO;
+}
 
 - (id)init {
 	return [self initWithDictionary:[NSDictionary dictionary]];
@@ -41,30 +613,29 @@
 	self = [super init];
 	if (!self)
 		return nil;
+
+	if (![dict count])
+		return self;
+
+	NSDictionary *properties = [[self class] modelPropertiesByName];
+	NSNull *null = [NSNull null];
 	
 	for (NSString *key in dict) {
 		id value = [dict objectForKey:key];
 
 		// match the convention used by -setValuesForKeysWithDictionary:
-		if ([value isEqual:[NSNull null]])
+		if (value == null)
 			value = nil;
 
-		NSError *error = nil;
-		BOOL success = NO;
-
-		@try {
-			success = [self validateValue:&value forKey:key error:&error];
-		} @catch (NSException *ex) {
-			NSLog(@"Exception thrown during validation for key \"%@\" when initializing instance of %@: %@", key, [self class], ex);
-			return nil;
+		MLCModelProperty *property = [properties objectForKey:key];
+		if (!property) {
+			// not a declared property, so this will be validated and set
+			// entirely with key-value coding
+			property = [[self class] modelPropertyForUndeclaredKey:key];
 		}
 
-		if (!success) {
-			NSLog(@"Validation failed for key \"%@\" when initializing instance of %@: %@", key, [self class], error);
+		if (![property setValue:value onModel:self])
 			return nil;
-		}
-
-		[self setValue:value forKey:key];
 	}
 
 	return self;
@@ -84,7 +655,13 @@
 
 		// only accept dictionaries, since any other type is not a Lua table
 		if ([value isKindOfClass:[NSDictionary class]]) {
-			keyPaths = value;
+			// the table should be a list of key paths, but fall back to using
+			// its keys if it has no array part
+			NSArray *list = [NSArray arrayWithLuaDictionary:value];
+			if ([list count])
+				keyPaths = [NSSet setWithArray:list];
+			else
+				keyPaths = [NSSet setWithArray:[value allKeys]];
 		}
 	}
 
@@ -96,9 +673,30 @@
 	return keyPaths;
 }
 
-- (NSDictionary *)dictionaryWithValuesAffectingEquality; {
-	NSSet *equalityKeyPaths = [self keysForValuesAffectingEquality];
-	return [self dictionaryWithValuesForKeys:[equalityKeyPaths allObjects]];
++ (MLCModelEqualityPlan *)equalityPlan; {
+	MLCModelEqualityPlan *plan = objc_getAssociatedObject(self, MLCModelAssociatedEqualityPlanKey);
+	if (plan)
+		return plan;
+
+	plan = [[MLCModelEqualityPlan alloc] initWithClass:self];
+
+	@synchronized (self) {
+		MLCModelEqualityPlan *existingPlan = objc_getAssociatedObject(self, MLCModelAssociatedEqualityPlanKey);
+		if (existingPlan)
+			return existingPlan;
+
+		objc_setAssociatedObject(self, MLCModelAssociatedEqualityPlanKey, plan, OBJC_ASSOCIATION_RETAIN);
+	}
+
+	return plan;
+}
+
++ (void)invalidateMetatableCaches; {
+	[super invalidateMetatableCaches];
+
+	@synchronized (self) {
+		objc_setAssociatedObject(self, MLCModelAssociatedEqualityPlanKey, nil, OBJC_ASSOCIATION_RETAIN);
+	}
 }
 
 #pragma mark Magic
@@ -119,78 +717,128 @@
 	}
 }
 
-+ (NSSet *)modelPropertyNames; {
-	NSMutableSet *names = [[NSMutableSet alloc] init];
++ (NSDictionary *)modelPropertiesByName; {
+	NSDictionary *properties = objc_getAssociatedObject(self, MLCModelAssociatedPropertiesKey);
+	if (properties)
+		return properties;
+
+	NSMutableDictionary *newProperties = [[NSMutableDictionary alloc] init];
 
 	[self enumeratePropertiesUsingBlock:^(objc_property_t property){
-		const char *cName = property_getName(property);
-		NSString *str = [[NSString alloc] initWithUTF8String:cName];
+		MLCModelProperty *modelProperty = [[MLCModelProperty alloc] initWithProperty:property ofClass:self];
 
-		[names addObject:str];
+		// subclasses are enumerated first, and their declarations take
+		// precedence
+		if (![newProperties objectForKey:modelProperty.name])
+			[newProperties setObject:modelProperty forKey:modelProperty.name];
 	}];
 
-	return names;
+	NSSet *names = [NSSet setWithArray:[newProperties allKeys]];
+
+	@synchronized (self) {
+		NSDictionary *existingProperties = objc_getAssociatedObject(self, MLCModelAssociatedPropertiesKey);
+		if (existingProperties)
+			return existingProperties;
+
+		objc_setAssociatedObject(self, MLCModelAssociatedPropertyNamesKey, names, OBJC_ASSOCIATION_RETAIN);
+		objc_setAssociatedObject(self, MLCModelAssociatedPropertiesKey, newProperties, OBJC_ASSOCIATION_RETAIN);
+	}
+
+	return newProperties;
 }
 
-+ (BOOL)resolveInstanceMethod:(SEL)aSelector {
-	@autoreleasepool {
-		NSString *name = NSStringFromSelector(aSelector);
-		NSRange range = [name rangeOfString:@":" options:NSLiteralSearch];
++ (NSSet *)modelPropertyNames; {
+	NSSet *names = objc_getAssociatedObject(self, MLCModelAssociatedPropertyNamesKey);
+	if (names)
+		return names;
 
-		// if the name doesn't match a standard init method, or there's no colon
-		// (meaning no argument), or the colon immediately follows "initWith",
-		// we can't build this
-		if (![name hasPrefix:@"initWith"] || range.location == NSNotFound || range.location == 8)
-			return NO;
+	// creates the set of names as well
+	[self modelPropertiesByName];
+	return objc_getAssociatedObject(self, MLCModelAssociatedPropertyNamesKey);
+}
 
-		NSMutableString *firstPropertyName = [[NSMutableString alloc] init];
-		
-		// grab the letter after 'initWith' and lowercase it
-		[firstPropertyName appendString:[[name substringWithRange:NSMakeRange(8, 1)] lowercaseString]];
-		
-		// append the rest, up to the first colon
-		[firstPropertyName appendString:[name substringWithRange:NSMakeRange(9, range.location - 9)]];
++ (MLCModelProperty *)modelPropertyForUndeclaredKey:(NSString *)key; {
+	NSMutableDictionary *properties = nil;
+	MLCModelProperty *property = nil;
 
-		NSAssert([firstPropertyName length] > 0, @"name of first initializer argument should have a non-zero length");
-		
-		NSMutableArray *initializerPropertyNames = [[NSMutableArray alloc] init];
-		[initializerPropertyNames addObject:firstPropertyName];
+	@synchronized (self) {
+		properties = objc_getAssociatedObject(self, MLCModelAssociatedUndeclaredPropertiesKey);
+		if (!properties) {
+			properties = [[NSMutableDictionary alloc] init];
+			objc_setAssociatedObject(self, MLCModelAssociatedUndeclaredPropertiesKey, properties, OBJC_ASSOCIATION_RETAIN);
+		}
+
+		property = [properties objectForKey:key];
+	}
 
-		// if the colon wasn't the last character in the initializer name, there
-		// are must be properties named
-		if (range.location < [name length] - 1) {
-			NSArray *otherPropertyNames = [[name substringFromIndex:range.location + 1] componentsSeparatedByString:@":"];
-			NSAssert([otherPropertyNames count] > 0, @"should be at least one other initializer argument if the first colon wasn't the last character in the method name");
+	if (property)
+		return property;
 
-			[initializerPropertyNames addObjectsFromArray:otherPropertyNames];
+	property = [[MLCModelProperty alloc] initWithKey:key ofClass:self];
 
-			NSAssert([[initializerPropertyNames lastObject] isEqualToString:@""], @"last colon-separated component of a method name with arguments should be an empty string");
-			[initializerPropertyNames removeLastObject];
+	@synchronized (self) {
+		MLCModelProperty *existingProperty = [properties objectForKey:key];
+		if (existingProperty)
+			return existingProperty;
+
+		if ([properties count] < MLCModelUndeclaredPropertyCacheLimit)
+			[properties setObject:property forKey:key];
+	}
+
+	return property;
+}
+
++ (MLCModelInitializer *)initializerForSelector:(SEL)selector; {
+	NSMapTable *initializers = nil;
+	MLCModelInitializer *initializer = nil;
+
+	@synchronized (self) {
+		initializers = objc_getAssociatedObject(self, MLCModelAssociatedInitializersKey);
+		if (!initializers) {
+			initializers = NSCreateMapTable(NSNonOwnedPointerMapKeyCallBacks, NSObjectMapValueCallBacks, 0);
+			objc_setAssociatedObject(self, MLCModelAssociatedInitializersKey, initializers, OBJC_ASSOCIATION_RETAIN);
 		}
 
-		id (^finalInitializerBlock)(id, NSArray *) = ^(id self, NSArray *arguments){
-			NSUInteger argumentCount = [arguments count];
-			NSMutableDictionary *dict = [[NSMutableDictionary alloc] initWithCapacity:argumentCount];
+		initializer = (__bridge id)NSMapGet(initializers, (const void *)selector);
+	}
 
-			for (NSUInteger i = 0;i < argumentCount;++i) {
-				id argument = [arguments objectAtIndex:i];
-				NSString *key = [initializerPropertyNames objectAtIndex:i];
+	if (initializer)
+		return initializer;
 
-				[dict setObject:argument forKey:key];
-			}
+	initializer = [[MLCModelInitializer alloc] initWithClass:self selector:selector];
+	if (!initializer)
+		return nil;
 
-			return [self initWithDictionary:dict];
-		};
+	@synchronized (self) {
+		MLCModelInitializer *existingInitializer = (__bridge id)NSMapGet(initializers, (const void *)selector);
+		if (existingInitializer)
+			return existingInitializer;
+
+		NSMapInsert(initializers, (const void *)selector, (__bridge void *)initializer);
+	}
+
+	return initializer;
+}
+
++ (BOOL)resolveInstanceMethod:(SEL)aSelector {
+	@autoreleasepool {
+		MLCModelInitializer *initializer = [self initializerForSelector:aSelector];
+		if (!initializer)
+			return [super resolveInstanceMethod:aSelector];
+
+		Class cls = self;
 
 		id initializerBlock = nil;
-		NSUInteger numberOfArguments = [initializerPropertyNames count];
+		NSUInteger numberOfArguments = [initializer.properties count];
 
-		// UGH!
+		// UGH! initializers with more arguments than this are handled by
+		// -forwardInvocation:
 		switch (numberOfArguments) {
 		case 1:
 			{
 				initializerBlock = [^(id self, id arg1){
-					return finalInitializerBlock(self, [NSArray arrayWithObjects:arg1, nil]);
+					__unsafe_unretained id arguments[] = { arg1 };
+					return invokeInitializer(cls, initializer, aSelector, self, arguments);
 				} copy];
 
 				break;
@@ -199,7 +847,8 @@
 		case 2:
 			{
 				initializerBlock = [^(id self, id arg1, id arg2){
-					return finalInitializerBlock(self, [NSArray arrayWithObjects:arg1, arg2, nil]);
+					__unsafe_unretained id arguments[] = { arg1, arg2 };
+					return invokeInitializer(cls, initializer, aSelector, self, arguments);
 				} copy];
 
 				break;
@@ -208,7 +857,8 @@
 		case 3:
 			{
 				initializerBlock = [^(id self, id arg1, id arg2, id arg3){
-					return finalInitializerBlock(self, [NSArray arrayWithObjects:arg1, arg2, arg3, nil]);
+					__unsafe_unretained id arguments[] = { arg1, arg2, arg3 };
+					return invokeInitializer(cls, initializer, aSelector, self, arguments);
 				} copy];
 
 				break;
@@ -217,7 +867,8 @@
 		case 4:
 			{
 				initializerBlock = [^(id self, id arg1, id arg2, id arg3, id arg4){
-					return finalInitializerBlock(self, [NSArray arrayWithObjects:arg1, arg2, arg3, arg4, nil]);
+					__unsafe_unretained id arguments[] = { arg1, arg2, arg3, arg4 };
+					return invokeInitializer(cls, initializer, aSelector, self, arguments);
 				} copy];
 
 				break;
@@ -226,7 +877,8 @@
 		case 5:
 			{
 				initializerBlock = [^(id self, id arg1, id arg2, id arg3, id arg4, id arg5){
-					return finalInitializerBlock(self, [NSArray arrayWithObjects:arg1, arg2, arg3, arg4, arg5, nil]);
+					__unsafe_unretained id arguments[] = { arg1, arg2, arg3, arg4, arg5 };
+					return invokeInitializer(cls, initializer, aSelector, self, arguments);
 				} copy];
 
 				break;
@@ -235,7 +887,8 @@
 		case 6:
 			{
 				initializerBlock = [^(id self, id arg1, id arg2, id arg3, id arg4, id arg5, id arg6){
-					return finalInitializerBlock(self, [NSArray arrayWithObjects:arg1, arg2, arg3, arg4, arg5, arg6, nil]);
+					__unsafe_unretained id arguments[] = { arg1, arg2, arg3, arg4, arg5, arg6 };
+					return invokeInitializer(cls, initializer, aSelector, self, arguments);
 				} copy];
 
 				break;
@@ -244,7 +897,8 @@
 		case 7:
 			{
 				initializerBlock = [^(id self, id arg1, id arg2, id arg3, id arg4, id arg5, id arg6, id arg7){
-					return finalInitializerBlock(self, [NSArray arrayWithObjects:arg1, arg2, arg3, arg4, arg5, arg6, arg7, nil]);
+					__unsafe_unretained id arguments[] = { arg1, arg2, arg3, arg4, arg5, arg6, arg7 };
+					return invokeInitializer(cls, initializer, aSelector, self, arguments);
 				} copy];
 
 				break;
@@ -253,7 +907,8 @@
 		case 8:
 			{
 				initializerBlock = [^(id self, id arg1, id arg2, id arg3, id arg4, id arg5, id arg6, id arg7, id arg8){
-					return finalInitializerBlock(self, [NSArray arrayWithObjects:arg1, arg2, arg3, arg4, arg5, arg6, arg7, arg8, nil]);
+					__unsafe_unretained id arguments[] = { arg1, arg2, arg3, arg4, arg5, arg6, arg7, arg8 };
+					return invokeInitializer(cls, initializer, aSelector, self, arguments);
 				} copy];
 
 				break;
@@ -262,7 +917,8 @@
 		case 9:
 			{
 				initializerBlock = [^(id self, id arg1, id arg2, id arg3, id arg4, id arg5, id arg6, id arg7, id arg8, id arg9){
-					return finalInitializerBlock(self, [NSArray arrayWithObjects:arg1, arg2, arg3, arg4, arg5, arg6, arg7, arg8, arg9, nil]);
+					__unsafe_unretained id arguments[] = { arg1, arg2, arg3, arg4, arg5, arg6, arg7, arg8, arg9 };
+					return invokeInitializer(cls, initializer, aSelector, self, arguments);
 				} copy];
 
 				break;
@@ -272,15 +928,7 @@
 			return NO;
 		}
 
-		NSMutableString *typeEncoding = [[NSMutableString alloc] init];
-
-		// id impl (id self, SEL _cmd, ...)
-		[typeEncoding appendFormat:@"%s%s%s", @encode(id), @encode(id), @encode(SEL)];
-
-		// add each 'id' argument to the type encoding
-		for (NSUInteger i = 0;i < numberOfArguments;++i) {
-			[typeEncoding appendFormat:@"%s", @encode(id)];
-		}
+		NSString *typeEncoding = initializerTypeEncoding(numberOfArguments);
 
 		if (class_addMethod(self, aSelector, imp_implementationWithBlock((__bridge void *)initializerBlock), [typeEncoding UTF8String])) {
 			objc_setAssociatedObject(self, aSelector, initializerBlock, OBJC_ASSOCIATION_COPY_NONATOMIC);
@@ -290,6 +938,59 @@
 	}
 }
 
+- (NSMethodSignature *)methodSignatureForSelector:(SEL)aSelector {
+	NSMethodSignature *signature = [super methodSignatureForSelector:aSelector];
+	if (signature)
+		return signature;
+
+	MLCModelInitializer *initializer = [[self class] initializerForSelector:aSelector];
+	if (!initializer)
+		return nil;
+
+	NSString *typeEncoding = initializerTypeEncoding([initializer.properties count]);
+	return [NSMethodSignature signatureWithObjCTypes:[typeEncoding UTF8String]];
+}
+
+- (void)forwardInvocation:(NSInvocation *)invocation {
+	SEL selector = [invocation selector];
+
+	// initializers implemented in Lua take precedence
+	MLCModelInitializer *initializer = nil;
+	if (![[self class] metatableHasValueForKey:NSStringFromSelector(selector)])
+		initializer = [[self class] initializerForSelector:selector];
+
+	NSMethodSignature *signature = [invocation methodSignature];
+	NSUInteger count = [initializer.properties count];
+
+	BOOL objectArguments = (initializer && [signature numberOfArguments] == count + 2 && *[signature methodReturnType] == '@');
+	for (NSUInteger i = 0;objectArguments && i < count;++i) {
+		objectArguments = (*[signature getArgumentTypeAtIndex:i + 2] == '@');
+	}
+
+	if (!objectArguments) {
+		[super forwardInvocation:invocation];
+		return;
+	}
+
+	// the invocation keeps the receiver and arguments alive until it's done,
+	// whatever the initializer does with them
+	[invocation retainArguments];
+
+	__unsafe_unretained id arguments[count];
+	for (NSUInteger i = 0;i < count;++i) {
+		[invocation getArgument:&arguments[i] atIndex:(NSInteger)i + 2];
+	}
+
+	id result = [initializer model:self initializedWithArguments:arguments];
+
+	// the sender of an initializer gives up its reference to the receiver, and
+	// expects to own the result
+	CFBridgingRelease((__bridge CFTypeRef)self);
+
+	void *retainedResult = (__bridge_retained void *)result;
+	[invocation setReturnValue:&retainedResult];
+}
+
 #pragma mark NSCoding
 
 - (id)initWithCoder:(NSCoder *)coder {
@@ -312,36 +1013,45 @@
 #pragma mark NSObject
 
 - (NSUInteger)hash {
-	NSNumber *num = nil;
+	NSUInteger hash = m_cachedHash;
+	if (hash)
+		return hash;
 
-	if ([[self class] metatableHasValueForKey:@"hash"]) {
+	MLCModelEqualityPlan *plan = [[self class] equalityPlan];
+
+	if (plan.usesLuaHash) {
 		id obj = [self valueForUndefinedKey:@"hash"];
 
 		if ([obj isKindOfClass:[NSNumber class]]) {
-			num = obj;
+			hash = [obj unsignedIntegerValue];
 		} else if ([obj isKindOfClass:[NSString class]]) {
-			num = [NSNumber numberWithDouble:[obj doubleValue]];
+			hash = (NSUInteger)[obj doubleValue];
+		} else {
+			hash = [plan hashOfModel:self];
 		}
-	}
-
-	// if Lua doesn't implement -hash, we hash our equality key paths
-	if (!num) {
-		return [[self dictionaryWithValuesAffectingEquality] hash];
 	} else {
-		return [num unsignedIntegerValue];
+		// if Lua doesn't implement -hash, we hash our equality key paths
+		hash = [plan hashOfModel:self];
 	}
+
+	if ([[self class] cachesHash])
+		m_cachedHash = hash;
+
+	return hash;
 }
 
 - (BOOL)isEqual:(MLCModel *)model {
+	if (model == self)
+		return YES;
+
 	if (![model isKindOfClass:[self class]])
 		return NO;
 	
+	MLCModelEqualityPlan *plan = [[self class] equalityPlan];
+
 	// if Lua doesn't implement -isEqual:, we compare our equality key paths
-	if (![[self class] metatableHasValueForKey:@"isEqual:"]) {
-		NSDictionary *selfEqualityValues = [self dictionaryWithValuesAffectingEquality];
-		NSDictionary *otherEqualityValues = [model dictionaryWithValuesAffectingEquality];
-		return [selfEqualityValues isEqualToDictionary:otherEqualityValues];
-	}
+	if (!plan.usesLuaIsEqual)
+		return [plan isModel:self equalToModel:model];
 	
 	NSMethodSignature *signature = [self methodSignatureForSelector:_cmd];
 	NSInvocation *invocation = [NSInvocation invocationWithMethodSignature:signature];
@@ -0,0 +1,118 @@
+//
+//  MLCModelProperty.h
+//  MoonlitCocoa
+//
+//  Created by agent on 17.10.26.
+//  Released into the public domain.
+//
+
+#import <Foundation/Foundation.h>
+#import <objc/runtime.h>
+
+/**
+ * Describes how an object is stored into a property.
+ */
+typedef enum {
+	/**
+	 * The value is assigned without being retained.
+	 */
+	MLCModelPropertyAssign,
+
+	/**
+	 * The value is retained.
+	 */
+	MLCModelPropertyRetain,
+
+	/**
+	 * The value is copied.
+	 */
+	MLCModelPropertyCopy,
+
+	/**
+	 * The value is stored as a zeroing weak reference.
+	 */
+	MLCModelPropertyWeak
+} MLCModelPropertyMemoryPolicy;
+
+/**
+ * Describes a property of an #MLCModel subclass, as needed to set it directly
+ * during initialization. Properties are described once per class, and then
+ * reused for every instance.
+ */
+@interface MLCModelProperty : NSObject
+/**
+ * Initializes the receiver with a description of \a property, as declared on
+ * \a cls.
+ */
+- (id)initWithProperty:(objc_property_t)property ofClass:(Class)cls;
+
+/**
+ * Initializes the receiver as a key with no declared property on \a cls. The
+ * value for such a key can only be set using key-value coding.
+ */
+- (id)initWithKey:(NSString *)key ofClass:(Class)cls;
+
+/**
+ * The name of the property.
+ */
+@property (nonatomic, copy, readonly) NSString *name;
+
+/**
+ * The first character of the type encoding of the property, or \c '@' if the
+ * key has no declared property.
+ */
+@property (nonatomic, readonly) char type;
+
+/**
+ * The getter of the property, whether or not it is implemented.
+ */
+@property (nonatomic, readonly) SEL getter;
+
+/**
+ * The implementation of #getter, or \c NULL if the class does not implement it
+ * in Objective-C.
+ */
+@property (nonatomic, readonly) IMP getterImplementation;
+
+/**
+ * The setter of the property, whether or not it is implemented.
+ */
+@property (nonatomic, readonly) SEL setter;
+
+/**
+ * The implementation of #setter, or \c NULL if the class does not implement it.
+ */
+@property (nonatomic, readonly) IMP setterImplementation;
+
+/**
+ * The instance variable backing the property, or \c NULL if there is none.
+ */
+@property (nonatomic, readonly) Ivar ivar;
+
+/**
+ * The offset of #ivar within instances of the class.
+ */
+@property (nonatomic, readonly) ptrdiff_t ivarOffset;
+
+/**
+ * How an object value is stored into the property.
+ */
+@property (nonatomic, readonly) MLCModelPropertyMemoryPolicy memoryPolicy;
+
+/**
+ * Whether the class implements a \c validate<Key>:error: method for this
+ * property, meaning that key-value validation needs to be performed before
+ * setting it.
+ */
+@property (nonatomic, readonly) BOOL validates;
+
+/**
+ * Validates \a value (if the class implements validation for this property)
+ * and then sets it on \a model. If the property holds an object, it is set
+ * using its setter or instance variable directly. Any other values are set
+ * using key-value coding.
+ *
+ * Returns \c NO if validation fails.
+ */
+- (BOOL)setValue:(id)value onModel:(id)model;
+@end
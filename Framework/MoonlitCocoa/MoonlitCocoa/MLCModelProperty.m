@@ -0,0 +1,198 @@
+//
+//  MLCModelProperty.m
+//  MoonlitCocoa
+//
+//  Created by agent on 17.10.26.
+//  Released into the public domain.
+//
+
+#import "MLCModelProperty.h"
+
+/**
+ * Returns whether \a property has the attribute \a name.
+ */
+static BOOL propertyHasAttribute (objc_property_t property, const char *name) {
+	char *value = property_copyAttributeValue(property, name);
+	if (!value)
+		return NO;
+
+	free(value);
+	return YES;
+}
+
+@interface MLCModelProperty ()
+@property (nonatomic, copy, readwrite) NSString *name;
+@property (nonatomic, readwrite) char type;
+@property (nonatomic, readwrite) SEL getter;
+@property (nonatomic, readwrite) IMP getterImplementation;
+@property (nonatomic, readwrite) SEL setter;
+@property (nonatomic, readwrite) IMP setterImplementation;
+@property (nonatomic, readwrite) Ivar ivar;
+@property (nonatomic, readwrite) ptrdiff_t ivarOffset;
+@property (nonatomic, readwrite) MLCModelPropertyMemoryPolicy memoryPolicy;
+@property (nonatomic, readwrite) BOOL validates;
+
+/**
+ * Sets the #validates flag based on the methods implemented by \a cls.
+ */
+- (void)findValidationMethodOfClass:(Class)cls;
+@end
+
+@implementation MLCModelProperty
+@synthesize name = m_name;
+@synthesize type = m_type;
+@synthesize getter = m_getter;
+@synthesize getterImplementation = m_getterImplementation;
+@synthesize setter = m_setter;
+@synthesize setterImplementation = m_setterImplementation;
+@synthesize ivar = m_ivar;
+@synthesize ivarOffset = m_ivarOffset;
+@synthesize memoryPolicy = m_memoryPolicy;
+@synthesize validates = m_validates;
+
+- (id)initWithProperty:(objc_property_t)property ofClass:(Class)cls; {
+	self = [super init];
+	if (!self)
+		return nil;
+
+	self.name = [[NSString alloc] initWithUTF8String:property_getName(property)];
+
+	char *type = property_copyAttributeValue(property, "T");
+	if (type) {
+		self.type = *(type + strspn(type, "rnNoORV"));
+		free(type);
+	} else {
+		self.type = '@';
+	}
+
+	char *getterName = property_copyAttributeValue(property, "G");
+	if (getterName) {
+		self.getter = sel_registerName(getterName);
+		free(getterName);
+	} else {
+		self.getter = NSSelectorFromString(self.name);
+	}
+
+	Method getterMethod = class_getInstanceMethod(cls, self.getter);
+	if (getterMethod)
+		self.getterImplementation = method_getImplementation(getterMethod);
+
+	char *setterName = property_copyAttributeValue(property, "S");
+	if (setterName) {
+		self.setter = sel_registerName(setterName);
+		free(setterName);
+	} else {
+		NSString *capitalizedName = [[[self.name substringToIndex:1] uppercaseString] stringByAppendingString:[self.name substringFromIndex:1]];
+		self.setter = NSSelectorFromString([NSString stringWithFormat:@"set%@:", capitalizedName]);
+	}
+
+	Method setterMethod = class_getInstanceMethod(cls, self.setter);
+	if (setterMethod)
+		self.setterImplementation = method_getImplementation(setterMethod);
+
+	char *ivarName = property_copyAttributeValue(property, "V");
+	if (ivarName) {
+		self.ivar = class_getInstanceVariable(cls, ivarName);
+		free(ivarName);
+
+		if (self.ivar)
+			self.ivarOffset = ivar_getOffset(self.ivar);
+	}
+
+	if (propertyHasAttribute(property, "C"))
+		self.memoryPolicy = MLCModelPropertyCopy;
+	else if (propertyHasAttribute(property, "&"))
+		self.memoryPolicy = MLCModelPropertyRetain;
+	else if (propertyHasAttribute(property, "W"))
+		self.memoryPolicy = MLCModelPropertyWeak;
+	else
+		self.memoryPolicy = MLCModelPropertyAssign;
+
+	[self findValidationMethodOfClass:cls];
+	return self;
+}
+
+- (id)initWithKey:(NSString *)key ofClass:(Class)cls; {
+	self = [super init];
+	if (!self)
+		return nil;
+
+	self.name = key;
+	self.type = '@';
+	self.getter = NSSelectorFromString(key);
+	self.memoryPolicy = MLCModelPropertyAssign;
+
+	[self findValidationMethodOfClass:cls];
+	return self;
+}
+
+- (void)findValidationMethodOfClass:(Class)cls; {
+	if (![self.name length])
+		return;
+
+	NSString *capitalizedName = [[[self.name substringToIndex:1] uppercaseString] stringByAppendingString:[self.name substringFromIndex:1]];
+	SEL validator = NSSelectorFromString([NSString stringWithFormat:@"validate%@:error:", capitalizedName]);
+
+	// this matches the lookup performed by -validateValue:forKey:error:, which
+	// only considers methods implemented in Objective-C
+	self.validates = (class_getInstanceMethod(cls, validator) != NULL);
+}
+
+- (BOOL)setValue:(id)value onModel:(id)model; {
+	if (self.validates) {
+		NSError *error = nil;
+		BOOL success = NO;
+
+		@try {
+			success = [model validateValue:&value forKey:self.name error:&error];
+		} @catch (NSException *ex) {
+			NSLog(@"Exception thrown during validation for key \"%@\" when initializing instance of %@: %@", self.name, [model class], ex);
+			return NO;
+		}
+
+		if (!success) {
+			NSLog(@"Validation failed for key \"%@\" when initializing instance of %@: %@", self.name, [model class], error);
+			return NO;
+		}
+	}
+
+	// scalars need to be unboxed, which key-value coding already knows how to
+	// do
+	if (self.type != '@') {
+		[model setValue:value forKey:self.name];
+		return YES;
+	}
+
+	if (self.setterImplementation) {
+		((void (*)(id, SEL, id))self.setterImplementation)(model, self.setter, value);
+		return YES;
+	}
+
+	if (self.ivar) {
+		void *slot = (char *)(__bridge void *)model + self.ivarOffset;
+
+		switch (self.memoryPolicy) {
+		case MLCModelPropertyRetain:
+			*(__strong id *)slot = value;
+			return YES;
+
+		case MLCModelPropertyCopy:
+			*(__strong id *)slot = [value copy];
+			return YES;
+
+		case MLCModelPropertyWeak:
+			*(__weak id *)slot = value;
+			return YES;
+
+		case MLCModelPropertyAssign:
+			// the ownership of the instance variable is unknown, so leave it
+			// to key-value coding
+			break;
+		}
+	}
+
+	[model setValue:value forKey:self.name];
+	return YES;
+}
+
+@end
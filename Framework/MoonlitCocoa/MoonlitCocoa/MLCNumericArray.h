@@ -0,0 +1,131 @@
+//
+//  MLCNumericArray.h
+//  MoonlitCocoa
+//
+//  Created by agent on 17.10.26.
+//  Released into the public domain.
+//
+
+#import <Foundation/Foundation.h>
+#import <MoonlitCocoa/MLCValue.h>
+
+/**
+ * The type of the elements stored in an #MLCNumericArray.
+ */
+typedef enum {
+	/**
+	 * Each element is a \c double.
+	 */
+	MLCNumericTypeDouble,
+
+	/**
+	 * Each element is an \c int64_t.
+	 *
+	 * @note Lua represents all numbers as \c double, so values with a magnitude
+	 * above 2^53 lose precision when read from Lua.
+	 */
+	MLCNumericTypeInt64,
+
+	/**
+	 * Each element is a \c float.
+	 */
+	MLCNumericTypeFloat
+} MLCNumericType;
+
+/**
+ * A fixed-size array of numbers stored in a contiguous C buffer.
+ *
+ * When pushed into Lua, the receiver becomes a userdata which shares the same
+ * buffer. It can be indexed (starting at one) and assigned to like an array
+ * table, and supports the length operator, but no element is ever copied or
+ * boxed when crossing the bridge. Use #pushTableOntoStack: and
+ * #initWithTableAtStackIndex:ofState:type: to convert to and from a real Lua
+ * table in bulk.
+ *
+ * @note Like the state it is pushed into, an instance of this class must not be
+ * used from multiple threads at once.
+ */
+@interface MLCNumericArray : NSObject <MLCValue>
+/**
+ * Initializes an array of \a count elements of the given type, all set to zero.
+ */
+- (id)initWithCount:(NSUInteger)count type:(MLCNumericType)type;
+
+/**
+ * Initializes an array of \a count elements of the given type, by copying them
+ * from \a bytes.
+ */
+- (id)initWithBytes:(const void *)bytes count:(NSUInteger)count type:(MLCNumericType)type;
+
+/**
+ * Initializes an array of \a count elements of the given type, using \a bytes
+ * as storage without copying it. If \a freeWhenDone is \c YES, \a bytes must
+ * have been allocated with \c malloc, and will be freed when the receiver is
+ * deallocated.
+ */
+- (id)initWithBytesNoCopy:(void *)bytes count:(NSUInteger)count type:(MLCNumericType)type freeWhenDone:(BOOL)freeWhenDone;
+
+/**
+ * Initializes an array from the array part of the Lua table at \a index in the
+ * stack of \a state, converting every element to the given type. Any elements
+ * which are not numbers are set to zero. Returns \c nil if the value at \a
+ * index is not a table.
+ */
+- (id)initWithTableAtStackIndex:(int)index ofState:(MLCState *)state type:(MLCNumericType)type;
+
+/**
+ * The type of every element in the array.
+ */
+@property (nonatomic, readonly) MLCNumericType type;
+
+/**
+ * The number of elements in the array.
+ */
+@property (nonatomic, readonly) NSUInteger count;
+
+/**
+ * The size of each element, in bytes.
+ */
+@property (nonatomic, readonly) size_t elementSize;
+
+/**
+ * The storage for the elements of the array. This buffer may be modified, and
+ * any changes are immediately visible from Lua.
+ */
+@property (nonatomic, readonly) void *bytes;
+
+/**
+ * Returns the element at \a index, converted to a \c double.
+ */
+- (double)doubleAtIndex:(NSUInteger)index;
+
+/**
+ * Converts \a value to the type of the array and stores it at \a index.
+ */
+- (void)setDouble:(double)value atIndex:(NSUInteger)index;
+
+/**
+ * Returns \c YES if the value at the top of the Lua stack of \a state is a
+ * userdata created by #pushOntoStack:.
+ */
++ (BOOL)isOnStack:(MLCState *)state;
+
+/**
+ * Pops a userdata created by #pushOntoStack: off the top of the Lua stack of \a
+ * state, and returns the array it shares a buffer with. Returns \c nil if the
+ * value at the top of the Lua stack is not such a userdata.
+ */
++ (id)popFromStack:(MLCState *)state;
+
+/**
+ * Pushes the receiver on the Lua stack of \a state as a userdata sharing the
+ * receiver's buffer.
+ */
+- (void)pushOntoStack:(MLCState *)state;
+
+/**
+ * Pushes a new Lua table containing every element of the receiver onto the
+ * stack of \a state.
+ */
+- (void)pushTableOntoStack:(MLCState *)state;
+@end
@@ -0,0 +1,446 @@
+//
+//  MLCNumericArray.m
+//  MoonlitCocoa
+//
+//  Created by agent on 17.10.26.
+//  Released into the public domain.
+//
+
+#import "MLCNumericArray.h"
+#import "MLCMarshaling.h"
+#import "MLCState.h"
+#import <lauxlib.h>
+#import <math.h>
+
+/**
+ * The address of this variable is used as the key for the numeric array
+ * metatable in the registry of each Lua state.
+ */
+static char MLCNumericArrayMetatableKey;
+
+/**
+ * The contents of a userdata representing an #MLCNumericArray. Everything
+ * needed to read or write elements is kept here, so that the metamethods never
+ * need to message the array itself.
+ */
+typedef struct {
+	/**
+	 * The #MLCNumericArray, retained for the lifetime of the userdata.
+	 */
+	void *array;
+
+	/**
+	 * The buffer of the array.
+	 */
+	void *bytes;
+
+	/**
+	 * The number of elements in #bytes.
+	 */
+	size_t count;
+
+	/**
+	 * The type of each element in #bytes.
+	 */
+	MLCNumericType type;
+} MLCNumericArrayUserdata;
+
+/**
+ * Returns the size of an element of the given type.
+ */
+static size_t numericTypeSize (MLCNumericType type) {
+	switch (type) {
+	case MLCNumericTypeDouble:
+		return sizeof(double);
+
+	case MLCNumericTypeInt64:
+		return sizeof(int64_t);
+
+	case MLCNumericTypeFloat:
+		return sizeof(float);
+	}
+
+	return 0;
+}
+
+/**
+ * Returns the element at \a index in \a bytes, converted to a \c double.
+ */
+static double getNumericElement (MLCNumericType type, const void *bytes, size_t index) {
+	switch (type) {
+	case MLCNumericTypeDouble:
+		return ((const double *)bytes)[index];
+
+	case MLCNumericTypeInt64:
+		return (double)((const int64_t *)bytes)[index];
+
+	case MLCNumericTypeFloat:
+		return ((const float *)bytes)[index];
+	}
+
+	return 0;
+}
+
+/**
+ * Converts \a value to the given type and stores it at \a index in \a bytes.
+ * Converting a double outside the range of \c int64_t is undefined, so for
+ * #MLCNumericTypeInt64, \a value is clamped to that range first, and NaN is
+ * stored as zero.
+ */
+static void setNumericElement (MLCNumericType type, void *bytes, size_t index, double value) {
+	switch (type) {
+	case MLCNumericTypeDouble:
+		((double *)bytes)[index] = value;
+		break;
+
+	case MLCNumericTypeInt64:
+		{
+			int64_t integer;
+
+			// the limits are powers of two, which are exact as doubles
+			if (isnan(value))
+				integer = 0;
+			else if (value <= (double)INT64_MIN)
+				integer = INT64_MIN;
+			else if (value >= -(double)INT64_MIN)
+				integer = INT64_MAX;
+			else
+				integer = (int64_t)value;
+
+			((int64_t *)bytes)[index] = integer;
+		}
+
+		break;
+
+	case MLCNumericTypeFloat:
+		((float *)bytes)[index] = (float)value;
+		break;
+	}
+}
+
+/**
+ * Returns the zero-based element index corresponding to the Lua value at \a
+ * index, or \c -1 if it is not an integer within the bounds of \a userdata.
+ */
+static ptrdiff_t elementIndex (lua_State *state, int index, const MLCNumericArrayUserdata *userdata) {
+	if (lua_type(state, index) != LUA_TNUMBER)
+		return -1;
+
+	lua_Number key = lua_tonumber(state, index);
+	if (key < 1 || key > (lua_Number)userdata->count || key != floor(key))
+		return -1;
+
+	// Lua indices start at one, so adjust appropriately
+	return (ptrdiff_t)key - 1;
+}
+
+/**
+ * Invoked as the __gc metamethod on a numeric array userdata.
+ */
+static int numericArrayGC (lua_State *state) {
+	MLCNumericArrayUserdata *userdata = lua_touserdata(state, 1);
+
+	// transfer ownership to ARC and discard, balancing the retain from
+	// -pushOntoStack:
+	(void)(__bridge_transfer id)userdata->array;
+	userdata->array = NULL;
+
+	return 0;
+}
+
+/**
+ * Invoked as the __index metamethod on a numeric array userdata. Returns the
+ * element at the given index, or \c nil if the index is out of bounds.
+ */
+static int numericArrayIndex (lua_State *state) {
+	MLCNumericArrayUserdata *userdata = lua_touserdata(state, 1);
+
+	MLCState *stateObj = [MLCState stateForLuaState:state];
+	MLCLuaExecutionContext context = MLCEnterObjectiveC(stateObj, state);
+
+	ptrdiff_t index = elementIndex(state, 2, userdata);
+	if (index < 0) {
+		lua_pushnil(state);
+	} else {
+		lua_pushnumber(state, getNumericElement(userdata->type, userdata->bytes, (size_t)index));
+	}
+
+	MLCLeaveObjectiveC(stateObj, context);
+	return 1;
+}
+
+/**
+ * Invoked as the __newindex metamethod on a numeric array userdata. Raises an
+ * error if the index is out of bounds, since the array cannot grow.
+ */
+static int numericArrayNewIndex (lua_State *state) {
+	MLCNumericArrayUserdata *userdata = lua_touserdata(state, 1);
+	lua_Number value = luaL_checknumber(state, 3);
+
+	ptrdiff_t index = elementIndex(state, 2, userdata);
+	if (index < 0)
+		return luaL_error(state, "index out of bounds for numeric array of length %f", (lua_Number)userdata->count);
+
+	MLCState *stateObj = [MLCState stateForLuaState:state];
+	MLCLuaExecutionContext context = MLCEnterObjectiveC(stateObj, state);
+
+	setNumericElement(userdata->type, userdata->bytes, (size_t)index, value);
+
+	MLCLeaveObjectiveC(stateObj, context);
+	return 0;
+}
+
+/**
+ * Invoked as the __len metamethod on a numeric array userdata.
+ */
+static int numericArrayLength (lua_State *state) {
+	MLCNumericArrayUserdata *userdata = lua_touserdata(state, 1);
+
+	MLCState *stateObj = [MLCState stateForLuaState:state];
+	MLCLuaExecutionContext context = MLCEnterObjectiveC(stateObj, state);
+
+	lua_pushnumber(state, (lua_Number)userdata->count);
+
+	MLCLeaveObjectiveC(stateObj, context);
+	return 1;
+}
+
+/**
+ * Pushes the metatable shared by all numeric array userdata in \a state,
+ * creating it if necessary.
+ */
+static void pushNumericArrayMetatable (lua_State *state) {
+	lua_pushlightuserdata(state, &MLCNumericArrayMetatableKey);
+	lua_rawget(state, LUA_REGISTRYINDEX);
+
+	if (lua_istable(state, -1))
+		return;
+
+	lua_pop(state, 1);
+	lua_createtable(state, 0, 4);
+
+	lua_pushcfunction(state, &numericArrayGC);
+	lua_setfield(state, -2, "__gc");
+
+	lua_pushcfunction(state, &numericArrayIndex);
+	lua_setfield(state, -2, "__index");
+
+	lua_pushcfunction(state, &numericArrayNewIndex);
+	lua_setfield(state, -2, "__newindex");
+
+	lua_pushcfunction(state, &numericArrayLength);
+	lua_setfield(state, -2, "__len");
+
+	lua_pushlightuserdata(state, &MLCNumericArrayMetatableKey);
+	lua_pushvalue(state, -2);
+	lua_rawset(state, LUA_REGISTRYINDEX);
+}
+
+/**
+ * Returns the numeric array userdata at \a index, or \c NULL if the value at \a
+ * index is not one.
+ */
+static MLCNumericArrayUserdata *toNumericArrayUserdata (lua_State *state, int index) {
+	void *userdata = lua_touserdata(state, index);
+	if (!userdata || !lua_getmetatable(state, index))
+		return NULL;
+
+	pushNumericArrayMetatable(state);
+	int equal = lua_rawequal(state, -1, -2);
+
+	// pop both metatables
+	lua_pop(state, 2);
+
+	return equal ? userdata : NULL;
+}
+
+BOOL MLCIsNumericArray (lua_State *L, int index) {
+	return toNumericArrayUserdata(L, index) != NULL;
+}
+
+@interface MLCNumericArray () {
+	/**
+	 * Whether #bytes should be freed upon deallocation.
+	 */
+	BOOL m_freeWhenDone;
+}
+
+@property (nonatomic, readwrite) MLCNumericType type;
+@property (nonatomic, readwrite) NSUInteger count;
+@property (nonatomic, readwrite) void *bytes;
+@end
+
+@implementation MLCNumericArray
+@synthesize type = m_type;
+@synthesize count = m_count;
+@synthesize bytes = m_bytes;
+
+- (id)init {
+	return [self initWithCount:0 type:MLCNumericTypeDouble];
+}
+
+- (id)initWithCount:(NSUInteger)count type:(MLCNumericType)type; {
+	void *bytes = calloc(count ?: 1, numericTypeSize(type));
+	if (!bytes)
+		return nil;
+
+	return [self initWithBytesNoCopy:bytes count:count type:type freeWhenDone:YES];
+}
+
+- (id)initWithBytes:(const void *)bytes count:(NSUInteger)count type:(MLCNumericType)type; {
+	size_t length = count * numericTypeSize(type);
+
+	void *copiedBytes = malloc(length ?: 1);
+	if (!copiedBytes)
+		return nil;
+
+	memcpy(copiedBytes, bytes, length);
+	return [self initWithBytesNoCopy:copiedBytes count:count type:type freeWhenDone:YES];
+}
+
+- (id)initWithBytesNoCopy:(void *)bytes count:(NSUInteger)count type:(MLCNumericType)type freeWhenDone:(BOOL)freeWhenDone; {
+	self = [super init];
+	if (!self) {
+		if (freeWhenDone)
+			free(bytes);
+
+		return nil;
+	}
+
+	self.bytes = bytes;
+	self.count = count;
+	self.type = type;
+	m_freeWhenDone = freeWhenDone;
+
+	return self;
+}
+
+- (id)initWithTableAtStackIndex:(int)index ofState:(MLCState *)state type:(MLCNumericType)type; {
+	lua_State *L = state.state;
+	if (!lua_istable(L, index))
+		return nil;
+
+	size_t count = lua_objlen(L, index);
+	self = [self initWithCount:count type:type];
+	if (!self)
+		return nil;
+
+	[state growStackBySize:1];
+
+	// make the index absolute, since we'll be pushing values
+	if (index < 0 && index > LUA_REGISTRYINDEX)
+		index = lua_gettop(L) + index + 1;
+
+	void *bytes = self.bytes;
+	for (size_t i = 0;i < count;++i) {
+		// lua_rawgeti() takes an int, so index any elements beyond that
+		// range with a number key
+		if (i < INT_MAX) {
+			lua_rawgeti(L, index, (int)i + 1);
+		} else {
+			lua_pushnumber(L, (lua_Number)i + 1);
+			lua_rawget(L, index);
+		}
+
+		setNumericElement(type, bytes, i, lua_tonumber(L, -1));
+		lua_pop(L, 1);
+	}
+
+	return self;
+}
+
+- (void)dealloc {
+	if (m_freeWhenDone)
+		free(m_bytes);
+
+	m_bytes = NULL;
+}
+
+- (size_t)elementSize {
+	return numericTypeSize(self.type);
+}
+
+- (double)doubleAtIndex:(NSUInteger)index; {
+	NSParameterAssert(index < self.count);
+	return getNumericElement(self.type, self.bytes, index);
+}
+
+- (void)setDouble:(double)value atIndex:(NSUInteger)index; {
+	NSParameterAssert(index < self.count);
+	setNumericElement(self.type, self.bytes, index, value);
+}
+
+- (void)pushTableOntoStack:(MLCState *)state; {
+	// reserve space for a new table and each key and value
+	[state growStackBySize:3];
+
+	lua_State *L = state.state;
+	NSUInteger count = self.count;
+
+	if (count <= INT_MAX) {
+		lua_createtable(L, (int)count, 0);
+	} else {
+		lua_newtable(L);
+	}
+
+	MLCNumericType type = self.type;
+	const void *bytes = self.bytes;
+
+	for (NSUInteger i = 0;i < count;++i) {
+		lua_pushnumber(L, getNumericElement(type, bytes, i));
+
+		// Lua indices start at one, so adjust appropriately (and
+		// lua_rawseti() takes an int, so use a number key beyond that range)
+		if (i < INT_MAX) {
+			lua_rawseti(L, -2, (int)i + 1);
+		} else {
+			lua_pushnumber(L, (lua_Number)i + 1);
+			lua_insert(L, -2);
+			lua_rawset(L, -3);
+		}
+	}
+}
+
+#pragma mark MLCValue
+
++ (BOOL)isOnStack:(MLCState *)state; {
+	[state growStackBySize:2];
+	return MLCIsNumericArray(state.state, -1);
+}
+
++ (id)popFromStack:(MLCState *)state; {
+	[state growStackBySize:2];
+
+	MLCNumericArrayUserdata *userdata = toNumericArrayUserdata(state.state, -1);
+
+	id array = nil;
+	if (userdata)
+		array = (__bridge id)userdata->array;
+
+	// Lua can garbage collect an object being popped off the stack, so we wait
+	// to pop until we've retrieved the array
+	lua_pop(state.state, 1);
+	return array;
+}
+
+- (void)pushOntoStack:(MLCState *)state; {
+	// metatable + userdata + metatable copy
+	[state growStackBySize:3];
+
+	lua_State *L = state.state;
+	pushNumericArrayMetatable(L);
+
+	MLCNumericArrayUserdata *userdata = lua_newuserdata(L, sizeof(*userdata));
+	userdata->array = (__bridge_retained void *)self;
+	userdata->bytes = self.bytes;
+	userdata->count = self.count;
+	userdata->type = self.type;
+
+	lua_pushvalue(L, -2);
+	lua_setmetatable(L, -2);
+
+	// remove the metatable, leaving the userdata
+	lua_remove(L, -2);
+}
+
+@end
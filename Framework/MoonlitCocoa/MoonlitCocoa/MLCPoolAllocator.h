@@ -0,0 +1,46 @@
+//
+//  MLCPoolAllocator.h
+//  MoonlitCocoa
+//
+//  Created by agent on 17.10.26.
+//  Released into the public domain.
+//
+
+#import <Foundation/Foundation.h>
+#import <lua.h>
+
+/**
+ * The largest block, in bytes, which is served from a pool instead of \c
+ * malloc.
+ */
+#define MLCPoolAllocatorMaximumBlockSize 256
+
+/**
+ * A Lua allocator which serves small blocks (such as strings, tables, closures,
+ * and userdata) from free lists of fixed-size blocks, one for every 16 bytes up
+ * to #MLCPoolAllocatorMaximumBlockSize. Larger blocks are allocated with \c
+ * malloc.
+ *
+ * Memory for pooled blocks is obtained in large slabs, which are only released
+ * when the allocator is destroyed. An allocator must not be used by more than
+ * one Lua state.
+ */
+typedef struct MLCPoolAllocator MLCPoolAllocator;
+
+/**
+ * Creates a new, empty allocator. Returns \c NULL if memory could not be
+ * allocated.
+ */
+MLCPoolAllocator *MLCPoolAllocatorCreate (void);
+
+/**
+ * Releases all memory owned by \a allocator. Any Lua state using \a allocator
+ * must be closed first.
+ */
+void MLCPoolAllocatorDestroy (MLCPoolAllocator *allocator);
+
+/**
+ * A \c lua_Alloc function, which must be passed an #MLCPoolAllocator as its
+ * user data.
+ */
+void *MLCPoolAllocatorAllocate (void *allocator, void *ptr, size_t oldSize, size_t newSize);
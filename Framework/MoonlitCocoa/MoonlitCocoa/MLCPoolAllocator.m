@@ -0,0 +1,187 @@
+//
+//  MLCPoolAllocator.m
+//  MoonlitCocoa
+//
+//  Created by agent on 17.10.26.
+//  Released into the public domain.
+//
+
+#import "MLCPoolAllocator.h"
+
+/**
+ * The difference in size between consecutive size classes. This is also the
+ * alignment of every pooled block.
+ */
+#define MLCPoolAllocatorGranularity 16
+
+/**
+ * The number of size classes with their own free lists.
+ */
+#define MLCPoolAllocatorSizeClassCount (MLCPoolAllocatorMaximumBlockSize / MLCPoolAllocatorGranularity)
+
+/**
+ * The size of each slab of memory carved into pooled blocks.
+ */
+#define MLCPoolAllocatorSlabSize 16384
+
+/**
+ * A free block, linked to the next free block of the same size class.
+ */
+typedef struct MLCPoolBlock {
+	struct MLCPoolBlock *next;
+} MLCPoolBlock;
+
+/**
+ * The header of a slab. Blocks begin #MLCPoolAllocatorGranularity bytes after
+ * the start of the slab, to preserve their alignment.
+ */
+typedef struct MLCPoolSlab {
+	struct MLCPoolSlab *next;
+} MLCPoolSlab;
+
+struct MLCPoolAllocator {
+	/**
+	 * Free blocks of each size class.
+	 */
+	MLCPoolBlock *freeLists[MLCPoolAllocatorSizeClassCount];
+
+	/**
+	 * Every slab allocated so far, so that they can be released together.
+	 */
+	MLCPoolSlab *slabs;
+};
+
+/**
+ * Returns the size class for blocks of \a size bytes, or
+ * #MLCPoolAllocatorSizeClassCount if such blocks are not pooled.
+ */
+static size_t sizeClassForSize (size_t size) {
+	if (size == 0 || size > MLCPoolAllocatorMaximumBlockSize)
+		return MLCPoolAllocatorSizeClassCount;
+
+	return (size - 1) / MLCPoolAllocatorGranularity;
+}
+
+/**
+ * Carves a new slab into blocks of \a sizeClass, and adds them to its free
+ * list. Returns \c NO if the slab could not be allocated.
+ */
+static BOOL refillSizeClass (MLCPoolAllocator *allocator, size_t sizeClass) {
+	char *slab = malloc(MLCPoolAllocatorSlabSize);
+	if (!slab)
+		return NO;
+
+	((MLCPoolSlab *)slab)->next = allocator->slabs;
+	allocator->slabs = (MLCPoolSlab *)slab;
+
+	size_t blockSize = (sizeClass + 1) * MLCPoolAllocatorGranularity;
+	char *end = slab + MLCPoolAllocatorSlabSize;
+
+	for (char *block = slab + MLCPoolAllocatorGranularity;block + blockSize <= end;block += blockSize) {
+		((MLCPoolBlock *)block)->next = allocator->freeLists[sizeClass];
+		allocator->freeLists[sizeClass] = (MLCPoolBlock *)block;
+	}
+
+	return YES;
+}
+
+/**
+ * Returns a new block of at least \a size bytes, or \c NULL if memory could not
+ * be allocated.
+ */
+static void *allocateBlock (MLCPoolAllocator *allocator, size_t size) {
+	size_t sizeClass = sizeClassForSize(size);
+	if (sizeClass == MLCPoolAllocatorSizeClassCount)
+		return malloc(size);
+
+	if (!allocator->freeLists[sizeClass] && !refillSizeClass(allocator, sizeClass))
+		return NULL;
+
+	MLCPoolBlock *block = allocator->freeLists[sizeClass];
+	allocator->freeLists[sizeClass] = block->next;
+	return block;
+}
+
+/**
+ * Releases \a ptr, which was allocated with \a size bytes.
+ */
+static void releaseBlock (MLCPoolAllocator *allocator, void *ptr, size_t size) {
+	size_t sizeClass = sizeClassForSize(size);
+	if (sizeClass == MLCPoolAllocatorSizeClassCount) {
+		free(ptr);
+		return;
+	}
+
+	MLCPoolBlock *block = ptr;
+	block->next = allocator->freeLists[sizeClass];
+	allocator->freeLists[sizeClass] = block;
+}
+
+MLCPoolAllocator *MLCPoolAllocatorCreate (void) {
+	return calloc(1, sizeof(MLCPoolAllocator));
+}
+
+void MLCPoolAllocatorDestroy (MLCPoolAllocator *allocator) {
+	if (!allocator)
+		return;
+
+	MLCPoolSlab *slab = allocator->slabs;
+	while (slab) {
+		MLCPoolSlab *next = slab->next;
+		free(slab);
+		slab = next;
+	}
+
+	free(allocator);
+}
+
+void *MLCPoolAllocatorAllocate (void *ud, void *ptr, size_t oldSize, size_t newSize) {
+	MLCPoolAllocator *allocator = ud;
+
+	// Lua only provides the size of existing blocks
+	if (!ptr)
+		oldSize = 0;
+
+	if (newSize == 0) {
+		if (ptr)
+			releaseBlock(allocator, ptr, oldSize);
+
+		return NULL;
+	}
+
+	if (!ptr)
+		return allocateBlock(allocator, newSize);
+
+	size_t oldClass = sizeClassForSize(oldSize);
+	size_t newClass = sizeClassForSize(newSize);
+
+	if (oldClass == newClass) {
+		if (oldClass != MLCPoolAllocatorSizeClassCount)
+			return ptr;
+
+		void *newPtr = realloc(ptr, newSize);
+
+		// Lua assumes that shrinking a block never fails, and the existing
+		// block is large enough anyways
+		if (!newPtr && newSize < oldSize)
+			return ptr;
+
+		return newPtr;
+	}
+
+	void *newPtr = allocateBlock(allocator, newSize);
+	if (!newPtr) {
+		// as above -- the existing block will later be released into the
+		// pool for its new size, which is harmless, since it's larger than
+		// the blocks of that size class
+		if (newSize < oldSize)
+			return ptr;
+
+		return NULL;
+	}
+
+	memcpy(newPtr, ptr, MIN(oldSize, newSize));
+	releaseBlock(allocator, ptr, oldSize);
+
+	return newPtr;
+}
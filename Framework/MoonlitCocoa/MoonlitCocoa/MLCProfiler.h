@@ -0,0 +1,228 @@
+//
+//  MLCProfiler.h
+//  MoonlitCocoa
+//
+//  Created by agent on 17.10.26.
+//  Released into the public domain.
+//
+
+#import <Foundation/Foundation.h>
+
+#ifdef __APPLE__
+#import <mach/mach_time.h>
+#else
+#import <time.h>
+#endif
+
+@class MLCState;
+
+/**
+ * The number of buckets in the latency histogram of an #MLCCrossingStatistics
+ * object.
+ */
+#define MLCProfilerHistogramBucketCount 40
+
+/**
+ * Identifies a path by which a call crosses between Objective-C and Lua.
+ */
+typedef enum {
+	/**
+	 * A message forwarded to Lua by MLCBridgedObject#forwardInvocation:.
+	 */
+	MLCProfilerCrossingForwardedInvocation,
+
+	/**
+	 * A key looked up in Lua by MLCBridgedObject#valueForUndefinedKey:.
+	 */
+	MLCProfilerCrossingUndefinedKey,
+
+	/**
+	 * An Objective-C method invoked from Lua through
+	 * MLCState#trampolineFunction.
+	 */
+	MLCProfilerCrossingTrampoline,
+
+	/**
+	 * A Lua function called through a method added by
+	 * MLCBridgedObject#resolveInstanceMethod:.
+	 */
+	MLCProfilerCrossingLuaMethod,
+
+	/**
+	 * The number of kinds of crossings.
+	 */
+	MLCProfilerCrossingCount
+} MLCProfilerCrossing;
+
+/**
+ * Returns the current time, in the units used by #MLCProfiler for start times.
+ */
+static inline uint64_t MLCProfilerCurrentTime (void) {
+	#ifdef __APPLE__
+	return mach_absolute_time();
+	#else
+	// elsewhere, these units are simply nanoseconds
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+	#endif
+}
+
+/**
+ * Converts an interval in the units of #MLCProfilerCurrentTime into
+ * nanoseconds.
+ */
+uint64_t MLCProfilerNanosecondsFromTime (uint64_t time);
+
+/**
+ * Statistics about the calls made to one selector along one kind of crossing.
+ */
+@interface MLCCrossingStatistics : NSObject
+/**
+ * The kind of crossing these statistics were collected from.
+ */
+@property (nonatomic, readonly) MLCProfilerCrossing crossing;
+
+/**
+ * The name of the selector (or key) which was called.
+ */
+@property (nonatomic, copy, readonly) NSString *selectorName;
+
+/**
+ * The number of calls made.
+ */
+@property (nonatomic, readonly) NSUInteger callCount;
+
+/**
+ * The total number of arguments and return values converted between
+ * Objective-C and Lua.
+ */
+@property (nonatomic, readonly) NSUInteger conversionCount;
+
+/**
+ * The total size of the arguments and return values marshaled, as laid out in
+ * memory by Objective-C. This does not include the contents of objects (such
+ * as the characters of a string).
+ */
+@property (nonatomic, readonly) unsigned long long byteCount;
+
+/**
+ * The total time spent in all calls.
+ */
+@property (nonatomic, readonly) NSTimeInterval totalTime;
+
+/**
+ * The time spent in the longest call.
+ */
+@property (nonatomic, readonly) NSTimeInterval maximumTime;
+
+/**
+ * The number of calls whose duration fell into each bucket, as \c NSNumber
+ * objects. The bucket at index \c i counts calls taking at least 2^i
+ * nanoseconds, but less than 2^(i+1) nanoseconds.
+ */
+@property (nonatomic, copy, readonly) NSArray *histogram;
+@end
+
+/**
+ * Collects statistics about calls crossing between Objective-C and Lua in any
+ * number of states, and can sample the Lua call stack of those states to find
+ * where their time goes.
+ *
+ * A profiler is attached to a state with MLCState#setProfiler:, and can be
+ * attached and detached at any time. States without a profiler only pay for
+ * checking whether one exists.
+ *
+ * All methods of this class are thread-safe.
+ */
+@interface MLCProfiler : NSObject
+/**
+ * Whether calls crossing between Objective-C and Lua in attached states are
+ * counted and timed. The default value is \c YES.
+ */
+@property (assign) BOOL recordsCrossings;
+
+/**
+ * The interval between samples of the Lua stack, while #startSampling is in
+ * effect. The default value is one millisecond.
+ *
+ * @note Changes to this property do not take effect until sampling is
+ * restarted.
+ */
+@property (assign) NSTimeInterval samplingInterval;
+
+/**
+ * Whether the Lua stacks of attached states are currently being sampled.
+ */
+@property (readonly, getter = isSampling) BOOL sampling;
+
+/**
+ * Begins sampling the Lua stack of each attached state every
+ * #samplingInterval. Each sample is taken from the thread (or coroutine)
+ * executing Lua code in the state at that moment, so states which are idle,
+ * or running Objective-C code, are not sampled.
+ *
+ * Coroutines are tracked through \c coroutine.resume and \c coroutine.wrap,
+ * which are replaced when a profiler is first attached to a state. Coroutines
+ * resumed through copies of those functions taken beforehand are sampled as
+ * part of the thread which resumed them.
+ */
+- (void)startSampling;
+
+/**
+ * Stops sampling. Samples already taken are kept until #reset.
+ */
+- (void)stopSampling;
+
+/**
+ * Returns an #MLCCrossingStatistics object for each selector which has been
+ * called along any crossing, sorted by descending total time.
+ */
+- (NSArray *)crossingStatistics;
+
+/**
+ * Returns every sampled Lua stack in the "folded" format read by flame graph
+ * tools: one line per unique stack, listing each frame from the outermost
+ * inwards (separated by semicolons), then a space and the number of samples.
+ *
+ * Each frame is described by its function name, source, and current line.
+ */
+- (NSString *)foldedStacks;
+
+/**
+ * Writes #foldedStacks to the file at \a URL as UTF-8. Returns \c NO and fills
+ * in \a error (if provided) if the file could not be written.
+ */
+- (BOOL)writeFoldedStacksToURL:(NSURL *)URL error:(NSError **)error;
+
+/**
+ * Discards all statistics and samples collected so far.
+ */
+- (void)reset;
+
+/**
+ * Records a call to \a selector along the given crossing, which started at \a
+ * startTime (as returned by #MLCProfilerCurrentTime) and has just finished. \a
+ * signature is used to count the conversions and bytes involved, and may be
+ * \c nil for a key which was read without arguments.
+ *
+ * This is invoked automatically by MoonlitCocoa for each crossing in an
+ * attached state.
+ */
+- (void)recordCrossing:(MLCProfilerCrossing)crossing selector:(SEL)selector signature:(NSMethodSignature *)signature startTime:(uint64_t)startTime;
+
+/**
+ * Includes \a state in sampling. This is invoked automatically by
+ * MLCState#setProfiler:, and should not be invoked directly.
+ *
+ * @note The receiver retains \a state until #removeState: is invoked.
+ */
+- (void)addState:(MLCState *)state;
+
+/**
+ * Removes \a state from sampling. This is invoked automatically by
+ * MLCState#setProfiler:, and should not be invoked directly.
+ */
+- (void)removeState:(MLCState *)state;
+@end
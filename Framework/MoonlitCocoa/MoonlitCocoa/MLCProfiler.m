@@ -0,0 +1,622 @@
+//
+//  MLCProfiler.m
+//  MoonlitCocoa
+//
+//  Created by agent on 17.10.26.
+//  Released into the public domain.
+//
+
+#import "MLCProfiler.h"
+#import "MLCState.h"
+#import <dispatch/dispatch.h>
+#import <lua.h>
+#import <pthread.h>
+
+/**
+ * The maximum number of Lua stack frames recorded in a sample.
+ */
+#define MLCProfilerMaximumSampleDepth 64
+
+/**
+ * The maximum length of a function name recorded in a sample, including the
+ * terminating \c NUL. Longer names are truncated.
+ */
+#define MLCProfilerMaximumNameLength 64
+
+/**
+ * The number of samples which can be taken between two runs of the sampling
+ * timer, which symbolicates them. Further samples are dropped.
+ */
+#define MLCProfilerSampleBufferCapacity 32
+
+/**
+ * The key in the registry of each attached state whose value is the
+ * #MLCProfilerSampleBuffer of its profiler, as a light userdata.
+ */
+static char MLCProfilerRegistryKey;
+
+/**
+ * One frame of a sampled stack, as read from \c lua_Debug.
+ */
+typedef struct {
+	char name[MLCProfilerMaximumNameLength];
+	char source[LUA_IDSIZE];
+	int currentLine;
+} MLCProfilerFrame;
+
+/**
+ * A sampled stack, from the innermost frame outwards.
+ */
+typedef struct {
+	int depth;
+	MLCProfilerFrame frames[MLCProfilerMaximumSampleDepth];
+} MLCProfilerSample;
+
+/**
+ * Samples taken by #samplingHook which have not been symbolicated yet. The
+ * hook runs in the middle of Lua code, so it only copies raw data into this
+ * preallocated buffer, without allocating memory or sending messages.
+ */
+typedef struct {
+	/**
+	 * Guards every other field.
+	 */
+	pthread_mutex_t mutex;
+
+	/**
+	 * When the hooks were last armed, as returned by #MLCProfilerCurrentTime.
+	 */
+	uint64_t armTime;
+
+	/**
+	 * The sampling interval, in nanoseconds.
+	 */
+	uint64_t samplingInterval;
+
+	NSUInteger count;
+	MLCProfilerSample samples[MLCProfilerSampleBufferCapacity];
+} MLCProfilerSampleBuffer;
+
+/**
+ * Counters for calls to a single selector along a single crossing.
+ */
+typedef struct {
+	NSUInteger callCount;
+	NSUInteger conversionCount;
+	unsigned long long byteCount;
+	uint64_t totalTime;
+	uint64_t maximumTime;
+	NSUInteger histogram[MLCProfilerHistogramBucketCount];
+
+	/**
+	 * The number of conversions involved in each call, calculated once from
+	 * the method signature.
+	 */
+	NSUInteger conversionsPerCall;
+
+	/**
+	 * The number of bytes marshaled by each call, calculated once from the
+	 * method signature.
+	 */
+	NSUInteger bytesPerCall;
+} MLCProfilerCounters;
+
+uint64_t MLCProfilerNanosecondsFromTime (uint64_t time) {
+	#ifdef __APPLE__
+	static mach_timebase_info_data_t timebase;
+	static dispatch_once_t pred;
+
+	dispatch_once(&pred, ^{
+		mach_timebase_info(&timebase);
+	});
+
+	return time * timebase.numer / timebase.denom;
+	#else
+	return time;
+	#endif
+}
+
+/**
+ * Returns the histogram bucket for a call lasting \a nanoseconds.
+ */
+static NSUInteger histogramBucket (uint64_t nanoseconds) {
+	NSUInteger bucket = 0;
+
+	while (nanoseconds > 1 && bucket < MLCProfilerHistogramBucketCount - 1) {
+		nanoseconds >>= 1;
+		++bucket;
+	}
+
+	return bucket;
+}
+
+@interface MLCCrossingStatistics ()
+@property (nonatomic, readwrite) MLCProfilerCrossing crossing;
+@property (nonatomic, copy, readwrite) NSString *selectorName;
+@property (nonatomic, readwrite) NSUInteger callCount;
+@property (nonatomic, readwrite) NSUInteger conversionCount;
+@property (nonatomic, readwrite) unsigned long long byteCount;
+@property (nonatomic, readwrite) NSTimeInterval totalTime;
+@property (nonatomic, readwrite) NSTimeInterval maximumTime;
+@property (nonatomic, copy, readwrite) NSArray *histogram;
+
+/**
+ * Initializes the receiver with a snapshot of \a counters.
+ */
+- (id)initWithCounters:(const MLCProfilerCounters *)counters crossing:(MLCProfilerCrossing)crossing selector:(SEL)selector;
+@end
+
+@implementation MLCCrossingStatistics
+@synthesize crossing = m_crossing;
+@synthesize selectorName = m_selectorName;
+@synthesize callCount = m_callCount;
+@synthesize conversionCount = m_conversionCount;
+@synthesize byteCount = m_byteCount;
+@synthesize totalTime = m_totalTime;
+@synthesize maximumTime = m_maximumTime;
+@synthesize histogram = m_histogram;
+
+- (id)initWithCounters:(const MLCProfilerCounters *)counters crossing:(MLCProfilerCrossing)crossing selector:(SEL)selector; {
+	self = [super init];
+	if (!self)
+		return nil;
+
+	self.crossing = crossing;
+	self.selectorName = NSStringFromSelector(selector);
+	self.callCount = counters->callCount;
+	self.conversionCount = counters->conversionCount;
+	self.byteCount = counters->byteCount;
+	self.totalTime = MLCProfilerNanosecondsFromTime(counters->totalTime) / 1e9;
+	self.maximumTime = MLCProfilerNanosecondsFromTime(counters->maximumTime) / 1e9;
+
+	NSMutableArray *histogram = [[NSMutableArray alloc] initWithCapacity:MLCProfilerHistogramBucketCount];
+	for (NSUInteger i = 0;i < MLCProfilerHistogramBucketCount;++i) {
+		[histogram addObject:[NSNumber numberWithUnsignedInteger:counters->histogram[i]]];
+	}
+
+	self.histogram = histogram;
+	return self;
+}
+
+- (NSString *)description {
+	static NSString * const crossingNames[MLCProfilerCrossingCount] = {
+		@"forwardInvocation",
+		@"valueForUndefinedKey",
+		@"trampoline",
+		@"luaMethod"
+	};
+
+	return [NSString stringWithFormat:@"<%@: %p>{ %@ %@, calls = %lu, conversions = %lu, bytes = %llu, total = %.6fs, max = %.6fs }", [self class], self, crossingNames[self.crossing], self.selectorName, (unsigned long)self.callCount, (unsigned long)self.conversionCount, self.byteCount, self.totalTime, self.maximumTime];
+}
+
+@end
+
+@interface MLCProfiler () {
+	/**
+	 * Guards all of the mutable state of the receiver.
+	 */
+	pthread_mutex_t m_mutex;
+
+	/**
+	 * For each #MLCProfilerCrossing, a map table from selectors to
+	 * #MLCProfilerCounters.
+	 */
+	NSMapTable *m_counters[MLCProfilerCrossingCount];
+
+	/**
+	 * Arms the sampling hook in each state, while sampling.
+	 */
+	dispatch_source_t m_samplingTimer;
+
+	/**
+	 * Samples not yet added to #samples.
+	 */
+	MLCProfilerSampleBuffer *m_sampleBuffer;
+}
+
+@property (readwrite, getter = isSampling) BOOL sampling;
+
+/**
+ * The states attached to the receiver.
+ */
+@property (nonatomic, strong) NSMutableSet *states;
+
+/**
+ * Every folded stack sampled, counted by the number of times it was sampled.
+ */
+@property (nonatomic, strong) NSCountedSet *samples;
+
+/**
+ * Moves every sample in #m_sampleBuffer into #samples, as a folded stack. The
+ * receiver's mutex must be held.
+ */
+- (void)symbolicateSamples;
+
+/**
+ * Sets the #MLCProfilerSampleBuffer in the registry of \a state to \a buffer,
+ * which may be \c NULL.
+ */
+- (void)setSampleBuffer:(MLCProfilerSampleBuffer *)buffer ofState:(MLCState *)state;
+
+/**
+ * Symbolicates the samples taken since the last run, and then arms the
+ * sampling hook on the running thread of each attached state.
+ */
+- (void)armSamplingHooks;
+@end
+
+/**
+ * Copies the string \a source into \a destination, which can hold \a size
+ * characters, truncating it if necessary.
+ */
+static void copyString (char *destination, const char *source, size_t size) {
+	size_t length = strlen(source);
+	if (length >= size)
+		length = size - 1;
+
+	memcpy(destination, source, length);
+	destination[length] = '\0';
+}
+
+/**
+ * Installed as a count hook on a sampled state for a single instruction, so
+ * that the next instruction it executes is sampled. The stack is only copied
+ * into the #MLCProfilerSampleBuffer here, and symbolicated later.
+ */
+static void samplingHook (lua_State *state, lua_Debug *ar) {
+	// disarm until the next sample is due
+	lua_sethook(state, NULL, 0, 0);
+
+	// the profiler may have been detached since the hook was armed, in which
+	// case the buffer is gone from the registry
+	lua_pushlightuserdata(state, &MLCProfilerRegistryKey);
+	lua_rawget(state, LUA_REGISTRYINDEX);
+
+	MLCProfilerSampleBuffer *buffer = lua_touserdata(state, -1);
+	lua_pop(state, 1);
+
+	if (!buffer)
+		return;
+
+	pthread_mutex_lock(&buffer->mutex);
+
+	// a hook which fires long after it was armed was left on a thread that
+	// stopped running soon afterwards, so it would land on whatever that
+	// thread happened to run first when it started again
+	uint64_t elapsed = MLCProfilerNanosecondsFromTime(MLCProfilerCurrentTime() - buffer->armTime);
+
+	if (elapsed <= buffer->samplingInterval && buffer->count < MLCProfilerSampleBufferCapacity) {
+		MLCProfilerSample *sample = &buffer->samples[buffer->count];
+		lua_Debug info;
+		int depth = 0;
+
+		while (depth < MLCProfilerMaximumSampleDepth && lua_getstack(state, depth, &info) && lua_getinfo(state, "Sln", &info)) {
+			MLCProfilerFrame *frame = &sample->frames[depth];
+
+			const char *name = info.name;
+			if (!name)
+				name = (strcmp(info.what, "main") == 0 ? "(main chunk)" : "?");
+
+			copyString(frame->name, name, sizeof(frame->name));
+			copyString(frame->source, info.short_src, sizeof(frame->source));
+			frame->currentLine = info.currentline;
+
+			++depth;
+		}
+
+		if (depth) {
+			sample->depth = depth;
+			++buffer->count;
+		}
+	}
+
+	pthread_mutex_unlock(&buffer->mutex);
+}
+
+@implementation MLCProfiler
+@synthesize recordsCrossings = m_recordsCrossings;
+@synthesize samplingInterval = m_samplingInterval;
+@synthesize sampling = m_sampling;
+@synthesize states = m_states;
+@synthesize samples = m_samples;
+
+- (id)init {
+	self = [super init];
+	if (!self)
+		return nil;
+
+	pthread_mutex_init(&m_mutex, NULL);
+
+	m_sampleBuffer = calloc(1, sizeof(*m_sampleBuffer));
+	if (!m_sampleBuffer)
+		return nil;
+
+	pthread_mutex_init(&m_sampleBuffer->mutex, NULL);
+
+	for (NSUInteger i = 0;i < MLCProfilerCrossingCount;++i) {
+		m_counters[i] = [[NSMapTable alloc]
+			initWithKeyOptions:NSPointerFunctionsOpaqueMemory | NSPointerFunctionsOpaquePersonality
+			valueOptions:NSPointerFunctionsMallocMemory | NSPointerFunctionsOpaquePersonality
+			capacity:0
+		];
+	}
+
+	self.recordsCrossings = YES;
+	self.samplingInterval = 0.001;
+	self.states = [[NSMutableSet alloc] init];
+	self.samples = [[NSCountedSet alloc] init];
+
+	return self;
+}
+
+- (void)dealloc {
+	[self stopSampling];
+	pthread_mutex_destroy(&m_mutex);
+
+	// every state has been removed by now, since each state retains its
+	// profiler, so no hook can still find the buffer
+	if (m_sampleBuffer) {
+		pthread_mutex_destroy(&m_sampleBuffer->mutex);
+		free(m_sampleBuffer);
+	}
+}
+
+#pragma mark Crossings
+
+- (void)recordCrossing:(MLCProfilerCrossing)crossing selector:(SEL)selector signature:(NSMethodSignature *)signature startTime:(uint64_t)startTime; {
+	uint64_t duration = MLCProfilerCurrentTime() - startTime;
+
+	if (!self.recordsCrossings)
+		return;
+
+	pthread_mutex_lock(&m_mutex);
+
+	MLCProfilerCounters *counters = NSMapGet(m_counters[crossing], selector);
+	if (!counters) {
+		counters = calloc(1, sizeof(*counters));
+
+		if (signature) {
+			NSUInteger argumentCount = [signature numberOfArguments];
+
+			// self and _cmd are not converted
+			for (NSUInteger i = 2;i < argumentCount;++i) {
+				NSUInteger size = 0;
+				NSGetSizeAndAlignment([signature getArgumentTypeAtIndex:i], &size, NULL);
+
+				counters->bytesPerCall += size;
+				++counters->conversionsPerCall;
+			}
+
+			if ([signature methodReturnLength]) {
+				counters->bytesPerCall += [signature methodReturnLength];
+				++counters->conversionsPerCall;
+			}
+		} else {
+			// a single object value
+			counters->bytesPerCall = sizeof(id);
+			counters->conversionsPerCall = 1;
+		}
+
+		NSMapInsert(m_counters[crossing], selector, counters);
+	}
+
+	++counters->callCount;
+	counters->conversionCount += counters->conversionsPerCall;
+	counters->byteCount += counters->bytesPerCall;
+	counters->totalTime += duration;
+
+	if (duration > counters->maximumTime)
+		counters->maximumTime = duration;
+
+	++counters->histogram[histogramBucket(MLCProfilerNanosecondsFromTime(duration))];
+
+	pthread_mutex_unlock(&m_mutex);
+}
+
+- (NSArray *)crossingStatistics; {
+	NSMutableArray *statistics = [[NSMutableArray alloc] init];
+
+	pthread_mutex_lock(&m_mutex);
+
+	for (NSUInteger i = 0;i < MLCProfilerCrossingCount;++i) {
+		NSMapEnumerator enumerator = NSEnumerateMapTable(m_counters[i]);
+
+		void *key;
+		void *value;
+		while (NSNextMapEnumeratorPair(&enumerator, &key, &value)) {
+			MLCCrossingStatistics *stats = [[MLCCrossingStatistics alloc] initWithCounters:value crossing:(MLCProfilerCrossing)i selector:key];
+			[statistics addObject:stats];
+		}
+
+		NSEndMapTableEnumeration(&enumerator);
+	}
+
+	pthread_mutex_unlock(&m_mutex);
+
+	[statistics sortUsingComparator:^(MLCCrossingStatistics *a, MLCCrossingStatistics *b){
+		if (a.totalTime > b.totalTime)
+			return NSOrderedAscending;
+		else if (a.totalTime < b.totalTime)
+			return NSOrderedDescending;
+		else
+			return NSOrderedSame;
+	}];
+
+	return statistics;
+}
+
+- (void)reset; {
+	pthread_mutex_lock(&m_mutex);
+
+	for (NSUInteger i = 0;i < MLCProfilerCrossingCount;++i) {
+		NSResetMapTable(m_counters[i]);
+	}
+
+	[self.samples removeAllObjects];
+
+	pthread_mutex_lock(&m_sampleBuffer->mutex);
+	m_sampleBuffer->count = 0;
+	pthread_mutex_unlock(&m_sampleBuffer->mutex);
+
+	pthread_mutex_unlock(&m_mutex);
+}
+
+#pragma mark Sampling
+
+- (void)addState:(MLCState *)state; {
+	[self setSampleBuffer:m_sampleBuffer ofState:state];
+
+	pthread_mutex_lock(&m_mutex);
+	[self.states addObject:state];
+	pthread_mutex_unlock(&m_mutex);
+}
+
+- (void)removeState:(MLCState *)state; {
+	[self setSampleBuffer:NULL ofState:state];
+
+	pthread_mutex_lock(&m_mutex);
+	[self.states removeObject:state];
+	pthread_mutex_unlock(&m_mutex);
+}
+
+- (void)setSampleBuffer:(MLCProfilerSampleBuffer *)buffer ofState:(MLCState *)state; {
+	// the hook reads the registry from the thread running the state, which
+	// holds its lock
+	[state lock];
+
+	@try {
+		[state growStackBySize:2];
+
+		lua_State *L = state.state;
+		lua_pushlightuserdata(L, &MLCProfilerRegistryKey);
+
+		if (buffer)
+			lua_pushlightuserdata(L, buffer);
+		else
+			lua_pushnil(L);
+
+		lua_rawset(L, LUA_REGISTRYINDEX);
+	} @finally {
+		[state unlock];
+	}
+}
+
+- (void)startSampling; {
+	pthread_mutex_lock(&m_mutex);
+
+	if (!m_samplingTimer) {
+		m_samplingTimer = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_HIGH, 0));
+
+		uint64_t interval = (uint64_t)(self.samplingInterval * NSEC_PER_SEC);
+
+		pthread_mutex_lock(&m_sampleBuffer->mutex);
+		m_sampleBuffer->samplingInterval = interval;
+		pthread_mutex_unlock(&m_sampleBuffer->mutex);
+		dispatch_source_set_timer(m_samplingTimer, dispatch_time(DISPATCH_TIME_NOW, (int64_t)interval), interval, interval / 10);
+
+		__weak MLCProfiler *weakSelf = self;
+		dispatch_source_set_event_handler(m_samplingTimer, ^{
+			[weakSelf armSamplingHooks];
+		});
+
+		dispatch_resume(m_samplingTimer);
+		self.sampling = YES;
+	}
+
+	pthread_mutex_unlock(&m_mutex);
+}
+
+- (void)stopSampling; {
+	pthread_mutex_lock(&m_mutex);
+
+	if (m_samplingTimer) {
+		dispatch_source_cancel(m_samplingTimer);
+
+		#if !OS_OBJECT_USE_OBJC
+		dispatch_release(m_samplingTimer);
+		#endif
+
+		m_samplingTimer = NULL;
+		self.sampling = NO;
+	}
+
+	// keep the samples taken since the timer last ran
+	[self symbolicateSamples];
+
+	pthread_mutex_unlock(&m_mutex);
+}
+
+- (void)armSamplingHooks; {
+	pthread_mutex_lock(&m_mutex);
+
+	[self symbolicateSamples];
+
+	pthread_mutex_lock(&m_sampleBuffer->mutex);
+	m_sampleBuffer->armTime = MLCProfilerCurrentTime();
+	pthread_mutex_unlock(&m_sampleBuffer->mutex);
+
+	for (MLCState *state in self.states) {
+		// idle states are left alone, so that samples are only taken while
+		// Lua code is actually running
+		[state armHookForRunningThread:&samplingHook];
+	}
+
+	pthread_mutex_unlock(&m_mutex);
+}
+
+- (void)symbolicateSamples; {
+	MLCProfilerSampleBuffer *buffer = m_sampleBuffer;
+
+	// a hook firing meanwhile waits for the buffer to be emptied
+	pthread_mutex_lock(&buffer->mutex);
+
+	for (NSUInteger i = 0;i < buffer->count;++i) {
+		const MLCProfilerSample *sample = &buffer->samples[i];
+		NSMutableArray *frames = [[NSMutableArray alloc] initWithCapacity:(NSUInteger)sample->depth];
+
+		// folded stacks list the outermost frame first
+		for (int depth = sample->depth - 1;depth >= 0;--depth) {
+			const MLCProfilerFrame *frame = &sample->frames[depth];
+
+			NSString *description;
+			if (frame->currentLine > 0)
+				description = [[NSString alloc] initWithFormat:@"%s (%s:%i)", frame->name, frame->source, frame->currentLine];
+			else
+				description = [[NSString alloc] initWithFormat:@"%s (%s)", frame->name, frame->source];
+
+			[frames addObject:description];
+		}
+
+		[self.samples addObject:[frames componentsJoinedByString:@";"]];
+	}
+
+	buffer->count = 0;
+	pthread_mutex_unlock(&buffer->mutex);
+}
+
+- (NSString *)foldedStacks; {
+	NSMutableArray *lines = [[NSMutableArray alloc] init];
+
+	pthread_mutex_lock(&m_mutex);
+
+	[self symbolicateSamples];
+
+	for (NSString *stack in self.samples) {
+		[lines addObject:[NSString stringWithFormat:@"%@ %lu", stack, (unsigned long)[self.samples countForObject:stack]]];
+	}
+
+	pthread_mutex_unlock(&m_mutex);
+
+	[lines sortUsingSelector:@selector(compare:)];
+
+	if (![lines count])
+		return @"";
+
+	return [[lines componentsJoinedByString:@"\n"] stringByAppendingString:@"\n"];
+}
+
+- (BOOL)writeFoldedStacksToURL:(NSURL *)URL error:(NSError **)error; {
+	return [[self foldedStacks] writeToURL:URL atomically:YES encoding:NSUTF8StringEncoding error:error];
+}
+
+@end
@@ -9,6 +9,10 @@
 #import <Foundation/Foundation.h>
 #import <lua.h>
 
+@class MLCNumericArray;
+@class MLCProfiler;
+@class MLCTask;
+
 /**
  * An error domain for error codes originating from Lua (i.e., codes with
  * symbolic names that begin with "LUA_").
@@ -20,37 +24,235 @@ extern NSString * const MLCLuaErrorDomain;
  */
 extern NSString * const MLCLuaStackOverflowException;
 
+/**
+ * The name of an exception thrown when Lua code called from Objective-C raises
+ * an error, and the caller has no other way to be told about it (for example,
+ * from a method implemented in Lua). The \c NSError describing the Lua error
+ * is under \c NSUnderlyingErrorKey in the user info of the exception.
+ */
+extern NSString * const MLCLuaErrorException;
+
 /**
  * Represents a Lua state.
+ *
+ * A Lua state must not be used by more than one thread at a time. Code which
+ * may share a state with other threads should bracket its use with #lock and
+ * #unlock. The lock is recursive, so a Lua function calling back into
+ * Objective-C may safely lock the same state again.
  */
-@interface MLCState : NSObject
+@interface MLCState : NSObject <NSLocking>
 /**
  * The state object managed by the receiver.
+ *
+ * While a coroutine is being run with #resumeThread:argumentCount:resultCount:,
+ * or calls into Objective-C after being resumed by Lua code, this is the
+ * coroutine's thread, so that any values pushed or popped by Objective-C code
+ * that it calls use the coroutine's stack.
  */
 @property (nonatomic, readonly) lua_State *state;
 
+/**
+ * The profiler collecting statistics about the receiver, or \c nil if the
+ * receiver is not being profiled. This can be changed at any time, from any
+ * thread. A profiler retains each state it is attached to, until it is
+ * detached by setting this property to \c nil (or another profiler).
+ *
+ * @note Objective-C methods invoked through FFI stubs, when built with \c
+ * MLC_USE_LUAJIT, are not counted by the profiler.
+ */
+@property (nonatomic, strong) MLCProfiler *profiler;
+
 /**
  * A Lua closure that can bridge to an Objective-C object. The function always
  * takes at least two arguments (\c self and \c _cmd), plus whatever arguments
  * the called method accepts. The closure takes one upvalue -- a light userdata
  * representing the #MLCState to use.
  *
+ * Optionally, the name of the selector to invoke may be provided as a second
+ * upvalue, in which case the closure only takes \c self and the arguments of
+ * the method.
+ *
  * @note Just as in Lua, the number of arguments passed are adjusted to the
  * number of parameters required by the method.
+ *
+ * The method signature, implementation, and argument types for each class and
+ * selector are looked up only once, and then cached by the #MLCState. Methods
+ * with only object arguments and simple return types are invoked directly,
+ * without creating an \c NSInvocation.
  */
 + (lua_CFunction)trampolineFunction;
 
+/**
+ * Pushes a Lua function which invokes the selector named \a selectorName on its
+ * first argument, an instance of \a cls, passing along any remaining arguments.
+ *
+ * Normally, this is a closure of #trampolineFunction. When MoonlitCocoa is
+ * built with \c MLC_USE_LUAJIT, methods whose arguments and return value are
+ * all simple scalars are instead invoked through an FFI call to \c
+ * objc_msgSend, which LuaJIT can compile into the calling trace.
+ */
+- (void)pushMethodFunctionForClass:(Class)cls selectorName:(const char *)selectorName;
+
+/**
+ * Returns the directory in which compiled Metalua scripts are cached, keyed by
+ * a hash of their source and the compiler version. By default, this is
+ * a "MoonlitCocoa/Bytecode" folder in the user's caches directory.
+ */
++ (NSURL *)bytecodeCacheURL;
+
+/**
+ * Sets the directory in which compiled Metalua scripts are cached. If \a URL
+ * is \c nil, scripts are compiled every time they are loaded.
+ *
+ * This may be changed at any time, from any thread. Scripts which are already
+ * being loaded may still use the previous directory.
+ */
++ (void)setBytecodeCacheURL:(NSURL *)URL;
+
 /**
  * Returns an autoreleased Lua state initialized with #init.
  */
 + (id)state;
 
+/**
+ * Returns the #MLCState which created \a state, or \c nil if \a state was not
+ * created by an #MLCState.
+ */
++ (MLCState *)stateForLuaState:(lua_State *)state;
+
 /**
  * Initializes the receiver as a new Lua state with a completely unique
- * execution context.
+ * execution context, which allocates memory from size-class pools.
  */
 - (id)init;
 
+/**
+ * Initializes the receiver as a new Lua state with a completely unique
+ * execution context, which allocates memory with \a allocator, passing it \a
+ * userData. If \a allocator is \c NULL, memory is allocated from size-class
+ * pools, as with #init.
+ *
+ * \a allocator is only ever invoked while the receiver is locked, and is
+ * wrapped in order to count the memory used and enforce the #memoryLimit.
+ *
+ * @note When built with \c MLC_USE_LUAJIT for a 64-bit architecture, LuaJIT
+ * always uses its own allocator, and \a allocator is ignored.
+ */
+- (id)initWithAllocator:(lua_Alloc)allocator userData:(void *)userData;
+
+/**
+ * The number of bytes currently allocated by the receiver.
+ */
+@property (nonatomic, readonly) size_t memoryUsage;
+
+/**
+ * The largest #memoryUsage of the receiver since it was created, or since
+ * #resetPeakMemoryUsage was last invoked.
+ */
+@property (nonatomic, readonly) size_t peakMemoryUsage;
+
+/**
+ * The estimated number of bytes used by Objective-C objects which are kept
+ * alive by Lua values in the receiver, as added with
+ * #addExternalMemoryOfSize:. This is not included in #memoryUsage.
+ */
+@property (nonatomic, readonly) size_t externalMemoryUsage;
+
+/**
+ * The maximum #memoryUsage that Lua code running in the receiver may grow to,
+ * or zero for no limit. The default value is zero. #externalMemoryUsage is
+ * not counted against this limit, since it is only an estimate, and it grows
+ * when objects are pushed from Objective-C, where it cannot be refused.
+ *
+ * When Lua code run with #callFunctionWithArgumentCount:resultCount:error: or
+ * #resumeThread:argumentCount:resultCount: would exceed this limit, the
+ * allocation fails with a \c LUA_ERRMEM error, which is returned from that
+ * method like any other. Memory allocated by Objective-C code outside of
+ * those methods is counted, but never refused.
+ *
+ * @note Memory limits are not supported by 64-bit LuaJIT.
+ */
+@property (nonatomic, assign) size_t memoryLimit;
+
+/**
+ * Resets #peakMemoryUsage to the current #memoryUsage.
+ */
+- (void)resetPeakMemoryUsage;
+
+/**
+ * Records that the Lua values in the receiver now keep \a size more bytes of
+ * memory alive outside of Lua, and advances the garbage collector as if Lua
+ * had allocated that much itself. The receiver must be locked.
+ *
+ * The garbage collector is advanced in a protected call, so this may be
+ * invoked outside of Lua code. An error raised by a \c __gc metamethod during
+ * the step is logged and discarded.
+ *
+ * This is invoked automatically for each #MLCBridgedObject pushed onto the
+ * receiver, using MLCBridgedObject#externalMemorySize.
+ */
+- (void)addExternalMemoryOfSize:(size_t)size;
+
+/**
+ * Records that \a size bytes added with #addExternalMemoryOfSize: are no
+ * longer kept alive by the receiver. The receiver must be locked.
+ */
+- (void)removeExternalMemoryOfSize:(size_t)size;
+
+/**
+ * Runs a full garbage collection cycle. This locks the receiver.
+ */
+- (void)collectGarbage;
+
+/**
+ * Performs an incremental step of garbage collection, doing as much work as
+ * if \a kilobytes of memory had been allocated (or a single basic step, if \a
+ * kilobytes is zero). Returns whether the step finished a collection cycle.
+ * This locks the receiver.
+ */
+- (BOOL)performGarbageCollectionStepOfSize:(NSUInteger)kilobytes;
+
+/**
+ * How long the incremental garbage collector waits before starting a new
+ * cycle, as a percentage of the memory in use after the previous cycle. The
+ * default value is 200, which waits for memory use to double.
+ *
+ * @note Lua 5.1 and LuaJIT only provide an incremental collector, so there is
+ * no generational mode to tune.
+ */
+@property (nonatomic, assign) int garbageCollectorPause;
+
+/**
+ * The speed of the incremental garbage collector, relative to allocation, as a
+ * percentage. The default value is 200, which collects twice as fast as
+ * memory is allocated.
+ */
+@property (nonatomic, assign) int garbageCollectorStepMultiplier;
+
+/**
+ * Whether the receiver should perform incremental garbage collection whenever
+ * the main run loop becomes idle after Lua code has run in the receiver. Each
+ * idle collection runs for at most a few milliseconds, and continues at the
+ * next idle time if the cycle did not finish. The default value is \c NO.
+ */
+@property (nonatomic, assign) BOOL collectsGarbageWhenIdle;
+
+/**
+ * Acquires the receiver's lock, blocking until it is available.
+ */
+- (void)lock;
+
+/**
+ * Attempts to acquire the receiver's lock without blocking, returning whether
+ * it was successful.
+ */
+- (BOOL)tryLock;
+
+/**
+ * Releases the receiver's lock.
+ */
+- (void)unlock;
+
 /**
  * Pops \a argCount arguments from the top of the stack and calls the function
  * that should then be at the top. The number of results is adjusted to \a
@@ -60,11 +262,113 @@ extern NSString * const MLCLuaStackOverflowException;
  */
 - (BOOL)callFunctionWithArgumentCount:(int)argCount resultCount:(int)resultCount error:(NSError **)error;
 
+/**
+ * Pops \a argCount arguments from the top of the stack and the function that
+ * should then be at the top, and calls the function in a new #MLCTask. The
+ * task runs until it suspends or finishes, and is then returned.
+ *
+ * \a handler is invoked when the task finishes, on whichever thread finished
+ * it, after the receiver has been unlocked.
+ */
+- (MLCTask *)startTaskWithArgumentCount:(int)argCount completionHandler:(void (^)(NSArray *results, NSError *error))handler;
+
+/**
+ * Resumes \a task, which must be suspended, passing \a values to the Lua code
+ * that suspended it. Returns \c NO if \a task was not suspended. See
+ * MLCTask#resumeWithValues:.
+ */
+- (BOOL)resumeTask:(MLCTask *)task withValues:(NSArray *)values;
+
+/**
+ * Cancels \a task, which will not be resumed again. See MLCTask#cancel.
+ */
+- (void)cancelTask:(MLCTask *)task;
+
+/**
+ * Pops the function at the top of the stack, and calls it once for each object
+ * in \a objects, passing that object as its only argument. Returns the first
+ * result of each call, in order, with \c nil results represented by \c
+ * NSNull.
+ *
+ * All of the calls are made in one batch, with the function pushed and the
+ * stack grown only once, which is much faster than calling the function
+ * separately for each object. If any call raises an error, the remaining
+ * objects are skipped, \c nil is returned, and \a error (if provided) is
+ * filled in with information about the error.
+ *
+ * The receiver must be locked while invoking this method.
+ */
+- (NSArray *)popFunctionAndMapObjects:(NSArray *)objects error:(NSError **)error;
+
+/**
+ * Pops the function at the top of the stack, and calls it once for each object
+ * in \a objects, as described in #popFunctionAndMapObjects:error:. Returns the
+ * objects for which the function returned a true value (in the Lua sense), in
+ * order.
+ */
+- (NSArray *)popFunctionAndFilterObjects:(NSArray *)objects error:(NSError **)error;
+
+/**
+ * Pops the function at the top of the stack, and calls it once for each object
+ * in \a objects, as described in #popFunctionAndMapObjects:error:. Each call is
+ * passed the result of the previous call (or \a initialValue, for the first
+ * call), followed by the object, and the result of the last call is returned.
+ *
+ * The intermediate results stay in Lua, and are never converted into
+ * Objective-C objects. If \a objects is empty, \a initialValue is converted
+ * into Lua and back, and returned.
+ */
+- (id)popFunctionAndReduceObjects:(NSArray *)objects initialValue:(id)initialValue error:(NSError **)error;
+
+/**
+ * Pops the function at the top of the stack, and calls it once for each
+ * element of \a array in \a range, passing the element as a number. The
+ * result of each call is converted to a number (with anything else becoming
+ * zero) and stored at the same index in \a results, which must be long
+ * enough to hold it, and may be \a array itself.
+ *
+ * The calls are made in one batch, as described in
+ * #popFunctionAndMapObjects:error:. Returns \c NO if any call raises an error,
+ * in which case the elements of \a results after the failing one are left
+ * unmodified.
+ */
+- (BOOL)popFunctionAndMapRange:(NSRange)range ofNumericArray:(MLCNumericArray *)array intoNumericArray:(MLCNumericArray *)results error:(NSError **)error;
+
+/**
+ * Resumes the coroutine \a thread, passing the \a argCount values at the top of
+ * its stack. If the coroutine has not started yet, the function to run must be
+ * beneath them.
+ *
+ * Once the coroutine yields, returns, or raises an error, the values it yielded
+ * or returned (or the error message) are moved onto the receiver's stack, and
+ * their number is stored in \a resultCount. Returns the status from \c
+ * lua_resume.
+ *
+ * @note #MLCTask should be used instead of this method whenever possible.
+ */
+- (int)resumeThread:(lua_State *)thread argumentCount:(int)argCount resultCount:(int *)resultCount;
+
+/**
+ * Installs \a hook as a count hook on the thread of the receiver which is
+ * currently executing Lua code, so that it runs before that thread's next
+ * instruction. Does nothing if the receiver is idle or running Objective-C
+ * code. Coroutines are included once the receiver has had a #profiler.
+ *
+ * Unlike most methods, this can be invoked without locking the receiver. This
+ * is invoked automatically by #MLCProfiler, and should not be invoked directly.
+ */
+- (void)armHookForRunningThread:(lua_Hook)hook;
+
 /**
  * Loads the given Metalua script, pushing a function representing the script
  * onto the receiver's stack and returning \c YES upon success. If an error
  * occurs, \c NO is returned, and \a error (if provided) is filled in with
  * information about the error.
+ *
+ * If the script has been compiled before, its bytecode is loaded from the
+ * #bytecodeCacheURL instead of running the Metalua compiler again. The
+ * compiler itself is only loaded into the receiver the first time a script
+ * actually needs to be compiled.
  */
 - (BOOL)loadScript:(NSString *)source error:(NSError **)error;
 
@@ -73,9 +377,33 @@ extern NSString * const MLCLuaStackOverflowException;
  * script onto the receiver's stack and returning \c YES upon success. If an
  * error occurs, \c NO is returned, and \a error (if provided) is filled in with
  * information about the error.
+ *
+ * If the file at \a URL has a .luac extension, it is loaded as precompiled
+ * bytecode using #loadBytecode:name:error:. If it has a .lua extension, it is
+ * loaded as plain Lua, without the Metalua compiler or the Metalua runtime.
+ *
+ * @note Plain Lua scripts used to be loaded after \c metalua.runtime, like
+ * Metalua scripts are. A plain Lua script which relies on the runtime (for
+ * example, on the globals that it defines) must now \c require it itself.
  */
 - (BOOL)loadScriptAtURL:(NSURL *)URL error:(NSError **)error;
 
+/**
+ * Loads a chunk of precompiled Lua bytecode (as created by \c lua_dump, \c
+ * luac, or the mluac.lua tool), pushing a function representing the chunk onto
+ * the receiver's stack and returning \c YES upon success. \a name is used to
+ * identify the chunk in error messages. If an error occurs, \c NO is returned,
+ * and \a error (if provided) is filled in with information about the error.
+ */
+- (BOOL)loadBytecode:(NSData *)bytecode name:(NSString *)name error:(NSError **)error;
+
+/**
+ * Discards any cached method signatures and implementations used by the
+ * #trampolineFunction. This must be invoked if the implementation of a method
+ * that has already been called from Lua is replaced at runtime.
+ */
+- (void)flushMethodCache;
+
 /**
  * Gets the value at \a index in the stack, attempting to create an Objective-C
  * object from its type. If no known mapping to Objective-C is known, \c nil is
@@ -132,6 +460,8 @@ extern NSString * const MLCLuaStackOverflowException;
  * @li If the value is a table, an \c NSDictionary is returned. This method will never convert a table into an \c NSArray (use the NSArray#arrayWithLuaDictionary: extension instead).
  * @li If the value is a full userdata, the corresponding instance of #MLCBridgedObject is returned.
  * @li If the value is a light userdata, it is interpreted as a pointer to an object, and the object is returned.
+ * @li If the value is a function, an #MLCLuaFunction referencing it is returned.
+ * @li If the value is a coroutine belonging to an unfinished #MLCTask, the task is returned.
  *
  * If none of the above rules match, \c nil is returned. In every case, the
  * topmost item on the stack is removed.
@@ -159,6 +489,11 @@ extern NSString * const MLCLuaStackOverflowException;
  * Pushes the value in \a buffer. \a buffer must contain data of the given
  * Objective-C type encoding. Returns \c NO if an error occurs trying to bridge
  * the given value into Lua.
+ *
+ * Structures are pushed as tables. The fields of well-known structures (such as
+ * \c NSRange, \c CGPoint, \c CGSize, and \c CGRect) are stored by name (e.g.,
+ * \c location and \c length, or \c origin and \c size), and the fields of any
+ * other structure are stored in order in the array part of the table.
  */
 - (BOOL)pushValue:(void *)buffer objCType:(const char *)type;
 
@@ -167,6 +502,9 @@ extern NSString * const MLCLuaStackOverflowException;
  * matching the given Objective-C type encoding. If the type coercion succeeds,
  * \a buffer is filled in with the value and \c YES is returned. Returns \c NO
  * and zeroes out \a buffer if an error occurs.
+ *
+ * Structures are popped from tables laid out as described in
+ * #pushValue:objCType:, with any missing fields set to zero.
  */
 - (BOOL)popValue:(void *)buffer objCType:(const char *)type;
 
@@ -8,20 +8,398 @@
 
 #import "MLCState.h"
 #import "MLCBridgedObject.h"
+#import "MLCInvocationPlan.h"
+#import "MLCLuaFunction.h"
+#import "MLCMarshaling.h"
+#import "MLCMarshalingPlan.h"
+#import "MLCNumericArray.h"
+#import "MLCPoolAllocator.h"
+#import "MLCProfiler.h"
+#import "MLCTask.h"
 #import "MLCValue.h"
 #import "NSDictionary+LuaAdditions.h"
 #import "NSNull+LuaAdditions.h"
 #import "NSNumber+LuaAdditions.h"
 #import "NSString+LuaAdditions.h"
+#import <dispatch/dispatch.h>
 #import <lauxlib.h>
 #import <lualib.h>
 #import <objc/runtime.h>
+#import <pthread.h>
+
+#if MLC_USE_LUAJIT
+#import <luajit.h>
+#endif
 
 NSString * const MLCLuaErrorDomain = @"MLCLuaErrorDomain";
 NSString * const MLCLuaStackOverflowException = @"MLCLuaStackOverflowException";
+NSString * const MLCLuaErrorException = @"MLCLuaErrorException";
+
+/**
+ * The address of this variable is used as the registry key for a light
+ * userdata pointing back to the #MLCState that owns a Lua state.
+ */
+static char MLCStateRegistryKey;
+
+#if MLC_USE_LUAJIT
+/**
+ * The address of this variable is used as the registry key for the MLCFFI Lua
+ * module, which generates FFI stubs for bridged methods.
+ */
+static char MLCFFIModuleRegistryKey;
+
+/**
+ * The type encodings of arguments and return values which can be passed
+ * through an FFI stub. 64-bit integers are excluded, since LuaJIT returns them
+ * as boxed cdata instead of numbers.
+ */
+static const char * const MLCFFIScalarTypes = "cCiIsSfdB";
+#endif
+
+/**
+ * Incremented whenever the way scripts are compiled changes, invalidating
+ * every existing entry in the bytecode cache.
+ */
+static const int MLCBytecodeCacheFormatVersion = 2;
+
+/**
+ * The directory in which compiled scripts are cached, or \c nil if the cache
+ * is disabled. This is protected by #MLCBytecodeCacheMutex.
+ */
+static NSURL *MLCBytecodeCacheDirectoryURL = nil;
+
+/**
+ * Guards #MLCBytecodeCacheDirectoryURL, which may be changed while other
+ * threads are loading scripts.
+ */
+static pthread_mutex_t MLCBytecodeCacheMutex = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Identifies the Lua implementation and compiler used to create cached
+ * bytecode. This is hashed along with the source of each script, and written
+ * into the header of each cache entry.
+ */
+static NSString *MLCCompilerVersion = nil;
+
+/**
+ * Returns the 64-bit FNV-1a hash of \a length bytes at \a bytes, continuing
+ * from \a hash.
+ */
+static uint64_t hashBytes (const void *bytes, size_t length, uint64_t hash) {
+	const unsigned char *ptr = bytes;
+
+	for (size_t i = 0;i < length;++i) {
+		hash ^= ptr[i];
+		hash *= 1099511628211ULL;
+	}
+
+	return hash;
+}
+
+/**
+ * A \c lua_Writer which appends the chunk pieces it is given to the \c
+ * NSMutableData pointed to by \a data.
+ */
+static int writeChunkToData (lua_State *state, const void *bytes, size_t length, void *data) {
+	[(__bridge NSMutableData *)data appendBytes:bytes length:length];
+	return 0;
+}
+
+/**
+ * Tracks the memory allocated by a Lua state, and enforces its limit.
+ */
+typedef struct {
+	/**
+	 * The allocator which actually provides memory, or \c NULL if the state
+	 * was not created with #allocateWithAccounting.
+	 */
+	lua_Alloc allocator;
+
+	/**
+	 * The user data passed to #allocator.
+	 */
+	void *userData;
+
+	size_t usage;
+	size_t peakUsage;
+
+	/**
+	 * The estimated memory used by Objective-C objects kept alive by the
+	 * state.
+	 */
+	size_t externalUsage;
+
+	/**
+	 * External memory added since the garbage collector was last advanced to
+	 * account for it.
+	 */
+	size_t externalDebt;
+
+	/**
+	 * The maximum #usage that a protected call may grow to, or zero if there
+	 * is no limit. #externalUsage is not counted, since it is only an
+	 * estimate, and it grows when values are pushed, where an allocation
+	 * cannot be refused.
+	 */
+	size_t limit;
+
+	/**
+	 * The number of protected calls currently running. Running out of memory
+	 * outside of a protected call would cause Lua to panic, so #limit is only
+	 * enforced when this is non-zero. This is reset to zero while Lua calls
+	 * into Objective-C.
+	 */
+	unsigned protectedCallDepth;
+} MLCMemoryAccount;
+
+/**
+ * A \c lua_Alloc which updates the #MLCMemoryAccount given as its user data,
+ * and forwards to the allocator that it contains. Growing a block fails if it
+ * would exceed the memory limit of the account.
+ */
+static void *allocateWithAccounting (void *ud, void *ptr, size_t oldSize, size_t newSize) {
+	MLCMemoryAccount *account = ud;
+
+	// Lua only provides the size of existing blocks
+	if (!ptr)
+		oldSize = 0;
+
+	size_t usage = account->usage - oldSize + newSize;
+	if (newSize > oldSize && account->limit && account->protectedCallDepth && usage > account->limit)
+		return NULL;
+
+	void *result = account->allocator(account->userData, ptr, oldSize, newSize);
+	if (result || newSize == 0) {
+		account->usage = usage;
+
+		if (usage > account->peakUsage)
+			account->peakUsage = usage;
+	}
+
+	return result;
+}
+
+/**
+ * Posted (with an #MLCState as the object) when the main run loop becomes idle
+ * after Lua code has run in a state which #collectsGarbageWhenIdle.
+ */
+static NSString * const MLCStateIdleGarbageCollectionNotification = @"MLCStateIdleGarbageCollectionNotification";
+
+/**
+ * The longest time that a single idle garbage collection may run for.
+ */
+static const NSTimeInterval MLCStateIdleGarbageCollectionTimeLimit = 0.005;
+
+/**
+ * Invoked by Lua when an error occurs outside of a protected call, after which
+ * the process is terminated. This matches the panic function installed by \c
+ * luaL_newstate.
+ */
+static int panic (lua_State *L) {
+	NSLog(@"Unprotected error in call to Lua API (%s)", lua_tostring(L, -1));
+	return 0;
+}
+
+@interface MLCState () {
+	/**
+	 * A recursive mutex used to implement the \c NSLocking protocol.
+	 */
+	pthread_mutex_t m_mutex;
+
+	/**
+	 * The memory used by #state. Its address is the user data of
+	 * #allocateWithAccounting.
+	 */
+	MLCMemoryAccount m_memoryAccount;
+
+	/**
+	 * The allocator created for the receiver if none was provided to
+	 * #initWithAllocator:userData:, or \c NULL.
+	 */
+	MLCPoolAllocator *m_poolAllocator;
+
+	int m_garbageCollectorPause;
+	int m_garbageCollectorStepMultiplier;
+	BOOL m_collectsGarbageWhenIdle;
+
+	/**
+	 * Whether an idle garbage collection has been requested, and not yet run.
+	 * This must only be accessed while the receiver is locked.
+	 */
+	BOOL m_idleGarbageCollectionScheduled;
+
+	/**
+	 * Whether the Metalua compiler has been loaded into #state. The compiler
+	 * is only loaded once a Metalua script actually needs to be compiled.
+	 */
+	BOOL m_loadedCompiler;
+
+	/**
+	 * The main thread of the Lua state. #state is temporarily replaced by
+	 * the stack of a coroutine while it calls into Objective-C, but this
+	 * never changes.
+	 */
+	lua_State *m_mainState;
+
+	/**
+	 * The thread of #state currently executing Lua code, or \c NULL if the
+	 * receiver is idle or running Objective-C code. This is read by
+	 * #armHookForRunningThread: without locking the receiver.
+	 */
+	lua_State * volatile m_runningThread;
+
+	/**
+	 * Held while #armHookForRunningThread: uses #m_runningThread, and while
+	 * it is changed from a thread which could then be garbage collected.
+	 */
+	pthread_mutex_t m_samplingMutex;
+
+	/**
+	 * Whether \c coroutine.resume and \c coroutine.wrap have been replaced
+	 * to update #m_runningThread.
+	 */
+	BOOL m_tracksCoroutines;
+
+	/**
+	 * Registry references given to #MLCStateReleaseReference while another
+	 * thread held the receiver's lock, which are released by #unlock. These
+	 * are protected by #m_pendingReferenceMutex, except that #unlock reads
+	 * the count without it; a reference added after that read waits for the
+	 * following #unlock.
+	 */
+	int *m_pendingReferences;
+	volatile size_t m_pendingReferenceCount;
+	size_t m_pendingReferenceCapacity;
+	pthread_mutex_t m_pendingReferenceMutex;
+}
+
+@property (nonatomic, readwrite) lua_State *state;
+
+/**
+ * Maps each target class to another map table, which in turn maps selector
+ * names (as C strings) to #MLCInvocationPlan objects.
+ */
+@property (nonatomic, strong) NSMapTable *invocationPlans;
+
+/**
+ * Returns a cached plan for invoking the selector named \a selectorName on
+ * instances of \a cls, creating one if necessary. Returns \c nil if instances
+ * of \a cls do not respond to the selector.
+ */
+- (MLCInvocationPlan *)invocationPlanForClass:(Class)cls selectorName:(const char *)selectorName;
+
+/**
+ * Returns the URL at which compiled bytecode for \a source (the UTF-8 bytes of
+ * a script) would be cached, or \c nil if the bytecode cache is disabled. \a
+ * header is set to the bytes which must begin the cache entry, identifying the
+ * compiler and the hash and length of \a source, so that an entry for any
+ * other source or compiler is never loaded.
+ */
+- (NSURL *)bytecodeCacheURLForSource:(NSData *)source header:(NSData **)header;
+
+/**
+ * Dumps the Lua function at the top of the stack into the bytecode cache at \a
+ * URL, after \a header. Failures are logged, but otherwise ignored, since the
+ * cache only exists to speed things up.
+ */
+- (void)writeFunctionOnStackToBytecodeCacheURL:(NSURL *)URL header:(NSData *)header;
+
+/**
+ * If the receiver #collectsGarbageWhenIdle, and has not already done so,
+ * enqueues an #MLCStateIdleGarbageCollectionNotification to be posted on the
+ * main thread when its run loop is idle. The receiver must be locked.
+ */
+- (void)scheduleIdleGarbageCollection;
+
+/**
+ * Pops the error message at the top of the stack, and returns an error with
+ * \a code (the status returned by Lua) which describes it.
+ */
+- (NSError *)popErrorWithCode:(int)code;
+
+/**
+ * Loads the Metalua compiler into the receiver, if it hasn't been loaded
+ * already. Returns \c NO and fills in \a error if the compiler could not be
+ * loaded.
+ */
+- (BOOL)loadCompilerWithError:(NSError **)error;
+
+/**
+ * Loads \a length bytes of Lua source or bytecode at \a bytes with \c
+ * luaL_loadbuffer, pushing the resulting function onto the receiver's stack.
+ */
+- (BOOL)loadChunk:(const char *)bytes length:(size_t)length name:(NSString *)name error:(NSError **)error;
+
+/**
+ * Invokes \a block, which should make one or more calls with
+ * #batchProtectedCall, stopping at and returning the first nonzero status. The
+ * receiver is considered to be running Lua code for the whole batch, but the
+ * memory limit only applies within each call. If \a block returns an error
+ * status, the error message is popped, and \a error (if provided) is filled in
+ * with information about it.
+ */
+- (BOOL)performBatchUsingBlock:(int (^)(void))block error:(NSError **)error;
+
+/**
+ * Performs incremental garbage collection for up to
+ * #MLCStateIdleGarbageCollectionTimeLimit, in response to an
+ * #MLCStateIdleGarbageCollectionNotification.
+ */
+- (void)collectGarbageWhenIdle:(NSNotification *)notification;
+
+/**
+ * Replaces the coroutine functions in #state with versions that update
+ * #m_runningThread, if that has not already been done.
+ */
+- (void)trackCoroutines;
+
+#if MLC_USE_LUAJIT
+/**
+ * Attempts to push an FFI stub invoking the selector named \a selectorName on
+ * instances of \a cls. Returns \c NO, leaving the stack unmodified, if the
+ * method cannot be called through the FFI.
+ */
+- (BOOL)pushFFIFunctionForClass:(Class)cls selectorName:(const char *)selectorName;
+#endif
+@end
+
+/**
+ * Calls \c lua_pcall on the stack of \a state for one element of a batch,
+ * enforcing the memory limit only for the duration of the call. Code between
+ * the calls of a batch converts values and may raise memory errors that
+ * nothing would catch, so the limit must not apply there.
+ */
+static int batchProtectedCall (__unsafe_unretained MLCState *state, int argCount, int resultCount);
+
+/**
+ * Replaces \c coroutine.resume in a state with a profiler, so that the state
+ * knows which of its threads is running. The original function is the first
+ * upvalue, and the #MLCState the second.
+ */
+static int resumeTrackingThread (lua_State *L);
+
+/**
+ * Replaces \c coroutine.wrap in a state with a profiler, so that wrapped
+ * coroutines are also resumed through #resumeTrackingThread. The chunk is
+ * passed the new \c coroutine.resume.
+ */
+static const char * const MLCTrackingCoroutineWrap =
+	"local resume = ...\n"
+	"local create, error = coroutine.create, error\n"
+	"local function finish (ok, ...)\n"
+	"	if not ok then error((...), 2) end\n"
+	"	return ...\n"
+	"end\n"
+	"function coroutine.wrap (f)\n"
+	"	local co = create(f)\n"
+	"	return function (...) return finish(resume(co, ...)) end\n"
+	"end\n";
 
 /**
  * Trampolines a Lua function call into an Objective-C invocation.
+ *
+ * If the closure has a second upvalue, it is used as the name of the selector
+ * to invoke, and the selector is not expected among the arguments.
  */
 static int trampolineToObjectiveC (lua_State *L) {
 	int args = lua_gettop(L);
@@ -30,170 +408,1120 @@ static int trampolineToObjectiveC (lua_State *L) {
 		lua_error(L);
 	}
 
-	if (args < 2) {
-		lua_pushliteral(L, "No selector included in Lua to Objective-C function call");
-		lua_error(L);
-	}
+	int stateIndex = lua_upvalueindex(1);
+	int selectorIndex = lua_upvalueindex(2);
+	int firstArgumentIndex = 2;
+
+	if (lua_isnil(L, selectorIndex)) {
+		if (args < 2) {
+			lua_pushliteral(L, "No selector included in Lua to Objective-C function call");
+			lua_error(L);
+		}
+
+		selectorIndex = 2;
+		firstArgumentIndex = 3;
+	}
+
+	// get the MLCState object associated with this Lua state
+	MLCState *state = (__bridge id)lua_touserdata(L, stateIndex);
+	if (!state) {
+		lua_pushliteral(L, "Could not get MLCState associated with Lua state");
+		lua_error(L);
+	}
+
+	// coroutines created by Lua code share the registry of the main state
+	if (L != state.state && [MLCState stateForLuaState:L] != state) {
+		lua_pushliteral(L, "Given MLCState upvalue is not associated with the current Lua state");
+		lua_error(L);
+	}
+
+	// get the selector that this function is trying to call
+	const char *selectorString = lua_tostring(L, selectorIndex);
+	if (!selectorString) {
+		lua_pushliteral(L, "Selector included in Lua to Objective-C function call is not a string");
+		lua_error(L);
+	}
+
+	MLCProfiler *profiler = state.profiler;
+	uint64_t startTime = (profiler ? MLCProfilerCurrentTime() : 0);
+	int resultCount = -1;
+
+	MLCInvocationPlan *plan = nil;
+	id target = nil;
+
+	MLCLuaExecutionContext context = MLCEnterObjectiveC(state, L);
+
+	@try {
+		@autoreleasepool {
+			// get the object upon which to invoke this method
+			target = [state getValueAtStackIndex:1];
+
+			if (target)
+				plan = [state invocationPlanForClass:object_getClass(target) selectorName:selectorString];
+
+			if (plan)
+				resultCount = [plan invokeWithTarget:target state:state argumentIndex:firstArgumentIndex];
+		}
+	} @finally {
+		MLCLeaveObjectiveC(state, context);
+	}
+
+	if (!plan) {
+		// raised only after leaving, since the error unwinds this frame
+		NSString *errorMessage = [NSString stringWithFormat:@"%@ does not recognize selector %s (methods must be called with a receiver, as in obj:method())", target, selectorString];
+		lua_pushstring(L, [errorMessage UTF8String]);
+
+		lua_error(L);
+	}
+
+	if (profiler)
+		[profiler recordCrossing:MLCProfilerCrossingTrampoline selector:plan.selector signature:plan.signature startTime:startTime];
+
+	return resultCount;
+}
+
+/**
+ * Performs a garbage collection step of the number of kilobytes pointed to by
+ * the light userdata argument. This is run with \c lua_cpcall, so that errors
+ * from \c __gc metamethods are caught.
+ */
+static int stepGarbageCollector (lua_State *L) {
+	int kilobytes = *(int *)lua_touserdata(L, 1);
+	lua_gc(L, LUA_GCSTEP, kilobytes);
+	return 0;
+}
+
+@implementation MLCState
+@synthesize state = m_state;
+@synthesize invocationPlans = m_invocationPlans;
+@synthesize profiler = m_profiler;
+
+// these are defined within the implementation so that they may read the ivars
+// directly
+lua_State *MLCStateGetLuaState (__unsafe_unretained MLCState *state) {
+	return state->m_state;
+}
+
+void MLCStateReleaseReference (__unsafe_unretained MLCState *state, int reference) {
+	if (reference == LUA_NOREF || reference == LUA_REFNIL)
+		return;
+
+	if (pthread_mutex_trylock(&state->m_mutex) == 0) {
+		// the lock is recursive, so this thread may already be in the middle
+		// of using the stack, which might not have room for luaL_unref()
+		if (lua_checkstack(state->m_state, 2)) {
+			luaL_unref(state->m_state, LUA_REGISTRYINDEX, reference);
+			[state unlock];
+			return;
+		}
+
+		pthread_mutex_unlock(&state->m_mutex);
+	}
+
+	pthread_mutex_lock(&state->m_pendingReferenceMutex);
+
+	if (state->m_pendingReferenceCount == state->m_pendingReferenceCapacity) {
+		size_t capacity = MAX(state->m_pendingReferenceCapacity * 2, (size_t)16);
+		int *references = realloc(state->m_pendingReferences, capacity * sizeof(*references));
+
+		if (references) {
+			state->m_pendingReferences = references;
+			state->m_pendingReferenceCapacity = capacity;
+		}
+	}
+
+	// if the array could not grow, the value stays in the registry until the
+	// state is closed
+	if (state->m_pendingReferenceCount < state->m_pendingReferenceCapacity)
+		state->m_pendingReferences[state->m_pendingReferenceCount++] = reference;
+
+	pthread_mutex_unlock(&state->m_pendingReferenceMutex);
+}
+
+MLCLuaExecutionContext MLCEnterObjectiveC (__unsafe_unretained MLCState *state, lua_State *L) {
+	MLCLuaExecutionContext context = {
+		.stack = state->m_state,
+		.protectedCallDepth = state->m_memoryAccount.protectedCallDepth,
+		.runningThread = state->m_runningThread
+	};
+
+	// the call may come from a coroutine that the state did not resume itself
+	state->m_state = L;
+
+	// any protected calls made by the Objective-C code will enforce the limit
+	// again, since errors in them cannot escape the call
+	state->m_memoryAccount.protectedCallDepth = 0;
+	state->m_runningThread = NULL;
+
+	return context;
+}
+
+void MLCLeaveObjectiveC (__unsafe_unretained MLCState *state, MLCLuaExecutionContext context) {
+	state->m_state = context.stack;
+	state->m_memoryAccount.protectedCallDepth = context.protectedCallDepth;
+	state->m_runningThread = context.runningThread;
+}
+
+static int batchProtectedCall (__unsafe_unretained MLCState *state, int argCount, int resultCount) {
+	int ret;
+
+	++state->m_memoryAccount.protectedCallDepth;
+
+	@try {
+		ret = lua_pcall(state->m_state, argCount, resultCount, 0);
+	} @finally {
+		--state->m_memoryAccount.protectedCallDepth;
+	}
+
+	return ret;
+}
+
+static int resumeTrackingThread (lua_State *L) {
+	MLCState *state = (__bridge MLCState *)lua_touserdata(L, lua_upvalueindex(2));
+	lua_State *thread = lua_tothread(L, 1);
+
+	lua_pushvalue(L, lua_upvalueindex(1));
+	lua_insert(L, 1);
+
+	if (!thread) {
+		// let the original function raise the error
+		lua_call(L, lua_gettop(L) - 1, LUA_MULTRET);
+		return lua_gettop(L);
+	}
+
+	lua_State *resumer = state->m_runningThread;
+	state->m_runningThread = thread;
+
+	// errors in the coroutine are returned, not raised
+	lua_call(L, lua_gettop(L) - 1, LUA_MULTRET);
+
+	// the coroutine may be collected once it is no longer running, so the
+	// profiler must not be arming it at the same time
+	pthread_mutex_lock(&state->m_samplingMutex);
+	state->m_runningThread = resumer;
+	pthread_mutex_unlock(&state->m_samplingMutex);
+
+	return lua_gettop(L);
+}
+
++ (void)initialize {
+	if (self != [MLCState class])
+		return;
+
+	NSString *bundleVersion = [[[NSBundle bundleForClass:self] infoDictionary] objectForKey:@"CFBundleVersion"];
+	#if MLC_USE_LUAJIT
+	// LuaJIT bytecode is incompatible with that of Lua 5.1
+	MLCCompilerVersion = [[NSString alloc] initWithFormat:@"%s/%@/%i", LUAJIT_VERSION, bundleVersion, MLCBytecodeCacheFormatVersion];
+	#else
+	MLCCompilerVersion = [[NSString alloc] initWithFormat:@"%s/%@/%i", LUA_RELEASE, bundleVersion, MLCBytecodeCacheFormatVersion];
+	#endif
+
+	NSArray *cachePaths = NSSearchPathForDirectoriesInDomains(NSCachesDirectory, NSUserDomainMask, YES);
+	if ([cachePaths count]) {
+		NSString *path = [[cachePaths objectAtIndex:0] stringByAppendingPathComponent:@"MoonlitCocoa/Bytecode"];
+		MLCBytecodeCacheDirectoryURL = [NSURL fileURLWithPath:path isDirectory:YES];
+	}
+}
+
++ (NSURL *)bytecodeCacheURL; {
+	pthread_mutex_lock(&MLCBytecodeCacheMutex);
+	NSURL *URL = MLCBytecodeCacheDirectoryURL;
+	pthread_mutex_unlock(&MLCBytecodeCacheMutex);
+
+	return URL;
+}
+
++ (void)setBytecodeCacheURL:(NSURL *)URL; {
+	URL = [URL copy];
+
+	pthread_mutex_lock(&MLCBytecodeCacheMutex);
+	MLCBytecodeCacheDirectoryURL = URL;
+	pthread_mutex_unlock(&MLCBytecodeCacheMutex);
+}
+
++ (lua_CFunction)trampolineFunction; {
+	return &trampolineToObjectiveC;
+}
+
+- (void)pushMethodFunctionForClass:(Class)cls selectorName:(const char *)selectorName; {
+	#if MLC_USE_LUAJIT
+	if ([self pushFFIFunctionForClass:cls selectorName:selectorName])
+		return;
+	#endif
+
+	[self growStackBySize:2];
+
+	// capture the MLCState and the selector name as upvalues
+	lua_pushlightuserdata(self.state, (__bridge void *)self);
+	lua_pushstring(self.state, selectorName);
+	lua_pushcclosure(self.state, [[self class] trampolineFunction], 2);
+}
+
+#if MLC_USE_LUAJIT
+- (BOOL)pushFFIFunctionForClass:(Class)cls selectorName:(const char *)selectorName; {
+	MLCInvocationPlan *plan = [self invocationPlanForClass:cls selectorName:selectorName];
+	if (!plan || !plan.implementation || plan.implementation == (IMP)_objc_msgForward)
+		return NO;
+
+	NSUInteger argumentCount = plan.argumentCount;
+	if (argumentCount > MLCInvocationPlanMaximumDirectArguments)
+		return NO;
+
+	if (*plan.returnType != 'v' && !strchr(MLCFFIScalarTypes, *plan.returnType))
+		return NO;
+
+	char argumentTypes[MLCInvocationPlanMaximumDirectArguments + 1] = { '\0' };
+	for (NSUInteger i = 0;i < argumentCount;++i) {
+		char type = *[plan typeOfArgumentAtIndex:i];
+		if (!strchr(MLCFFIScalarTypes, type))
+			return NO;
+
+		argumentTypes[i] = type;
+	}
+
+	lua_State *L = self.state;
+	int top = lua_gettop(L);
+
+	// module + stub function + four arguments
+	[self growStackBySize:6];
+
+	lua_pushlightuserdata(L, &MLCFFIModuleRegistryKey);
+	lua_rawget(L, LUA_REGISTRYINDEX);
+	if (!lua_istable(L, -1)) {
+		lua_settop(L, top);
+		return NO;
+	}
+
+	lua_getfield(L, -1, "stub");
+	lua_remove(L, -2);
+
+	lua_pushstring(L, selectorName);
+	lua_pushlstring(L, plan.returnType, 1);
+	lua_pushstring(L, argumentTypes);
+
+	// the stub only accepts userdata with the metatable of this class
+	luaL_getmetatable(L, class_getName(cls));
+	if (!lua_istable(L, -1)) {
+		lua_settop(L, top);
+		return NO;
+	}
+
+	if (lua_pcall(L, 4, 1, 0) != 0 || !lua_isfunction(L, -1)) {
+		NSLog(@"Could not create FFI stub for %s: %s", selectorName, lua_tostring(L, -1));
+		lua_settop(L, top);
+		return NO;
+	}
+
+	return YES;
+}
+#endif
+
++ (id)state; {
+	return [[self alloc] init];
+}
+
++ (MLCState *)stateForLuaState:(lua_State *)state; {
+	lua_pushlightuserdata(state, &MLCStateRegistryKey);
+	lua_rawget(state, LUA_REGISTRYINDEX);
+
+	MLCState *stateObj = (__bridge MLCState *)lua_touserdata(state, -1);
+	lua_pop(state, 1);
+
+	return stateObj;
+}
+
+- (id)init; {
+	return [self initWithAllocator:NULL userData:NULL];
+}
+
+- (id)initWithAllocator:(lua_Alloc)allocator userData:(void *)userData; {
+  	self = [super init];
+	if (!self)
+		return nil;
+
+	pthread_mutexattr_t attributes;
+	pthread_mutexattr_init(&attributes);
+	pthread_mutexattr_settype(&attributes, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&m_mutex, &attributes);
+	pthread_mutexattr_destroy(&attributes);
+
+	pthread_mutex_init(&m_samplingMutex, NULL);
+	pthread_mutex_init(&m_pendingReferenceMutex, NULL);
+
+	if (!allocator) {
+		m_poolAllocator = MLCPoolAllocatorCreate();
+		if (!m_poolAllocator)
+			return nil;
+
+		allocator = &MLCPoolAllocatorAllocate;
+		userData = m_poolAllocator;
+	}
+
+	m_memoryAccount.allocator = allocator;
+	m_memoryAccount.userData = userData;
+
+	lua_State *L = lua_newstate(&allocateWithAccounting, &m_memoryAccount);
+
+	#if MLC_USE_LUAJIT
+	if (!L) {
+		// 64-bit LuaJIT manages its own memory, and cannot use a custom
+		// allocator
+		m_memoryAccount.allocator = NULL;
+		L = luaL_newstate();
+	}
+	#endif
+
+	if (!L)
+		return nil;
+
+	lua_atpanic(L, &panic);
+
+	m_garbageCollectorPause = LUAI_GCPAUSE;
+	m_garbageCollectorStepMultiplier = LUAI_GCMUL;
+
+	m_mainState = L;
+	self.state = L;
+	luaL_openlibs(self.state);
+
+	#if MLC_USE_LUAJIT
+	luaJIT_setmode(self.state, 0, LUAJIT_MODE_ENGINE | LUAJIT_MODE_ON);
+	#endif
+
+	// registry[MLCStateRegistryKey] = self
+	lua_pushlightuserdata(self.state, &MLCStateRegistryKey);
+	lua_pushlightuserdata(self.state, (__bridge void *)self);
+	lua_rawset(self.state, LUA_REGISTRYINDEX);
+
+	self.invocationPlans = [[NSMapTable alloc]
+		initWithKeyOptions:NSPointerFunctionsOpaqueMemory | NSPointerFunctionsOpaquePersonality
+		valueOptions:NSPointerFunctionsStrongMemory | NSPointerFunctionsObjectPersonality
+		capacity:0
+	];
+
+	// await() for tasks
+	lua_register(self.state, "await", [MLCTask awaitFunction]);
+
+	// add additional package paths (including the path used by Homebrew)
+	[self growStackBySize:2];
+	[self enforceStackDelta:0 forBlock:^{
+		[self pushGlobal:@"package"];
+
+		lua_pushliteral(self.state, ";;?;?.lua;?.luac;/usr/local/lib/?.luac;/usr/local/lib/?.lua");
+		lua_setfield(self.state, -2, "path");
+		lua_pop(self.state, 1);
+		return YES;
+	}];
+
+	#if MLC_USE_LUAJIT
+	NSString *modulePath = [[NSBundle bundleForClass:[MLCState class]] pathForResource:@"MLCFFI" ofType:@"lua"];
+	if (!modulePath) {
+		// luaL_dofile would read a chunk from stdin given a NULL path
+		NSLog(@"Could not find MLCFFI.lua in the MoonlitCocoa bundle");
+		return nil;
+	}
+
+	[self growStackBySize:2];
+	[self enforceStackDelta:0 forBlock:^{
+		if (0 != luaL_dofile(self.state, [modulePath fileSystemRepresentation])) {
+			// methods will still be invoked through the trampoline
+			NSLog(@"Could not load FFI module: %@", [NSString popFromStack:self]);
+			return YES;
+		}
+
+		// registry[MLCFFIModuleRegistryKey] = module
+		lua_pushlightuserdata(self.state, &MLCFFIModuleRegistryKey);
+		lua_insert(self.state, -2);
+		lua_rawset(self.state, LUA_REGISTRYINDEX);
+		return YES;
+	}];
+	#endif
+
+	return self;
+}
+
+- (void)dealloc {
+  	if (self.state) {
+		// __gc metamethods run by lua_close must not message the receiver
+		// while it is being deallocated, so hide it from +stateForLuaState:
+		lua_pushlightuserdata(self.state, &MLCStateRegistryKey);
+		lua_pushnil(self.state);
+		lua_rawset(self.state, LUA_REGISTRYINDEX);
+
+		lua_close(self.state);
+		self.state = NULL;
+	}
+
+	MLCPoolAllocatorDestroy(m_poolAllocator);
+	pthread_mutex_destroy(&m_mutex);
+	pthread_mutex_destroy(&m_samplingMutex);
+	pthread_mutex_destroy(&m_pendingReferenceMutex);
+
+	// any references still pending were released by lua_close
+	free(m_pendingReferences);
+
+	[[NSNotificationCenter defaultCenter] removeObserver:self];
+}
+
+- (size_t)memoryUsage {
+	#if MLC_USE_LUAJIT
+	if (!m_memoryAccount.allocator) {
+		[self lock];
+		size_t usage = (size_t)lua_gc(self.state, LUA_GCCOUNT, 0) * 1024 + (size_t)lua_gc(self.state, LUA_GCCOUNTB, 0);
+		[self unlock];
+
+		return usage;
+	}
+	#endif
+
+	return m_memoryAccount.usage;
+}
+
+- (size_t)peakMemoryUsage {
+	#if MLC_USE_LUAJIT
+	if (!m_memoryAccount.allocator)
+		return self.memoryUsage;
+	#endif
+
+	return m_memoryAccount.peakUsage;
+}
+
+- (size_t)memoryLimit {
+	return m_memoryAccount.limit;
+}
+
+- (void)setMemoryLimit:(size_t)limit {
+	#if MLC_USE_LUAJIT
+	if (!m_memoryAccount.allocator && limit) {
+		NSLog(@"Memory limits are not supported by this build of LuaJIT");
+		return;
+	}
+	#endif
+
+	[self lock];
+	m_memoryAccount.limit = limit;
+	[self unlock];
+}
+
+- (void)resetPeakMemoryUsage; {
+	[self lock];
+	m_memoryAccount.peakUsage = m_memoryAccount.usage;
+	[self unlock];
+}
+
+#pragma mark Garbage collection
+
+- (size_t)externalMemoryUsage {
+	return m_memoryAccount.externalUsage;
+}
+
+- (void)addExternalMemoryOfSize:(size_t)size; {
+	m_memoryAccount.externalUsage += size;
+	m_memoryAccount.externalDebt += size;
+
+	// steps are measured in kilobytes, so smaller debts are left to
+	// accumulate
+	if (m_memoryAccount.externalDebt >= 1024) {
+		int kilobytes = (int)MIN(m_memoryAccount.externalDebt / 1024, (size_t)INT_MAX);
+		m_memoryAccount.externalDebt -= (size_t)kilobytes * 1024;
+
+		// this is usually invoked while pushing a value, outside of any
+		// protected call, where an error from a __gc metamethod would panic
+		[self growStackBySize:1];
+
+		int ret = lua_cpcall(self.state, &stepGarbageCollector, &kilobytes);
+		if (ret != 0) {
+			NSLog(@"Error collecting garbage: %@", [self popErrorWithCode:ret]);
+		}
+	}
+
+	[self scheduleIdleGarbageCollection];
+}
+
+- (void)removeExternalMemoryOfSize:(size_t)size; {
+	m_memoryAccount.externalUsage -= MIN(size, m_memoryAccount.externalUsage);
+	m_memoryAccount.externalDebt -= MIN(size, m_memoryAccount.externalDebt);
+}
+
+- (void)collectGarbage; {
+	[self lock];
+	lua_gc(self.state, LUA_GCCOLLECT, 0);
+	[self unlock];
+}
+
+- (BOOL)performGarbageCollectionStepOfSize:(NSUInteger)kilobytes; {
+	[self lock];
+	BOOL finished = (lua_gc(self.state, LUA_GCSTEP, (int)MIN(kilobytes, (NSUInteger)INT_MAX)) != 0);
+	[self unlock];
+
+	return finished;
+}
+
+- (int)garbageCollectorPause {
+	return m_garbageCollectorPause;
+}
+
+- (void)setGarbageCollectorPause:(int)pause {
+	[self lock];
+	m_garbageCollectorPause = pause;
+	lua_gc(self.state, LUA_GCSETPAUSE, pause);
+	[self unlock];
+}
+
+- (int)garbageCollectorStepMultiplier {
+	return m_garbageCollectorStepMultiplier;
+}
+
+- (void)setGarbageCollectorStepMultiplier:(int)multiplier {
+	[self lock];
+	m_garbageCollectorStepMultiplier = multiplier;
+	lua_gc(self.state, LUA_GCSETSTEPMUL, multiplier);
+	[self unlock];
+}
+
+- (BOOL)collectsGarbageWhenIdle {
+	return m_collectsGarbageWhenIdle;
+}
+
+- (void)setCollectsGarbageWhenIdle:(BOOL)collects {
+	[self lock];
+
+	if (collects != m_collectsGarbageWhenIdle) {
+		m_collectsGarbageWhenIdle = collects;
+
+		if (collects) {
+			[[NSNotificationCenter defaultCenter] addObserver:self selector:@selector(collectGarbageWhenIdle:) name:MLCStateIdleGarbageCollectionNotification object:self];
+			[self scheduleIdleGarbageCollection];
+		} else {
+			[[NSNotificationCenter defaultCenter] removeObserver:self name:MLCStateIdleGarbageCollectionNotification object:self];
+		}
+	}
+
+	[self unlock];
+}
+
+- (void)scheduleIdleGarbageCollection; {
+	if (!m_collectsGarbageWhenIdle || m_idleGarbageCollectionScheduled)
+		return;
+
+	m_idleGarbageCollectionScheduled = YES;
+
+	NSNotification *notification = [NSNotification notificationWithName:MLCStateIdleGarbageCollectionNotification object:self];
+
+	// notification queues are per-thread, and only the main thread is
+	// guaranteed to have a run loop
+	dispatch_async(dispatch_get_main_queue(), ^{
+		[[NSNotificationQueue defaultQueue]
+			enqueueNotification:notification
+			postingStyle:NSPostWhenIdle
+			coalesceMask:NSNotificationCoalescingOnName | NSNotificationCoalescingOnSender
+			forModes:nil
+		];
+	});
+}
+
+- (void)collectGarbageWhenIdle:(NSNotification *)notification; {
+	if (![self tryLock]) {
+		// the state is in use on another thread, so try again at the next
+		// idle time
+		[[NSNotificationQueue defaultQueue] enqueueNotification:notification postingStyle:NSPostWhenIdle];
+		return;
+	}
+
+	m_idleGarbageCollectionScheduled = NO;
+
+	NSTimeInterval deadline = [NSDate timeIntervalSinceReferenceDate] + MLCStateIdleGarbageCollectionTimeLimit;
+	BOOL finished = NO;
+
+	while (!finished && [NSDate timeIntervalSinceReferenceDate] < deadline) {
+		finished = (lua_gc(self.state, LUA_GCSTEP, 0) != 0);
+	}
+
+	if (!finished)
+		[self scheduleIdleGarbageCollection];
+
+	[self unlock];
+}
+
+- (void)setProfiler:(MLCProfiler *)profiler {
+	[self lock];
+
+	if (profiler != m_profiler) {
+		if (profiler)
+			[self trackCoroutines];
+
+		[m_profiler removeState:self];
+		m_profiler = profiler;
+		[m_profiler addState:self];
+	}
+
+	[self unlock];
+}
+
+- (void)trackCoroutines; {
+	if (m_tracksCoroutines)
+		return;
+
+	lua_State *L = self.state;
+	int top = lua_gettop(L);
+
+	// coroutine table + original function + state
+	[self growStackBySize:3];
+
+	lua_getglobal(L, "coroutine");
+	if (!lua_istable(L, -1)) {
+		lua_settop(L, top);
+		return;
+	}
+
+	lua_getfield(L, -1, "resume");
+	lua_pushlightuserdata(L, (__bridge void *)self);
+	lua_pushcclosure(L, &resumeTrackingThread, 2);
+
+	// coroutine.wrap resumes coroutines internally, so it is rebuilt on top of
+	// the new coroutine.resume
+	if (luaL_loadstring(L, MLCTrackingCoroutineWrap) != 0) {
+		NSLog(@"Could not replace coroutine.wrap: %s", lua_tostring(L, -1));
+		lua_settop(L, top);
+		return;
+	}
+
+	lua_pushvalue(L, -2);
+	if (lua_pcall(L, 1, 0, 0) != 0) {
+		NSLog(@"Could not replace coroutine.wrap: %s", lua_tostring(L, -1));
+		lua_settop(L, top);
+		return;
+	}
+
+	lua_setfield(L, -2, "resume");
+	lua_settop(L, top);
+
+	m_tracksCoroutines = YES;
+}
+
+- (void)armHookForRunningThread:(lua_Hook)hook; {
+	pthread_mutex_lock(&m_samplingMutex);
+
+	// lua_sethook is safe to call while the thread is running on another
+	// thread of the process
+	lua_State *thread = m_runningThread;
+	if (thread)
+		lua_sethook(thread, hook, LUA_MASKCOUNT, 1);
+
+	pthread_mutex_unlock(&m_samplingMutex);
+}
+
+- (void)lock; {
+	pthread_mutex_lock(&m_mutex);
+}
+
+- (BOOL)tryLock; {
+	return pthread_mutex_trylock(&m_mutex) == 0;
+}
+
+- (void)unlock; {
+	// luaL_unref() needs room on the stack; if there is none, the references
+	// wait for a later unlock
+	if (m_pendingReferenceCount && lua_checkstack(m_state, 2)) {
+		pthread_mutex_lock(&m_pendingReferenceMutex);
+
+		for (size_t i = 0;i < m_pendingReferenceCount;++i) {
+			luaL_unref(m_state, LUA_REGISTRYINDEX, m_pendingReferences[i]);
+		}
+
+		m_pendingReferenceCount = 0;
+		pthread_mutex_unlock(&m_pendingReferenceMutex);
+	}
+
+	pthread_mutex_unlock(&m_mutex);
+}
+
+- (BOOL)callFunctionWithArgumentCount:(int)argCount resultCount:(int)resultCount error:(NSError **)error; {
+	int ret;
+	lua_State *previousThread = m_runningThread;
+
+	++m_memoryAccount.protectedCallDepth;
+	m_runningThread = self.state;
+
+	@try {
+		ret = lua_pcall(self.state, argCount, resultCount, 0);
+	} @finally {
+		--m_memoryAccount.protectedCallDepth;
+		m_runningThread = previousThread;
+	}
+
+	[self scheduleIdleGarbageCollection];
+
+	if (ret == 0)
+		return YES;
+
+	// always pop the error message, even if the caller doesn't want it
+	NSError *callError = [self popErrorWithCode:ret];
+	if (error)
+		*error = callError;
+
+	return NO;
+}
+
+- (NSError *)popErrorWithCode:(int)code; {
+	NSDictionary *userInfo = nil;
+	NSString *message = [NSString popFromStack:self];
+	if (message) {
+		userInfo = [NSDictionary dictionaryWithObject:message forKey:NSLocalizedDescriptionKey];
+	}
+
+	return [NSError
+		errorWithDomain:MLCLuaErrorDomain
+		code:code
+		userInfo:userInfo
+	];
+}
+
+#pragma mark Batches
+
+- (BOOL)performBatchUsingBlock:(int (^)(void))block error:(NSError **)error; {
+	int ret;
+	lua_State *previousThread = m_runningThread;
 
-	int stateIndex = lua_upvalueindex(1);
+	m_runningThread = self.state;
 
-	// get the MLCState object associated with this Lua state
-	MLCState *state = (__bridge id)lua_touserdata(L, stateIndex);
-	if (!state) {
-		lua_pushliteral(L, "Could not get MLCState associated with Lua state");
-		lua_error(L);
+	@try {
+		ret = block();
+	} @finally {
+		m_runningThread = previousThread;
 	}
 
-	if (L != state.state) {
-		lua_pushliteral(L, "Given MLCState upvalue is not associated with the current Lua state");
-		lua_error(L);
-	}
+	[self scheduleIdleGarbageCollection];
+
+	if (ret == 0)
+		return YES;
 
-	// get the object upon which to invoke this method
-	id target = [state getValueAtStackIndex:1];
+	NSError *batchError = [self popErrorWithCode:ret];
+	if (error)
+		*error = batchError;
 
-	// get the selector that this function is trying to call
-	const char *selectorString = lua_tostring(L, 2);
-	SEL selector = sel_registerName(selectorString);
+	return NO;
+}
 
-	NSMethodSignature *signature = [target methodSignatureForSelector:selector];
-	if (!signature) {
-		NSString *errorMessage = [NSString stringWithFormat:@"%@ does not recognize selector %s", target, selector];
-		[state pushObject:errorMessage];
+- (NSArray *)popFunctionAndMapObjects:(NSArray *)objects error:(NSError **)error; {
+	lua_State *L = self.state;
+	int functionIndex = lua_gettop(L);
 
-		lua_error(L);
+	// function + argument
+	[self growStackBySize:2];
+
+	NSMutableArray *results = [[NSMutableArray alloc] initWithCapacity:[objects count]];
+
+	BOOL success = NO;
+
+	@try {
+		success = [self performBatchUsingBlock:^{
+			for (id object in objects) {
+				lua_pushvalue(L, functionIndex);
+				MLCPushObject(self, object);
+
+				int ret = batchProtectedCall(self, 1, 1);
+				if (ret != 0)
+					return ret;
+
+				[results addObject:MLCPopValue(self) ?: [NSNull null]];
+			}
+
+			return 0;
+		} error:error];
+	} @finally {
+		// pop the function
+		lua_settop(L, functionIndex - 1);
 	}
 
-	NSInvocation *invocation = [NSInvocation invocationWithMethodSignature:signature];
-	NSInteger methodArgumentCount = (NSInteger)[signature numberOfArguments];
+	return (success ? results : nil);
+}
+
+- (NSArray *)popFunctionAndFilterObjects:(NSArray *)objects error:(NSError **)error; {
+	lua_State *L = self.state;
+	int functionIndex = lua_gettop(L);
+
+	// function + argument
+	[self growStackBySize:2];
+
+	NSMutableArray *results = [[NSMutableArray alloc] init];
+
+	BOOL success = NO;
+
+	@try {
+		success = [self performBatchUsingBlock:^{
+			for (id object in objects) {
+				lua_pushvalue(L, functionIndex);
+				MLCPushObject(self, object);
 
-	@autoreleasepool {
-		[invocation setTarget:target];
-		[invocation setSelector:selector];
+				int ret = batchProtectedCall(self, 1, 1);
+				if (ret != 0)
+					return ret;
 
-		for (NSInteger i = methodArgumentCount - 1;i > 2;--i) {
-			// any arguments required by the method but not passed from the Lua
-			// script get filled with nil, matching Lua semantics
-			__autoreleasing id obj = nil;
+				if (lua_toboolean(L, -1))
+					[results addObject:object];
 
-			if (i < args) {
-				obj = [state popValueOnStack];
+				lua_pop(L, 1);
 			}
 
-			[invocation setArgument:&obj atIndex:i];
-		}
+			return 0;
+		} error:error];
+	} @finally {
+		// pop the function
+		lua_settop(L, functionIndex - 1);
+	}
+
+	return (success ? results : nil);
+}
+
+- (id)popFunctionAndReduceObjects:(NSArray *)objects initialValue:(id)initialValue error:(NSError **)error; {
+	lua_State *L = self.state;
+	int functionIndex = lua_gettop(L);
+	int accumulatorIndex = functionIndex + 1;
+
+	// accumulator + function + two arguments
+	[self growStackBySize:4];
+
+	id result = nil;
 
-		[invocation invoke];
+	@try {
+		MLCPushObject(self, initialValue);
+
+		BOOL success = [self performBatchUsingBlock:^{
+			for (id object in objects) {
+				lua_pushvalue(L, functionIndex);
+				lua_pushvalue(L, accumulatorIndex);
+				MLCPushObject(self, object);
+
+				int ret = batchProtectedCall(self, 2, 1);
+				if (ret != 0)
+					return ret;
+
+				lua_replace(L, accumulatorIndex);
+			}
 
-		NSUInteger returnLength = [signature methodReturnLength];
-		if (!returnLength)
 			return 0;
+		} error:error];
+
+		if (success)
+			result = MLCGetValue(self, accumulatorIndex);
+	} @finally {
+		// pop the accumulator and the function
+		lua_settop(L, functionIndex - 1);
+	}
+
+	return result;
+}
+
+- (BOOL)popFunctionAndMapRange:(NSRange)range ofNumericArray:(MLCNumericArray *)array intoNumericArray:(MLCNumericArray *)results error:(NSError **)error; {
+	NSParameterAssert(NSMaxRange(range) <= array.count);
+	NSParameterAssert(NSMaxRange(range) <= results.count);
+
+	lua_State *L = self.state;
+	int functionIndex = lua_gettop(L);
+
+	// function + argument
+	[self growStackBySize:2];
+
+	BOOL success = NO;
+
+	@try {
+		success = [self performBatchUsingBlock:^{
+			for (NSUInteger i = range.location;i < NSMaxRange(range);++i) {
+				lua_pushvalue(L, functionIndex);
+				lua_pushnumber(L, [array doubleAtIndex:i]);
+
+				int ret = batchProtectedCall(self, 1, 1);
+				if (ret != 0)
+					return ret;
 
-		unsigned char buffer[returnLength];
+				[results setDouble:lua_tonumber(L, -1) atIndex:i];
+				lua_pop(L, 1);
+			}
 
-		[invocation getReturnValue:buffer];
-		[state pushValue:buffer objCType:[signature methodReturnType]];
-		return 1;
+			return 0;
+		} error:error];
+	} @finally {
+		// pop the function
+		lua_settop(L, functionIndex - 1);
 	}
+
+	return success;
 }
 
-@interface MLCState ()
-@property (nonatomic, readwrite) lua_State *state;
-@end
+- (int)resumeThread:(lua_State *)thread argumentCount:(int)argCount resultCount:(int *)resultCount; {
+	lua_State *previousState = self.state;
+	int status;
 
-@implementation MLCState
-@synthesize state = m_state;
+	// while the coroutine runs, any methods it calls on the receiver need to
+	// use its stack
+	self.state = thread;
+	lua_State *previousThread = m_runningThread;
 
-+ (lua_CFunction)trampolineFunction; {
-	return &trampolineToObjectiveC;
+	++m_memoryAccount.protectedCallDepth;
+	m_runningThread = thread;
+
+	@try {
+		status = lua_resume(thread, argCount);
+	} @finally {
+		--m_memoryAccount.protectedCallDepth;
+		self.state = previousState;
+
+		// the thread may be collected once the task finishes
+		pthread_mutex_lock(&m_samplingMutex);
+		m_runningThread = previousThread;
+		pthread_mutex_unlock(&m_samplingMutex);
+	}
+
+	[self scheduleIdleGarbageCollection];
+
+	// after an error, the stack of the coroutine is left as it was, with the
+	// error message on top
+	int count = 1;
+	if (status == 0 || status == LUA_YIELD)
+		count = lua_gettop(thread);
+
+	[self growStackBySize:count];
+	lua_xmove(thread, self.state, count);
+
+	if (resultCount)
+		*resultCount = count;
+
+	return status;
 }
 
-+ (id)state; {
-	return [[self alloc] init];
+- (MLCTask *)startTaskWithArgumentCount:(int)argCount completionHandler:(void (^)(NSArray *results, NSError *error))handler; {
+	MLCTask *task = [[MLCTask alloc] initWithArgumentCount:argCount ofState:self completionHandler:handler];
+	[task start];
+	return task;
 }
 
-- (id)init; {
-  	self = [super init];
-	if (!self)
-		return nil;
-	
-	self.state = luaL_newstate();
-	luaL_openlibs(self.state);
+- (BOOL)resumeTask:(MLCTask *)task withValues:(NSArray *)values; {
+	NSParameterAssert(task.state == self);
+	return [task resumeWithValues:values];
+}
 
-	// add additional package paths (including the path used by Homebrew)
-	[self growStackBySize:2];
-	[self enforceStackDelta:0 forBlock:^{
-		[self pushGlobal:@"package"];
+- (void)cancelTask:(MLCTask *)task; {
+	NSParameterAssert(task.state == self);
+	[task cancel];
+}
 
-		lua_pushliteral(self.state, ";;?;?.lua;?.luac;/usr/local/lib/?.luac;/usr/local/lib/?.lua");
-		lua_setfield(self.state, -2, "path");
-		lua_pop(self.state, 1);
-		return YES;
-	}];
+- (MLCInvocationPlan *)invocationPlanForClass:(Class)cls selectorName:(const char *)selectorName; {
+	NSMapTable *plansForClass = (__bridge NSMapTable *)NSMapGet(self.invocationPlans, (__bridge void *)cls);
+	if (!plansForClass) {
+		plansForClass = [[NSMapTable alloc]
+			initWithKeyOptions:NSPointerFunctionsOpaqueMemory | NSPointerFunctionsCStringPersonality
+			valueOptions:NSPointerFunctionsStrongMemory | NSPointerFunctionsObjectPersonality
+			capacity:0
+		];
 
-	// initialize Metalua compiler
-	BOOL result = [self enforceStackDelta:0 forBlock:^{
-		NSString *compilerPath = [[NSBundle bundleForClass:[self class]] pathForResource:@"compiler" ofType:@"lua"];
-		if (0 != luaL_dofile(self.state, [compilerPath UTF8String])) {
-			NSLog(@"Could not load Metalua compiler: %@", [NSString popFromStack:self]);
-			return NO;
-		}
+		NSMapInsert(self.invocationPlans, (__bridge void *)cls, (__bridge void *)plansForClass);
+	}
 
-		return YES;
-	}];
+	MLCInvocationPlan *plan = (__bridge MLCInvocationPlan *)NSMapGet(plansForClass, selectorName);
+	if (!plan) {
+		plan = [[MLCInvocationPlan alloc] initWithClass:cls selector:sel_registerName(selectorName)];
+		if (!plan)
+			return nil;
 
-	if (!result)
-		return nil;
-	else
-		return self;
+		// selector names are never deallocated by the runtime, so they can
+		// safely be used as keys without copying
+		NSMapInsert(plansForClass, sel_getName(plan.selector), (__bridge void *)plan);
+	}
+
+	return plan;
 }
 
-- (void)dealloc {
-  	if (self.state) {
-		lua_close(self.state);
-		self.state = NULL;
-	}
+- (void)flushMethodCache; {
+	[self.invocationPlans removeAllObjects];
 }
 
-- (BOOL)callFunctionWithArgumentCount:(int)argCount resultCount:(int)resultCount error:(NSError **)error; {
-	int ret = lua_pcall(self.state, argCount, resultCount, 0);
-	if (ret == 0) {
+- (id)getValueAtStackIndex:(int)index; {
+	return MLCGetValue(self, index);
+}
+
+- (BOOL)loadCompilerWithError:(NSError **)error; {
+	if (m_loadedCompiler)
 		return YES;
-	} else {
-		if (error) {
-			NSDictionary *userInfo = nil;
-			NSString *message = [NSString popFromStack:self];
-			if (message) {
-				userInfo = [NSDictionary dictionaryWithObject:message forKey:NSLocalizedDescriptionKey];
-			}
 
-			*error = [NSError
-				errorWithDomain:MLCLuaErrorDomain
-				code:ret
-				userInfo:userInfo
-			];
-		}
+	NSString *compilerPath = [[NSBundle bundleForClass:[MLCState class]] pathForResource:@"compiler" ofType:@"lua"];
+	if (!compilerPath) {
+		// luaL_dofile would read a chunk from stdin given a NULL path
+		NSDictionary *userInfo = [NSDictionary dictionaryWithObject:@"Could not find compiler.lua in the MoonlitCocoa bundle" forKey:NSLocalizedDescriptionKey];
+		NSError *localError = [NSError errorWithDomain:MLCLuaErrorDomain code:LUA_ERRFILE userInfo:userInfo];
+		NSLog(@"Could not load Metalua compiler: %@", localError);
+
+		if (error)
+			*error = localError;
 
 		return NO;
 	}
-}
 
-- (id)getValueAtStackIndex:(int)index; {
-  	[self growStackBySize:1];
+	// a script may be loaded from Objective-C called by a task, in which case
+	// #state is the stack of the task's coroutine; the compiler is loaded on
+	// the main thread instead, so that it can't be caught up in the task
+	// yielding or failing, and without the memory limit, since the compiler
+	// is shared by every script rather than belonging to one
+	lua_State *previousStack = m_state;
+	unsigned previousCallDepth = m_memoryAccount.protectedCallDepth;
+
+	m_state = m_mainState;
+	m_memoryAccount.protectedCallDepth = 0;
+
+	int ret;
+	NSError *localError = nil;
+
+	@try {
+		[self growStackBySize:1];
+
+		ret = luaL_dofile(m_state, [compilerPath fileSystemRepresentation]);
+		if (ret != 0)
+			localError = [self popErrorWithCode:ret];
+	} @finally {
+		m_state = previousStack;
+		m_memoryAccount.protectedCallDepth = previousCallDepth;
+	}
+
+	if (ret != 0) {
+		NSLog(@"Could not load Metalua compiler: %@", localError);
+
+		if (error)
+			*error = localError;
 
-	// duplicate the value in the stack, so that we can pop and then leave the
-	// stack in its previous state
-  	lua_pushvalue(self.state, index);
+		return NO;
+	}
 
-	return [self popValueOnStack];
+	m_loadedCompiler = YES;
+	return YES;
 }
 
 - (BOOL)loadScript:(NSString *)source error:(NSError **)error; {
 	source = [@"require 'metalua.runtime'\n\n" stringByAppendingString:source];
+
+	NSData *cacheHeader = nil;
+	NSURL *cacheURL = [self bytecodeCacheURLForSource:[source dataUsingEncoding:NSUTF8StringEncoding] header:&cacheHeader];
+
+	if (cacheURL) {
+		NSData *entry = [NSData dataWithContentsOfURL:cacheURL options:NSDataReadingMappedIfSafe error:NULL];
+		NSUInteger headerLength = [cacheHeader length];
+
+		// an entry with a different header (from another compiler, or a
+		// colliding hash), or which is otherwise corrupted, is simply
+		// recompiled
+		if ([entry length] > headerLength && memcmp([entry bytes], [cacheHeader bytes], headerLength) == 0) {
+			const char *bytecode = (const char *)[entry bytes] + headerLength;
+
+			if (bytecode[0] == LUA_SIGNATURE[0] && [self loadChunk:bytecode length:[entry length] - headerLength name:[cacheURL lastPathComponent] error:NULL])
+				return YES;
+		}
+	}
   
+	// the compiler is only needed once there's a cache miss
+	if (![self loadCompilerWithError:error])
+		return NO;
+
   	[self growStackBySize:2];
 
-	return [self enforceStackDelta:1 forBlock:^{
+	BOOL success = [self enforceStackDelta:1 forBlock:^{
 		[self pushGlobal:@"compiler"];
 		[self popTableAndPushField:@"loadstring"];
 
@@ -214,9 +1542,32 @@ static int trampolineToObjectiveC (lua_State *L) {
 			return YES;
 		}
 	}];
+
+	if (success && cacheURL)
+		[self writeFunctionOnStackToBytecodeCacheURL:cacheURL header:cacheHeader];
+
+	return success;
 }
 
 - (BOOL)loadScriptAtURL:(NSURL *)URL error:(NSError **)error; {
+	if ([[URL pathExtension] isEqualToString:@"luac"]) {
+		NSData *bytecode = [NSData dataWithContentsOfURL:URL options:NSDataReadingMappedIfSafe error:error];
+		if (!bytecode)
+			return NO;
+
+		return [self loadBytecode:bytecode name:[URL lastPathComponent] error:error];
+	}
+
+	if ([[URL pathExtension] isEqualToString:@"lua"]) {
+		// plain Lua needs neither the Metalua compiler nor its runtime, so
+		// it's handed straight to Lua without being decoded
+		NSData *source = [NSData dataWithContentsOfURL:URL options:NSDataReadingMappedIfSafe error:error];
+		if (!source)
+			return NO;
+
+		return [self loadChunk:[source bytes] length:[source length] name:[URL lastPathComponent] error:error];
+	}
+
   	NSString *source = [NSString stringWithContentsOfURL:URL usedEncoding:NULL error:error];
 	if (!source)
 		return NO;
@@ -224,12 +1575,90 @@ static int trampolineToObjectiveC (lua_State *L) {
 	return [self loadScript:source error:error];
 }
 
+- (BOOL)loadBytecode:(NSData *)bytecode name:(NSString *)name error:(NSError **)error; {
+	const char *bytes = [bytecode bytes];
+	size_t length = [bytecode length];
+
+	// precompiled chunks always begin with an escape character, which keeps us
+	// from accidentally interpreting arbitrary data as source code
+	if (length == 0 || bytes[0] != LUA_SIGNATURE[0]) {
+		if (error) {
+			NSDictionary *userInfo = [NSDictionary dictionaryWithObject:@"Data does not contain precompiled Lua bytecode" forKey:NSLocalizedDescriptionKey];
+			*error = [NSError errorWithDomain:MLCLuaErrorDomain code:LUA_ERRSYNTAX userInfo:userInfo];
+		}
+
+		return NO;
+	}
+
+	return [self loadChunk:bytes length:length name:name error:error];
+}
+
+- (BOOL)loadChunk:(const char *)bytes length:(size_t)length name:(NSString *)name error:(NSError **)error; {
+	[self growStackBySize:1];
+
+	NSString *chunkName = [@"=" stringByAppendingString:name ?: @"?"];
+	int ret = luaL_loadbuffer(self.state, bytes, length, [chunkName UTF8String]);
+	if (ret == 0)
+		return YES;
+
+	NSError *localError = [self popErrorWithCode:ret];
+	if (error)
+		*error = localError;
+
+	return NO;
+}
+
+- (NSURL *)bytecodeCacheURLForSource:(NSData *)source header:(NSData **)header; {
+	NSURL *directoryURL = [[self class] bytecodeCacheURL];
+	if (!directoryURL)
+		return nil;
+
+	const char *versionString = [MLCCompilerVersion UTF8String];
+
+	// hash every byte of the source, since it may contain embedded NULs
+	uint64_t hash = 14695981039346656037ULL;
+	hash = hashBytes(versionString, strlen(versionString) + 1, hash);
+	hash = hashBytes([source bytes], [source length], hash);
+
+	NSString *headerString = [NSString stringWithFormat:@"MLC %@ %016llx %lu\n", MLCCompilerVersion, (unsigned long long)hash, (unsigned long)[source length]];
+	*header = [headerString dataUsingEncoding:NSUTF8StringEncoding];
+
+	NSString *filename = [NSString stringWithFormat:@"%016llx.luac", (unsigned long long)hash];
+	return [directoryURL URLByAppendingPathComponent:filename];
+}
+
+- (void)writeFunctionOnStackToBytecodeCacheURL:(NSURL *)URL header:(NSData *)header; {
+	NSMutableData *bytecode = [header mutableCopy];
+
+	if (lua_dump(self.state, &writeChunkToData, (__bridge void *)bytecode) != 0 || [bytecode length] <= [header length]) {
+		// not a Lua function (e.g., a C function), so it can't be cached
+		return;
+	}
+
+	NSError *error = nil;
+
+	NSURL *directoryURL = [URL URLByDeletingLastPathComponent];
+	if (![[NSFileManager defaultManager] createDirectoryAtURL:directoryURL withIntermediateDirectories:YES attributes:nil error:&error]) {
+		NSLog(@"Could not create bytecode cache directory %@: %@", directoryURL, error);
+		return;
+	}
+
+	if (![bytecode writeToURL:URL options:NSDataWritingAtomic error:&error]) {
+		NSLog(@"Could not write compiled script to bytecode cache: %@", error);
+	}
+}
+
 - (BOOL)enforceStackDelta:(int)delta forBlock:(BOOL (^)(void))block; {
+	#ifndef NS_BLOCK_ASSERTIONS
   	int top = lua_gettop(self.state);
+	#endif
+
 	BOOL result = block();
-	int newTop = lua_gettop(self.state);
 
+	#ifndef NS_BLOCK_ASSERTIONS
+	int newTop = lua_gettop(self.state);
 	NSAssert2(newTop == top + delta, @"Actual stack delta (%i) does not match expected delta (%i)", newTop - top, delta);
+	#endif
 
 	return result;
 }
@@ -257,359 +1686,27 @@ static int trampolineToObjectiveC (lua_State *L) {
 }
 
 - (id)popValueOnStack; {
-	__block id result = nil;
-
-	[self enforceStackDelta:-1 forBlock:^{
-		switch (lua_type(self.state, -1)) {
-		case LUA_TNIL:
-			result = [NSNull popFromStack:self];
-			break;
-
-		case LUA_TNUMBER:
-		case LUA_TBOOLEAN:
-			result = [NSNumber popFromStack:self];
-			break;
-
-		case LUA_TSTRING:
-			result = [NSString popFromStack:self];
-			break;
-
-		case LUA_TTABLE:
-			result = [NSDictionary popFromStack:self];
-			break;
-
-		case LUA_TUSERDATA:
-			result = [MLCBridgedObject popFromStack:self];
-			break;
-
-		case LUA_TLIGHTUSERDATA:
-			result = (__bridge id)lua_touserdata(self.state, -1);
-			lua_pop(self.state, 1);
-			break;
-		
-		case LUA_TTHREAD:
-		case LUA_TFUNCTION:
-			// TODO: not yet implemented
-		
-		default:
-			lua_pop(self.state, 1);
-			return NO;
-		}
-
-		return YES;
-	}];
-
-	return result;
+	return MLCPopValue(self);
 }
 
 - (void)pushArgumentsOfInvocation:(NSInvocation *)invocation; {
-	NSMethodSignature *signature = [invocation methodSignature];
-	int count = (int)[signature numberOfArguments];
-
-	if (count <= 2)
-		return;
-	
-	[self growStackBySize:count - 2];
-
-	// buffer to hold untyped argument data
-	unsigned char buffer[[signature frameLength]];
-
-	for (int i = 2;i < count;++i) {
-		const char *type = [signature getArgumentTypeAtIndex:(NSUInteger)i];
-		[invocation getArgument:buffer atIndex:i];
-		[self pushValue:buffer objCType:type];
-	}
+	MLCMarshalingPlan *plan = [MLCMarshalingPlan planForSignature:[invocation methodSignature]];
+	[plan pushArgumentsOfInvocation:invocation ontoState:self];
 }
 
 - (BOOL)pushValue:(void *)buffer objCType:(const char *)type; {
-	// skip attributes in the provided type encoding
-	while (
-		*type == 'r' ||
-		*type == 'n' ||
-		*type == 'N' ||
-		*type == 'o' ||
-		*type == 'O' ||
-		*type == 'R' ||
-		*type == 'V'
-	) {
-		++type;
-	}
-
-	return [self enforceStackDelta:1 forBlock:^{
-		#define pushNumberOfType(TYPE) \
-			do { \
-				TYPE num; \
-				memcpy(&num, buffer, sizeof(num)); \
-				lua_pushnumber(self.state, (lua_Number)num); \
-			} while (0)
-
-		switch (*type) {
-		case 'c':
-			// single characters are pushed as numbers because BOOL is
-			// typedef'd to 'char'
-			pushNumberOfType(signed char);
-			break;
-
-		case 'C':
-			pushNumberOfType(unsigned char);
-			break;
-
-		case 'i':
-			pushNumberOfType(int);
-			break;
-
-		case 'I':
-			pushNumberOfType(unsigned int);
-			break;
-
-		case 's':
-			pushNumberOfType(short);
-			break;
-
-		case 'S':
-			pushNumberOfType(unsigned short);
-			break;
-
-		case 'l':
-			pushNumberOfType(long);
-			break;
-
-		case 'L':
-			pushNumberOfType(unsigned long);
-			break;
-
-		case 'q':
-			pushNumberOfType(long long);
-			break;
-
-		case 'Q':
-			pushNumberOfType(unsigned long long);
-			break;
-
-		case 'f':
-			pushNumberOfType(float);
-			break;
-
-		case 'd':
-			pushNumberOfType(double);
-			break;
-
-		case 'B':
-			{
-				_Bool b;
-				memcpy(&b, buffer, sizeof(b));
-				lua_pushboolean(self.state, b);
-			}
-
-			break;
-
-		case '*':
-			{
-				const char *str;
-				memcpy(&str, buffer, sizeof(str));
-				lua_pushstring(self.state, str);
-			}
-
-			break;
-
-		case ':':
-			{
-				SEL selector;
-				memcpy(&selector, buffer, sizeof(selector));
-
-				const char *name = sel_getName(selector);
-				lua_pushstring(self.state, name);
-			}
-
-			break;
-
-		case '@':
-		case '#':
-			{
-				__unsafe_unretained id obj;
-				memcpy(&obj, buffer, sizeof(obj));
-
-				id strongObj = obj;
-				[self pushObject:strongObj];
-			}
-
-			break;
-
-		case '^':
-			{
-				void *ptr;
-				memcpy(&ptr, buffer, sizeof(ptr));
-				lua_pushlightuserdata(self.state, ptr);
-			}
-
-			break;
-
-		default:
-			NSLog(@"Unsupported argument type \"%s\", pushing nil", type);
-			lua_pushnil(self.state);
-			return NO;
-		}
-
-		return YES;
-	}];
+	const MLCTypeConverter *converter = MLCTypeConverterForType(type);
+	return converter->push(converter, self, buffer);
 }
 
 - (BOOL)popReturnValueForInvocation:(NSInvocation *)invocation; {
-	NSMethodSignature *signature = [invocation methodSignature];
-
-	NSUInteger returnLength = [signature methodReturnLength];
-	if (!returnLength)
-		return YES;
-
-	const char *type = [signature methodReturnType];
-	unsigned char buffer[returnLength];
-
-	BOOL success = [self popValue:buffer objCType:type];
-	[invocation setReturnValue:buffer];
-
-	return success;
+	MLCMarshalingPlan *plan = [MLCMarshalingPlan planForSignature:[invocation methodSignature]];
+	return [plan popReturnValueForInvocation:invocation fromState:self];
 }
 
 - (BOOL)popValue:(void *)buffer objCType:(const char *)type; {
-	// skip attributes in the provided type encoding
-	while (
-		*type == 'r' ||
-		*type == 'n' ||
-		*type == 'N' ||
-		*type == 'o' ||
-		*type == 'O' ||
-		*type == 'R' ||
-		*type == 'V'
-	) {
-		++type;
-	}
-
-	#define popNSNumberValue(TYPE, NAME) \
-		do { \
-			NSNumber *numObj = [NSNumber popFromStack:self]; \
-			TYPE num = [numObj NAME ## Value]; \
-			memcpy(buffer, &num, sizeof(num)); \
-		} while (0)
-
-	switch (*type) {
-	case 'c':
-		popNSNumberValue(char, char);
-		break;
-
-	case 'C':
-		popNSNumberValue(unsigned char, unsignedChar);
-		break;
-
-	case 'i':
-		popNSNumberValue(int, int);
-		break;
-
-	case 'I':
-		popNSNumberValue(unsigned int, unsignedInt);
-		break;
-
-	case 's':
-		popNSNumberValue(short, short);
-		break;
-
-	case 'S':
-		popNSNumberValue(unsigned short, unsignedShort);
-		break;
-
-	case 'l':
-		popNSNumberValue(long, long);
-		break;
-
-	case 'L':
-		popNSNumberValue(unsigned long, unsignedLong);
-		break;
-
-	case 'q':
-		popNSNumberValue(long long, longLong);
-		break;
-
-	case 'Q':
-		popNSNumberValue(unsigned long long, unsignedLongLong);
-		break;
-	
-	case 'f':
-		popNSNumberValue(float, float);
-		break;
-	
-	case 'd':
-		popNSNumberValue(double, double);
-		break;
-	
-	case 'B':
-		popNSNumberValue(_Bool, bool);
-		break;
-	
-	case 'v':
-		// no return value, nothing to do
-		break;
-	
-	case '*':
-		{
-			size_t length = 0;
-			const char *str = lua_tolstring(self.state, -1, &length);
-
-			// create a junk NSData, added to the autorelease pool, to hold this
-			// string data and automatically release it
-			__autoreleasing NSData *data = [NSData dataWithBytes:str length:length];
-
-			// pop the string, potentially garbage collecting it
-			lua_pop(self.state, 1);
-
-			str = [data bytes];
-			memcpy(buffer, &str, sizeof(str));
-		}
-
-		break;
-	
-	case '@':
-	case '#':
-		{
-			__autoreleasing id obj = [self popValueOnStack];
-
-			__unsafe_unretained id unsafeObj = obj;
-			memcpy(buffer, &unsafeObj, sizeof(unsafeObj));
-		}
-
-		break;
-	
-	case ':':
-		{
-			const char *str = lua_tostring(self.state, -1);
-			SEL selector = sel_registerName(str);
-
-			// pop the string, potentially garbage collecting it
-			lua_pop(self.state, 1);
-
-			memcpy(buffer, &selector, sizeof(selector));
-		}
-		
-		break;
-	
-	case '^':
-		{
-			void *ptr = (void *)lua_topointer(self.state, -1);
-			memcpy(buffer, &ptr, sizeof(ptr));
-		}
-
-		break;
-
-	default:
-		{
-			NSUInteger size = 0;
-			NSGetSizeAndAlignment(buffer, &size, NULL);
-
-			memset(buffer, 0, size);
-		}
-
-		return NO;
-	}
-
-	return YES;
+	const MLCTypeConverter *converter = MLCTypeConverterForType(type);
+	return converter->pop(converter, self, buffer);
 }
 
 - (void)pushGlobal:(NSString *)symbol; {
@@ -618,18 +1715,7 @@ static int trampolineToObjectiveC (lua_State *L) {
 }
 
 - (void)pushObject:(id)object; {
-	if ([object respondsToSelector:@selector(pushOntoStack:)]) {
-		[object pushOntoStack:self];
-		return;
-	}
-
-	[self growStackBySize:1];
-
-  	if (!object) {
-		lua_pushnil(self.state);
-	} else {
-		lua_pushlightuserdata(self.state, (__bridge void *)object);
-	}
+	MLCPushObject(self, object);
 }
 
 @end
@@ -0,0 +1,87 @@
+//
+//  MLCStatePool.h
+//  MoonlitCocoa
+//
+//  Created by agent on 17.10.26.
+//  Released into the public domain.
+//
+
+#import <Foundation/Foundation.h>
+
+@class MLCProfiler;
+@class MLCState;
+
+/**
+ * Manages a set of identically initialized Lua states, which can be checked out
+ * by one thread at a time. This allows the same Lua code to run concurrently on
+ * many threads, without serializing every call through a single state.
+ *
+ * Because each state in the pool is separate, any module-level variables in a
+ * script are duplicated in each one. Pooled states should therefore only be
+ * used to run code that does not depend on such variables changing.
+ */
+@interface MLCStatePool : NSObject
+/**
+ * Initializes a pool which will create up to one state for each active
+ * processor. See #initWithMaximumCount:setupBlock:.
+ */
+- (id)initWithSetupBlock:(BOOL (^)(MLCState *state))setupBlock;
+
+/**
+ * Initializes a pool which will create up to \a maximumCount states. Each state
+ * is created only when needed, and then passed to \a setupBlock, which should
+ * load any scripts into it and return whether it was successful.
+ *
+ * This is the designated initializer for this class.
+ */
+- (id)initWithMaximumCount:(NSUInteger)maximumCount setupBlock:(BOOL (^)(MLCState *state))setupBlock;
+
+/**
+ * The maximum number of states that the receiver will create.
+ */
+@property (nonatomic, readonly) NSUInteger maximumCount;
+
+/**
+ * The block used to set up each new state.
+ */
+@property (nonatomic, copy, readonly) BOOL (^setupBlock)(MLCState *state);
+
+/**
+ * A profiler to attach to every state in the pool, or \c nil. Idle states are
+ * updated immediately, and states which are checked out are updated the next
+ * time they are checked out.
+ */
+@property (strong) MLCProfiler *profiler;
+
+/**
+ * Returns an idle state, creating one if necessary. If #maximumCount states
+ * are already checked out, this method blocks until one is checked back in.
+ * Returns \c nil if a new state could not be set up.
+ *
+ * The returned state is locked by the calling thread, and must be returned with
+ * #checkInState: from the same thread.
+ */
+- (MLCState *)checkOutState;
+
+/**
+ * Unlocks \a state, and returns it to the pool of idle states. \a state must
+ * have been returned from #checkOutState.
+ */
+- (void)checkInState:(MLCState *)state;
+
+/**
+ * Checks out a state, invokes \a block with it, and checks the state back in.
+ * Returns \c NO without invoking \a block if a state could not be set up.
+ *
+ * If the calling thread is already inside a call to this method on the
+ * receiver, \a block is invoked with the same state, so that a Lua method
+ * calling back into Objective-C cannot deadlock the pool.
+ */
+- (BOOL)performWithState:(void (^)(MLCState *state))block;
+
+/**
+ * Releases all of the idle states in the receiver. New states will be created
+ * with #setupBlock as needed.
+ */
+- (void)removeIdleStates;
+@end
@@ -0,0 +1,204 @@
+//
+//  MLCStatePool.m
+//  MoonlitCocoa
+//
+//  Created by agent on 17.10.26.
+//  Released into the public domain.
+//
+
+#import "MLCStatePool.h"
+#import "MLCState.h"
+#import <pthread.h>
+
+@interface MLCStatePool () {
+	/**
+	 * Guards #idleStates and #m_stateCount.
+	 */
+	pthread_mutex_t m_mutex;
+
+	/**
+	 * Signaled whenever a state is checked in, or a slot for a new state
+	 * becomes available.
+	 */
+	pthread_cond_t m_condition;
+
+	/**
+	 * The key for the state that the current thread is using within
+	 * #performWithState:, if any.
+	 */
+	pthread_key_t m_currentStateKey;
+
+	/**
+	 * The number of states that currently exist, whether idle or checked out.
+	 */
+	NSUInteger m_stateCount;
+}
+
+@property (nonatomic, readwrite) NSUInteger maximumCount;
+@property (nonatomic, copy, readwrite) BOOL (^setupBlock)(MLCState *state);
+
+/**
+ * States which are not currently checked out.
+ */
+@property (nonatomic, strong) NSMutableArray *idleStates;
+@end
+
+@implementation MLCStatePool
+@synthesize maximumCount = m_maximumCount;
+@synthesize setupBlock = m_setupBlock;
+@synthesize idleStates = m_idleStates;
+@synthesize profiler = m_profiler;
+
+- (id)init {
+	return [self initWithSetupBlock:nil];
+}
+
+- (id)initWithSetupBlock:(BOOL (^)(MLCState *state))setupBlock; {
+	NSUInteger count = [[NSProcessInfo processInfo] activeProcessorCount];
+	return [self initWithMaximumCount:count setupBlock:setupBlock];
+}
+
+- (id)initWithMaximumCount:(NSUInteger)maximumCount setupBlock:(BOOL (^)(MLCState *state))setupBlock; {
+	NSParameterAssert(maximumCount > 0);
+
+	self = [super init];
+	if (!self)
+		return nil;
+
+	if (pthread_key_create(&m_currentStateKey, NULL) != 0)
+		return nil;
+
+	pthread_mutex_init(&m_mutex, NULL);
+	pthread_cond_init(&m_condition, NULL);
+
+	self.maximumCount = maximumCount;
+	self.setupBlock = setupBlock;
+	self.idleStates = [[NSMutableArray alloc] initWithCapacity:maximumCount];
+	return self;
+}
+
+- (void)dealloc {
+	pthread_key_delete(m_currentStateKey);
+	pthread_cond_destroy(&m_condition);
+	pthread_mutex_destroy(&m_mutex);
+}
+
+- (MLCState *)checkOutState; {
+	MLCState *state = nil;
+
+	pthread_mutex_lock(&m_mutex);
+
+	while (![self.idleStates count] && m_stateCount >= self.maximumCount) {
+		pthread_cond_wait(&m_condition, &m_mutex);
+	}
+
+	if ([self.idleStates count]) {
+		state = [self.idleStates lastObject];
+		[self.idleStates removeLastObject];
+
+		pthread_mutex_unlock(&m_mutex);
+
+		[state lock];
+
+		MLCProfiler *profiler = self.profiler;
+		if (state.profiler != profiler)
+			state.profiler = profiler;
+
+		return state;
+	}
+
+	// reserve a slot for a new state, and then set it up without holding the
+	// mutex
+	++m_stateCount;
+	pthread_mutex_unlock(&m_mutex);
+
+	state = [[MLCState alloc] init];
+	if (state && self.setupBlock && !self.setupBlock(state))
+		state = nil;
+
+	if (!state) {
+		pthread_mutex_lock(&m_mutex);
+		--m_stateCount;
+		pthread_cond_signal(&m_condition);
+		pthread_mutex_unlock(&m_mutex);
+
+		return nil;
+	}
+
+	[state lock];
+	state.profiler = self.profiler;
+
+	return state;
+}
+
+- (void)checkInState:(MLCState *)state; {
+	NSParameterAssert(state != nil);
+
+	[state unlock];
+
+	pthread_mutex_lock(&m_mutex);
+	[self.idleStates addObject:state];
+	pthread_cond_signal(&m_condition);
+	pthread_mutex_unlock(&m_mutex);
+}
+
+- (BOOL)performWithState:(void (^)(MLCState *state))block; {
+	MLCState *currentState = (__bridge MLCState *)pthread_getspecific(m_currentStateKey);
+	if (currentState) {
+		block(currentState);
+		return YES;
+	}
+
+	MLCState *state = [self checkOutState];
+	if (!state)
+		return NO;
+
+	pthread_setspecific(m_currentStateKey, (__bridge void *)state);
+
+	@try {
+		block(state);
+	} @finally {
+		pthread_setspecific(m_currentStateKey, NULL);
+		[self checkInState:state];
+	}
+
+	return YES;
+}
+
+- (void)setProfiler:(MLCProfiler *)profiler {
+	pthread_mutex_lock(&m_mutex);
+
+	m_profiler = profiler;
+
+	for (MLCState *state in self.idleStates) {
+		state.profiler = profiler;
+	}
+
+	pthread_mutex_unlock(&m_mutex);
+}
+
+- (MLCProfiler *)profiler {
+	pthread_mutex_lock(&m_mutex);
+	MLCProfiler *profiler = m_profiler;
+	pthread_mutex_unlock(&m_mutex);
+
+	return profiler;
+}
+
+- (void)removeIdleStates; {
+	pthread_mutex_lock(&m_mutex);
+
+	m_stateCount -= [self.idleStates count];
+
+	// a profiler would otherwise keep the states alive
+	for (MLCState *state in self.idleStates) {
+		state.profiler = nil;
+	}
+
+	[self.idleStates removeAllObjects];
+
+	pthread_cond_broadcast(&m_condition);
+	pthread_mutex_unlock(&m_mutex);
+}
+
+@end
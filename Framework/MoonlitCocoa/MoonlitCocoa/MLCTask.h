@@ -0,0 +1,129 @@
+//
+//  MLCTask.h
+//  MoonlitCocoa
+//
+//  Created by agent on 17.10.26.
+//  Released into the public domain.
+//
+
+#import <Foundation/Foundation.h>
+#import <MoonlitCocoa/MLCValue.h>
+#import <lua.h>
+
+@class MLCState;
+
+/**
+ * A block invoked when an #MLCTask finishes. If the task's function returned
+ * normally, \a results contains its return values (with \c nil values
+ * represented by \c NSNull), and \a error is \c nil. If the function raised an
+ * error, or the task was cancelled, \a results is \c nil, and \a error
+ * describes what went wrong.
+ */
+typedef void (^MLCTaskCompletionHandler)(NSArray *results, NSError *error);
+
+/**
+ * A Lua function running as a coroutine, which can be suspended while waiting
+ * on an asynchronous operation in Objective-C, and then resumed when the
+ * operation completes. Because a suspended task does not occupy a thread, any
+ * number of tasks can be in progress at once.
+ *
+ * Within a task, Lua code can call the global \c await function with
+ * a function argument. That function is invoked with a completion block, which
+ * should be passed to an Objective-C method as its callback:
+ *
+ * @code
+local data = await(function (done)
+	loader:loadDataWithCompletionHandler(done)
+end)
+ * @endcode
+ *
+ * When the completion block is invoked, from any thread, the task is resumed,
+ * and \c await returns the first argument given to the block. The block only
+ * reads its first argument, which must be an object, so it is safe to pass
+ * wherever the callback would receive one or more object arguments.
+ *
+ * A task may also suspend itself with \c coroutine.yield, in which case it must
+ * be resumed explicitly with #resumeWithValues:.
+ *
+ * @note \c await and \c coroutine.yield can only be used from Lua code running
+ * directly within the task. The coroutine cannot be suspended across a C call,
+ * so they raise an error inside a Lua method invoked from Objective-C (even
+ * when the method belongs to an object in the same state), inside a function
+ * called with \c pcall or \c xpcall (except under LuaJIT), and inside
+ * a metamethod.
+ *
+ * Instances of this class are created with MLCState#startTaskWithArgumentCount:completionHandler:,
+ * and should not usually need to be created directly. All methods of this
+ * class are thread-safe.
+ */
+@interface MLCTask : NSObject <MLCValue>
+/**
+ * Returns the function implementing \c await, which is installed as a global
+ * in every #MLCState.
+ */
++ (lua_CFunction)awaitFunction;
+
+/**
+ * Pops \a argCount arguments from the top of the stack of \a state, and the
+ * function that should then be at the top, and prepares to call the function
+ * in a new coroutine. The task does not begin running until #start is invoked.
+ *
+ * This is the designated initializer for this class.
+ *
+ * @note A task retains its #state until it finishes.
+ */
+- (id)initWithArgumentCount:(int)argCount ofState:(MLCState *)state completionHandler:(MLCTaskCompletionHandler)handler;
+
+/**
+ * The state that the receiver runs in.
+ */
+@property (nonatomic, strong, readonly) MLCState *state;
+
+/**
+ * Whether the receiver's function has returned, raised an error, or been
+ * cancelled.
+ */
+@property (readonly, getter = isFinished) BOOL finished;
+
+/**
+ * Whether the receiver was cancelled with #cancel before it finished.
+ */
+@property (readonly, getter = isCancelled) BOOL cancelled;
+
+/**
+ * Whether the receiver has started, and is currently suspended in \c await or
+ * \c coroutine.yield.
+ */
+@property (readonly, getter = isSuspended) BOOL suspended;
+
+/**
+ * If the receiver is suspended in \c coroutine.yield, the values that were
+ * passed to it (with \c nil values represented by \c NSNull). Otherwise, \c
+ * nil.
+ */
+@property (copy, readonly) NSArray *yieldedValues;
+
+/**
+ * Runs the receiver's function until it suspends or finishes. If it finishes,
+ * the completion handler is invoked before this method returns. Returns \c NO
+ * if the receiver has already been started.
+ */
+- (BOOL)start;
+
+/**
+ * Resumes the receiver, which must be suspended, passing \a values as the
+ * results of \c coroutine.yield (or \c await). If the receiver finishes, the
+ * completion handler is invoked before this method returns. Returns \c NO if
+ * the receiver was not suspended.
+ */
+- (BOOL)resumeWithValues:(NSArray *)values;
+
+/**
+ * Cancels the receiver, which will not be resumed again, and invokes its
+ * completion handler with an \c NSUserCancelledError. If the receiver is
+ * currently running, the completion handler is invoked once it next suspends
+ * or finishes. This method has no effect if the receiver has already
+ * finished.
+ */
+- (void)cancel;
+@end
@@ -0,0 +1,602 @@
+//
+//  MLCTask.m
+//  MoonlitCocoa
+//
+//  Created by agent on 17.10.26.
+//  Released into the public domain.
+//
+
+#import "MLCTask.h"
+#import "MLCMarshaling.h"
+#import "MLCState.h"
+#import "NSString+LuaAdditions.h"
+#import <lauxlib.h>
+
+/**
+ * The address of this variable is used as the registry key for the table
+ * mapping the coroutine of each unfinished task to the task (as a light
+ * userdata). The table keeps each coroutine alive, and holds a retain on each
+ * task, until the task finishes.
+ */
+static char MLCTaskTableKey;
+
+/**
+ * Pushes onto the stack of \a state the table of unfinished tasks, creating it
+ * if necessary.
+ */
+static void pushTaskTable (lua_State *state) {
+	lua_pushlightuserdata(state, &MLCTaskTableKey);
+	lua_rawget(state, LUA_REGISTRYINDEX);
+
+	if (lua_istable(state, -1))
+		return;
+
+	lua_pop(state, 1);
+	lua_newtable(state);
+
+	// registry[MLCTaskTableKey] = taskTable
+	lua_pushlightuserdata(state, &MLCTaskTableKey);
+	lua_pushvalue(state, -2);
+	lua_rawset(state, LUA_REGISTRYINDEX);
+}
+
+/**
+ * Returns the unfinished task running the coroutine at \a index in the stack
+ * of \a state, or \c nil if there is none.
+ */
+static MLCTask *taskAtIndex (lua_State *state, int index) {
+	if (lua_type(state, index) != LUA_TTHREAD)
+		return nil;
+
+	// make the index absolute, since we'll be pushing values
+	if (index < 0 && index > LUA_REGISTRYINDEX)
+		index = lua_gettop(state) + index + 1;
+
+	pushTaskTable(state);
+	lua_pushvalue(state, index);
+	lua_rawget(state, -2);
+
+	MLCTask *task = (__bridge MLCTask *)lua_touserdata(state, -1);
+
+	// pop the task and the task table
+	lua_pop(state, 2);
+	return task;
+}
+
+/**
+ * Pops \a count values from the stack of \a state and returns them in order,
+ * representing \c nil and values which cannot be bridged with \c NSNull.
+ */
+static NSArray *popValues (MLCState *state, int count) {
+	NSMutableArray *values = [[NSMutableArray alloc] initWithCapacity:(NSUInteger)count];
+
+	for (int i = count;i > 0;--i) {
+		id value = [state getValueAtStackIndex:-i];
+		[values addObject:value ?: [NSNull null]];
+	}
+
+	lua_pop(state.state, count);
+	return values;
+}
+
+@interface MLCTask () {
+	/**
+	 * The coroutine running the receiver's function.
+	 */
+	lua_State *m_thread;
+
+	/**
+	 * The number of arguments waiting on the stack of #m_thread to be passed
+	 * to the function when the receiver is started.
+	 */
+	int m_initialArgumentCount;
+
+	/**
+	 * Whether the receiver has been started.
+	 */
+	BOOL m_started;
+
+	/**
+	 * Whether the receiver is currently inside a call to \c lua_resume.
+	 */
+	BOOL m_running;
+
+	/**
+	 * Whether the receiver is inside a call to \c await, waiting on its
+	 * completion block.
+	 */
+	BOOL m_awaiting;
+
+	/**
+	 * Incremented each time \c await is called, so that a completion block
+	 * from an earlier call cannot resume the receiver.
+	 */
+	NSUInteger m_awaitGeneration;
+}
+
+@property (nonatomic, strong, readwrite) MLCState *state;
+@property (readwrite, getter = isFinished) BOOL finished;
+@property (readwrite, getter = isCancelled) BOOL cancelled;
+@property (readwrite, getter = isSuspended) BOOL suspended;
+@property (copy, readwrite) NSArray *yieldedValues;
+
+/**
+ * The block invoked when the receiver finishes. This is set to \c nil after it
+ * is invoked.
+ */
+@property (nonatomic, copy) MLCTaskCompletionHandler completionHandler;
+
+/**
+ * The results and error to pass to the #completionHandler.
+ */
+@property (nonatomic, copy) NSArray *results;
+@property (nonatomic, strong) NSError *error;
+
+/**
+ * The completion block passed to the function given to \c await.
+ */
+@property (nonatomic, copy) void (^awaitCallback)(id value);
+
+/**
+ * If the completion block of \c await was invoked before the coroutine could
+ * be suspended, the values that \c await should return.
+ */
+@property (nonatomic, copy) NSArray *awaitedValues;
+
+/**
+ * Resumes #m_thread with the \a argCount values at the top of its stack, and
+ * processes the outcome. Returns \c YES if the receiver has now finished, in
+ * which case #invokeCompletionHandler should be invoked after unlocking the
+ * #state.
+ *
+ * The #state must be locked when invoking this method.
+ */
+- (BOOL)resumeWithArgumentCount:(int)argCount;
+
+/**
+ * Moves \a values onto the stack of #m_thread, and then resumes it. Returns
+ * \c YES if the receiver has now finished.
+ *
+ * The #state must be locked when invoking this method.
+ */
+- (BOOL)resumeWithValuesWhileLocked:(NSArray *)values;
+
+/**
+ * Marks the receiver as finished, and removes it from the table of unfinished
+ * tasks, allowing the coroutine to be collected.
+ *
+ * The #state must be locked when invoking this method.
+ */
+- (void)finish;
+
+/**
+ * Invokes the #completionHandler with the #results and #error, and then
+ * discards all of them.
+ */
+- (void)invokeCompletionHandler;
+
+/**
+ * Prepares a new completion block for \c await, and returns it.
+ */
+- (id)beginAwaiting;
+
+/**
+ * Returns the values passed to the completion block for \c await, if it has
+ * already been invoked. Otherwise, returns \c nil, and the coroutine should be
+ * suspended.
+ */
+- (NSArray *)endAwaiting;
+
+/**
+ * Invoked by a completion block for \c await. Resumes the receiver with \a
+ * value if the block belongs to the current call to \c await.
+ */
+- (void)completeAwaitWithGeneration:(NSUInteger)generation value:(id)value;
+@end
+
+/**
+ * Implements the \c await function available to Lua code in a task.
+ */
+static int awaitAsyncOperation (lua_State *state) {
+	luaL_checktype(state, 1, LUA_TFUNCTION);
+	lua_settop(state, 1);
+
+	lua_pushthread(state);
+
+	// the task is retained by the task table, and ARC would not release
+	// a strong reference if lua_call raises an error
+	__unsafe_unretained MLCTask *task = taskAtIndex(state, -1);
+	lua_pop(state, 1);
+
+	if (!task)
+		return luaL_error(state, "await() can only be called from within an MLCTask");
+
+	// the state is running this coroutine, so it outlives the call
+	__unsafe_unretained MLCState *stateObj = task.state;
+	MLCLuaExecutionContext context = MLCEnterObjectiveC(stateObj, state);
+
+	// the block is retained by the task until the next call to await()
+	__unsafe_unretained id callback = nil;
+
+	@try {
+		callback = [task beginAwaiting];
+	} @finally {
+		MLCLeaveObjectiveC(stateObj, context);
+	}
+
+	// the operation is started by Lua code, so this must be outside of the
+	// Objective-C context
+	lua_pushlightuserdata(state, (__bridge void *)callback);
+	lua_call(state, 1, 0);
+
+	context = MLCEnterObjectiveC(stateObj, state);
+	int resultCount = -1;
+
+	@try {
+		NSArray *values = [task endAwaiting];
+		if (values) {
+			// the operation finished before it returned
+			[stateObj growStackBySize:(int)[values count]];
+
+			for (id value in values) {
+				[stateObj pushObject:value];
+			}
+
+			resultCount = (int)[values count];
+		}
+	} @finally {
+		MLCLeaveObjectiveC(stateObj, context);
+	}
+
+	if (resultCount < 0)
+		return lua_yield(state, 0);
+
+	return resultCount;
+}
+
+@implementation MLCTask
+@synthesize state = m_state;
+@synthesize finished = m_finished;
+@synthesize cancelled = m_cancelled;
+@synthesize suspended = m_suspended;
+@synthesize yieldedValues = m_yieldedValues;
+@synthesize completionHandler = m_completionHandler;
+@synthesize results = m_results;
+@synthesize error = m_error;
+@synthesize awaitCallback = m_awaitCallback;
+@synthesize awaitedValues = m_awaitedValues;
+
++ (lua_CFunction)awaitFunction; {
+	return &awaitAsyncOperation;
+}
+
+- (id)initWithArgumentCount:(int)argCount ofState:(MLCState *)state completionHandler:(MLCTaskCompletionHandler)handler; {
+	NSParameterAssert(state != nil);
+	NSParameterAssert(argCount >= 0);
+
+	self = [super init];
+	if (!self)
+		return nil;
+
+	self.state = state;
+	self.completionHandler = handler;
+
+	[state lock];
+
+	@try {
+		// thread + task table + thread copy + task
+		[state growStackBySize:4];
+
+		lua_State *L = state.state;
+		m_thread = lua_newthread(L);
+
+		// taskTable[thread] = self, balanced by CFBridgingRelease() in
+		// -finish
+		pushTaskTable(L);
+		lua_pushvalue(L, -2);
+		lua_pushlightuserdata(L, (void *)CFBridgingRetain(self));
+		lua_rawset(L, -3);
+		lua_pop(L, 1);
+
+		// move the function and its arguments into the coroutine, leaving the
+		// thread
+		lua_insert(L, -(argCount + 2));
+		lua_xmove(L, m_thread, argCount + 1);
+		lua_pop(L, 1);
+
+		m_initialArgumentCount = argCount;
+	} @finally {
+		[state unlock];
+	}
+
+	return self;
+}
+
+- (BOOL)start; {
+	MLCState *state = self.state;
+	BOOL finished = NO;
+
+	[state lock];
+
+	@try {
+		if (m_started)
+			return NO;
+
+		m_started = YES;
+
+		// if cancelled before being started, the completion handler has
+		// already been invoked
+		if (!self.cancelled)
+			finished = [self resumeWithArgumentCount:m_initialArgumentCount];
+	} @finally {
+		[state unlock];
+	}
+
+	if (finished)
+		[self invokeCompletionHandler];
+
+	return YES;
+}
+
+- (BOOL)resumeWithValues:(NSArray *)values; {
+	MLCState *state = self.state;
+	BOOL finished = NO;
+
+	[state lock];
+
+	@try {
+		if (!self.suspended || m_running || self.finished)
+			return NO;
+
+		// any outstanding completion block for await() should now be ignored
+		m_awaiting = NO;
+		++m_awaitGeneration;
+
+		finished = [self resumeWithValuesWhileLocked:values];
+	} @finally {
+		[state unlock];
+	}
+
+	if (finished)
+		[self invokeCompletionHandler];
+
+	return YES;
+}
+
+- (BOOL)resumeWithValuesWhileLocked:(NSArray *)values; {
+	MLCState *state = self.state;
+	int count = (int)[values count];
+
+	[state growStackBySize:count];
+
+	for (id value in values) {
+		[state pushObject:value];
+	}
+
+	if (!lua_checkstack(m_thread, count)) {
+		[NSException raise:MLCLuaStackOverflowException format:@"Could not grow stack of task %@ by %i slots", self, count];
+	}
+
+	lua_xmove(state.state, m_thread, count);
+	return [self resumeWithArgumentCount:count];
+}
+
+- (BOOL)resumeWithArgumentCount:(int)argCount; {
+	MLCState *state = self.state;
+	int resultCount = 0;
+
+	self.suspended = NO;
+	self.yieldedValues = nil;
+
+	m_running = YES;
+	int status = [state resumeThread:m_thread argumentCount:argCount resultCount:&resultCount];
+	m_running = NO;
+
+	if (self.cancelled) {
+		// the error was set by -cancel
+		lua_pop(state.state, resultCount);
+		[self finish];
+		return YES;
+	}
+
+	if (status == LUA_YIELD) {
+		if (m_awaiting) {
+			// await() never yields any values
+			lua_pop(state.state, resultCount);
+		} else {
+			self.yieldedValues = popValues(state, resultCount);
+		}
+
+		self.suspended = YES;
+		return NO;
+	}
+
+	if (status == 0) {
+		self.results = popValues(state, resultCount);
+	} else {
+		NSDictionary *userInfo = nil;
+
+		// the error message is the only result
+		NSString *message = [NSString popFromStack:state];
+		if (message) {
+			userInfo = [NSDictionary dictionaryWithObject:message forKey:NSLocalizedDescriptionKey];
+		}
+
+		self.error = [NSError
+			errorWithDomain:MLCLuaErrorDomain
+			code:status
+			userInfo:userInfo
+		];
+	}
+
+	[self finish];
+	return YES;
+}
+
+- (void)finish; {
+	self.finished = YES;
+	self.suspended = NO;
+	self.yieldedValues = nil;
+	self.awaitCallback = nil;
+	m_awaiting = NO;
+	++m_awaitGeneration;
+
+	if (!m_thread)
+		return;
+
+	// use the coroutine's own stack, since it is no longer running
+	if (!lua_checkstack(m_thread, 3)) {
+		[NSException raise:MLCLuaStackOverflowException format:@"Could not grow stack of task %@ by 3 slots", self];
+	}
+
+	lua_State *thread = m_thread;
+	m_thread = NULL;
+
+	lua_settop(thread, 0);
+
+	// taskTable[thread] = nil
+	pushTaskTable(thread);
+	lua_pushthread(thread);
+	lua_pushnil(thread);
+	lua_rawset(thread, -3);
+	lua_pop(thread, 1);
+
+	// balance the retain from the task table; this cannot deallocate the
+	// receiver, since every caller of -finish is reached through a message
+	// to it, and that sender holds its own reference
+	CFBridgingRelease((__bridge CFTypeRef)self);
+}
+
+- (void)invokeCompletionHandler; {
+	MLCTaskCompletionHandler handler = self.completionHandler;
+	NSArray *results = self.results;
+	NSError *error = self.error;
+
+	self.completionHandler = nil;
+	self.results = nil;
+	self.error = nil;
+
+	if (handler)
+		handler(results, error);
+}
+
+- (void)cancel; {
+	MLCState *state = self.state;
+	[state lock];
+
+	@try {
+		if (self.finished || self.cancelled)
+			return;
+
+		self.cancelled = YES;
+		self.error = [NSError errorWithDomain:NSCocoaErrorDomain code:NSUserCancelledError userInfo:nil];
+
+		// if running, -resumeWithArgumentCount: will finish once the
+		// coroutine returns control to us
+		if (m_running)
+			return;
+
+		[self finish];
+	} @finally {
+		[state unlock];
+	}
+
+	[self invokeCompletionHandler];
+}
+
+#pragma mark Awaiting
+
+- (id)beginAwaiting; {
+	m_awaiting = YES;
+	self.awaitedValues = nil;
+
+	NSUInteger generation = ++m_awaitGeneration;
+
+	// the task is kept alive by the task table until it finishes, so
+	// a completion block invoked after that point does nothing
+	__weak MLCTask *weakSelf = self;
+
+	self.awaitCallback = ^(id value){
+		[weakSelf completeAwaitWithGeneration:generation value:value];
+	};
+
+	return self.awaitCallback;
+}
+
+- (NSArray *)endAwaiting; {
+	NSArray *values = self.awaitedValues;
+	self.awaitedValues = nil;
+	return values;
+}
+
+- (void)completeAwaitWithGeneration:(NSUInteger)generation value:(id)value; {
+	NSArray *values = value ? [NSArray arrayWithObject:value] : [NSArray array];
+
+	MLCState *state = self.state;
+	BOOL finished = NO;
+
+	[state lock];
+
+	@try {
+		if (!m_awaiting || generation != m_awaitGeneration || self.finished)
+			return;
+
+		m_awaiting = NO;
+
+		if (!self.suspended) {
+			// the block was invoked before await() could yield, so it can
+			// return the values directly
+			self.awaitedValues = values;
+			return;
+		}
+
+		finished = [self resumeWithValuesWhileLocked:values];
+	} @finally {
+		[state unlock];
+	}
+
+	if (finished)
+		[self invokeCompletionHandler];
+}
+
+#pragma mark MLCValue
+
++ (BOOL)isOnStack:(MLCState *)state; {
+	[state growStackBySize:3];
+	return taskAtIndex(state.state, -1) != nil;
+}
+
++ (id)popFromStack:(MLCState *)state; {
+	[state growStackBySize:3];
+
+	MLCTask *task = taskAtIndex(state.state, -1);
+	lua_pop(state.state, 1);
+
+	return task;
+}
+
+- (void)pushOntoStack:(MLCState *)state; {
+	[state lock];
+
+	@try {
+		[state growStackBySize:1];
+
+		if (m_thread && state == self.state) {
+			if (m_thread == state.state) {
+				// the task is currently running
+				lua_pushthread(m_thread);
+			} else {
+				lua_checkstack(m_thread, 1);
+				lua_pushthread(m_thread);
+				lua_xmove(m_thread, state.state, 1);
+			}
+		} else {
+			// a finished task no longer has a coroutine
+			lua_pushnil(state.state);
+		}
+	} @finally {
+		[state unlock];
+	}
+}
+
+@end
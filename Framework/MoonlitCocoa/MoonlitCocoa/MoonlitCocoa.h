@@ -6,9 +6,20 @@
 //  Released into the public domain.
 //
 
+#import <MoonlitCocoa/MLCBinaryDecoder.h>
+#import <MoonlitCocoa/MLCBinaryEncoder.h>
+#import <MoonlitCocoa/MLCBinaryFormat.h>
 #import <MoonlitCocoa/MLCBridgedObject.h>
+#import <MoonlitCocoa/MLCLuaArray.h>
+#import <MoonlitCocoa/MLCLuaDictionary.h>
+#import <MoonlitCocoa/MLCLuaFunction.h>
+#import <MoonlitCocoa/MLCLuaString.h>
 #import <MoonlitCocoa/MLCModel.h>
+#import <MoonlitCocoa/MLCNumericArray.h>
+#import <MoonlitCocoa/MLCProfiler.h>
 #import <MoonlitCocoa/MLCState.h>
+#import <MoonlitCocoa/MLCStatePool.h>
+#import <MoonlitCocoa/MLCTask.h>
 #import <MoonlitCocoa/MLCValue.h>
 #import <MoonlitCocoa/NSArray+LuaAdditions.h>
 #import <MoonlitCocoa/NSDecimalNumber+LuaAdditions.h>
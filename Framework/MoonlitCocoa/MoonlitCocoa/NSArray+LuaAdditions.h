@@ -41,6 +41,10 @@
  * Any values whose types are not understood are inserted into the array as
  * instances of \c NSNull.
  *
+ * If the receiver is \c NSArray, an #MLCLuaArray is returned, which converts
+ * values only when they are accessed. Otherwise, the whole table is converted
+ * immediately.
+ *
  * @note In Lua, numeric indices are expected to start at one. This method will
  * subtract one from every index in the Lua table, resulting in an array that
  * begins at zero.
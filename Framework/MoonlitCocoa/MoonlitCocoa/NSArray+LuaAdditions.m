@@ -7,6 +7,8 @@
 //
 
 #import "NSArray+LuaAdditions.h"
+#import "MLCLuaArray.h"
+#import "MLCMarshaling.h"
 #import "MLCState.h"
 #import <lua.h>
 
@@ -45,6 +47,14 @@
 		return [NSArray array];
 	}
 
+	// plain arrays convert their contents lazily
+	if (self == [NSArray class]) {
+		MLCLuaArray *array = [[MLCLuaArray alloc] initWithValueAtStackIndex:-1 ofState:state];
+
+		lua_pop(state.state, 1);
+		return array;
+	}
+
 	// zeroing out the array will help in catching bugs, but it shouldn't be
 	// necessary and can't be considered a fix for missing elements (since
 	// initializing an array with a nil object will throw an exception anyways)
@@ -54,65 +64,49 @@
 		return nil;
 	}
 
+	lua_State *L = state.state;
+
 	// space for the key used during iteration
-	[state growStackBySize:1];
-
-	[state enforceStackDelta:-1 forBlock:^{
-		lua_pushnil(state.state);
-
-		while (lua_next(state.state, -2) != 0) {
-			// key is now at -2
-			// value is now at -1
-			
-			NSUInteger index = (NSUInteger)lua_tonumber(state.state, -2);
-			if (index == 0 || index > length) {
-				// this index is non-numeric or out-of-order -- skip it (popping
-				// the value from the stack)
-				lua_pop(state.state, 1);
-				continue;
-			}
-
-			id value = [state popValueOnStack];
-			
-			// Lua indices start at one, so adjust appropriately
-			values[index - 1] = value;
+	MLCGrowStack(L, 1);
+	MLCBeginStackCheck(L);
+
+	lua_pushnil(L);
+
+	while (lua_next(L, -2) != 0) {
+		// key is now at -2
+		// value is now at -1
+
+		NSUInteger index = (NSUInteger)lua_tonumber(L, -2);
+		if (index == 0 || index > length) {
+			// this index is non-numeric or out-of-order -- skip it (popping
+			// the value from the stack)
+			lua_pop(L, 1);
+			continue;
 		}
 
-		// pop the table
-		lua_pop(state.state, 1);
+		// Lua indices start at one, so adjust appropriately
+		values[index - 1] = MLCPopValue(state);
+	}
 
-		return YES;
-	}];
+	// pop the table
+	lua_pop(L, 1);
+
+	MLCEndStackCheck(L, -1);
 
 	NSArray *array = [[self alloc] initWithObjects:values count:length];
+
+	// ARC does not release objects stored in malloc'd memory
+	for (size_t i = 0;i < length;++i) {
+		values[i] = nil;
+	}
+
 	free(values);
 
 	return array;
 }
 
 - (void)pushOntoStack:(MLCState *)state; {
-	// reserve space for a new table
-	[state growStackBySize:1];
-
-	[state enforceStackDelta:1 forBlock:^{
-		NSUInteger count = [self count];
-		if (count <= INT_MAX) {
-			lua_createtable(state.state, (int)count, 0);
-		} else {
-			lua_newtable(state.state);
-		}
-
-		lua_Number index = 1;
-		for (id value in self) {
-			lua_pushnumber(state.state, index);
-			[state pushObject:value];
-
-			// t[index] = value
-			lua_settable(state.state, -2);
-		}
-
-		return YES;
-	}];
+	MLCPushArray(state, self);
 }
 
 @end
@@ -24,6 +24,10 @@
  * MLCState#popValueOnStack. Any keys or values whose types are not understood
  * are silently omitted from the returned dictionary.
  *
+ * If the receiver is \c NSDictionary, an #MLCLuaDictionary is returned, which
+ * converts keys and values only when they are accessed. Otherwise, the whole
+ * table is converted immediately.
+ *
  * @note In Lua, numeric indices are expected to start at one. The indices in
  * the table being popped off the stack are not adjusted in any way, so they may
  * begin at one instead of zero.
@@ -7,6 +7,8 @@
 //
 
 #import "NSDictionary+LuaAdditions.h"
+#import "MLCLuaDictionary.h"
+#import "MLCMarshaling.h"
 #import "MLCState.h"
 #import <lua.h>
 
@@ -21,59 +23,51 @@
 		return nil;
 	}
 
+	// plain dictionaries convert their contents lazily
+	if (self == [NSDictionary class]) {
+		MLCLuaDictionary *dict = [[MLCLuaDictionary alloc] initWithValueAtStackIndex:-1 ofState:state];
+
+		lua_pop(state.state, 1);
+		return dict;
+	}
+
+	lua_State *L = state.state;
+
 	// space for the key used during iteration
-	[state growStackBySize:1];
+	MLCGrowStack(L, 1);
 
 	NSMutableDictionary *dict = [[NSMutableDictionary alloc] init];
 
-	[state enforceStackDelta:-1 forBlock:^{
-		lua_pushnil(state.state);
+	MLCBeginStackCheck(L);
+	lua_pushnil(L);
 
-		while (lua_next(state.state, -2) != 0) {
-			// key is now at -2
-			// value is now at -1
-			id value = [state popValueOnStack];
-			if (!value)
-				continue;
+	while (lua_next(L, -2) != 0) {
+		// key is now at -2
+		// value is now at -1
+		id value = MLCPopValue(state);
+		if (!value)
+			continue;
 
-			id key = [state getValueAtStackIndex:-1];
-			if (!key)
-				continue;
+		id key = MLCGetValue(state, -1);
+		if (!key)
+			continue;
 
-			[dict setObject:value forKey:key];
-		}
+		[dict setObject:value forKey:key];
+	}
 
-		// pop the table
-		lua_pop(state.state, 1);
+	// pop the table
+	lua_pop(L, 1);
 
-		return YES;
-	}];
+	MLCEndStackCheck(L, -1);
+
+	// avoid copying the dictionary again if it's already of the right class
+	if ([dict isKindOfClass:self])
+		return dict;
 
 	return [[self alloc] initWithDictionary:dict];
 }
 
 - (void)pushOntoStack:(MLCState *)state; {
-	// reserve space for a new table
-	[state growStackBySize:1];
-
-	[state enforceStackDelta:1 forBlock:^{
-		NSUInteger count = [self count];
-		if (count <= INT_MAX) {
-			lua_createtable(state.state, 0, (int)count);
-		} else {
-			lua_newtable(state.state);
-		}
-
-		for (id key in self) {
-			id value = [self objectForKey:key];
-
-			[state pushObject:key];
-			[state pushObject:value];
-
-			lua_settable(state.state, -2);
-		}
-
-		return YES;
-	}];
+	MLCPushDictionary(state, self);
 }
 @end
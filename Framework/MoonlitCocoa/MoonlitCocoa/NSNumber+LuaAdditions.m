@@ -7,6 +7,7 @@
 //
 
 #import "NSNumber+LuaAdditions.h"
+#import "MLCMarshaling.h"
 #import "MLCState.h"
 
 @implementation NSNumber (LuaAdditions)
@@ -30,7 +31,10 @@
 - (void)pushOntoStack:(MLCState *)state; {
 	[state growStackBySize:1];
 
-	lua_pushnumber(state.state, [self doubleValue]);
+	if (MLCNumberIsBoolean(self))
+		lua_pushboolean(state.state, [self boolValue]);
+	else
+		lua_pushnumber(state.state, [self doubleValue]);
 }
 
 @end
@@ -21,6 +21,10 @@
  * to be encoded with UTF-8. Returns \c nil if the value at the top of the Lua
  * stack is not a string or number.
  *
+ * If the receiver is \c NSString and the value is a string of at least
+ * #MLCLuaStringMinimumLength bytes, an #MLCLuaString is returned, which reads
+ * the bytes of the Lua string without copying them.
+ *
  * @note The string on the stack may contain embedded NULs.
  */
 + (id)popFromStack:(MLCState *)state;
@@ -28,7 +32,8 @@
 /**
  * Pushes the receiver on the Lua stack of \a state.
  *
- * @note The string is encoded with UTF-8 before being passed into Lua.
+ * @note The string is encoded with UTF-8 before being passed into Lua. If the
+ * string is already stored as ASCII, its bytes are passed into Lua directly.
  */
 - (void)pushOntoStack:(MLCState *)state;
 @end
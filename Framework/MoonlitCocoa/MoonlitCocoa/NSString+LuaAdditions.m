@@ -7,6 +7,7 @@
 //
 
 #import "NSString+LuaAdditions.h"
+#import "MLCMarshaling.h"
 #import "MLCState.h"
 #import <lua.h>
 
@@ -16,6 +17,9 @@
 }
 
 + (id)popFromStack:(MLCState *)state; {
+	if (self == [NSString class])
+		return MLCPopString(state);
+
   	size_t len = 0;
 	const char *cStr = lua_tolstring(state.state, -1, &len);
 	if (!cStr) {
@@ -32,9 +36,6 @@
 }
 
 - (void)pushOntoStack:(MLCState *)state; {
-	[state growStackBySize:1];
-
-  	NSData *data = [self dataUsingEncoding:NSUTF8StringEncoding];
-	lua_pushlstring(state.state, [data bytes], [data length]);
+	MLCPushString(state, self);
 }
 @end
@@ -0,0 +1,29 @@
+//
+//  SenTestCase.m
+//  MoonlitCocoaTests
+//
+//  Created by agent on 17.10.26.
+//  Released into the public domain.
+//
+
+#import <SenTestingKit/SenTestingKit.h>
+
+@interface SenTestCase ()
+@property (nonatomic, assign, readwrite) NSUInteger failureCount;
+@end
+
+@implementation SenTestCase
+@synthesize failureCount = m_failureCount;
+
+- (void)setUp; {
+}
+
+- (void)tearDown; {
+}
+
+- (void)recordFailureInFile:(const char *)file line:(int)line description:(NSString *)description; {
+	++self.failureCount;
+	fprintf(stderr, "%s:%i: error: %s\n", file, line, [description UTF8String]);
+}
+
+@end
@@ -0,0 +1,85 @@
+//
+//  SenTestingKit.h
+//  MoonlitCocoaTests
+//
+//  Created by agent on 17.10.26.
+//  Released into the public domain.
+//
+//  A minimal stand-in for the parts of SenTestingKit used by the tests, for
+//  platforms without it. Unlike SenTestingKit, the descriptions given to
+//  assertions must not be nil.
+//
+
+#import <Foundation/Foundation.h>
+
+/**
+ * The base class of test cases. Every method of a subclass whose name begins
+ * with "test" and which takes no arguments is run by main.m, on a new
+ * instance, between #setUp and #tearDown.
+ */
+@interface SenTestCase : NSObject
+/**
+ * The number of failures recorded by the receiver.
+ */
+@property (nonatomic, assign, readonly) NSUInteger failureCount;
+
+/**
+ * Invoked before each test method.
+ */
+- (void)setUp;
+
+/**
+ * Invoked after each test method, even if it failed.
+ */
+- (void)tearDown;
+
+/**
+ * Records a failure at the given location, and prints it to stderr in the
+ * format used by compilers, so that editors can jump to it.
+ */
+- (void)recordFailureInFile:(const char *)file line:(int)line description:(NSString *)description;
+@end
+
+#define STFail(description, ...) \
+	[self recordFailureInFile:__FILE__ line:__LINE__ description:[NSString stringWithFormat:(description), ##__VA_ARGS__]]
+
+#define STAssertTrue(expr, description, ...) \
+	do { \
+		if (!(expr)) \
+			STFail(@"\"%s\" should be true. %@", #expr, [NSString stringWithFormat:(description), ##__VA_ARGS__]); \
+	} while (0)
+
+#define STAssertFalse(expr, description, ...) \
+	do { \
+		if ((expr)) \
+			STFail(@"\"%s\" should be false. %@", #expr, [NSString stringWithFormat:(description), ##__VA_ARGS__]); \
+	} while (0)
+
+#define STAssertNil(expr, description, ...) \
+	do { \
+		id MLCTestValue = (expr); \
+		if (MLCTestValue) \
+			STFail(@"\"%s\" should be nil but is %@. %@", #expr, MLCTestValue, [NSString stringWithFormat:(description), ##__VA_ARGS__]); \
+	} while (0)
+
+#define STAssertNotNil(expr, description, ...) \
+	do { \
+		if (!(expr)) \
+			STFail(@"\"%s\" should not be nil. %@", #expr, [NSString stringWithFormat:(description), ##__VA_ARGS__]); \
+	} while (0)
+
+#define STAssertEqualObjects(a, b, description, ...) \
+	do { \
+		id MLCTestLeft = (a); \
+		id MLCTestRight = (b); \
+		if (MLCTestLeft != MLCTestRight && ![MLCTestLeft isEqual:MLCTestRight]) \
+			STFail(@"'%@' should be equal to '%@'. %@", MLCTestLeft, MLCTestRight, [NSString stringWithFormat:(description), ##__VA_ARGS__]); \
+	} while (0)
+
+#define STAssertEquals(a, b, description, ...) \
+	do { \
+		__typeof__(a) MLCTestLeft = (a); \
+		__typeof__(b) MLCTestRight = (b); \
+		if (MLCTestLeft != MLCTestRight) \
+			STFail(@"\"%s\" should be equal to \"%s\". %@", #a, #b, [NSString stringWithFormat:(description), ##__VA_ARGS__]); \
+	} while (0)
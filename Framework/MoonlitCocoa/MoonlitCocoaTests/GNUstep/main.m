@@ -0,0 +1,124 @@
+//
+//  main.m
+//  MoonlitCocoaTests
+//
+//  Created by agent on 17.10.26.
+//  Released into the public domain.
+//
+//  Runs every test method of every SenTestCase subclass linked into the tool,
+//  and exits with a non-zero status if any of them failed.
+//
+//  Usage: MoonlitCocoaTests [FILTER]
+//
+//  If FILTER is given, only tests whose names (as in "-[Class testMethod]")
+//  contain it are run.
+//
+
+#import <Foundation/Foundation.h>
+#import <SenTestingKit/SenTestingKit.h>
+#import <objc/runtime.h>
+
+/**
+ * Returns whether \a cls inherits from SenTestCase.
+ */
+static BOOL isTestCaseClass (Class cls) {
+	Class testCaseClass = [SenTestCase class];
+
+	for (Class superclass = class_getSuperclass(cls);superclass;superclass = class_getSuperclass(superclass)) {
+		if (superclass == testCaseClass)
+			return YES;
+	}
+
+	return NO;
+}
+
+/**
+ * Returns the names of the test methods of \a cls, sorted so that they run in
+ * the same order every time.
+ */
+static NSArray *testMethodNames (Class cls) {
+	NSMutableArray *names = [NSMutableArray array];
+
+	unsigned count = 0;
+	Method *methods = class_copyMethodList(cls, &count);
+
+	for (unsigned i = 0;i < count;++i) {
+		NSString *name = NSStringFromSelector(method_getName(methods[i]));
+		if ([name hasPrefix:@"test"] && method_getNumberOfArguments(methods[i]) == 2)
+			[names addObject:name];
+	}
+
+	free(methods);
+	return [names sortedArrayUsingSelector:@selector(compare:)];
+}
+
+/**
+ * Runs the test method \a name of \a cls on a new instance, and returns the
+ * number of failures recorded.
+ */
+static NSUInteger runTest (Class cls, NSString *name) {
+	SEL selector = NSSelectorFromString(name);
+	void (*testMethod)(id, SEL) = (void (*)(id, SEL))class_getMethodImplementation(cls, selector);
+
+	SenTestCase *testCase = [[cls alloc] init];
+
+	@try {
+		[testCase setUp];
+
+		@try {
+			testMethod(testCase, selector);
+		} @finally {
+			[testCase tearDown];
+		}
+	} @catch (NSException *ex) {
+		[testCase recordFailureInFile:"Unknown" line:0 description:[NSString stringWithFormat:@"Uncaught exception %@: %@", [ex name], [ex reason]]];
+	}
+
+	return testCase.failureCount;
+}
+
+int main (int argc, const char *argv[]) {
+	@autoreleasepool {
+		NSString *filter = (argc > 1 ? [NSString stringWithUTF8String:argv[1]] : nil);
+
+		int classCount = objc_getClassList(NULL, 0);
+		Class __unsafe_unretained *classes = (Class __unsafe_unretained *)malloc(sizeof(Class) * (size_t)classCount);
+		classCount = objc_getClassList(classes, classCount);
+
+		NSMutableArray *testCaseClasses = [NSMutableArray array];
+		for (int i = 0;i < classCount;++i) {
+			if (isTestCaseClass(classes[i]))
+				[testCaseClasses addObject:classes[i]];
+		}
+
+		free(classes);
+
+		[testCaseClasses sortUsingComparator:^(id a, id b){
+			return [NSStringFromClass(a) compare:NSStringFromClass(b)];
+		}];
+
+		NSUInteger testCount = 0;
+		NSUInteger failedTestCount = 0;
+
+		for (Class cls in testCaseClasses) {
+			for (NSString *name in testMethodNames(cls)) {
+				NSString *testName = [NSString stringWithFormat:@"-[%@ %@]", NSStringFromClass(cls), name];
+				if (filter && [testName rangeOfString:filter].location == NSNotFound)
+					continue;
+
+				++testCount;
+
+				@autoreleasepool {
+					BOOL passed = (runTest(cls, name) == 0);
+					if (!passed)
+						++failedTestCount;
+
+					fprintf(stderr, "Test Case '%s' %s.\n", [testName UTF8String], (passed ? "passed" : "failed"));
+				}
+			}
+		}
+
+		fprintf(stderr, "Executed %lu tests, with %lu failures.\n", (unsigned long)testCount, (unsigned long)failedTestCount);
+		return (failedTestCount == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+	}
+}
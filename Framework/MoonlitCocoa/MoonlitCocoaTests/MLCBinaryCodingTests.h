@@ -0,0 +1,18 @@
+//
+//  MLCBinaryCodingTests.h
+//  MoonlitCocoaTests
+//
+//  Created by agent on 17.10.26.
+//  Released into the public domain.
+//
+
+#import <SenTestingKit/SenTestingKit.h>
+
+/**
+ * Tests round trips through MLCBinaryEncoder and MLCBinaryDecoder, for
+ * Objective-C objects and Lua values and for each kind of input, and checks
+ * that malformed input is rejected cleanly.
+ */
+@interface MLCBinaryCodingTests : SenTestCase
+
+@end
@@ -0,0 +1,563 @@
+//
+//  MLCBinaryCodingTests.m
+//  MoonlitCocoaTests
+//
+//  Created by agent on 17.10.26.
+//  Released into the public domain.
+//
+
+#import "MLCBinaryCodingTests.h"
+#import "MLCTestModel.h"
+#import <MoonlitCocoa/MoonlitCocoa.h>
+#import <fcntl.h>
+#import <lauxlib.h>
+#import <unistd.h>
+
+/**
+ * Appends \a value to \a data as an unsigned LEB128 varint.
+ */
+static void appendVarint (NSMutableData *data, unsigned long long value) {
+	do {
+		unsigned char byte = value & 0x7F;
+		value >>= 7;
+
+		if (value)
+			byte |= 0x80;
+
+		[data appendBytes:&byte length:1];
+	} while (value);
+}
+
+/**
+ * Appends a single tag byte to \a data.
+ */
+static void appendTag (NSMutableData *data, MLCBinaryTag tag) {
+	unsigned char byte = (unsigned char)tag;
+	[data appendBytes:&byte length:1];
+}
+
+/**
+ * Returns the number of times that \a string occurs in \a data, as bytes of
+ * UTF-8.
+ */
+static NSUInteger occurrencesOfString (NSData *data, NSString *string) {
+	const char *bytes = [data bytes];
+	size_t length = [data length];
+
+	const char *needle = [string UTF8String];
+	size_t needleLength = strlen(needle);
+
+	NSUInteger count = 0;
+	for (size_t i = 0;i + needleLength <= length;++i) {
+		if (memcmp(bytes + i, needle, needleLength) == 0)
+			++count;
+	}
+
+	return count;
+}
+
+@interface MLCBinaryCodingTests ()
+@property (nonatomic, strong) MLCState *state;
+@property (nonatomic, copy) NSURL *temporaryFileURL;
+
+/**
+ * Returns a stream containing only the header of the binary format.
+ */
+- (NSMutableData *)emptyStream;
+
+/**
+ * Loads \a source as a Lua chunk, and calls it with the value at the top of
+ * the stack of #state, which is popped. Returns whether the chunk returned a
+ * true value. The receiver must be locked.
+ */
+- (BOOL)valueOnStackPassesChunk:(const char *)source;
+
+/**
+ * Asserts that decoding \a data into Objective-C fails with \a code, and that
+ * decoding it onto #state fails with the same code, leaving the stack as it
+ * was.
+ */
+- (void)assertDecodingData:(NSData *)data failsWithCode:(MLCBinaryError)code;
+@end
+
+@implementation MLCBinaryCodingTests
+@synthesize state = m_state;
+@synthesize temporaryFileURL = m_temporaryFileURL;
+
+- (void)setUp {
+	[super setUp];
+
+	self.state = [[MLCState alloc] init];
+
+	NSString *name = [NSString stringWithFormat:@"MLCBinaryCodingTests-%@", [[NSProcessInfo processInfo] globallyUniqueString]];
+	self.temporaryFileURL = [NSURL fileURLWithPath:[NSTemporaryDirectory() stringByAppendingPathComponent:name]];
+}
+
+- (void)tearDown {
+	[[NSFileManager defaultManager] removeItemAtURL:self.temporaryFileURL error:NULL];
+
+	self.temporaryFileURL = nil;
+	self.state = nil;
+
+	[super tearDown];
+}
+
+- (NSMutableData *)emptyStream; {
+	NSMutableData *data = [NSMutableData dataWithBytes:MLCBinaryFormatMagic length:sizeof(MLCBinaryFormatMagic)];
+
+	unsigned char version = MLCBinaryFormatVersion;
+	[data appendBytes:&version length:1];
+
+	return data;
+}
+
+- (BOOL)valueOnStackPassesChunk:(const char *)source; {
+	MLCState *state = self.state;
+
+	if (luaL_loadstring(state.state, source) != 0) {
+		NSString *message = [state popValueOnStack];
+		STFail(@"Could not load chunk: %@", message);
+
+		lua_pop(state.state, 1);
+		return NO;
+	}
+
+	// move the function below its argument
+	lua_insert(state.state, -2);
+
+	NSError *error = nil;
+	if (![state callFunctionWithArgumentCount:1 resultCount:1 error:&error]) {
+		STFail(@"Chunk failed: %@", error);
+		return NO;
+	}
+
+	BOOL result = lua_toboolean(state.state, -1);
+	lua_pop(state.state, 1);
+
+	return result;
+}
+
+- (void)assertDecodingData:(NSData *)data failsWithCode:(MLCBinaryError)code; {
+	NSError *error = nil;
+	STAssertNil([MLCBinaryDecoder objectWithData:data error:&error], @"");
+	STAssertEqualObjects([error domain], MLCBinaryErrorDomain, @"%@", error);
+	STAssertEquals([error code], (NSInteger)code, @"%@", error);
+
+	MLCState *state = self.state;
+	[state lock];
+
+	int top = lua_gettop(state.state);
+
+	error = nil;
+	MLCBinaryDecoder *decoder = [[MLCBinaryDecoder alloc] initWithData:data];
+	STAssertFalse([decoder decodeValueOntoState:state error:&error], @"");
+	STAssertEquals([error code], (NSInteger)code, @"%@", error);
+	STAssertEquals(lua_gettop(state.state), top, @"nothing should be left on the stack");
+
+	[state unlock];
+}
+
+#pragma mark Objective-C values
+
+- (void)testObjectRoundTrip {
+	NSDictionary *object = [NSDictionary dictionaryWithObjectsAndKeys:
+		@"bar", @"foo",
+		[NSNumber numberWithInt:-42], @"integer",
+		[NSNumber numberWithUnsignedLongLong:ULLONG_MAX], @"unsigned",
+		[NSNumber numberWithDouble:0.25], @"double",
+		[NSNumber numberWithBool:YES], @"boolean",
+		[NSNull null], @"null",
+		[NSDecimalNumber decimalNumberWithString:@"12.34"], @"decimal",
+		[@"bytes" dataUsingEncoding:NSUTF8StringEncoding], @"data",
+		[NSArray arrayWithObjects:@"café", [NSArray array], [NSDictionary dictionary], nil], @"array",
+		@"a number key", [NSNumber numberWithInt:5],
+		nil
+	];
+
+	NSError *error = nil;
+	NSData *data = [MLCBinaryEncoder dataWithObject:object error:&error];
+	STAssertNotNil(data, @"%@", error);
+
+	id decoded = [MLCBinaryDecoder objectWithData:data error:&error];
+	STAssertEqualObjects(decoded, object, @"%@", error);
+}
+
+- (void)testModelRoundTrip {
+	MLCTestModel *child = [[MLCTestModel alloc] initWithName:@"child" quantity:[NSNumber numberWithInt:1]];
+	MLCTestModel *parent = [[MLCTestModel alloc] initWithDictionary:[NSDictionary dictionaryWithObjectsAndKeys:
+		@"parent", @"name",
+		[NSNumber numberWithInt:2], @"quantity",
+		[NSNumber numberWithDouble:0.5], @"ratio",
+		[NSArray arrayWithObject:child], @"children",
+		nil
+	]];
+
+	STAssertNotNil(parent, @"");
+
+	NSArray *models = [NSArray arrayWithObjects:child, parent, nil];
+
+	NSError *error = nil;
+	NSData *data = [MLCBinaryEncoder dataWithObject:models error:&error];
+	STAssertNotNil(data, @"%@", error);
+
+	// the layout, with the class and property names, is only written once
+	STAssertEquals(occurrencesOfString(data, @"MLCTestModel"), (NSUInteger)1, @"");
+	STAssertEquals(occurrencesOfString(data, @"quantity"), (NSUInteger)1, @"");
+
+	NSArray *decoded = [MLCBinaryDecoder objectWithData:data error:&error];
+	STAssertEqualObjects(decoded, models, @"%@", error);
+	STAssertTrue([[decoded objectAtIndex:1] isKindOfClass:[MLCTestModel class]], @"");
+	STAssertEquals([[decoded objectAtIndex:1] quantity], (NSInteger)2, @"");
+	STAssertEquals([[decoded objectAtIndex:1] ratio], 0.5, @"");
+}
+
+- (void)testRejectedModel {
+	NSMutableData *data = [self emptyStream];
+
+	appendTag(data, MLCBinaryTagLayout);
+	appendTag(data, MLCBinaryTagString);
+	appendVarint(data, strlen("MLCTestModel"));
+	[data appendBytes:"MLCTestModel" length:strlen("MLCTestModel")];
+	appendVarint(data, 1);
+	appendTag(data, MLCBinaryTagString);
+	appendVarint(data, strlen("quantity"));
+	[data appendBytes:"quantity" length:strlen("quantity")];
+	[data appendBytes:"q" length:1];
+
+	// zigzag-encoded -1, which fails validation
+	appendVarint(data, 1);
+
+	NSError *error = nil;
+	STAssertNil([MLCBinaryDecoder objectWithData:data error:&error], @"");
+	STAssertEquals([error code], (NSInteger)MLCBinaryErrorModelRejected, @"%@", error);
+}
+
+- (void)testSharedReferences {
+	NSMutableArray *shared = [NSMutableArray arrayWithObject:@"x"];
+	NSArray *object = [NSArray arrayWithObjects:shared, shared, nil];
+
+	NSError *error = nil;
+	NSData *data = [MLCBinaryEncoder dataWithObject:object error:&error];
+	STAssertNotNil(data, @"%@", error);
+
+	NSArray *decoded = [MLCBinaryDecoder objectWithData:data error:&error];
+	STAssertEqualObjects(decoded, object, @"%@", error);
+	STAssertTrue([decoded objectAtIndex:0] == [decoded objectAtIndex:1], @"a shared array should be decoded once");
+}
+
+- (void)testSelfContainingObjectIsRejected {
+	NSMutableArray *array = [NSMutableArray array];
+	[array addObject:array];
+
+	NSError *error = nil;
+	STAssertNil([MLCBinaryEncoder dataWithObject:array error:&error], @"");
+	STAssertEquals([error code], (NSInteger)MLCBinaryErrorUnsupportedValue, @"%@", error);
+
+	// break the cycle
+	[array removeAllObjects];
+}
+
+- (void)testInternedStrings {
+	NSString *string = [@"" stringByPaddingToLength:1000 withString:@"abc" startingAtIndex:0];
+	NSArray *object = [NSArray arrayWithObjects:string, string, string, string, nil];
+
+	NSError *error = nil;
+	NSData *data = [MLCBinaryEncoder dataWithObject:object error:&error];
+	STAssertNotNil(data, @"%@", error);
+	STAssertTrue([data length] < 2 * [string length], @"a repeated string should only be written once");
+
+	STAssertEqualObjects([MLCBinaryDecoder objectWithData:data error:&error], object, @"%@", error);
+}
+
+#pragma mark Lua values
+
+- (void)testLuaTableRoundTrip {
+	MLCState *state = self.state;
+	[state lock];
+
+	const char *source = "local shared = { 'x' }; return { 1, 'two', true, shared, shared, name = 'two', nested = { [false] = 3.5, [shared] = 'table key' } }";
+	STAssertEquals(luaL_loadstring(state.state, source), 0, @"");
+	STAssertTrue([state callFunctionWithArgumentCount:0 resultCount:1 error:NULL], @"");
+
+	MLCBinaryEncoder *encoder = [[MLCBinaryEncoder alloc] init];
+
+	NSError *error = nil;
+	STAssertTrue([encoder encodeValueAtStackIndex:-1 ofState:state error:&error], @"%@", error);
+	lua_pop(state.state, 1);
+
+	MLCBinaryDecoder *decoder = [[MLCBinaryDecoder alloc] initWithData:encoder.encodedData];
+	STAssertTrue([decoder decodeValueOntoState:state error:&error], @"%@", error);
+
+	BOOL matches = [self valueOnStackPassesChunk:
+		"local t = ...\n"
+		"return t[1] == 1 and t[2] == 'two' and t[3] == true and t.name == 'two'\n"
+		"   and t[4] == t[5] and t[4][1] == 'x'\n"
+		"   and t.nested[false] == 3.5 and t.nested[t[4]] == 'table key'"
+	];
+
+	STAssertTrue(matches, @"the decoded table should match the original");
+	STAssertTrue(decoder.atEnd, @"");
+
+	[state unlock];
+}
+
+- (void)testObjectIntoLua {
+	NSArray *shared = [NSArray arrayWithObject:@"x"];
+	NSDictionary *object = [NSDictionary dictionaryWithObjectsAndKeys:
+		[NSArray arrayWithObjects:@"foo", [NSNumber numberWithInt:2], shared, shared, nil], @"array",
+		[NSNumber numberWithBool:NO], @"flag",
+		nil
+	];
+
+	NSError *error = nil;
+	NSData *data = [MLCBinaryEncoder dataWithObject:object error:&error];
+	STAssertNotNil(data, @"%@", error);
+
+	MLCState *state = self.state;
+	[state lock];
+
+	MLCBinaryDecoder *decoder = [[MLCBinaryDecoder alloc] initWithData:data];
+	STAssertTrue([decoder decodeValueOntoState:state error:&error], @"%@", error);
+
+	BOOL matches = [self valueOnStackPassesChunk:
+		"local t = ...\n"
+		"return #t.array == 4 and t.array[1] == 'foo' and t.array[2] == 2\n"
+		"   and t.array[3] == t.array[4] and t.array[3][1] == 'x' and t.flag == false"
+	];
+
+	STAssertTrue(matches, @"the decoded table should match the original");
+
+	[state unlock];
+}
+
+- (void)testLuaTableIntoObjectiveC {
+	MLCState *state = self.state;
+	[state lock];
+
+	STAssertEquals(luaL_loadstring(state.state, "return { list = { 1, 2, 3 }, name = 'foo' }"), 0, @"");
+	STAssertTrue([state callFunctionWithArgumentCount:0 resultCount:1 error:NULL], @"");
+
+	MLCBinaryEncoder *encoder = [[MLCBinaryEncoder alloc] init];
+
+	NSError *error = nil;
+	STAssertTrue([encoder encodeValueAtStackIndex:-1 ofState:state error:&error], @"%@", error);
+	lua_pop(state.state, 1);
+
+	[state unlock];
+
+	NSDictionary *expected = [NSDictionary dictionaryWithObjectsAndKeys:
+		[NSArray arrayWithObjects:[NSNumber numberWithInt:1], [NSNumber numberWithInt:2], [NSNumber numberWithInt:3], nil], @"list",
+		@"foo", @"name",
+		nil
+	];
+
+	STAssertEqualObjects([MLCBinaryDecoder objectWithData:encoder.encodedData error:&error], expected, @"%@", error);
+}
+
+#pragma mark Readers
+
+- (void)testFileDescriptorRoundTrip {
+	int fd = open([[self.temporaryFileURL path] fileSystemRepresentation], O_RDWR | O_CREAT | O_TRUNC, 0600);
+	STAssertTrue(fd >= 0, @"");
+
+	// larger than the read buffer, so that it has to grow
+	NSString *longString = [@"" stringByPaddingToLength:100000 withString:@"xyz" startingAtIndex:0];
+	NSArray *first = [NSArray arrayWithObjects:@"foo", longString, nil];
+	NSArray *second = [NSArray arrayWithObjects:@"foo", [NSNumber numberWithInt:3], nil];
+
+	MLCBinaryEncoder *encoder = [[MLCBinaryEncoder alloc] initWithFileDescriptor:fd];
+
+	NSError *error = nil;
+	STAssertTrue([encoder encodeObject:first error:&error], @"%@", error);
+	STAssertTrue([encoder encodeObject:second error:&error], @"%@", error);
+	STAssertTrue([encoder finishEncodingWithError:&error], @"%@", error);
+
+	lseek(fd, 0, SEEK_SET);
+
+	// strings in the second value refer back to the first
+	MLCBinaryDecoder *decoder = [[MLCBinaryDecoder alloc] initWithFileDescriptor:fd];
+	STAssertEqualObjects([decoder decodeObjectWithError:&error], first, @"%@", error);
+	STAssertEqualObjects([decoder decodeObjectWithError:&error], second, @"%@", error);
+	STAssertTrue(decoder.atEnd, @"");
+
+	close(fd);
+}
+
+- (void)testMappedFileRoundTrip {
+	MLCBinaryEncoder *encoder = [[MLCBinaryEncoder alloc] init];
+
+	NSError *error = nil;
+	STAssertTrue([encoder encodeObject:@"foo" error:&error], @"%@", error);
+	STAssertTrue([encoder encodeObject:[NSArray arrayWithObject:@"foo"] error:&error], @"%@", error);
+	STAssertTrue([encoder.encodedData writeToURL:self.temporaryFileURL atomically:NO], @"");
+
+	MLCBinaryDecoder *decoder = [[MLCBinaryDecoder alloc] initWithContentsOfMappedFileAtURL:self.temporaryFileURL error:&error];
+	STAssertNotNil(decoder, @"%@", error);
+
+	STAssertEqualObjects([decoder decodeObjectWithError:&error], @"foo", @"%@", error);
+	STAssertEqualObjects([decoder decodeObjectWithError:&error], [NSArray arrayWithObject:@"foo"], @"%@", error);
+	STAssertTrue(decoder.atEnd, @"");
+}
+
+#pragma mark Malformed input
+
+- (void)testTruncatedInput {
+	NSDictionary *object = [NSDictionary dictionaryWithObjectsAndKeys:
+		[NSArray arrayWithObjects:@"foo", [NSNumber numberWithDouble:1.5], nil], @"array",
+		[NSNumber numberWithInt:300], @"number",
+		nil
+	];
+
+	NSData *data = [MLCBinaryEncoder dataWithObject:object error:NULL];
+	STAssertNotNil(data, @"");
+
+	for (NSUInteger length = 0;length < [data length];++length) {
+		NSError *error = nil;
+		STAssertNil([MLCBinaryDecoder objectWithData:[data subdataWithRange:NSMakeRange(0, length)] error:&error], @"");
+		STAssertEquals([error code], (NSInteger)MLCBinaryErrorTruncated, @"%@ at length %lu", error, (unsigned long)length);
+	}
+}
+
+- (void)testBadHeader {
+	NSMutableData *data = [self emptyStream];
+	((unsigned char *)[data mutableBytes])[0] = 'X';
+	appendTag(data, MLCBinaryTagNil);
+
+	[self assertDecodingData:data failsWithCode:MLCBinaryErrorMalformed];
+
+	data = [self emptyStream];
+	((unsigned char *)[data mutableBytes])[sizeof(MLCBinaryFormatMagic)] = MLCBinaryFormatVersion + 1;
+	appendTag(data, MLCBinaryTagNil);
+
+	[self assertDecodingData:data failsWithCode:MLCBinaryErrorMalformed];
+}
+
+- (void)testBadTags {
+	NSMutableData *data = [self emptyStream];
+	appendTag(data, 0x7F);
+	[self assertDecodingData:data failsWithCode:MLCBinaryErrorMalformed];
+
+	// references to strings and objects which were never written
+	data = [self emptyStream];
+	appendTag(data, MLCBinaryTagStringReference);
+	appendVarint(data, 0);
+	[self assertDecodingData:data failsWithCode:MLCBinaryErrorMalformed];
+
+	data = [self emptyStream];
+	appendTag(data, MLCBinaryTagReference);
+	appendVarint(data, 3);
+	[self assertDecodingData:data failsWithCode:MLCBinaryErrorMalformed];
+
+	data = [self emptyStream];
+	appendTag(data, MLCBinaryTagModel);
+	appendVarint(data, 0);
+	[self assertDecodingData:data failsWithCode:MLCBinaryErrorMalformed];
+}
+
+- (void)testOversizedCounts {
+	NSMutableData *data = [self emptyStream];
+	appendTag(data, MLCBinaryTagArray);
+	appendVarint(data, 1ULL << 62);
+	appendTag(data, MLCBinaryTagNil);
+	[self assertDecodingData:data failsWithCode:MLCBinaryErrorTruncated];
+
+	data = [self emptyStream];
+	appendTag(data, MLCBinaryTagDictionary);
+	appendVarint(data, ULLONG_MAX);
+	[self assertDecodingData:data failsWithCode:MLCBinaryErrorTruncated];
+
+	data = [self emptyStream];
+	appendTag(data, MLCBinaryTagString);
+	appendVarint(data, 1ULL << 30);
+	[data appendBytes:"foo" length:3];
+	[self assertDecodingData:data failsWithCode:MLCBinaryErrorTruncated];
+
+	// a file should be rejected by its size, before the buffer grows
+	STAssertTrue([data writeToURL:self.temporaryFileURL atomically:NO], @"");
+
+	int fd = open([[self.temporaryFileURL path] fileSystemRepresentation], O_RDONLY);
+	STAssertTrue(fd >= 0, @"");
+
+	NSError *error = nil;
+	MLCBinaryDecoder *decoder = [[MLCBinaryDecoder alloc] initWithFileDescriptor:fd];
+	STAssertNil([decoder decodeObjectWithError:&error], @"");
+	STAssertEquals([error code], (NSInteger)MLCBinaryErrorTruncated, @"%@", error);
+
+	close(fd);
+}
+
+- (void)testNestingDepth {
+	NSMutableData *data = [self emptyStream];
+	for (int i = 0;i < 600;++i) {
+		appendTag(data, MLCBinaryTagArray);
+		appendVarint(data, 1);
+	}
+
+	appendTag(data, MLCBinaryTagNil);
+	[self assertDecodingData:data failsWithCode:MLCBinaryErrorMalformed];
+
+	// models are decoded through Objective-C, even when decoding into Lua, and
+	// count toward the same limit; this one has only a scalar property, so
+	// nothing nested within it is checked
+	data = [self emptyStream];
+	appendTag(data, MLCBinaryTagArray);
+	appendVarint(data, 2);
+
+	appendTag(data, MLCBinaryTagLayout);
+	appendTag(data, MLCBinaryTagString);
+	appendVarint(data, strlen("MLCTestModel"));
+	[data appendBytes:"MLCTestModel" length:strlen("MLCTestModel")];
+	appendVarint(data, 1);
+	appendTag(data, MLCBinaryTagString);
+	appendVarint(data, strlen("quantity"));
+	[data appendBytes:"quantity" length:strlen("quantity")];
+	[data appendBytes:"q" length:1];
+	appendVarint(data, 2);
+
+	for (int i = 0;i < 511;++i) {
+		appendTag(data, MLCBinaryTagArray);
+		appendVarint(data, 1);
+	}
+
+	appendTag(data, MLCBinaryTagModel);
+	appendVarint(data, 0);
+	appendVarint(data, 2);
+	[self assertDecodingData:data failsWithCode:MLCBinaryErrorMalformed];
+
+	// shallower nesting is fine
+	data = [self emptyStream];
+	for (int i = 0;i < 100;++i) {
+		appendTag(data, MLCBinaryTagArray);
+		appendVarint(data, 1);
+	}
+
+	appendTag(data, MLCBinaryTagNil);
+
+	NSError *error = nil;
+	STAssertNotNil([MLCBinaryDecoder objectWithData:data error:&error], @"%@", error);
+}
+
+- (void)testCollectionKeysAreRejected {
+	NSMutableData *data = [self emptyStream];
+	appendTag(data, MLCBinaryTagDictionary);
+	appendVarint(data, 1);
+	appendTag(data, MLCBinaryTagArray);
+	appendVarint(data, 0);
+	appendTag(data, MLCBinaryTagTrue);
+
+	NSError *error = nil;
+	STAssertNil([MLCBinaryDecoder objectWithData:data error:&error], @"");
+	STAssertEquals([error code], (NSInteger)MLCBinaryErrorUnsupportedValue, @"%@", error);
+
+	// Lua tables can be keyed by tables
+	MLCState *state = self.state;
+	[state lock];
+
+	MLCBinaryDecoder *decoder = [[MLCBinaryDecoder alloc] initWithData:data];
+	STAssertTrue([decoder decodeValueOntoState:state error:&error], @"%@", error);
+	STAssertTrue([self valueOnStackPassesChunk:"local t = ...; local k = next(t); return type(k) == 'table' and t[k] == true"], @"");
+
+	[state unlock];
+}
+
+@end
@@ -0,0 +1,22 @@
+//
+//  MLCBridgingTests.h
+//  MoonlitCocoaTests
+//
+//  Created by agent on 17.10.26.
+//  Released into the public domain.
+//
+
+#import <SenTestingKit/SenTestingKit.h>
+
+/**
+ * Tests messages forwarded from Objective-C to Lua, and Objective-C methods
+ * called from Lua, with the kinds of arguments and return values that take
+ * different paths through the bridge.
+ *
+ * When built with \c MLC_USE_LUAJIT, scalar methods called from Lua go through
+ * FFI stubs instead of the trampoline, so these tests should be run against
+ * both builds.
+ */
+@interface MLCBridgingTests : SenTestCase
+
+@end
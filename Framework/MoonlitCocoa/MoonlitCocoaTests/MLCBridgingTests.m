@@ -0,0 +1,188 @@
+//
+//  MLCBridgingTests.m
+//  MoonlitCocoaTests
+//
+//  Created by agent on 17.10.26.
+//  Released into the public domain.
+//
+
+#import "MLCBridgingTests.h"
+#import "MLCTestObject.h"
+#import <MoonlitCocoa/MoonlitCocoa.h>
+#import <lauxlib.h>
+#import <objc/runtime.h>
+
+@interface MLCBridgingTests ()
+@property (nonatomic, strong) MLCTestObject *object;
+
+/**
+ * Loads \a source as a Lua chunk into the state of MLCTestObject, calls it
+ * with #object, and returns its single result. If the call fails, \c nil is
+ * returned, and \a error is set to the error.
+ */
+- (id)callChunkWithObject:(const char *)source error:(NSError **)error;
+
+/**
+ * Returns whether MLCTestObject itself has a method for \a selector, which
+ * would have been added by +resolveInstanceMethod:. This does not attempt to
+ * resolve the method.
+ */
+- (BOOL)testObjectHasMethodForSelector:(SEL)selector;
+@end
+
+@implementation MLCBridgingTests
+@synthesize object = m_object;
+
+- (void)setUp {
+	[super setUp];
+
+	self.object = [[MLCTestObject alloc] init];
+}
+
+- (void)tearDown {
+	self.object = nil;
+
+	[super tearDown];
+}
+
+- (id)callChunkWithObject:(const char *)source error:(NSError **)error; {
+	// the object must be pushed into a state where its class is registered
+	MLCState *state = [MLCTestObject state];
+	[state lock];
+
+	@try {
+		if (luaL_loadstring(state.state, source) != 0) {
+			NSString *message = [state popValueOnStack];
+			STFail(@"Could not load chunk: %@", message);
+			return nil;
+		}
+
+		[state pushObject:self.object];
+
+		if (![state callFunctionWithArgumentCount:1 resultCount:1 error:error])
+			return nil;
+
+		return [state popValueOnStack];
+	} @finally {
+		[state unlock];
+	}
+}
+
+- (void)testLuaImplementation {
+	NSError *error = nil;
+	id jit = [self callChunkWithObject:"return jit ~= nil" error:&error];
+	STAssertNotNil(jit, @"%@", error);
+
+	#if MLC_USE_LUAJIT
+	STAssertTrue([jit boolValue], @"should be running on LuaJIT");
+	#else
+	STAssertFalse([jit boolValue], @"should not be running on LuaJIT");
+	#endif
+}
+
+- (BOOL)testObjectHasMethodForSelector:(SEL)selector; {
+	unsigned count = 0;
+	Method *methods = class_copyMethodList([MLCTestObject class], &count);
+
+	BOOL found = NO;
+	for (unsigned i = 0;i < count && !found;++i) {
+		found = sel_isEqual(method_getName(methods[i]), selector);
+	}
+
+	free(methods);
+	return found;
+}
+
+#pragma mark Objective-C to Lua
+
+- (void)testForwardedScalarArguments {
+	STAssertEquals([self.object addInteger:-2 toInteger:5], 3, @"");
+	STAssertEquals([self.object averageOfDouble:1.5 andDouble:2.5], 2.0, @"");
+}
+
+- (void)testForwardedObjectArguments {
+	// object methods are added by +resolveInstanceMethod:, so call twice to
+	// use both the first lookup and the added method
+	for (int i = 0;i < 2;++i) {
+		STAssertEqualObjects([self.object echoObject:@"foobar"], @"foobar", @"");
+		STAssertEqualObjects([self.object echoObject:[NSNumber numberWithBool:YES]], [NSNumber numberWithBool:YES], @"");
+		STAssertEqualObjects([self.object echoObject:[NSNull null]], [NSNull null], @"");
+	}
+
+	STAssertTrue([MLCTestObject instancesRespondToSelector:@selector(echoObject:)], @"");
+	STAssertFalse([MLCTestObject instancesRespondToSelector:@selector(frobnicate)], @"");
+}
+
+- (void)testResolvedMethodWithScalarArguments {
+	// integer arguments are received by a method added by
+	// +resolveInstanceMethod:, rather than being forwarded
+	for (int i = 0;i < 2;++i) {
+		STAssertEquals([self.object lengthOfString:@"foobar" timesShort:-3], (NSInteger)-18, @"");
+		STAssertEquals([self.object addInteger:-2 toInteger:5], 3, @"");
+	}
+
+	STAssertTrue([self testObjectHasMethodForSelector:@selector(lengthOfString:timesShort:)], @"");
+	STAssertTrue([self testObjectHasMethodForSelector:@selector(addInteger:toInteger:)], @"");
+
+	// floating-point arguments are always forwarded
+	STAssertEquals([self.object averageOfDouble:1.5 andDouble:2.5], 2.0, @"");
+	STAssertFalse([self testObjectHasMethodForSelector:@selector(averageOfDouble:andDouble:)], @"");
+}
+
+- (void)testResolvedMethodRaisesLuaErrors {
+	for (int i = 0;i < 2;++i) {
+		NSException *exception = nil;
+
+		@try {
+			[self.object failWithMessage:@"frobnicated"];
+		} @catch (NSException *ex) {
+			exception = ex;
+		}
+
+		STAssertEqualObjects([exception name], MLCLuaErrorException, @"%@", exception);
+		STAssertTrue([[exception reason] rangeOfString:@"frobnicated"].location != NSNotFound, @"%@", exception);
+
+		NSError *error = [[exception userInfo] objectForKey:NSUnderlyingErrorKey];
+		STAssertEqualObjects([error domain], MLCLuaErrorDomain, @"%@", error);
+	}
+}
+
+#pragma mark Lua to Objective-C
+
+- (void)testScalarMethodsFromLua {
+	NSError *error = nil;
+
+	id product = [self callChunkWithObject:"local obj = ...; return obj['multiplyInteger:byInteger:'](obj, 6, -7)" error:&error];
+	STAssertEqualObjects(product, [NSNumber numberWithInt:-42], @"%@", error);
+
+	id scaled = [self callChunkWithObject:"local obj = ...; return obj['scaleDouble:byFactor:'](obj, 0.25, 3)" error:&error];
+	STAssertEqualObjects(scaled, [NSNumber numberWithDouble:0.75], @"%@", error);
+
+	// calls without a return value, made from inside a forwarded call
+	[self.object incrementTimes:4];
+	STAssertEquals(self.object.counter, (NSUInteger)4, @"");
+}
+
+- (void)testObjectMethodsFromLua {
+	NSError *error = nil;
+
+	NSArray *array = [self callChunkWithObject:"local obj = ...; return obj['arrayWrappingObject:'](obj, 'foobar')" error:&error];
+	STAssertNotNil(array, @"%@", error);
+	STAssertEqualObjects([array objectAtIndex:0], @"foobar", @"");
+}
+
+- (void)testMethodFromLuaWithoutReceiver {
+	NSError *error = nil;
+
+	// calling with '.' instead of ':' passes the first argument as the
+	// receiver, which must be rejected rather than treated as an object
+	STAssertNil([self callChunkWithObject:"local obj = ...; return obj['multiplyInteger:byInteger:'](6, 7)" error:&error], @"");
+	STAssertTrue([[error localizedDescription] rangeOfString:@"does not recognize selector"].location != NSNotFound, @"%@", error);
+
+	error = nil;
+	STAssertNil([self callChunkWithObject:"local obj = ...; obj.increment(); return true" error:&error], @"");
+	STAssertNotNil(error, @"");
+	STAssertEquals(self.object.counter, (NSUInteger)0, @"");
+}
+
+@end
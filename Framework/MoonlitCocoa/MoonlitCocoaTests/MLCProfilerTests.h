@@ -0,0 +1,16 @@
+//
+//  MLCProfilerTests.h
+//  MoonlitCocoaTests
+//
+//  Created by agent on 17.10.26.
+//  Released into the public domain.
+//
+
+#import <SenTestingKit/SenTestingKit.h>
+
+/**
+ * Tests the crossing statistics and sampled stacks collected by MLCProfiler.
+ */
+@interface MLCProfilerTests : SenTestCase
+
+@end
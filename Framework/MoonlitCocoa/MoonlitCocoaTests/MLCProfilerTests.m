@@ -0,0 +1,186 @@
+//
+//  MLCProfilerTests.m
+//  MoonlitCocoaTests
+//
+//  Created by agent on 17.10.26.
+//  Released into the public domain.
+//
+
+#import "MLCProfilerTests.h"
+#import "MLCTestObject.h"
+#import <MoonlitCocoa/MoonlitCocoa.h>
+#import <lauxlib.h>
+
+@interface MLCProfilerTests ()
+@property (nonatomic, strong) MLCProfiler *profiler;
+
+/**
+ * Returns the statistics in #profiler for the selector named \a name, or \c
+ * nil if it has not been called.
+ */
+- (MLCCrossingStatistics *)statisticsForSelectorName:(NSString *)name;
+@end
+
+@implementation MLCProfilerTests
+@synthesize profiler = m_profiler;
+
+- (void)setUp {
+	[super setUp];
+
+	self.profiler = [[MLCProfiler alloc] init];
+}
+
+- (void)tearDown {
+	[self.profiler stopSampling];
+
+	// states retain their profiler until detached
+	[MLCTestObject state].profiler = nil;
+	self.profiler = nil;
+
+	[super tearDown];
+}
+
+- (MLCCrossingStatistics *)statisticsForSelectorName:(NSString *)name; {
+	for (MLCCrossingStatistics *statistics in [self.profiler crossingStatistics]) {
+		if ([statistics.selectorName isEqualToString:name])
+			return statistics;
+	}
+
+	return nil;
+}
+
+- (void)testRecordCrossing {
+	NSMethodSignature *signature = [NSMethodSignature signatureWithObjCTypes:"i@:ii"];
+
+	for (int i = 0;i < 2;++i) {
+		[self.profiler recordCrossing:MLCProfilerCrossingTrampoline selector:@selector(multiplyInteger:byInteger:) signature:signature startTime:MLCProfilerCurrentTime()];
+	}
+
+	NSArray *allStatistics = [self.profiler crossingStatistics];
+	STAssertEquals([allStatistics count], (NSUInteger)1, @"%@", allStatistics);
+
+	MLCCrossingStatistics *statistics = [allStatistics lastObject];
+	STAssertEquals(statistics.crossing, MLCProfilerCrossingTrampoline, @"");
+	STAssertEqualObjects(statistics.selectorName, @"multiplyInteger:byInteger:", @"");
+	STAssertEquals(statistics.callCount, (NSUInteger)2, @"");
+
+	// two arguments and a return value for each call
+	STAssertEquals(statistics.conversionCount, (NSUInteger)6, @"");
+	STAssertEquals(statistics.byteCount, 6ULL * sizeof(int), @"");
+
+	STAssertTrue(statistics.maximumTime <= statistics.totalTime, @"");
+}
+
+- (void)testHistogram {
+	[self.profiler recordCrossing:MLCProfilerCrossingLuaMethod selector:@selector(description) signature:nil startTime:MLCProfilerCurrentTime()];
+
+	// a longer call lands in a later bucket
+	uint64_t startTime = MLCProfilerCurrentTime();
+	[NSThread sleepForTimeInterval:0.002];
+
+	[self.profiler recordCrossing:MLCProfilerCrossingLuaMethod selector:@selector(description) signature:nil startTime:startTime];
+
+	MLCCrossingStatistics *statistics = [self statisticsForSelectorName:@"description"];
+	STAssertEquals([statistics.histogram count], (NSUInteger)MLCProfilerHistogramBucketCount, @"");
+
+	NSUInteger total = 0;
+	NSUInteger lowest = NSNotFound;
+	NSUInteger highest = 0;
+
+	for (NSUInteger i = 0;i < [statistics.histogram count];++i) {
+		NSUInteger count = [[statistics.histogram objectAtIndex:i] unsignedIntegerValue];
+		if (!count)
+			continue;
+
+		total += count;
+		lowest = MIN(lowest, i);
+		highest = MAX(highest, i);
+	}
+
+	STAssertEquals(total, (NSUInteger)2, @"%@", statistics.histogram);
+
+	// a call of at least one millisecond is counted in bucket 19 or later
+	STAssertTrue(highest >= 19, @"%@", statistics.histogram);
+	STAssertTrue(lowest < highest, @"%@", statistics.histogram);
+
+	// keys read without a signature count as a single object
+	STAssertEquals(statistics.conversionCount, (NSUInteger)2, @"");
+	STAssertEquals(statistics.byteCount, 2ULL * sizeof(id), @"");
+}
+
+- (void)testCrossingsFromBridgedObject {
+	[MLCTestObject state].profiler = self.profiler;
+
+	MLCTestObject *object = [[MLCTestObject alloc] init];
+	for (int i = 0;i < 3;++i) {
+		STAssertEquals([object addInteger:i toInteger:1], i + 1, @"");
+	}
+
+	MLCCrossingStatistics *statistics = [self statisticsForSelectorName:@"addInteger:toInteger:"];
+	STAssertNotNil(statistics, @"%@", [self.profiler crossingStatistics]);
+	STAssertEquals(statistics.callCount, (NSUInteger)3, @"");
+
+	// nothing is recorded once the profiler has been detached
+	[MLCTestObject state].profiler = nil;
+	[object addInteger:1 toInteger:1];
+
+	STAssertEquals([self statisticsForSelectorName:@"addInteger:toInteger:"].callCount, (NSUInteger)3, @"");
+}
+
+#if !MLC_USE_LUAJIT
+// code in LuaJIT traces is not sampled, so the loop below might never be
+- (void)testFoldedStacks {
+	MLCState *state = [[MLCState alloc] init];
+	state.profiler = self.profiler;
+
+	self.profiler.samplingInterval = 0.001;
+	[self.profiler startSampling];
+
+	NSError *error = nil;
+
+	[state lock];
+
+	@try {
+		const char *source =
+			"local function spin ()\n"
+			"	local start = os.clock()\n"
+			"	while os.clock() - start < 0.25 do end\n"
+			"end\n"
+			"spin()\n";
+
+		STAssertEquals(luaL_loadstring(state.state, source), 0, @"");
+		STAssertTrue([state callFunctionWithArgumentCount:0 resultCount:0 error:&error], @"%@", error);
+	} @finally {
+		[state unlock];
+	}
+
+	[self.profiler stopSampling];
+	state.profiler = nil;
+
+	NSString *folded = [self.profiler foldedStacks];
+	STAssertTrue([folded hasSuffix:@"\n"], @"%@", folded);
+
+	BOOL foundSpin = NO;
+	for (NSString *line in [[folded stringByTrimmingCharactersInSet:[NSCharacterSet newlineCharacterSet]] componentsSeparatedByString:@"\n"]) {
+		// each line is the stack, a space, and the number of samples
+		NSRange space = [line rangeOfString:@" " options:NSBackwardsSearch];
+		STAssertTrue(space.location != NSNotFound, @"%@", line);
+		STAssertTrue([[line substringFromIndex:space.location + 1] integerValue] > 0, @"%@", line);
+
+		// frames are listed from the outermost inwards
+		NSString *stack = [line substringToIndex:space.location];
+		STAssertTrue([stack hasPrefix:@"(main chunk)"], @"%@", line);
+
+		if ([stack rangeOfString:@"spin ("].location != NSNotFound)
+			foundSpin = YES;
+	}
+
+	STAssertTrue(foundSpin, @"%@", folded);
+
+	[self.profiler reset];
+	STAssertEqualObjects([self.profiler foldedStacks], @"", @"");
+	STAssertEquals([[self.profiler crossingStatistics] count], (NSUInteger)0, @"");
+}
+#endif
+
+@end
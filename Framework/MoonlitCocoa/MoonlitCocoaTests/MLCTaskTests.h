@@ -0,0 +1,17 @@
+//
+//  MLCTaskTests.h
+//  MoonlitCocoaTests
+//
+//  Created by agent on 17.10.26.
+//  Released into the public domain.
+//
+
+#import <SenTestingKit/SenTestingKit.h>
+
+/**
+ * Tests starting, suspending, resuming, and cancelling MLCTask, and the
+ * completion handler invoked when a task finishes.
+ */
+@interface MLCTaskTests : SenTestCase
+
+@end
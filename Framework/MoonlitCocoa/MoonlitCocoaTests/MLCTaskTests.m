@@ -0,0 +1,253 @@
+//
+//  MLCTaskTests.m
+//  MoonlitCocoaTests
+//
+//  Created by agent on 17.10.26.
+//  Released into the public domain.
+//
+
+#import "MLCTaskTests.h"
+#import <MoonlitCocoa/MoonlitCocoa.h>
+#import <lauxlib.h>
+
+/**
+ * Invokes the completion block given as the first argument with the string
+ * "now", before \c await has had a chance to suspend the task.
+ */
+static int invokeAwaitCallback (lua_State *L) {
+	void (^callback)(id) = (__bridge void (^)(id))lua_touserdata(L, 1);
+	callback(@"now");
+	return 0;
+}
+
+@interface MLCTaskTests ()
+@property (nonatomic, strong) MLCState *state;
+
+/**
+ * The number of times that the completion handler of the task created by
+ * #startTaskWithSource: has been invoked.
+ */
+@property (nonatomic, assign) NSUInteger completionCount;
+
+/**
+ * The arguments most recently passed to the completion handler of the task
+ * created by #startTaskWithSource:.
+ */
+@property (nonatomic, copy) NSArray *results;
+@property (nonatomic, strong) NSError *error;
+
+/**
+ * Loads \a source as a Lua chunk into #state, and starts it in a new task
+ * whose completion handler records its arguments in #results and #error.
+ */
+- (MLCTask *)startTaskWithSource:(const char *)source;
+
+/**
+ * Returns the value of the global variable \a name in #state.
+ */
+- (id)globalNamed:(const char *)name;
+@end
+
+@implementation MLCTaskTests
+@synthesize state = m_state;
+@synthesize completionCount = m_completionCount;
+@synthesize results = m_results;
+@synthesize error = m_error;
+
+- (void)setUp {
+	[super setUp];
+
+	self.state = [[MLCState alloc] init];
+	self.completionCount = 0;
+	self.results = nil;
+	self.error = nil;
+
+	[self.state lock];
+	lua_register(self.state.state, "invokeNow", &invokeAwaitCallback);
+	[self.state unlock];
+}
+
+- (void)tearDown {
+	self.state = nil;
+	self.results = nil;
+	self.error = nil;
+
+	[super tearDown];
+}
+
+- (MLCTask *)startTaskWithSource:(const char *)source; {
+	MLCState *state = self.state;
+	[state lock];
+
+	@try {
+		if (luaL_loadstring(state.state, source) != 0) {
+			NSString *message = [state popValueOnStack];
+			STFail(@"Could not load chunk: %@", message);
+			return nil;
+		}
+
+		__weak MLCTaskTests *weakSelf = self;
+
+		return [state startTaskWithArgumentCount:0 completionHandler:^(NSArray *results, NSError *error){
+			MLCTaskTests *strongSelf = weakSelf;
+			++strongSelf.completionCount;
+			strongSelf.results = results;
+			strongSelf.error = error;
+		}];
+	} @finally {
+		[state unlock];
+	}
+}
+
+- (id)globalNamed:(const char *)name; {
+	MLCState *state = self.state;
+	[state lock];
+
+	@try {
+		lua_getglobal(state.state, name);
+		return [state popValueOnStack];
+	} @finally {
+		[state unlock];
+	}
+}
+
+- (void)testStartRunsToCompletion {
+	MLCTask *task = [self startTaskWithSource:"return 1, 'two'"];
+	STAssertNotNil(task, @"");
+
+	STAssertTrue(task.finished, @"");
+	STAssertFalse(task.suspended, @"");
+	STAssertFalse(task.cancelled, @"");
+	STAssertEquals(self.completionCount, (NSUInteger)1, @"");
+
+	NSArray *expected = [NSArray arrayWithObjects:[NSNumber numberWithInt:1], @"two", nil];
+	STAssertEqualObjects(self.results, expected, @"");
+	STAssertNil(self.error, @"%@", self.error);
+
+	STAssertFalse([task start], @"a task should only start once");
+	STAssertEquals(self.completionCount, (NSUInteger)1, @"");
+}
+
+- (void)testErrorFinishesTask {
+	MLCTask *task = [self startTaskWithSource:"error('boom')"];
+
+	STAssertTrue(task.finished, @"");
+	STAssertEquals(self.completionCount, (NSUInteger)1, @"");
+	STAssertNil(self.results, @"");
+	STAssertNotNil(self.error, @"");
+	STAssertTrue([[self.error localizedDescription] rangeOfString:@"boom"].location != NSNotFound, @"%@", self.error);
+}
+
+- (void)testYieldAndResume {
+	MLCTask *task = [self startTaskWithSource:"local x = coroutine.yield('waiting'); return x * 2"];
+
+	STAssertTrue(task.suspended, @"");
+	STAssertFalse(task.finished, @"");
+	STAssertEqualObjects(task.yieldedValues, [NSArray arrayWithObject:@"waiting"], @"");
+	STAssertEquals(self.completionCount, (NSUInteger)0, @"");
+
+	STAssertTrue([self.state resumeTask:task withValues:[NSArray arrayWithObject:[NSNumber numberWithInt:21]]], @"");
+
+	STAssertTrue(task.finished, @"");
+	STAssertNil(task.yieldedValues, @"");
+	STAssertEquals(self.completionCount, (NSUInteger)1, @"");
+	STAssertEqualObjects(self.results, [NSArray arrayWithObject:[NSNumber numberWithInt:42]], @"");
+
+	STAssertFalse([task resumeWithValues:nil], @"a finished task should not resume");
+}
+
+- (void)testAwaitCompletedLater {
+	MLCTask *task = [self startTaskWithSource:"return await(function (done) pendingCallback = done end) .. '!'"];
+
+	STAssertTrue(task.suspended, @"");
+	STAssertNil(task.yieldedValues, @"await() should not yield any values");
+	STAssertEquals(self.completionCount, (NSUInteger)0, @"");
+
+	void (^callback)(id) = [self globalNamed:"pendingCallback"];
+	STAssertNotNil(callback, @"");
+
+	callback(@"loaded");
+
+	STAssertTrue(task.finished, @"");
+	STAssertEquals(self.completionCount, (NSUInteger)1, @"");
+	STAssertEqualObjects(self.results, [NSArray arrayWithObject:@"loaded!"], @"");
+
+	// later invocations of the block are ignored
+	callback(@"again");
+	STAssertEquals(self.completionCount, (NSUInteger)1, @"");
+}
+
+- (void)testAwaitCompletedImmediately {
+	MLCTask *task = [self startTaskWithSource:"return await(function (done) invokeNow(done) end)"];
+
+	STAssertTrue(task.finished, @"");
+	STAssertEquals(self.completionCount, (NSUInteger)1, @"");
+	STAssertEqualObjects(self.results, [NSArray arrayWithObject:@"now"], @"");
+}
+
+- (void)testAwaitOutsideTask {
+	MLCState *state = self.state;
+	NSError *error = nil;
+
+	[state lock];
+
+	@try {
+		luaL_loadstring(state.state, "return await(function () end)");
+		STAssertFalse([state callFunctionWithArgumentCount:0 resultCount:1 error:&error], @"");
+	} @finally {
+		[state unlock];
+	}
+
+	STAssertTrue([[error localizedDescription] rangeOfString:@"MLCTask"].location != NSNotFound, @"%@", error);
+}
+
+- (void)testCancelSuspendedTask {
+	MLCTask *task = [self startTaskWithSource:"coroutine.yield(); ran = true"];
+	STAssertTrue(task.suspended, @"");
+
+	[self.state cancelTask:task];
+
+	STAssertTrue(task.finished, @"");
+	STAssertTrue(task.cancelled, @"");
+	STAssertFalse(task.suspended, @"");
+	STAssertEquals(self.completionCount, (NSUInteger)1, @"");
+	STAssertNil(self.results, @"");
+	STAssertEquals([self.error code], (NSInteger)NSUserCancelledError, @"%@", self.error);
+
+	STAssertFalse([task resumeWithValues:nil], @"a cancelled task should not resume");
+	STAssertNil([self globalNamed:"ran"], @"");
+
+	// cancelling again has no effect
+	[task cancel];
+	STAssertEquals(self.completionCount, (NSUInteger)1, @"");
+}
+
+- (void)testCancelBeforeStart {
+	MLCState *state = self.state;
+	__block NSUInteger completionCount = 0;
+	__block NSError *completionError = nil;
+
+	MLCTask *task = nil;
+	[state lock];
+
+	@try {
+		luaL_loadstring(state.state, "ran = true");
+		task = [[MLCTask alloc] initWithArgumentCount:0 ofState:state completionHandler:^(NSArray *results, NSError *error){
+			++completionCount;
+			completionError = error;
+		}];
+	} @finally {
+		[state unlock];
+	}
+
+	[task cancel];
+	STAssertEquals(completionCount, (NSUInteger)1, @"");
+	STAssertEquals([completionError code], (NSInteger)NSUserCancelledError, @"%@", completionError);
+
+	// starting a cancelled task does not run its function
+	STAssertTrue([task start], @"");
+	STAssertEquals(completionCount, (NSUInteger)1, @"");
+	STAssertNil([self globalNamed:"ran"], @"");
+}
+
+@end
@@ -0,0 +1,23 @@
+//
+//  MLCTestModel.h
+//  MoonlitCocoaTests
+//
+//  Created by agent on 17.10.26.
+//  Released into the public domain.
+//
+
+#import <Foundation/Foundation.h>
+#import <MoonlitCocoa/MoonlitCocoa.h>
+
+/**
+ * A model with object and scalar properties, used to test encoding and
+ * comparing models. It has no Lua implementation.
+ */
+@lua_bridged(MLCTestModel, MLCModel)
+@property (nonatomic, copy, readonly) NSString *name;
+@property (nonatomic, assign, readonly) NSInteger quantity;
+@property (nonatomic, assign, readonly) double ratio;
+@property (nonatomic, copy, readonly) NSArray *children;
+
+- (id)initWithName:(NSString *)name quantity:(NSNumber *)quantity;
+@end
@@ -0,0 +1,28 @@
+//
+//  MLCTestModel.m
+//  MoonlitCocoaTests
+//
+//  Created by agent on 17.10.26.
+//  Released into the public domain.
+//
+
+#import "MLCTestModel.h"
+
+@interface MLCTestModel ()
+@property (nonatomic, copy, readwrite) NSString *name;
+@property (nonatomic, assign, readwrite) NSInteger quantity;
+@property (nonatomic, assign, readwrite) double ratio;
+@property (nonatomic, copy, readwrite) NSArray *children;
+@end
+
+@implementation MLCTestModel
+@synthesize name = m_name;
+@synthesize quantity = m_quantity;
+@synthesize ratio = m_ratio;
+@synthesize children = m_children;
+
+- (BOOL)validateQuantity:(NSNumber **)quantity error:(NSError **)error {
+	return [*quantity integerValue] >= 0;
+}
+
+@end
@@ -0,0 +1,76 @@
+//
+//  MLCTestObject.h
+//  MoonlitCocoaTests
+//
+//  Created by agent on 17.10.26.
+//  Released into the public domain.
+//
+
+#import <Foundation/Foundation.h>
+#import <MoonlitCocoa/MoonlitCocoa.h>
+
+/**
+ * A bridged object used to test calls in each direction between Objective-C
+ * and Lua. Methods without an Objective-C implementation are implemented in
+ * MLCTestObject.lua.
+ */
+@lua_bridged(MLCTestObject, MLCBridgedObject)
+/**
+ * The number of times that #increment has been invoked.
+ */
+@property (nonatomic, assign) NSUInteger counter;
+
+/**
+ * Increments #counter. This is implemented in Objective-C, and called from Lua.
+ */
+- (void)increment;
+
+/**
+ * Returns the product of \a a and \a b. This is implemented in Objective-C,
+ * and called from Lua.
+ */
+- (int)multiplyInteger:(int)a byInteger:(int)b;
+
+/**
+ * Returns \a value multiplied by \a factor. This is implemented in
+ * Objective-C, and called from Lua.
+ */
+- (double)scaleDouble:(double)value byFactor:(double)factor;
+
+/**
+ * Returns an array containing only \a obj. This is implemented in
+ * Objective-C, and called from Lua.
+ */
+- (NSArray *)arrayWrappingObject:(id)obj;
+
+/**
+ * Invokes #increment from Lua \a count times.
+ */
+- (void)incrementTimes:(int)count;
+
+/**
+ * Returns the sum of \a a and \a b, as calculated in Lua.
+ */
+- (int)addInteger:(int)a toInteger:(int)b;
+
+/**
+ * Returns the mean of \a a and \a b, as calculated in Lua.
+ */
+- (double)averageOfDouble:(double)a andDouble:(double)b;
+
+/**
+ * Returns \a obj after converting it into Lua and back.
+ */
+- (id)echoObject:(id)obj;
+
+/**
+ * Returns the length of \a string multiplied by \a factor, as calculated in
+ * Lua.
+ */
+- (NSInteger)lengthOfString:(NSString *)string timesShort:(short)factor;
+
+/**
+ * Raises a Lua error with \a message.
+ */
+- (id)failWithMessage:(NSString *)message;
+@end
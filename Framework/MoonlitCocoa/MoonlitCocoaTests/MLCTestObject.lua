@@ -0,0 +1,29 @@
+local M = {
+	["incrementTimes:"] = function (self, count)
+		for i = 1, count do
+			self:increment()
+		end
+	end,
+
+	["addInteger:toInteger:"] = function (self, a, b)
+		return a + b
+	end,
+
+	["averageOfDouble:andDouble:"] = function (self, a, b)
+		return (a + b) / 2
+	end,
+
+	["echoObject:"] = function (self, obj)
+		return obj
+	end,
+
+	["lengthOfString:timesShort:"] = function (self, str, factor)
+		return #str * factor
+	end,
+
+	["failWithMessage:"] = function (self, message)
+		error(message, 0)
+	end
+}
+
+return M
@@ -0,0 +1,30 @@
+//
+//  MLCTestObject.m
+//  MoonlitCocoaTests
+//
+//  Created by agent on 17.10.26.
+//  Released into the public domain.
+//
+
+#import "MLCTestObject.h"
+
+@implementation MLCTestObject
+@synthesize counter = m_counter;
+
+- (void)increment; {
+	++m_counter;
+}
+
+- (int)multiplyInteger:(int)a byInteger:(int)b; {
+	return a * b;
+}
+
+- (double)scaleDouble:(double)value byFactor:(double)factor; {
+	return value * factor;
+}
+
+- (NSArray *)arrayWrappingObject:(id)obj; {
+	return [NSArray arrayWithObject:obj];
+}
+
+@end
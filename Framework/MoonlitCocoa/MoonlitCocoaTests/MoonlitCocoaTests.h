@@ -8,6 +8,11 @@
 
 #import <SenTestingKit/SenTestingKit.h>
 
+/**
+ * Smoke tests for the core of the bridge: converting values between
+ * Objective-C and Lua, calling bridged methods in each direction, and
+ * reporting errors raised by Lua code.
+ */
 @interface MoonlitCocoaTests : SenTestCase
 
 @end
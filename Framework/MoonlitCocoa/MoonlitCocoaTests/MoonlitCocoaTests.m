@@ -7,26 +7,297 @@
 //
 
 #import "MoonlitCocoaTests.h"
+#import "MLCTestModel.h"
+#import "MLCTestObject.h"
+#import <MoonlitCocoa/MoonlitCocoa.h>
+#import <lauxlib.h>
+#import <math.h>
+
+@interface MoonlitCocoaTests ()
+@property (nonatomic, strong) MLCState *state;
+
+/**
+ * Pushes \a object onto the stack of #state, and returns the value popped back
+ * off of it.
+ */
+- (id)roundTripObject:(id)object;
+
+/**
+ * Loads \a source as a Lua chunk, calls it with \a arguments, and returns its
+ * single result. If the call fails, \c nil is returned, and \a error is set
+ * to the error.
+ */
+- (id)callChunk:(const char *)source withArguments:(NSArray *)arguments error:(NSError **)error;
+@end
 
 @implementation MoonlitCocoaTests
+@synthesize state = m_state;
+
+- (void)setUp {
+	[super setUp];
+
+	self.state = [[MLCState alloc] init];
+}
+
+- (void)tearDown {
+	self.state = nil;
+
+	[super tearDown];
+}
+
+- (id)roundTripObject:(id)object; {
+	MLCState *state = self.state;
+	[state lock];
+
+	@try {
+		[state pushObject:object];
+		return [state popValueOnStack];
+	} @finally {
+		[state unlock];
+	}
+}
+
+- (id)callChunk:(const char *)source withArguments:(NSArray *)arguments error:(NSError **)error; {
+	MLCState *state = self.state;
+	[state lock];
+
+	@try {
+		if (luaL_loadstring(state.state, source) != 0) {
+			NSString *message = [state popValueOnStack];
+			STFail(@"Could not load chunk: %@", message);
+			return nil;
+		}
+
+		for (id argument in arguments) {
+			[state pushObject:argument];
+		}
+
+		if (![state callFunctionWithArgumentCount:(int)[arguments count] resultCount:1 error:error])
+			return nil;
+
+		return [state popValueOnStack];
+	} @finally {
+		[state unlock];
+	}
+}
+
+#pragma mark Marshaling
+
+- (void)testStringRoundTrip {
+	STAssertEqualObjects([self roundTripObject:@""], @"", @"");
+	STAssertEqualObjects([self roundTripObject:@"foobar"], @"foobar", @"");
 
-- (void)setUp
-{
-    [super setUp];
-    
-    // Set-up code here.
+	// characters outside of ASCII take more than one byte in UTF-8
+	NSString *unicodeString = @"café ☃";
+	STAssertEqualObjects([self roundTripObject:unicodeString], unicodeString, @"");
+
+	// long strings are encoded into a heap buffer, and bridged back without
+	// copying
+	NSMutableString *longString = [NSMutableString string];
+	while ([longString length] < MLCLuaStringMinimumLength * 2) {
+		[longString appendString:unicodeString];
+	}
+
+	STAssertEqualObjects([self roundTripObject:longString], longString, @"");
+}
+
+- (void)testNumberRoundTrip {
+	STAssertEqualObjects([self roundTripObject:[NSNumber numberWithInt:42]], [NSNumber numberWithInt:42], @"");
+	STAssertEqualObjects([self roundTripObject:[NSNumber numberWithDouble:-0.5]], [NSNumber numberWithDouble:-0.5], @"");
+	STAssertEqualObjects([self roundTripObject:[NSNull null]], [NSNull null], @"");
 }
 
-- (void)tearDown
-{
-    // Tear-down code here.
-    
-    [super tearDown];
+- (void)testBooleanRoundTrip {
+	MLCState *state = self.state;
+	[state lock];
+
+	[state pushObject:[NSNumber numberWithBool:YES]];
+	STAssertEquals(lua_type(state.state, -1), LUA_TBOOLEAN, @"booleans should be pushed as Lua booleans");
+	STAssertEqualObjects([state popValueOnStack], [NSNumber numberWithBool:YES], @"");
+
+	[state unlock];
+}
+
+- (void)testArrayRoundTrip {
+	NSArray *array = [NSArray arrayWithObjects:@"foo", [NSNumber numberWithInt:5], @"bar", nil];
+
+	MLCState *state = self.state;
+	[state lock];
+
+	[state pushObject:array];
+	STAssertEqualObjects([NSArray popFromStack:state], array, @"");
+
+	[state unlock];
 }
 
-- (void)testExample
-{
-    STFail(@"Unit tests are not implemented yet in MoonlitCocoaTests");
+- (void)testDictionaryRoundTrip {
+	NSDictionary *dictionary = [NSDictionary dictionaryWithObjectsAndKeys:
+		@"bar", @"foo",
+		[NSNumber numberWithInt:2], [NSNumber numberWithInt:1],
+		nil
+	];
+
+	NSDictionary *result = [self roundTripObject:dictionary];
+	STAssertEquals([result count], [dictionary count], @"");
+	STAssertEqualObjects(result, dictionary, @"");
+}
+
+- (void)testStringWithUnpairedSurrogate {
+	unichar characters[] = { 'a', 0xD800, 'b' };
+	NSString *string = [NSString stringWithCharacters:characters length:3];
+
+	// the surrogate cannot be encoded, but must not truncate the string
+	STAssertEqualObjects([self roundTripObject:string], @"a\uFFFDb", @"");
+}
+
+- (void)testDictionaryWithNaNKey {
+	NSDictionary *dictionary = [NSDictionary dictionaryWithObjectsAndKeys:
+		@"bar", @"foo",
+		@"nan", [NSNumber numberWithDouble:NAN],
+		nil
+	];
+
+	NSDictionary *result = [self roundTripObject:dictionary];
+	STAssertEquals([result count], (NSUInteger)1, @"");
+	STAssertEqualObjects([result objectForKey:@"foo"], @"bar", @"");
+}
+
+- (void)testTableWithBooleanKeys {
+	NSError *error = nil;
+	NSDictionary *table = [self callChunk:"return { [true] = 'yes', [1] = 'one' }" withArguments:nil error:&error];
+	STAssertNotNil(table, @"%@", error);
+
+	STAssertEqualObjects([table objectForKey:[NSNumber numberWithBool:YES]], @"yes", @"");
+	STAssertEqualObjects([table objectForKey:[NSNumber numberWithInt:1]], @"one", @"");
+}
+
+#pragma mark Bridged calls
+
+- (void)testForwardingToLua {
+	MLCTestObject *obj = [[MLCTestObject alloc] init];
+
+	STAssertEquals([obj addInteger:2 toInteger:3], 5, @"");
+	STAssertEqualObjects([obj echoObject:@"foobar"], @"foobar", @"");
+}
+
+- (void)testCallingObjectiveCFromLua {
+	MLCTestObject *obj = [[MLCTestObject alloc] init];
+
+	[obj incrementTimes:3];
+	STAssertEquals(obj.counter, (NSUInteger)3, @"");
+}
+
+#pragma mark Errors
+
+- (void)testLuaErrorIsReturned {
+	NSError *error = nil;
+	STAssertNil([self callChunk:"error('expected failure')" withArguments:nil error:&error], @"");
+
+	STAssertNotNil(error, @"");
+	STAssertEqualObjects([error domain], MLCLuaErrorDomain, @"");
+	STAssertEquals([error code], (NSInteger)LUA_ERRRUN, @"");
+	STAssertTrue([[error localizedDescription] rangeOfString:@"expected failure"].location != NSNotFound, @"%@", error);
+}
+
+- (void)testLuaErrorLeavesStackBalanced {
+	MLCState *state = self.state;
+	[state lock];
+
+	int top = lua_gettop(state.state);
+
+	luaL_loadstring(state.state, "error('expected failure')");
+	STAssertFalse([state callFunctionWithArgumentCount:0 resultCount:0 error:NULL], @"");
+	STAssertEquals(lua_gettop(state.state), top, @"the error message should be popped");
+
+	[state unlock];
+}
+
+- (void)testUnrecognizedSelectorFromLua {
+	MLCTestObject *obj = [[MLCTestObject alloc] init];
+
+	NSError *error = nil;
+	STAssertNil([self callChunk:"local obj = ...; return obj:frobnicate()" withArguments:[NSArray arrayWithObject:obj] error:&error], @"");
+	STAssertTrue([[error localizedDescription] rangeOfString:@"does not recognize selector"].location != NSNotFound, @"%@", error);
+}
+
+#if !MLC_USE_LUAJIT
+- (void)testMemoryLimitFailsScriptCleanly {
+	MLCState *state = self.state;
+	state.memoryLimit = state.memoryUsage + 256 * 1024;
+
+	NSError *error = nil;
+	STAssertNil([self callChunk:"local t = {}; for i = 1, 1e7 do t[i] = tostring(i) end; return t" withArguments:nil error:&error], @"");
+	STAssertEqualObjects([error domain], MLCLuaErrorDomain, @"%@", error);
+	STAssertEquals([error code], (NSInteger)LUA_ERRMEM, @"%@", error);
+
+	// the table built by the failed script is garbage now, and the state
+	// should go on running scripts within the limit
+	[state collectGarbage];
+	STAssertTrue(state.memoryUsage <= state.memoryLimit, @"");
+
+	error = nil;
+	STAssertEqualObjects([self callChunk:"return #table.concat({ 'foo', 'bar' })" withArguments:nil error:&error], [NSNumber numberWithInt:6], @"%@", error);
+
+	[state lock];
+	STAssertEquals(lua_gettop(state.state), 0, @"the stack should be empty after the failed script");
+	[state unlock];
+}
+#endif
+
+- (void)testLuaFunctionError {
+	NSError *error = nil;
+	MLCLuaFunction *function = [self callChunk:"return function () error('expected failure') end" withArguments:nil error:&error];
+	STAssertNotNil(function, @"%@", error);
+
+	STAssertNil([function callWithArguments:nil error:&error], @"");
+	STAssertNotNil(error, @"");
+}
+
+- (void)testLuaFunctionErrorIsThrown {
+	NSError *error = nil;
+	MLCLuaFunction *function = [self callChunk:"return function (x) if x then error('expected failure') end; return true end" withArguments:nil error:&error];
+	STAssertNotNil(function, @"%@", error);
+
+	STAssertTrue(function.predicateBlock([NSNull null]), @"");
+
+	NSException *exception = nil;
+
+	@try {
+		function.predicateBlock(@"fail");
+	} @catch (NSException *ex) {
+		exception = ex;
+	}
+
+	STAssertEqualObjects([exception name], MLCLuaErrorException, @"%@", exception);
+	STAssertTrue([[exception reason] rangeOfString:@"expected failure"].location != NSNotFound, @"%@", exception);
+
+	// the state should be left usable
+	[self.state lock];
+	STAssertEquals(lua_gettop(self.state.state), 0, @"the stack should be empty after the error");
+	[self.state unlock];
+
+	STAssertEqualObjects([function callWithArguments:nil], [NSNumber numberWithBool:YES], @"");
+}
+
+#pragma mark Models
+
+- (void)testModelEquality {
+	MLCTestModel *model = [[MLCTestModel alloc] initWithName:@"foo" quantity:[NSNumber numberWithInt:2]];
+	MLCTestModel *equalModel = [[MLCTestModel alloc] initWithDictionary:[NSDictionary dictionaryWithObjectsAndKeys:
+		@"foo", @"name",
+		[NSNumber numberWithInt:2], @"quantity",
+		[NSNumber numberWithDouble:-0.0], @"ratio",
+		nil
+	]];
+
+	MLCTestModel *otherModel = [[MLCTestModel alloc] initWithName:@"foo" quantity:[NSNumber numberWithInt:3]];
+
+	// the plan is built from the declared properties of the class, so it
+	// doesn't matter which instance is compared first
+	STAssertFalse([otherModel isEqual:model], @"");
+	STAssertEqualObjects(model, equalModel, @"");
+	STAssertEquals([model hash], [equalModel hash], @"");
+	STAssertFalse([model isEqual:otherModel], @"");
 }
 
 @end
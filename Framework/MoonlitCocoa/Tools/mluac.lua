@@ -0,0 +1,49 @@
+-- mluac.lua
+-- MoonlitCocoa
+--
+-- Created by agent on 17.10.26.
+-- Released into the public domain.
+--
+-- Precompiles a Metalua script into Lua bytecode, exactly as MLCState would
+-- compile it at runtime. A .luac file placed next to (or instead of) a .mlua
+-- file in a bundle is loaded by +[MLCBridgedObject state] without running the
+-- Metalua compiler at all.
+--
+-- Usage: lua mluac.lua input.mlua [output.luac]
+--
+-- If no output path is given, the input path is used with its extension
+-- replaced by .luac.
+--
+-- Scripts are compiled with compiler.loadstring from the framework's
+-- compiler.lua, the same function that MLCState calls, so that precompiled
+-- bytecode is identical to what the runtime would produce. Set MLC_COMPILER
+-- to the path of compiler.lua if this script has been moved out of the
+-- source tree.
+
+local toolDirectory = (arg and arg[0] or ""):match("^(.*)[/\\]") or "."
+dofile(os.getenv("MLC_COMPILER") or (toolDirectory .. "/../MoonlitCocoa/compiler.lua"))
+
+local input, output = ...
+if not input then
+	io.stderr:write("usage: lua mluac.lua input.mlua [output.luac]\n")
+	os.exit(1)
+end
+
+output = output or (input:gsub("%.[^./]*$", "") .. ".luac")
+
+local file = assert(io.open(input, "r"))
+local source = file:read("*a")
+file:close()
+
+-- must match the prelude added by -[MLCState loadScript:error:]
+source = "require 'metalua.runtime'\n\n" .. source
+
+local func = compiler.loadstring(source)
+if not func then
+	io.stderr:write("mluac: could not compile " .. input .. "\n")
+	os.exit(1)
+end
+
+file = assert(io.open(output, "wb"))
+file:write(string.dump(func))
+file:close()